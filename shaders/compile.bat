@@ -1,13 +1,38 @@
-..\lib\VulkanSDK\Bin\glslc.exe shader.vert -o spv/vert.spv
-..\lib\VulkanSDK\Bin\glslc.exe shader.frag -o spv/frag.spv
-
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/frag_shader.frag		--target-env=vulkan1.2 -o spv/frag_shader.frag.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/passthrough.vert		--target-env=vulkan1.2 -o spv/passthrough.vert.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/post.frag				--target-env=vulkan1.2 -o spv/post.frag.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytrace.rchit		--target-env=vulkan1.2 -o spv/raytrace.rchit.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytrace.rgen			--target-env=vulkan1.2 -o spv/raytrace.rgen.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytrace.rmiss		--target-env=vulkan1.2 -o spv/raytrace.rmiss.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytraceShadow.rmiss	--target-env=vulkan1.2 -o spv/raytraceShadow.rmiss.spv
-..\lib\VulkanSDK\Bin\glslc.exe raytracing/vert_shader.vert		--target-env=vulkan1.2 -o spv/vert_shader.vert.spv
-
-pause
+if not exist spv mkdir spv
+
+..\lib\VulkanSDK\Bin\glslc.exe shader.vert -o spv/vert.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe shader.frag --target-env=vulkan1.2 -o spv/frag.spv || goto failed
+
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/cluster_lights.comp	--target-env=vulkan1.2 -o spv/cluster_lights.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/denoise_atrous.comp	--target-env=vulkan1.2 -o spv/denoise_atrous.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/denoise_temporal.comp	--target-env=vulkan1.2 -o spv/denoise_temporal.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/frag_shader.frag		--target-env=vulkan1.2 -o spv/frag_shader.frag.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/instances.comp		--target-env=vulkan1.2 -o spv/instances.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_control.comp	--target-env=vulkan1.2 -o spv/integrator_control.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_generate.comp	--target-env=vulkan1.2 -o spv/integrator_generate.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_intersect.comp	--target-env=vulkan1.2 -o spv/integrator_intersect.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_resolve.comp	--target-env=vulkan1.2 -o spv/integrator_resolve.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_scatter.comp	--target-env=vulkan1.2 -o spv/integrator_scatter.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_shade.comp	--target-env=vulkan1.2 -o spv/integrator_shade.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/integrator_shadow.comp	--target-env=vulkan1.2 -o spv/integrator_shadow.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/passthrough.vert		--target-env=vulkan1.2 -o spv/passthrough.vert.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/pick.comp				--target-env=vulkan1.2 -o spv/pick.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/post.frag				--target-env=vulkan1.2 -o spv/post.frag.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytrace.rchit		--target-env=vulkan1.2 -o spv/raytrace.rchit.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytrace.rgen			--target-env=vulkan1.2 -o spv/raytrace.rgen.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytrace.rmiss		--target-env=vulkan1.2 -o spv/raytrace.rmiss.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/raytraceShadow.rmiss	--target-env=vulkan1.2 -o spv/raytraceShadow.rmiss.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/upsample.comp			--target-env=vulkan1.2 -o spv/upsample.comp.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/upsample_guide.frag	--target-env=vulkan1.2 -o spv/upsample_guide.frag.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/upsample_guide.vert	--target-env=vulkan1.2 -o spv/upsample_guide.vert.spv || goto failed
+..\lib\VulkanSDK\Bin\glslc.exe raytracing/vert_shader.vert		--target-env=vulkan1.2 -o spv/vert_shader.vert.spv || goto failed
+
+python pack_shaders.py spv spv/shaders.pak || goto failed
+
+if not "%~1"=="nopause" pause
+exit /b 0
+
+:failed
+echo Shader compilation failed
+if not "%~1"=="nopause" pause
+exit /b 1
@@ -0,0 +1,60 @@
+#  Copyright © 2021 Subph. All rights reserved.
+#
+#  Packs every .spv in a directory into one archive the app maps into memory.
+#
+#  Layout, little endian:
+#    header  magic "SPAK", version, entry count, reserved     (4 x uint32)
+#    entries name (40 bytes, zero padded), offset, size, hash (64 bytes each)
+#    blobs   SPIR-V words, every blob starts on a 16 byte boundary
+#
+#  The hash is 64-bit FNV-1a over the blob, the same as HashBytes in vs/helper.cpp.
+#
+#  usage: python pack_shaders.py <spv directory> <output file>
+
+import os
+import struct
+import sys
+
+MAGIC      = 0x4B415053
+VERSION    = 1
+NAME_SIZE  = 40
+ENTRY_SIZE = 64
+ALIGNMENT  = 16
+
+def fnv1a64(data):
+    hash = 0xcbf29ce484222325
+    for byte in data:
+        hash ^= byte
+        hash = (hash * 0x100000001b3) & 0xFFFFFFFFFFFFFFFF
+    return hash
+
+def align(value):
+    return (value + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+def main(directory, output):
+    names = sorted(name for name in os.listdir(directory) if name.endswith(".spv"))
+    blobs = []
+    for name in names:
+        if len(name.encode()) >= NAME_SIZE:
+            sys.exit("shader name too long: " + name)
+        with open(os.path.join(directory, name), "rb") as file:
+            blobs.append(file.read())
+
+    offset  = align(16 + ENTRY_SIZE * len(names))
+    entries = b""
+    for name, blob in zip(names, blobs):
+        entries += struct.pack("<40sQQQ", name.encode(), offset, len(blob), fnv1a64(blob))
+        offset = align(offset + len(blob))
+
+    data = struct.pack("<IIII", MAGIC, VERSION, len(names), 0) + entries
+    for blob in blobs:
+        data += b"\0" * (align(len(data)) - len(data)) + blob
+
+    with open(output, "wb") as file:
+        file.write(data)
+    print("packed %d shaders into %s (%d bytes)" % (len(names), output, len(data)))
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: python pack_shaders.py <spv directory> <output file>")
+    main(sys.argv[1], sys.argv[2])
@@ -53,7 +53,7 @@ layout(buffer_reference, scalar) buffer Materials {WaveFrontMaterial m[]; }; //
 layout(buffer_reference, scalar) buffer MatIndices {int i[]; }; // Material ID for each triangle
 
 layout(binding = 1, scalar) buffer SceneDesc_ { SceneDesc i[]; } sceneDesc;
-layout(binding = 2) uniform sampler2D[] textureSamplers;
+layout(binding = 1, set = 2) uniform sampler2D textureSamplers[];  // bindless table shared by every pipeline
 // clang-format on
 
 
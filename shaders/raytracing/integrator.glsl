@@ -0,0 +1,116 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// Shared by the integrator_*.comp kernels of the wavefront path tracer. Every kernel declares the
+// same resources and push constants, so all of them share one pipeline layout and descriptor sets.
+// Include after wavefront.glsl.
+
+#define INTEGRATOR_WORKGROUP_SIZE 64
+#define INTEGRATOR_TILE_SIZE      8
+#define INTEGRATOR_MATERIAL_BINS  64
+#define INTEGRATOR_SHADOW_RAYS    2   // slots per shaded hit, the key light and one light of the tree
+
+// Steps of integrator_control.comp
+#define CONTROL_RESET 0  // before the primary rays of a sample
+#define CONTROL_SORT  1  // after intersection, material bin offsets
+#define CONTROL_NEXT  2  // after shading, swaps the ray queues
+
+struct IntegratorRay
+{
+  vec3 origin;
+  uint pixel;
+  vec3 direction;
+  uint seed;
+  vec3 throughput;
+  uint depth;
+};
+
+struct IntegratorHit
+{
+  uint  ray;  // index in the ray buffer
+  uint  instance;
+  uint  primitive;
+  uint  bin;  // material bin the shading is grouped by
+  vec2  barycentrics;
+  float t;
+  uint  pad;
+};
+
+struct ShadowRay
+{
+  vec3  origin;
+  uint  pixel;
+  vec3  direction;
+  float tMax;
+  vec3  contribution;  // added to the pixel when the light is visible
+  uint  pad;
+};
+
+// clang-format off
+layout(buffer_reference, scalar) buffer Vertices {Vertex v[]; }; // Positions of an object
+layout(buffer_reference, scalar) buffer Indices {ivec3 i[]; }; // Triangle indices
+layout(buffer_reference, scalar) buffer Materials {WaveFrontMaterial m[]; }; // Array of all materials on an object
+layout(buffer_reference, scalar) buffer MatIndices {int i[]; }; // Material ID for each triangle
+// clang-format on
+
+layout(binding = 0, set = 0) uniform accelerationStructureEXT topLevelAS;
+layout(binding = 1, set = 0, rgba32f) uniform image2D image;
+layout(binding = 2, set = 0, rgba32f) uniform image2D accumImage;
+// Counters and indirect dispatch arguments, the offsets are mirrored in integrator.h
+layout(binding = 3, set = 0) buffer Queues
+{
+  uint  rayCount[2];    // ping-pong ray queues, the parity of the bounce picks the input
+  uint  hitCount;
+  uint  shadowCount;    // hits that queued shadow rays
+  uvec4 intersectArgs;  // VkDispatchIndirectCommand, w unused
+  uvec4 shadeArgs;
+  uvec4 shadowArgs;
+  uint  binCount[INTEGRATOR_MATERIAL_BINS];
+  uint  binOffset[INTEGRATOR_MATERIAL_BINS];
+}
+queues;
+layout(binding = 4, set = 0) buffer Rays { IntegratorRay r[]; } rays;  // two queues of one ray per pixel
+layout(binding = 5, set = 0) buffer Hits { IntegratorHit h[]; } hits;
+layout(binding = 6, set = 0) buffer SortedHits { uint i[]; } sortedHits;
+layout(binding = 7, set = 0) buffer ShadowRays { ShadowRay r[]; } shadowRays;  // INTEGRATOR_SHADOW_RAYS slots per hit, tMax 0 when unused
+layout(binding = 8, set = 0) buffer Radiance { vec4 c[]; } radiance;  // sum of the samples of this frame
+
+layout(binding = 0, set = 1) uniform CameraProperties
+{
+  mat4 view;
+  mat4 proj;
+  mat4 viewInverse;
+  mat4 projInverse;
+  mat4 prevViewProj;
+}
+cam;
+layout(binding = 1, set = 1, scalar) buffer SceneDesc_ { SceneDesc i[]; } sceneDesc;
+#include "textures.glsl"
+
+layout(push_constant) uniform Constants
+{
+  vec4  clearColor;
+  vec3  lightPosition;
+  float lightIntensity;
+  uint  frame;
+  uint  sampleCount;      // samples already averaged in accumImage
+  uint  samplesPerPixel;  // samples traced this frame
+  uint  maxDepth;
+  uint  sampleIndex;      // sample of this wave
+  uint  depth;            // bounce of this wave
+  uint  mode;             // step of integrator_control.comp
+  uint  pad;
+}
+pc;
+
+uint pixelCount()
+{
+  ivec2 size = imageSize(image);
+  return uint(size.x * size.y);
+}
+
+// First ray of the queue the current bounce reads, the next bounce appends to the other one
+uint queueBase(uint queue)
+{
+  return queue * pixelCount();
+}
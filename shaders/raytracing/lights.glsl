@@ -0,0 +1,57 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// The point lights of LightBuilder, the tree the path tracers sample them with and the view-space
+// clusters cluster_lights.comp sorts them into for the raster pass
+
+// Froxels of the cluster grid, tiles across the screen and exponential slices in depth
+#define CLUSTER_GRID_X     16
+#define CLUSTER_GRID_Y     9
+#define CLUSTER_GRID_Z     24
+#define CLUSTER_COUNT      (CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z)
+#define CLUSTER_MAX_LIGHTS 127
+#define CLUSTER_STRIDE     (CLUSTER_MAX_LIGHTS + 1)  // the light count, then the light indices
+
+struct Light
+{
+  vec3  position;
+  float range;  // the irradiance falls below LIGHT_CUTOFF past it
+  vec3  intensity;
+  float pad;
+};
+
+struct LightNode
+{
+  vec3  boundsMin;
+  float power;  // luminance of the lights below
+  vec3  boundsMax;
+  int   child;  // first of two adjacent children, ~light index in a leaf
+};
+
+// Cluster of a fragment at viewDepth in front of the camera
+uint clusterIndex(vec2 fragCoord, vec2 viewport, float viewDepth, float zNear, float zFar)
+{
+  uvec2 tile  = min(uvec2(fragCoord / viewport * vec2(CLUSTER_GRID_X, CLUSTER_GRID_Y)), uvec2(CLUSTER_GRID_X - 1, CLUSTER_GRID_Y - 1));
+  float slice = log(max(viewDepth, zNear) / zNear) / log(zFar / zNear) * float(CLUSTER_GRID_Z);
+  return (uint(clamp(slice, 0.0, float(CLUSTER_GRID_Z - 1))) * CLUSTER_GRID_Y + tile.y) * CLUSTER_GRID_X + tile.x;
+}
+
+// View depth where slice begins, the inverse of the slice in clusterIndex
+float clusterSliceDepth(uint slice, float zNear, float zFar)
+{
+  return zNear * pow(zFar / zNear, float(slice) / float(CLUSTER_GRID_Z));
+}
+
+// Estimated contribution of the lights below node to a surface at P facing N, the power over the
+// squared distance, no closer than the bounds reach. 0 when every light is behind the surface.
+float lightNodeImportance(LightNode node, vec3 P, vec3 N)
+{
+  vec3 front = mix(node.boundsMin, node.boundsMax, step(0.0, N));  // corner furthest along N
+  if(dot(front - P, N) <= 0.0)
+    return 0.0;
+
+  vec3  toCenter = 0.5 * (node.boundsMin + node.boundsMax) - P;
+  vec3  extent   = node.boundsMax - node.boundsMin;
+  float dist2    = max(dot(toCenter, toCenter), 0.25 * dot(extent, extent));
+  return node.power / max(dist2, 1e-4);
+}
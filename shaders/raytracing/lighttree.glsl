@@ -0,0 +1,49 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// The lights and the light tree in set 1 of the hit shaders and the integrator
+
+#include "lights.glsl"
+
+layout(binding = 2, set = 1, scalar) readonly buffer Lights_ { Light l[]; } lights;
+layout(binding = 3, set = 1, scalar) readonly buffer LightNodes_ { LightNode n[]; } lightNodes;
+
+// Picks one light for a surface at P facing N, descending the tree with u in [0, 1) and
+// choosing each child in proportion to its importance. Returns -1 when no light can reach
+// the surface, otherwise pdf is the probability the light was picked with.
+int sampleLightTree(vec3 P, vec3 N, float u, out float pdf)
+{
+  pdf = 1.0;
+  if(lightNodes.n[0].power <= 0.0)
+    return -1;
+
+  int node = 0;
+  // The median split keeps the tree log2 LIGHT_CAPACITY deep
+  for(int depth = 0; depth < 32; depth++)
+  {
+    int child = lightNodes.n[node].child;
+    if(child < 0)
+      return ~child;
+
+    float left  = lightNodeImportance(lightNodes.n[child], P, N);
+    float right = lightNodeImportance(lightNodes.n[child + 1], P, N);
+    if(left + right <= 0.0)
+      return -1;
+
+    // u is rescaled to the chosen side so the next level gets a fresh uniform number
+    float pLeft = left / (left + right);
+    if(u < pLeft)
+    {
+      node = child;
+      pdf *= pLeft;
+      u = min(u / pLeft, 0.99999);
+    }
+    else
+    {
+      node = child + 1;
+      pdf *= 1.0 - pLeft;
+      u = min((u - pLeft) / (1.0 - pLeft), 0.99999);
+    }
+  }
+  return -1;
+}
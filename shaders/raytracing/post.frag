@@ -23,15 +23,23 @@ layout(location = 0) out vec4 fragColor;
 
 layout(set = 0, binding = 0) uniform sampler2D noisyTxt;
 
-layout(push_constant) uniform shaderInformation
+// Fixed for the lifetime of the pipeline, a change selects another variant
+layout(constant_id = 0) const float ASPECT_RATIO = 1.0;
+layout(constant_id = 1) const int   TONEMAP      = 0;  // 0 gamma only, 1 Reinhard, 2 ACES fit
+
+vec3 tonemap(vec3 color)
 {
-  float aspectRatio;
+  if(TONEMAP == 1)
+    return color / (color + vec3(1.0));
+  if(TONEMAP == 2)
+    return clamp((color * (2.51 * color + 0.03)) / (color * (2.43 * color + 0.59) + 0.14), 0.0, 1.0);
+  return color;
 }
-pushc;
 
 void main()
 {
   vec2  uv    = outUV;
   float gamma = 1. / 2.2;
-  fragColor   = pow(texture(noisyTxt, uv).rgba, vec4(gamma));
+  vec4  color = texture(noisyTxt, uv);
+  fragColor   = vec4(pow(tonemap(color.rgb), vec3(gamma)), color.a);
 }
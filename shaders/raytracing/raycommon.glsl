@@ -19,5 +19,13 @@
 
 struct hitPayload
 {
-  vec3 hitValue;
+  vec3 hitValue;   // light leaving the hit towards the ray origin
+  vec3 weight;     // throughput of the bounce ray, set by the hit shader
+  vec3 rayOrigin;  // next ray of the path
+  vec3 rayDir;
+  vec3 normal;     // facing the ray, with hitT for the denoiser G-buffer
+  float hitT;      // negative on a miss
+  uint seed;
+  float spreadAngle;  // of the ray cone, 0 when the hit does not report texture detail
+  bool done;       // the path ends here
 };
@@ -0,0 +1,48 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// Which full resolution pixels a reduced resolution launch of raytrace.rgen traces, shared with
+// upsample.comp. Each launch thread stands for a block of pixels and traces one of them, the pixel
+// moves every frame so the accumulation still sees all of them.
+
+// Mirrored in upsampler.h
+#define RT_RESOLUTION_FULL         0
+#define RT_RESOLUTION_CHECKERBOARD 1  // every other pixel of a row, alternating rows and frames
+#define RT_RESOLUTION_HALF         2  // one pixel of each 2x2 block
+#define RT_RESOLUTION_QUARTER      3  // one pixel of each 4x4 block
+
+// Pixels across and down the block of one launch thread
+uvec2 traceBlock(uint resolution)
+{
+  if(resolution == RT_RESOLUTION_CHECKERBOARD)
+    return uvec2(2, 1);
+  if(resolution == RT_RESOLUTION_HALF)
+    return uvec2(2);
+  if(resolution == RT_RESOLUTION_QUARTER)
+    return uvec2(4);
+  return uvec2(1);
+}
+
+// Position of the k-th entry of a 2^levels wide Bayer matrix, consecutive frames land far apart
+uvec2 bayerOffset(uint k, uint levels)
+{
+  uvec2 offset = uvec2(0);
+  for(uint i = 0; i < levels; i++)
+  {
+    uint b = (k >> (2 * i)) & 3u;
+    offset |= uvec2((b & 1u) ^ (b >> 1), b & 1u) << (levels - 1 - i);
+  }
+  return offset;
+}
+
+// Full resolution pixel the launch thread id traces this frame
+ivec2 tracedPixel(uvec2 id, uint resolution, uint frame)
+{
+  if(resolution == RT_RESOLUTION_CHECKERBOARD)
+    return ivec2(2 * id.x + ((id.y + frame) & 1u), id.y);
+  if(resolution == RT_RESOLUTION_HALF)
+    return ivec2(id * 2 + bayerOffset(frame % 4, 1));
+  if(resolution == RT_RESOLUTION_QUARTER)
+    return ivec2(id * 4 + bayerOffset(frame % 16, 2));
+  return ivec2(id);
+}
@@ -0,0 +1,48 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// Random numbers and direction sampling for the path tracer
+
+const float M_PI = 3.14159265358979323846;
+
+// Seeds a per-pixel sequence from the pixel index and the frame, decorrelates neighbouring pixels
+uint tea(uint val0, uint val1)
+{
+  uint v0 = val0;
+  uint v1 = val1;
+  uint s0 = 0;
+
+  for(uint n = 0; n < 16; n++)
+  {
+    s0 += 0x9e3779b9;
+    v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+    v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+  }
+  return v0;
+}
+
+uint lcg(inout uint prev)
+{
+  prev = 1664525u * prev + 1013904223u;
+  return prev & 0x00FFFFFF;
+}
+
+// Uniform in [0, 1)
+float rnd(inout uint prev)
+{
+  return float(lcg(prev)) / float(0x01000000);
+}
+
+// Cosine weighted direction around normal, the pdf cancels the cosine of a Lambert surface
+vec3 sampleCosineHemisphere(inout uint seed, vec3 normal)
+{
+  float r1 = rnd(seed);
+  float r2 = rnd(seed);
+  float sq = sqrt(r1);
+  vec3  local = vec3(cos(2.0 * M_PI * r2) * sq, sin(2.0 * M_PI * r2) * sq, sqrt(1.0 - r1));
+
+  vec3 tangent   = abs(normal.x) > abs(normal.z) ? normalize(vec3(-normal.y, normal.x, 0.0))
+                                                 : normalize(vec3(0.0, -normal.z, normal.y));
+  vec3 bitangent = cross(normal, tangent);
+  return normalize(local.x * tangent + local.y * bitangent + local.z * normal);
+}
@@ -0,0 +1,27 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// The bindless table of TextureRegistry and the feedback TextureLoader streams mips from,
+// needs GL_EXT_nonuniform_qualifier
+
+layout(binding = 0, set = 2) buffer TextureFeedback { uint detail[]; } textureFeedback;  // per slot, read back each frame
+layout(binding = 1, set = 2) uniform sampler2D textureSamplers[];  // bindless table shared by every pipeline, variable count so last
+
+// Records that txtId was sampled with a footprint uvWidth wide in uv units, the loader streams in
+// the mip that has 1 / uvWidth texels across. 0 is left for slots no shader sampled.
+void requestTextureDetail(uint txtId, float uvWidth)
+{
+  uint detail = uint(clamp(ceil(-log2(max(uvWidth, 1e-9))), 0.0, 30.0)) + 1;
+  // Most samples of a frame ask for what is already recorded, the atomic is left for the rest
+  if(textureFeedback.detail[txtId] < detail)
+    atomicMax(textureFeedback.detail[txtId], detail);
+}
+
+// Footprint in uv units of a ray cone coneWidth wide where it hits the triangle, from the ratio of
+// its uv and world space areas
+float triangleUvWidth(vec3 p0, vec3 p1, vec3 p2, vec2 t0, vec2 t1, vec2 t2, float coneWidth)
+{
+  float worldArea = length(cross(p1 - p0, p2 - p0));
+  float uvArea    = abs((t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y));
+  return coneWidth * sqrt(uvArea / max(worldArea, 1e-12));
+}
@@ -0,0 +1,29 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// Normal facing the camera and the hit distance, as raytrace.rgen writes its G-buffer. The target
+// is cleared to a w of -1 where nothing is drawn, a miss.
+
+#version 460
+
+layout(binding = 0, set = 0) uniform CameraProperties
+{
+  mat4 view;
+  mat4 proj;
+  mat4 viewInverse;
+  mat4 projInverse;
+  mat4 prevViewProj;
+}
+cam;
+
+layout(location = 0) in vec3 worldPosition;
+layout(location = 1) in vec3 worldNormal;
+
+layout(location = 0) out vec4 outNormalDepth;
+
+void main()
+{
+  vec3 toSurface = worldPosition - cam.viewInverse[3].xyz;
+  vec3 normal    = normalize(worldNormal);
+  outNormalDepth = vec4(dot(normal, toSurface) > 0 ? -normal : normal, length(toSurface));
+}
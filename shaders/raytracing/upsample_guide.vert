@@ -0,0 +1,38 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+// Rasterized guide of upsample.comp, the world space normal and the distance from the camera of
+// what a primary ray of raytrace.rgen would hit through the pixel center
+
+#version 460
+
+layout(binding = 0, set = 0) uniform CameraProperties
+{
+  mat4 view;
+  mat4 proj;
+  mat4 viewInverse;
+  mat4 projInverse;
+  mat4 prevViewProj;
+}
+cam;
+
+// The transform of the mesh, the one its TLAS instance and SceneDesc carry
+layout(push_constant) uniform Constants
+{
+  mat4 model;
+}
+pc;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+
+layout(location = 0) out vec3 worldPosition;
+layout(location = 1) out vec3 worldNormal;
+
+void main()
+{
+  vec4 position = pc.model * vec4(inPosition, 1.0);
+  gl_Position   = cam.proj * cam.view * position;
+  worldPosition = position.xyz;
+  worldNormal   = transpose(inverse(mat3(pc.model))) * inNormal;
+}
@@ -1,9 +1,102 @@
-#version 450
+#version 460
+#extension GL_EXT_ray_query : require
+#extension GL_EXT_nonuniform_qualifier : enable
+#extension GL_GOOGLE_include_directive : enable
+
+#include "raytracing/lights.glsl"
+#include "raytracing/sampling.glsl"
+#include "raytracing/textures.glsl"
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    vec4 cluster;  // near, far, width and height of the viewport
+    vec4 light;    // position and intensity of the scene light of the ray tracer
+    vec4 hybrid;   // shadow rays on, ambient occlusion rays, their length and strength
+} ubo;
+
+// Written by LightBuilder and cluster_lights.comp
+layout(binding = 1, std430) readonly buffer Lights_ { Light l[]; } lights;
+layout(binding = 2, std430) readonly buffer Clusters_ { uint c[]; } clusters;
+
+// The scene the ray tracer sees, only used by the hybrid mode
+layout(binding = 3) uniform accelerationStructureEXT topLevelAS;
+
+// Per draw, matches RasterDrawConstants. texture is the registry slot of the mesh's texture or -1 without one.
+layout(push_constant) uniform Draw {
+    mat4 model;
+    int  texture;
+} draw;
 
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec3 fragPosition;
+layout(location = 2) in vec3 fragNormal;
+layout(location = 3) in float fragDepth;
+layout(location = 4) in vec2 fragTexCoord;
 
 layout(location = 0) out vec4 outColor;
 
+// Any hit closer than tMax, the first one found ends the query
+bool occluded(vec3 origin, vec3 direction, float tMax) {
+    rayQueryEXT rayQuery;
+    rayQueryInitializeEXT(rayQuery, topLevelAS, gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsOpaqueEXT, 0xFF,
+                          origin, 0.0, direction, tMax);
+    while (rayQueryProceedEXT(rayQuery)) {
+    }
+    return rayQueryGetIntersectionTypeEXT(rayQuery, true) != gl_RayQueryCommittedIntersectionNoneEXT;
+}
+
 void main() {
-    outColor = vec4(fragColor, 1.0);
-}
\ No newline at end of file
+    bool shadows = ubo.hybrid.x > 0.0;
+    uint aoRays  = uint(ubo.hybrid.y);
+
+    // Both sides are drawn, the rays leave from the one facing the camera
+    vec3 normal = normalize(fragNormal);
+    vec3 eye    = -transpose(mat3(ubo.view)) * ubo.view[3].xyz;
+    if (dot(normal, eye - fragPosition) < 0.0) normal = -normal;
+    vec3 origin = fragPosition + normal * 1e-3;
+
+    // Only the lights of the cluster the fragment falls in, the window takes each one to zero at its range
+    vec3 lit    = vec3(0.0);
+    uint base   = clusterIndex(gl_FragCoord.xy, ubo.cluster.zw, fragDepth, ubo.cluster.x, ubo.cluster.y) * CLUSTER_STRIDE;
+    uint count  = clusters.c[base];
+    for (uint i = 0; i < count; i++) {
+        Light light   = lights.l[clusters.c[base + 1 + i]];
+        vec3  toLight = light.position - fragPosition;
+        float dist2   = dot(toLight, toLight);
+        float ratio   = dist2 / (light.range * light.range);
+        float window  = clamp(1.0 - ratio * ratio, 0.0, 1.0);
+        vec3  L       = toLight * inversesqrt(dist2);
+        vec3  radiance = light.intensity / max(dist2, 1e-4) * window * window * max(dot(normal, L), 0.0);
+        // A shadow ray only for the lights that would visibly light the fragment
+        if (shadows && max(radiance.r, max(radiance.g, radiance.b)) > 1e-3 && occluded(origin, L, sqrt(dist2))) continue;
+        lit += radiance;
+    }
+
+    // The scene light of the ray tracer, so the shadows have something to fall from without demo lights
+    if (shadows) {
+        vec3  toLight = ubo.light.xyz - fragPosition;
+        float dist2   = dot(toLight, toLight);
+        vec3  L       = toLight * inversesqrt(dist2);
+        float NdotL   = dot(normal, L);
+        if (NdotL > 0.0 && !occluded(origin, L, sqrt(dist2))) lit += vec3(ubo.light.w / dist2 * NdotL);
+    }
+
+    // Short cosine weighted rays, a fixed pattern per pixel so the raster image does not flicker
+    float ambient = 1.0;
+    if (aoRays > 0) {
+        uint seed   = tea(uint(gl_FragCoord.y) * uint(ubo.cluster.z) + uint(gl_FragCoord.x), 0);
+        uint hits   = 0;
+        for (uint i = 0; i < aoRays; i++) {
+            if (occluded(origin, sampleCosineHemisphere(seed, normal), ubo.hybrid.z)) hits++;
+        }
+        ambient = 1.0 - ubo.hybrid.w * float(hits) / float(aoRays);
+    }
+    vec3 albedo = fragColor;
+    if (draw.texture >= 0) {
+        albedo *= texture(textureSamplers[draw.texture], fragTexCoord).rgb;
+        // The footprint of the pixel in uv units, from the derivatives of the quad
+        requestTextureDetail(uint(draw.texture), max(length(dFdx(fragTexCoord)), length(dFdy(fragTexCoord))));
+    }
+    outColor = vec4(albedo * (ambient + lit), 1.0);
+}
@@ -1,18 +1,37 @@
 #version 450
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
+    vec4 cluster;
+    vec4 light;
+    vec4 hybrid;
 } ubo;
 
+// Per draw, matches RasterDrawConstants
+layout(push_constant) uniform Draw {
+    mat4 model;
+    int  texture;
+} draw;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inColor;
+layout(location = 3) in vec2 inTexCoord;
 
 layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec3 fragPosition;
+layout(location = 2) out vec3 fragNormal;
+layout(location = 3) out float fragDepth;
+layout(location = 4) out vec2 fragTexCoord;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragColor = inColor;
+    vec4 worldPosition = draw.model * vec4(inPosition, 1.0);
+    vec4 viewPosition  = ubo.view * worldPosition;
+    gl_Position  = ubo.proj * viewPosition;
+    fragColor    = inColor;
+    fragPosition = worldPosition.xyz;
+    fragNormal   = mat3(draw.model) * inNormal;
+    fragDepth    = -viewPosition.z;
+    fragTexCoord = inTexCoord;
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include "accelcache.h"
+#include "helper.h"
+#include "dispatch.h"
+
+#define ACCEL_CACHE_MAGIC   0x43415356 // "VSAC"
+#define ACCEL_CACHE_VERSION 1
+// Serialized data has to start at a 256 byte aligned device address
+#define ACCEL_SERIALIZE_ALIGNMENT 256
+
+AccelCache::~AccelCache() {}
+AccelCache::AccelCache( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties( m_physicalDevice, &properties );
+    m_deviceHash = HashBytes( &properties.driverVersion, sizeof( properties.driverVersion ) );
+    m_deviceHash = HashBytes( &properties.deviceID, sizeof( properties.deviceID ), m_deviceHash );
+    m_deviceHash = HashBytes( properties.pipelineCacheUUID, VK_UUID_SIZE, m_deviceHash );
+}
+
+void AccelCache::cleanup() {
+    releaseStaging();
+    for ( Pending& pending : m_pending ) {
+        pending.buffer->cleanup();
+        delete pending.buffer;
+    }
+    m_pending.clear();
+    if ( m_queryPool != VK_NULL_HANDLE ) vkDestroyQueryPool( m_device, m_queryPool, nullptr );
+    m_queryPool     = VK_NULL_HANDLE;
+    m_queryCapacity = 0;
+}
+
+void AccelCache::load( const std::string directory ) {
+    m_directory = directory;
+}
+
+bool AccelCache::cmdLoad( VkCommandBuffer commandBuffer, Mesh* mesh, VkBuildAccelerationStructureFlagsKHR flags, AccelStructure* accelStructure ) {
+    if ( m_directory.empty() ) return false;
+    uint64_t    key      = getKey( mesh, flags );
+    std::string filepath = getFilepath( key );
+
+    std::ifstream file( filepath, std::ios::ate | std::ios::binary );
+    if ( !file.is_open() ) return false;
+
+    size_t     fileSize = ( size_t )file.tellg();
+    FileHeader header{};
+    if ( fileSize > sizeof( FileHeader ) + sizeof( SerializedHeader ) ) {
+        file.seekg( 0 );
+        file.read( reinterpret_cast< char* >( &header ), sizeof( FileHeader ) );
+    }
+    bool valid = header.magic    == ACCEL_CACHE_MAGIC   &&
+                 header.version  == ACCEL_CACHE_VERSION &&
+                 header.key      == key                 &&
+                 header.dataSize == fileSize - sizeof( FileHeader );
+    if ( !valid ) {
+        LOG( "AccelCache::load " << filepath << " stale" );
+        return false;
+    }
+
+    std::vector<char> data( header.dataSize );
+    file.read( data.data(), header.dataSize );
+    file.close();
+
+    // The version data is the driver and compatibility UUID pair the blob starts with
+    VkAccelerationStructureVersionInfoKHR versionInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR };
+    versionInfo.pVersionData = reinterpret_cast< const uint8_t* >( data.data() );
+
+    VkAccelerationStructureCompatibilityKHR compatibility = VK_ACCELERATION_STRUCTURE_COMPATIBILITY_INCOMPATIBLE_KHR;
+    vkd.GetDeviceAccelerationStructureCompatibilityKHR( m_device, &versionInfo, &compatibility );
+    if ( compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR ) {
+        LOG( "AccelCache::load " << filepath << " rejected by the driver" );
+        return false;
+    }
+
+    SerializedHeader serialized;
+    memcpy( &serialized, data.data(), sizeof( SerializedHeader ) );
+    if ( serialized.serializedSize != header.dataSize || serialized.handleCount != 0 ) return false;
+
+    VkDeviceAddress address;
+    VkDeviceSize    offset;
+    Buffer* staging = createStaging( header.dataSize, &address, &offset );
+    char* mapped = static_cast< char* >( staging->mapMemory( offset + header.dataSize ) );
+    memcpy( mapped + offset, data.data(), header.dataSize );
+    staging->unmapMemory();
+    m_staging.push_back( staging );
+
+    *accelStructure = CreateAccelStructure( m_device, m_physicalDevice, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                                            serialized.deserializedSize );
+
+    VkCopyMemoryToAccelerationStructureInfoKHR copyInfo{ VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR };
+    copyInfo.src.deviceAddress = address;
+    copyInfo.dst               = accelStructure->handle;
+    copyInfo.mode              = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+
+    vkd.CmdCopyMemoryToAccelerationStructureKHR( commandBuffer, &copyInfo );
+
+    LOG( "AccelCache::load " << filepath << " hit " << header.dataSize / 1024 << " KB" );
+    return true;
+}
+
+void AccelCache::releaseStaging() {
+    for ( Buffer* staging : m_staging ) {
+        staging->cleanup();
+        delete staging;
+    }
+    m_staging.clear();
+}
+
+void AccelCache::cmdQuerySizes( VkCommandBuffer commandBuffer, const std::vector<AccelStructure>& accelStructures ) {
+    m_queryCount = UINT32( accelStructures.size() );
+    if ( m_queryCount == 0 ) return;
+
+    if ( m_queryCapacity < m_queryCount ) {
+        if ( m_queryPool != VK_NULL_HANDLE ) vkDestroyQueryPool( m_device, m_queryPool, nullptr );
+
+        VkQueryPoolCreateInfo queryPoolInfo{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+        queryPoolInfo.queryType  = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+        queryPoolInfo.queryCount = m_queryCount;
+        VkResult result = vkCreateQueryPool( m_device, &queryPoolInfo, nullptr, &m_queryPool );
+        CHECK_VKRESULT( result, "failed to create query pool!" );
+        m_queryCapacity = m_queryCount;
+    }
+
+    std::vector<VkAccelerationStructureKHR> handles;
+    for ( const AccelStructure& accelStructure : accelStructures ) handles.push_back( accelStructure.handle );
+
+    // The structures may have been written earlier in this command buffer
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    vkd.CmdResetQueryPool( commandBuffer, m_queryPool, 0, m_queryCount );
+    vkd.CmdWriteAccelerationStructuresPropertiesKHR( commandBuffer, m_queryCount, handles.data(),
+                                                     VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, m_queryPool, 0 );
+}
+
+void AccelCache::cmdSerialize( VkCommandBuffer commandBuffer, const std::vector<Mesh*>& meshes, VkBuildAccelerationStructureFlagsKHR flags,
+                               const std::vector<AccelStructure>& accelStructures ) {
+    if ( m_directory.empty() || m_queryCount == 0 ) return;
+    if ( m_queryCount != accelStructures.size() || meshes.size() != accelStructures.size() )
+        RUNTIME_ERROR( "serialization sizes were not queried for these acceleration structures!" );
+
+    std::vector<VkDeviceSize> sizes( m_queryCount );
+    VkResult result = vkGetQueryPoolResults( m_device, m_queryPool, 0, m_queryCount, sizes.size() * sizeof( VkDeviceSize ),
+                                             sizes.data(), sizeof( VkDeviceSize ), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT );
+    CHECK_VKRESULT( result, "failed to get serialization sizes!" );
+    m_queryCount = 0;
+
+
+    for ( size_t i = 0; i < accelStructures.size(); i++ ) {
+        Pending pending;
+        VkDeviceAddress address;
+        pending.key    = getKey( meshes[i], flags );
+        pending.size   = sizes[i];
+        pending.buffer = createStaging( sizes[i], &address, &pending.offset );
+        m_pending.push_back( pending );
+
+        VkCopyAccelerationStructureToMemoryInfoKHR copyInfo{ VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR };
+        copyInfo.src               = accelStructures[i].handle;
+        copyInfo.dst.deviceAddress = address;
+        copyInfo.mode              = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+        vkd.CmdCopyAccelerationStructureToMemoryKHR( commandBuffer, &copyInfo );
+    }
+}
+
+void AccelCache::save() {
+    std::error_code error;
+    std::filesystem::create_directories( m_directory, error );
+
+    for ( Pending& pending : m_pending ) {
+        const char* data = static_cast< const char* >( pending.buffer->mapMemory( pending.offset + pending.size ) ) + pending.offset;
+
+        FileHeader header{};
+        header.magic    = ACCEL_CACHE_MAGIC;
+        header.version  = ACCEL_CACHE_VERSION;
+        header.key      = pending.key;
+        header.dataSize = pending.size;
+
+        // Same as the pipeline cache, write next to the target and rename over it
+        std::filesystem::path filepath( getFilepath( pending.key ) );
+        std::filesystem::path temppath( filepath.string() + ".tmp" );
+        std::ofstream file( temppath, std::ios::binary | std::ios::trunc );
+        if ( file.is_open() ) {
+            file.write( reinterpret_cast< const char* >( &header ), sizeof( FileHeader ) );
+            file.write( data, pending.size );
+            file.close();
+            if ( !file.fail() ) std::filesystem::rename( temppath, filepath, error );
+            if ( file.fail() || error ) std::filesystem::remove( temppath, error );
+            else LOG( "AccelCache::save " << filepath.string() << " " << pending.size / 1024 << " KB" );
+        }
+
+        pending.buffer->unmapMemory();
+        pending.buffer->cleanup();
+        delete pending.buffer;
+    }
+    m_pending.clear();
+}
+
+
+// Private ==================================================
+
+
+std::string AccelCache::getFilepath( uint64_t key ) {
+    std::stringstream filename;
+    filename << m_directory << "/blas_" << std::hex << std::setfill( '0' ) << std::setw( 16 ) << key << ".bin";
+    return filename.str();
+}
+
+Buffer* AccelCache::createStaging( VkDeviceSize size, VkDeviceAddress* alignedAddress, VkDeviceSize* offset ) {
+    Buffer* staging = new Buffer( m_device, m_physicalDevice );
+    staging->setup( size + ACCEL_SERIALIZE_ALIGNMENT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT );
+    staging->create();
+
+    VkDeviceAddress address = staging->getDeviceAddress();
+    *alignedAddress = AlignUp( address, ACCEL_SERIALIZE_ALIGNMENT );
+    *offset         = *alignedAddress - address;
+    return staging;
+}
+
+uint64_t AccelCache::getKey( Mesh* mesh, VkBuildAccelerationStructureFlagsKHR flags ) {
+    uint64_t hash = HashBytes( &flags, sizeof( flags ), mesh->getHash() );
+    return HashBytes( &m_deviceHash, sizeof( m_deviceHash ), hash );
+}
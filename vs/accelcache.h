@@ -0,0 +1,78 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "accelstructure.h"
+#include "mesh.h"
+
+// Keeps serialized BLAS on disk keyed by mesh content, build flags and the device and driver
+// identity, so a driver update misses by key. The driver still decides whether a blob is
+// usable through the version data at the start of the blob.
+class AccelCache {
+
+public:
+    ~AccelCache();
+    AccelCache( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    void cleanup();
+    void load( const std::string directory );
+
+    // Records a deserialize into a new acceleration structure. False when there is no compatible
+    // entry and the mesh has to be built. Upload buffers live until releaseStaging().
+    bool cmdLoad( VkCommandBuffer commandBuffer, Mesh* mesh, VkBuildAccelerationStructureFlagsKHR flags, AccelStructure* accelStructure );
+    void releaseStaging();
+
+    // Saving takes two submits: the serialized sizes have to be read back before the copies are recorded,
+    // and the copies have to be finished before save() writes the files
+    void cmdQuerySizes( VkCommandBuffer commandBuffer, const std::vector<AccelStructure>& accelStructures );
+    void cmdSerialize( VkCommandBuffer commandBuffer, const std::vector<Mesh*>& meshes, VkBuildAccelerationStructureFlagsKHR flags,
+                       const std::vector<AccelStructure>& accelStructures );
+    void save();
+
+private:
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t dataSize;
+    };
+
+    // Start of every serialized acceleration structure, defined by the spec
+    struct SerializedHeader {
+        uint8_t  driverUUID[VK_UUID_SIZE];
+        uint8_t  compatibilityUUID[VK_UUID_SIZE];
+        uint64_t serializedSize;
+        uint64_t deserializedSize;
+        uint64_t handleCount;
+    };
+
+    // Serialized copy waiting to be written to disk, the data starts at offset in buffer
+    struct Pending {
+        uint64_t     key;
+        Buffer*      buffer;
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    std::string m_directory;
+    uint64_t    m_deviceHash = 0; // driverVersion, deviceID and pipelineCacheUUID
+
+    VkQueryPool m_queryPool     = VK_NULL_HANDLE;
+    uint32_t    m_queryCapacity = 0;
+    uint32_t    m_queryCount    = 0;
+
+    std::vector<Buffer*> m_staging;
+    std::vector<Pending> m_pending;
+
+    std::string getFilepath( uint64_t key );
+    Buffer*     createStaging( VkDeviceSize size, VkDeviceAddress* alignedAddress, VkDeviceSize* offset );
+
+    uint64_t    getKey( Mesh* mesh, VkBuildAccelerationStructureFlagsKHR flags );
+
+};
@@ -0,0 +1,42 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "accelstructure.h"
+#include "dispatch.h"
+
+AccelStructure CreateAccelStructure(VkDevice device, VkPhysicalDevice physicalDevice, VkAccelerationStructureTypeKHR type, VkDeviceSize size) {
+    AccelStructure accelStructure{};
+    accelStructure.size   = size;
+    accelStructure.buffer = new Buffer( device, physicalDevice );
+    accelStructure.buffer->setup( size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    accelStructure.buffer->create();
+
+    VkAccelerationStructureCreateInfoKHR createInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR };
+    createInfo.type   = type;
+    createInfo.size   = size;
+    createInfo.buffer = accelStructure.buffer->getBuffer();
+
+    VkResult result = vkd.CreateAccelerationStructureKHR( device, &createInfo, nullptr, &accelStructure.handle );
+    CHECK_VKRESULT( result, "failed to create acceleration structure!" );
+
+    VkAccelerationStructureDeviceAddressInfoKHR addressInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR };
+    addressInfo.accelerationStructure = accelStructure.handle;
+    accelStructure.address = vkd.GetAccelerationStructureDeviceAddressKHR( device, &addressInfo );
+    return accelStructure;
+}
+
+void DestroyAccelStructure(VkDevice device, AccelStructure& accelStructure) {
+    if ( accelStructure.handle != VK_NULL_HANDLE ) {
+        vkd.DestroyAccelerationStructureKHR( device, accelStructure.handle, nullptr );
+    }
+    if ( accelStructure.buffer != nullptr ) {
+        accelStructure.buffer->cleanup();
+        delete accelStructure.buffer;
+    }
+    accelStructure = AccelStructure{};
+}
+
+VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return alignment == 0 ? value : ( value + alignment - 1 ) / alignment * alignment;
+}
@@ -0,0 +1,20 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+
+struct AccelStructure {
+    VkAccelerationStructureKHR handle  = VK_NULL_HANDLE;
+    Buffer*                    buffer  = nullptr;
+    VkDeviceAddress            address = 0;
+    VkDeviceSize               size    = 0;
+};
+
+// Backed by its own device local buffer
+AccelStructure CreateAccelStructure(VkDevice device, VkPhysicalDevice physicalDevice, VkAccelerationStructureTypeKHR type, VkDeviceSize size);
+void DestroyAccelStructure(VkDevice device, AccelStructure& accelStructure);
+
+VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment);
@@ -2,9 +2,11 @@
 //
 
 #include <array>
+#include <fstream>
 
 #include "app.h"
 #include "helper.h"
+#include "dispatch.h"
 
 void App::run() {
     initWindow();
@@ -13,17 +15,37 @@ void App::run() {
     cleanup();
 }
 
+void App::runCpuReference() {
+    // The scene and the view the window starts with, every mesh stays on the CPU
+    m_jobSystem = new JobSystem();
+    m_camera    = new Camera();
+    m_pCube     = new Mesh( VK_NULL_HANDLE, VK_NULL_HANDLE );
+    m_pCube->createCube();
+    m_pPlane    = new Mesh( VK_NULL_HANDLE, VK_NULL_HANDLE );
+    m_pPlane->createPlane();
+    m_rtMeshes  = { m_pCube, m_pPlane };
+
+    // One path at a time first, then the packets and streams, so the log compares the two
+    m_cpuStream = false;
+    renderCpuReference( getCpuTraceSettings() );
+    m_cpuStream = true;
+    renderCpuReference( getCpuTraceSettings() );
+
+    m_cpuTracer->cleanup();
+    m_jobSystem->cleanup();
+}
+
 void App::cleanup() {
     m_pCube->cleanup();
     m_pPlane->cleanup();
-    m_uniformBuffer->cleanup();
+    for ( Buffer* uniformBuffer : m_uniformBuffers ) uniformBuffer->cleanup();
 
     for ( size_t i = 0; i < m_imageSemaphores.size(); i++ ) {
         vkDestroySemaphore( m_device, m_imageSemaphores[i], nullptr );
     }
 
     for ( size_t i = 0; i < m_totalFrame; i++ ) {
-        vkWaitForFences( m_device, 1, &m_commandFences[i], VK_TRUE, UINT64_MAX );
+        vkd.WaitForFences( m_device, 1, &m_commandFences[i], VK_TRUE, UINT64_MAX );
 
         vkDestroyFence( m_device, m_commandFences[i], nullptr );
         vkDestroySemaphore( m_device, m_renderSemaphores[i], nullptr );
@@ -36,13 +58,52 @@ void App::cleanup() {
     vkDestroyRenderPass( m_device, m_renderPass, nullptr );
     vkDestroySwapchainKHR( m_device, m_swapchain, nullptr );
 
-    vkDestroyPipeline( m_device, m_postPipeline, nullptr );
-    vkDestroyPipelineLayout( m_device, m_postPipelineLayout, nullptr );
-
-    vkDestroyDescriptorSetLayout( m_device, m_descSetLayout, nullptr );
     vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    vkDestroyDescriptorPool( m_device, m_rtDescPool, nullptr );
+    vkDestroyDescriptorPool( m_device, m_rtSceneDescPool, nullptr );
+    vkDestroyDescriptorPool( m_device, m_integratorDescPool, nullptr );
+    if ( m_rtAccumImage != nullptr ) m_rtAccumImage->cleanup();
+    for ( Buffer* cameraBuffer : m_rtCameraBuffers ) cameraBuffer->cleanup();
+
+    for ( AccelStructure& blas : m_blas ) DestroyAccelStructure( m_device, blas );
+    if ( m_blasBuilder != nullptr ) m_blasBuilder->cleanup();
+    if ( m_accelCache != nullptr ) m_accelCache->cleanup();
+    if ( m_tlasBuilder != nullptr ) m_tlasBuilder->cleanup();
+    if ( m_instanceBuilder != nullptr ) m_instanceBuilder->cleanup();
+    if ( m_sceneDescBuilder != nullptr ) m_sceneDescBuilder->cleanup();
+    if ( m_textureLoader != nullptr ) m_textureLoader->cleanup();
+    if ( m_textureRegistry != nullptr ) m_textureRegistry->cleanup();
+    if ( m_lightClusters != nullptr ) m_lightClusters->cleanup();
+    if ( m_lightBuilder != nullptr ) m_lightBuilder->cleanup();
+    if ( m_sbtBuilder != nullptr ) m_sbtBuilder->cleanup();
+    if ( m_denoiser != nullptr ) m_denoiser->cleanup();
+    if ( m_upsampler != nullptr ) m_upsampler->cleanup();
+    if ( m_picker != nullptr ) m_picker->cleanup();
+    if ( m_pickBvh != nullptr ) m_pickBvh->cleanup();
+    if ( m_integrator != nullptr ) m_integrator->cleanup();
+    if ( m_rtTimer != nullptr ) m_rtTimer->cleanup();
+    if ( m_cpuTracer != nullptr ) m_cpuTracer->cleanup();
+    if ( m_gpuCaptureBuffer != nullptr ) m_gpuCaptureBuffer->cleanup();
 
     vkDestroyCommandPool( m_device, m_commandPool, nullptr );
+
+    m_pipelineCompiler->cleanup();
+    m_jobSystem->cleanup();
+    m_layoutCache->cleanup();
+
+    for ( std::vector<Shader*>* shaders : { &m_offscreenShaders, &m_postShaders, &m_rtShaders, &m_instanceShaders,
+                                            &m_denoiseTemporalShaders, &m_denoiseAtrousShaders, &m_integratorShaders, &m_clusterShaders,
+                                            &m_upsampleShaders, &m_upsampleGuideShaders, &m_pickShaders } ) {
+        for ( Shader* shader : *shaders ) {
+            shader->cleanup();
+            delete shader;
+        }
+        shaders->clear();
+    }
+    m_shaderBundle->cleanup();
+
+    m_pipelineCache->save();
+    m_pipelineCache->cleanup();
     
     cleanupDevice();
 
@@ -56,7 +117,125 @@ void App::initWindow() {
     glfwWindowHint( GLFW_CLIENT_API, GLFW_NO_API );
     m_window = glfwCreateWindow( WIDTH, HEIGHT, "RT", nullptr, nullptr);
     glfwSetWindowUserPointer( m_window, this );
+    glfwSetKeyCallback( m_window, KeyCallback );
+    glfwSetMouseButtonCallback( m_window, MouseButtonCallback );
+}
+
+void App::KeyCallback( GLFWwindow* window, int key, int scancode, int action, int mods ) {
+    App* app = static_cast<App*>( glfwGetWindowUserPointer( window ) );
+    app->onKey( key, action );
+}
+
+void App::MouseButtonCallback( GLFWwindow* window, int button, int action, int mods ) {
+    App* app = static_cast<App*>( glfwGetWindowUserPointer( window ) );
+    app->onMouseButton( button, action );
+}
+
+void App::onMouseButton( int button, int action ) {
+    if ( action != GLFW_PRESS || button != GLFW_MOUSE_BUTTON_LEFT || m_picker == nullptr ) return;
+
+    double x, y;
+    int    width, height;
+    glfwGetCursorPos( m_window, &x, &y );
+    glfwGetWindowSize( m_window, &width, &height );
+    if ( width == 0 || height == 0 ) return;
+
+    // The cursor in pixels of the WIDTH x HEIGHT render the projection is made for, whatever the window size
+    glm::vec2 size( WIDTH, HEIGHT );
+    glm::vec2 cursor = glm::vec2( x, y ) * size / glm::vec2( width, height );
+    m_picker->pick( Picker::GetRay( cursor, size, glm::inverse( m_camera->getViewMatrix() ),
+                                    glm::inverse( m_camera->getProjection( size.x / size.y ) ) ) );
+}
+
+void App::onKey( int key, int action ) {
+    if ( action != GLFW_PRESS ) return;
+
+    // T cycles the tonemap operator, each one is its own post pipeline variant
+    if ( key == GLFW_KEY_T ) {
+        m_postTonemap = ( m_postTonemap + 1 ) % TONEMAP_COUNT;
+        createPostPipeline();
+    }
+
+    // M cycles the tint of the cube, only its hit record is rewritten
+    if ( key == GLFW_KEY_M && !m_rtHitRecords.empty() ) {
+        static const glm::vec4 tints[] = { glm::vec4( 1.0f ), glm::vec4( 1.0f, 0.3f, 0.3f, 1.0f ),
+                                           glm::vec4( 0.3f, 1.0f, 0.3f, 0.5f ), glm::vec4( 0.3f, 0.3f, 1.0f, 0.0f ) };
+        m_rtTintIndex = ( m_rtTintIndex + 1 ) % 4;
+        setRtHitRecord( 0, { tints[m_rtTintIndex] } );
+    }
+
+    // K switches the light of raytrace.rchit between point and directional, N its shadow rays. Each is a
+    // pipeline variant, the table switches to it once it has compiled.
+    if ( key == GLFW_KEY_K && m_sbtBuilder != nullptr ) {
+        m_rtLightType = ( m_rtLightType + 1 ) % 2;
+        createRtPipelineVariant();
+    }
+    if ( key == GLFW_KEY_N && m_sbtBuilder != nullptr ) {
+        m_rtShadows = !m_rtShadows;
+        createRtPipelineVariant();
+    }
+
+    // R switches between rasterization and ray tracing, P between primary rays and the path tracer
+    if ( key == GLFW_KEY_R && m_sbtBuilder != nullptr ) {
+        m_rtEnabled = !m_rtEnabled;
+        resetAccumulation();
+    }
+    if ( key == GLFW_KEY_P ) {
+        m_rtPathTrace = !m_rtPathTrace;
+        resetAccumulation();
+    }
+
+    // D toggles the denoiser, H its temporal reprojection
+    if ( key == GLFW_KEY_D && m_denoiser != nullptr ) {
+        m_denoise = !m_denoise;
+        m_denoiser->resetHistory();
+    }
+    if ( key == GLFW_KEY_H && m_denoiser != nullptr ) {
+        m_denoiseTemporal = !m_denoiseTemporal;
+        m_denoiser->setTemporal( m_denoiseTemporal );
+        m_denoiser->resetHistory();
+    }
+
+    // W switches between the ray tracing pipeline and the wavefront integrator
+    if ( key == GLFW_KEY_W && m_integrator != nullptr ) {
+        m_rtWavefront = !m_rtWavefront;
+        resetAccumulation();
+        m_denoiser->resetHistory();
+    }
+
+    // U cycles the resolution raytrace.rgen is launched at, primary rays and the path tracer keep their own
+    if ( key == GLFW_KEY_U && m_upsampler != nullptr ) {
+        static const char* names[RT_RESOLUTION_COUNT] = { "full", "checkerboard", "half", "quarter" };
+        uint32_t& resolution = m_rtResolution[m_rtPathTrace ? 1 : 0];
+        resolution = ( resolution + 1 ) % RT_RESOLUTION_COUNT;
+        resetAccumulation();
+        m_denoiser->resetHistory();
+        LOG( "App::onKey " << ( m_rtPathTrace ? "path tracer" : "primary rays" ) << " at " << names[resolution] << " resolution" );
+    }
+
+    // S toggles ray query shadows in the raster pass, O cycles its ambient occlusion rays
+    if ( key == GLFW_KEY_S ) m_hybridShadows = !m_hybridShadows;
+    if ( key == GLFW_KEY_O ) m_hybridAoRays = m_hybridAoRays == 0 ? 1 : m_hybridAoRays == 1 ? 4 : 0;
+
+    // C traces the current view on the CPU and writes it next to the project as a reference. While ray
+    // tracing the next launch is read back too and diffed against it, run with --diff to compare again.
+    if ( key == GLFW_KEY_C && !m_rtMeshes.empty() ) {
+        if ( m_rtEnabled ) m_gpuCaptureRequested = true;
+        else renderCpuReference( getCpuTraceSettings() );
+    }
+    // V switches the CPU tracer between packet streams and one path at a time
+    if ( key == GLFW_KEY_V ) m_cpuStream = !m_cpuStream;
+
+    // L cycles between no extra lights and a few hundred or thousand random ones over the plane
+    if ( key == GLFW_KEY_L && m_lightBuilder != nullptr ) {
+        static const uint32_t lightCounts[] = { 0, 256, LIGHT_CAPACITY };
+        m_lightSetIndex = ( m_lightSetIndex + 1 ) % 3;
+        setDemoLights( lightCounts[m_lightSetIndex] );
+    }
 
+    // + and - change the samples traced per frame, the average already gathered is kept
+    if ( key == GLFW_KEY_KP_ADD || key == GLFW_KEY_EQUAL ) m_rtSamplesPerFrame = std::min( m_rtSamplesPerFrame * 2, 64u );
+    if ( key == GLFW_KEY_KP_SUBTRACT || key == GLFW_KEY_MINUS ) m_rtSamplesPerFrame = std::max( m_rtSamplesPerFrame / 2, 1u );
 }
 
 void App::initVulkan() {
@@ -65,27 +244,57 @@ void App::initVulkan() {
     createLogicalDevice();
     createCommandPool();
 
+    m_pipelineCache = new PipelineCache( m_device, m_physicalDevice );
+    m_pipelineCache->load( PIPELINE_CACHE_DIR );
+
+    m_jobSystem        = new JobSystem();
+    m_pipelineCompiler = new PipelineCompiler( m_device, m_pipelineCache, m_jobSystem );
+    m_layoutCache      = new LayoutCache( m_device );
+
+    m_shaderBundle = new ShaderBundle();
+    m_shaderBundle->open( SHADER_BUNDLE );
+
     createSwapchain();
     createRenderPass();
 
     createGeometry();
     createFrameData();
 
+    // Once the frame count is known, and before any pipeline layout that declares the texture set
+    m_textureRegistry = new TextureRegistry( m_device, m_physicalDevice );
+    m_textureRegistry->setup( m_totalFrame, m_layoutCache );
+    m_textureLoader = new TextureLoader( m_device, m_physicalDevice, m_jobSystem, m_textureRegistry );
+    m_textureLoader->setup( m_totalFrame );
+    {
+        VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+        m_textureLoader->cmdInitialize( cmdBuffer );
+        endSingleTimeCommands( cmdBuffer );
+    }
+    m_lightBuilder = new LightBuilder( m_device, m_physicalDevice );
+    m_lightBuilder->setup( m_totalFrame );
+
     createOffscreenRenderPass();
     createOffscreenFramedata();
+    createLightClusters();
 
     createOffscreenDescriptorSet();
     createOffscreenPipeline();
-    updateOffscreenDescriptorSet();
 
     m_camera = new Camera();
 
-    //initRayTracing();
-    //createBottomLevelAS();
-    //createTopLevelAS();
-    //createRtDescriptorSet();
-    //createRtPipeline();
-    //createRtShaderBindingTable();
+    initRayTracing();
+    createBottomLevelAS();
+    createTopLevelAS();
+    createSceneDesc();
+    createDenoiser();
+    createUpsampler();
+    createRtDescriptorSet();
+    // After the TLAS, the hybrid mode of the raster pass queries it
+    updateOffscreenDescriptorSet();
+    createPicker();
+    createIntegrator();
+    createRtPipeline();
+    createRtShaderBindingTable();
     
     createPostDescriptor();
     createPostPipeline();
@@ -94,6 +303,20 @@ void App::initVulkan() {
 
 }
 
+// Shaders come from the mapped bundle, loose .spv files are only read when the bundle is missing or lacks the shader
+Shader* App::loadShader( const std::string name, VkShaderStageFlagBits stage ) {
+    ShaderBlob blob;
+    if ( m_shaderBundle->isOpen() && m_shaderBundle->find( name, &blob ) )
+        return new Shader( m_device, blob, stage );
+    return new Shader( m_device, SHADER_DIR + name, stage );
+}
+
+bool App::hasShader( const std::string name ) {
+    ShaderBlob blob;
+    if ( m_shaderBundle->isOpen() && m_shaderBundle->find( name, &blob ) ) return true;
+    return std::ifstream( SHADER_DIR + name ).good();
+}
+
 void App::createGeometry() {
     m_pCube = new Mesh( m_device, m_physicalDevice );
     m_pCube->createCube();
@@ -216,9 +439,13 @@ void App::createFrameData() {
 
     m_cmdBuffers = createCommandBuffers( m_totalFrame );
 
-    m_uniformBuffer = new Buffer( m_device, m_physicalDevice );
-    m_uniformBuffer->setup( sizeof( UniformBuffer ), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT );
-    m_uniformBuffer->create();
+    // Rewritten every frame, the buffers of the other frames in flight may still be read
+    for ( uint32_t i = 0; i < m_totalFrame; i++ ) {
+        Buffer* uniformBuffer = new Buffer( m_device, m_physicalDevice );
+        uniformBuffer->setup( sizeof( UniformBuffer ), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT );
+        uniformBuffer->create();
+        m_uniformBuffers.push_back( uniformBuffer );
+    }
 
     for ( size_t i = 0; i < m_totalFrame; i++ ) {
         m_fbImages[i] = new Image( m_device, m_physicalDevice );
@@ -256,29 +483,21 @@ void App::createFrameData() {
 }
 
 void App::createPostDescriptor() {
-    VkDescriptorSetLayoutBinding layoutBinding{};
-    layoutBinding.binding         = 0;
-    layoutBinding.descriptorCount = 1;
-    layoutBinding.descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    layoutBinding.stageFlags      = VK_SHADER_STAGE_FRAGMENT_BIT;
-    layoutBinding.pImmutableSamplers = nullptr;
-    
-    VkDescriptorSetLayoutCreateInfo layoutInfo{};
-    layoutInfo.sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = 1;
-    layoutInfo.pBindings    = &layoutBinding;
-    
-    VkResult result = vkCreateDescriptorSetLayout(m_device, &layoutInfo, nullptr, &m_postDescSetLayout );
-    CHECK_VKRESULT(result, "failed to create descriptor set layout!");
-    
-    VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 };
+    m_postShaders = {
+        loadShader( "passthrough.vert.spv", VK_SHADER_STAGE_VERTEX_BIT ),
+        loadShader( "post.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ),
+    };
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = LayoutCache::GetSetBindings( m_postShaders, 0 );
+    m_postDescSetLayout = m_layoutCache->getDescriptorSetLayout( layoutBindings );
+
+    std::vector<VkDescriptorPoolSize> poolSizes = LayoutCache::GetPoolSizes( layoutBindings );
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.maxSets       = 1;
-    poolInfo.poolSizeCount = 1;
-    poolInfo.pPoolSizes    = &poolSize;
+    poolInfo.poolSizeCount = UINT32(poolSizes.size());
+    poolInfo.pPoolSizes    = poolSizes.data();
 
-    result = vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_postDescPool );
+    VkResult result = vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_postDescPool );
     CHECK_VKRESULT(result, "failed to create descriptor pool!");
     
     VkDescriptorSetAllocateInfo allocInfo{};
@@ -292,88 +511,87 @@ void App::createPostDescriptor() {
 }
 
 void App::createPostPipeline() {
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width  = WIDTH;
-    viewport.height = HEIGHT;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = m_extent;
-
-    VkPipelineViewportStateCreateInfo viewportInfo{};
-    viewportInfo.sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportInfo.viewportCount = 1;
-    viewportInfo.scissorCount  = 1;
-    viewportInfo.pViewports    = &viewport;
-    viewportInfo.pScissors     = &scissor;
-
-    VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo{};
-    inputAssemblyInfo.sType    = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    
-    VkPipelineRasterizationStateCreateInfo rasterizationInfo{};
-    rasterizationInfo.sType       = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizationInfo.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizationInfo.cullMode    = VK_CULL_MODE_NONE;
-    rasterizationInfo.frontFace   = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterizationInfo.lineWidth   = 1.0f;
-    
-    VkPipelineMultisampleStateCreateInfo multisampleInfo{};
-    multisampleInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampleInfo.rasterizationSamples  = VK_SAMPLE_COUNT_1_BIT;
-    
-    VkPipelineDepthStencilStateCreateInfo depthStencilInfo{};
-    depthStencilInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencilInfo.depthTestEnable        = VK_TRUE;
-    depthStencilInfo.depthWriteEnable       = VK_TRUE;
-    depthStencilInfo.depthCompareOp         = VK_COMPARE_OP_LESS_OR_EQUAL;
-
-    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    
-    VkPipelineColorBlendStateCreateInfo colorBlendInfo{};
-    colorBlendInfo.sType             = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlendInfo.attachmentCount   = 1;
-    colorBlendInfo.pAttachments      = &colorBlendAttachment;
-
-    VkPushConstantRange pushConstantRanges = {VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(float)};
-    VkPipelineLayoutCreateInfo createInfo{VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
-    createInfo.setLayoutCount         = 1;
-    createInfo.pSetLayouts            = &m_postDescSetLayout;
-    createInfo.pushConstantRangeCount = 1;
-    createInfo.pPushConstantRanges    = &pushConstantRanges;
-    vkCreatePipelineLayout(m_device, &createInfo, nullptr, &m_postPipelineLayout);
-
-    Shader* vertShader = new Shader( m_device, "../shaders/spv/passthrough.vert.spv", VK_SHADER_STAGE_VERTEX_BIT );
-    Shader* fragShader = new Shader( m_device, "../shaders/spv/post.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT );
-    std::vector<VkPipelineShaderStageCreateInfo> shaderStages = {
-        vertShader->getShaderStageInfo(),
-        fragShader->getShaderStageInfo(),
-    };
-
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo{ VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
-
-    VkGraphicsPipelineCreateInfo pipelineInfo{};
-    pipelineInfo.sType      = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.layout     = m_postPipelineLayout;
-    pipelineInfo.renderPass = m_renderPass;
-    pipelineInfo.subpass    = 0;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages             = shaderStages.data();
-    pipelineInfo.pVertexInputState   = &vertexInputInfo;
-    pipelineInfo.pViewportState      = &viewportInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
-    pipelineInfo.pRasterizationState = &rasterizationInfo;
-    pipelineInfo.pMultisampleState   = &multisampleInfo;
-    pipelineInfo.pColorBlendState    = &colorBlendInfo;
-    pipelineInfo.pDepthStencilState  = &depthStencilInfo;
-    
-    VkResult result = vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_postPipeline );
-    CHECK_VKRESULT(result, "failed to create graphics pipeline!");
+    m_postPipelineLayout = m_layoutCache->getPipelineLayout( m_postShaders );
+
+    SpecConstants specConstants;
+    specConstants.set( 0, static_cast< float >( WIDTH ) / static_cast< float >( HEIGHT ) );
+    specConstants.set( 1, m_postTonemap );
+
+    uint64_t key = PipelineCompiler::GetKey( "post", m_postShaders, specConstants.getHash() );
+    m_postPipeline = m_pipelineCompiler->submit( "post", key, [this, specConstants]( VkPipelineCache pipelineCache ) mutable {
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width  = WIDTH;
+        viewport.height = HEIGHT;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+
+        VkRect2D scissor{};
+        scissor.offset = {0, 0};
+        scissor.extent = m_extent;
+
+        VkPipelineViewportStateCreateInfo viewportInfo{};
+        viewportInfo.sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportInfo.viewportCount = 1;
+        viewportInfo.scissorCount  = 1;
+        viewportInfo.pViewports    = &viewport;
+        viewportInfo.pScissors     = &scissor;
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo{};
+        inputAssemblyInfo.sType    = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+        VkPipelineRasterizationStateCreateInfo rasterizationInfo{};
+        rasterizationInfo.sType       = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizationInfo.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizationInfo.cullMode    = VK_CULL_MODE_NONE;
+        rasterizationInfo.frontFace   = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+        rasterizationInfo.lineWidth   = 1.0f;
+
+        VkPipelineMultisampleStateCreateInfo multisampleInfo{};
+        multisampleInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampleInfo.rasterizationSamples  = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineDepthStencilStateCreateInfo depthStencilInfo{};
+        depthStencilInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencilInfo.depthTestEnable        = VK_TRUE;
+        depthStencilInfo.depthWriteEnable       = VK_TRUE;
+        depthStencilInfo.depthCompareOp         = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+
+        VkPipelineColorBlendStateCreateInfo colorBlendInfo{};
+        colorBlendInfo.sType             = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlendInfo.attachmentCount   = 1;
+        colorBlendInfo.pAttachments      = &colorBlendAttachment;
+
+        std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+        for ( Shader* shader : m_postShaders ) shaderStages.push_back( shader->getShaderStageInfo( specConstants.getInfo() ) );
+
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{ VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType      = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout     = m_postPipelineLayout;
+        pipelineInfo.renderPass = m_renderPass;
+        pipelineInfo.subpass    = 0;
+        pipelineInfo.stageCount = UINT32(shaderStages.size());
+        pipelineInfo.pStages             = shaderStages.data();
+        pipelineInfo.pVertexInputState   = &vertexInputInfo;
+        pipelineInfo.pViewportState      = &viewportInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
+        pipelineInfo.pRasterizationState = &rasterizationInfo;
+        pipelineInfo.pMultisampleState   = &multisampleInfo;
+        pipelineInfo.pColorBlendState    = &colorBlendInfo;
+        pipelineInfo.pDepthStencilState  = &depthStencilInfo;
+
+        VkPipeline pipeline;
+        VkResult result = vkCreateGraphicsPipelines(m_device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline );
+        CHECK_VKRESULT(result, "failed to create graphics pipeline!");
+        return pipeline;
+    } );
 }
 
 void App::updatePostDescriptorSet() {
@@ -399,11 +617,23 @@ void App::process() {
         VkSemaphore     renderSemaphore = m_renderSemaphores[m_currentFrame];
 
         uint32_t imageIndex;
-        VkResult result =  vkAcquireNextImageKHR(m_device, m_swapchain,
-                                                 UINT64_MAX, imageSemaphore,
-                                                 VK_NULL_HANDLE, &imageIndex);
+        VkResult result =  vkd.AcquireNextImageKHR(m_device, m_swapchain,
+                                                   UINT64_MAX, imageSemaphore,
+                                                   VK_NULL_HANDLE, &imageIndex);
 
-        vkWaitForFences( m_device, 1, &commandFence, VK_TRUE, UINT64_MAX);
+        vkd.WaitForFences( m_device, 1, &commandFence, VK_TRUE, UINT64_MAX);
+        m_textureRegistry->beginFrame( m_currentFrame );
+
+        double traceTime;
+        if ( m_rtTimer != nullptr && m_rtTimer->collect( m_currentFrame, &traceTime ) ) {
+            reportRtTime( m_rtTimedWavefront[m_currentFrame], traceTime );
+        }
+        if ( m_gpuCaptureFrame == static_cast<int32_t>( m_currentFrame ) ) diffGpuCapture();
+        if ( m_picker != nullptr && m_picker->collect( m_currentFrame, &m_pickResult ) ) {
+            if ( m_pickResult.instance == UINT32_MAX ) LOG( "App::pick " << m_pickResult.request << " missed" );
+            else LOG( "App::pick " << m_pickResult.request << " instance " << m_pickResult.instance
+                      << " primitive " << m_pickResult.primitive << " at " << m_pickResult.position.x << ", " << m_pickResult.position.y << ", " << m_pickResult.position.z );
+        }
         
         {
             VkDeviceSize offsets[] = { 0 };
@@ -414,10 +644,22 @@ void App::process() {
             VkCommandBuffer commandBuffer = m_cmdBuffers[m_currentFrame];
             VkCommandBufferBeginInfo commandBeginInfo{};
             commandBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            VkResult result = vkBeginCommandBuffer(commandBuffer, &commandBeginInfo);
+            VkResult result = vkd.BeginCommandBuffer(commandBuffer, &commandBeginInfo);
             CHECK_VKRESULT(result, "failed to begin recording command buffer!");
+            if ( m_textureLoader->cmdUpload( commandBuffer, m_currentFrame ) > 0 ) resetAccumulation();
+            if ( m_lightBuilder->cmdUpload( commandBuffer, m_currentFrame ) ) resetAccumulation();
+            if ( m_tlasBuilder != nullptr && updateTopLevelAS( commandBuffer ) ) resetAccumulation();
+            if ( m_sceneDescBuilder != nullptr ) updateSceneDesc( commandBuffer );
+            if ( m_sbtBuilder != nullptr && updateRtShaderBindingTable() ) m_sbtBuilder->cmdUpdate( commandBuffer );
+            if ( m_picker != nullptr ) cmdPick( commandBuffer );
+            // Startup does not wait on the compiler, the raster path is drawn until ray tracing is ready
+            if ( m_rtEnabled && isRtReady() ) {
+                cmdTraceRays( commandBuffer );
+            }
             // Offscreen
-            {
+            else {
+                cmdBuildLightClusters( commandBuffer );
+
                 VkRenderPassBeginInfo offscreenRenderPassBeginInfo{VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
                 offscreenRenderPassBeginInfo.clearValueCount = 2;
                 offscreenRenderPassBeginInfo.pClearValues    = clearValues.data();
@@ -425,26 +667,43 @@ void App::process() {
                 offscreenRenderPassBeginInfo.framebuffer     = m_offscreenFramebuffer;
                 offscreenRenderPassBeginInfo.renderArea      = {{0, 0}, m_extent};
             
-                vkCmdBeginRenderPass( commandBuffer, &offscreenRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-                vkCmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_offscreenPipeline );
-                vkCmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, 
-                                         m_offscreenPipelineLayout, 0, 1, &m_descSet, 0, nullptr );
-                
-                m_mvp.model = m_pCube->getMatrix();
-                m_mvp.view = m_camera->getViewMatrix();
-                m_mvp.proj = m_camera->getProjection( ( float )WIDTH / HEIGHT );
-                m_uniformBuffer->fillBuffer(&m_mvp, sizeof(UniformBuffer));
-            
-                VkBuffer vertexBuffers[] = {m_pCube->m_vertexBuffer->m_buffer};
-                VkBuffer indexBuffers    = m_pCube->m_indexBuffer->m_buffer;
-                uint32_t indexSize       = UINT32( m_pCube->m_indices.size());
-                
-                vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-                vkCmdBindIndexBuffer  (commandBuffer, indexBuffers, 0, VK_INDEX_TYPE_UINT32);
+                vkd.CmdBeginRenderPass( commandBuffer, &offscreenRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+                // Pipelines compile in the background, skip the draw until it is ready
+                VkPipeline offscreenPipeline = PipelineCompiler::GetIfReady( m_offscreenPipeline );
+                if ( offscreenPipeline != VK_NULL_HANDLE ) {
+                    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, offscreenPipeline );
+                    VkDescriptorSet textureSet = m_textureRegistry->getDescriptorSet();
+                    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, 
+                                               m_offscreenPipelineLayout, 0, 1, &m_descSets[m_currentFrame], 0, nullptr );
+                    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, 
+                                               m_offscreenPipelineLayout, TEXTURE_SET, 1, &textureSet, 0, nullptr );
+                    
+                    m_mvp.view = m_camera->getViewMatrix();
+                    m_mvp.proj = m_camera->getProjection( ( float )WIDTH / HEIGHT );
+                    m_mvp.cluster = glm::vec4( m_camera->getNear(), m_camera->getFar(), WIDTH, HEIGHT );
+                    m_mvp.light   = glm::vec4( m_rtPushConstants.lightPosition, m_rtPushConstants.lightIntensity );
+                    // No ray queries before the first TLAS build
+                    bool hybrid   = m_tlasBuilder->isBuilt();
+                    m_mvp.hybrid  = glm::vec4( hybrid && m_hybridShadows ? 1.0f : 0.0f, hybrid ? m_hybridAoRays : 0,
+                                               m_hybridAoRadius, m_hybridAoStrength );
+                    m_uniformBuffers[m_currentFrame]->fillBuffer(&m_mvp, sizeof(UniformBuffer));
+
+                    // The meshes of the ray traced scene, so the hybrid shadows and occlusion have something to fall on
+                    VkShaderStageFlags pushStages = m_layoutCache->getPushConstantStages( m_offscreenPipelineLayout );
+                    for ( Mesh* mesh : m_rtMeshes ) {
+                        RasterDrawConstants draw;
+                        draw.model   = mesh->getMatrix();
+                        draw.texture = mesh == m_pPlane ? m_planeTexture : -1;
+                        vkd.CmdPushConstants( commandBuffer, m_offscreenPipelineLayout, pushStages, 0, sizeof( RasterDrawConstants ), &draw );
+
+                        vkd.CmdBindVertexBuffers(commandBuffer, 0, 1, &mesh->m_vertexBuffer->m_buffer, offsets);
+                        vkd.CmdBindIndexBuffer  (commandBuffer, mesh->m_indexBuffer->m_buffer, 0, VK_INDEX_TYPE_UINT32);
+                        vkd.CmdDrawIndexed(commandBuffer, mesh->getIndexCount(), 1, 0, 0, 0);
+                    }
+                }
             
-                vkCmdDrawIndexed(commandBuffer, indexSize, 1, 0, 0, 0);
-            
-                vkCmdEndRenderPass( commandBuffer );
+                vkd.CmdEndRenderPass( commandBuffer );
             
             }
             {
@@ -456,19 +715,23 @@ void App::process() {
                 postRenderPassBeginInfo.renderArea      = {{0, 0}, m_extent };
 
                 // Rendering tonemapper
-                vkCmdBeginRenderPass( commandBuffer, &postRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-                vkCmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_postPipeline );
-                vkCmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, 
-                                         m_postPipelineLayout, 0, 1, &m_postDescSet, 0, nullptr );
+                vkd.CmdBeginRenderPass( commandBuffer, &postRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+                // Keep drawing with the previous variant while a new one compiles
+                VkPipeline postPipeline = PipelineCompiler::GetIfReady( m_postPipeline, m_postPipelineReady );
+                m_postPipelineReady = postPipeline;
+                if ( postPipeline != VK_NULL_HANDLE ) {
+                    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, postPipeline );
+                    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, 
+                                               m_postPipelineLayout, 0, 1, &m_postDescSet, 0, nullptr );
 
-                auto aspectRatio = static_cast< float >( WIDTH ) / static_cast< float >( HEIGHT );
-                vkCmdPushConstants( commandBuffer, m_postPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof( float ), &aspectRatio );
-                
-                vkCmdDraw( commandBuffer, 3, 1, 0, 0 );
+                    vkd.CmdDraw( commandBuffer, 3, 1, 0, 0 );
+                }
 
-                vkCmdEndRenderPass( commandBuffer );
+                vkd.CmdEndRenderPass( commandBuffer );
             }
-            result = vkEndCommandBuffer(commandBuffer);
+            m_textureRegistry->cmdEndFrame( commandBuffer );
+            result = vkd.EndCommandBuffer(commandBuffer);
 
 
         }
@@ -487,8 +750,8 @@ void App::process() {
         submitInfo.signalSemaphoreCount = 1;
         submitInfo.pSignalSemaphores    = signalSemaphors;
     
-        vkResetFences(m_device, 1, &commandFence);
-        result = vkQueueSubmit(m_graphicQueue, 1, &submitInfo, commandFence);
+        vkd.ResetFences(m_device, 1, &commandFence);
+        result = vkd.QueueSubmit(m_graphicQueue, 1, &submitInfo, commandFence);
         CHECK_VKRESULT(result, "failed to submit draw command buffer!");
 
     
@@ -501,7 +764,7 @@ void App::process() {
         presentInfo.pWaitSemaphores    = signalSemaphors;
         presentInfo.pImageIndices      = &imageIndex;
 
-        result = vkQueuePresentKHR(m_presentQueue, &presentInfo);
+        result = vkd.QueuePresentKHR(m_presentQueue, &presentInfo);
 
         m_currentFrame = ( m_currentFrame + 1 ) % m_totalFrame;
     }
@@ -5,24 +5,67 @@
 
 #include "common.h"
 #include "shader.h"
+#include "specconstants.h"
+#include "layoutcache.h"
 #include "mesh.h"
 #include "buffer.h"
 #include "image.h"
 #include "camera.h"
+#include "blasbuilder.h"
+#include "accelcache.h"
+#include "tlasbuilder.h"
+#include "instancebuilder.h"
+#include "scenedescbuilder.h"
+#include "textureregistry.h"
+#include "textureloader.h"
+#include "lightbuilder.h"
+#include "lightclusters.h"
+#include "sbtbuilder.h"
+#include "denoiser.h"
+#include "upsampler.h"
+#include "picker.h"
+#include "integrator.h"
+#include "gputimer.h"
+#include "cputracer.h"
+#include "imagediff.h"
+#include "pipelinecache.h"
+#include "pipelinecompiler.h"
+#include "jobs.h"
 
 #define WIDTH   800
 #define HEIGHT  600
 
+#define PIPELINE_CACHE_DIR "../cache"
+#define ACCEL_CACHE_DIR    "../cache"
+#define SHADER_DIR         "../shaders/spv/"
+#define SHADER_BUNDLE      "../shaders/spv/shaders.pak"
+#define CPU_REFERENCE_FILE "../cpu_reference.pfm"
+#define GPU_OUTPUT_FILE    "../gpu_output.pfm"
+#define PLANE_TEXTURE_FILE "../textures/plane.ktx2"
+
+// Frames averaged by each ray tracing time report
+#define RT_TIMER_REPORT_FRAMES 120
+
 struct UniformBuffer {
-    glm::mat4 model;
     glm::mat4 view;
     glm::mat4 proj;
+    glm::vec4 cluster; // near, far, width and height of the viewport, locates the light cluster of a fragment
+    glm::vec4 light;   // position and intensity of the scene light, lit in the hybrid mode only
+    glm::vec4 hybrid;  // shadow rays on, ambient occlusion rays, their length and strength
+};
+
+// Push constants of shader.vert and shader.frag, set for each mesh the offscreen pass draws
+struct RasterDrawConstants {
+    glm::mat4 model;
+    int32_t   texture = -1; // registry slot of the mesh's texture, -1 without one
 };
 
 class App {
 public:
     
     void run();
+    // Renders the scene on the CPU tracer without a window or a device
+    void runCpuReference();
 
 private:
 
@@ -41,9 +84,23 @@ private:
     void initWindow();
     void initVulkan();
 
+    static void KeyCallback( GLFWwindow* window, int key, int scancode, int action, int mods );
+    void onKey( int key, int action );
+    static void MouseButtonCallback( GLFWwindow* window, int button, int action, int mods );
+    void onMouseButton( int button, int action );
+
+    JobSystem*        m_jobSystem;
+    PipelineCache*    m_pipelineCache;
+    PipelineCompiler* m_pipelineCompiler;
+    LayoutCache*      m_layoutCache;
+    ShaderBundle*     m_shaderBundle;
+    Shader* loadShader( const std::string name, VkShaderStageFlagBits stage );
+    bool    hasShader( const std::string name );
+
     Mesh* m_pCube;
     Mesh* m_pPlane;
     Mesh* m_pQuad;
+    int32_t m_planeTexture = -1; // registry slot of the plane's texture, -1 until it is loaded
     void createGeometry();
     
     VkExtent2D m_extent;
@@ -56,7 +113,7 @@ private:
 
     uint32_t m_totalFrame = 0;
     Image*   m_depthImage;
-    Buffer*  m_uniformBuffer;
+    std::vector<Buffer*>         m_uniformBuffers; // one per frame in flight
     std::vector<VkCommandBuffer> m_cmdBuffers;
     std::vector<Image*>        m_fbImages;
     std::vector<VkFramebuffer> m_fb;
@@ -67,7 +124,7 @@ private:
     
     VkDescriptorPool             m_descPool      = VK_NULL_HANDLE;
     VkDescriptorSetLayout        m_descSetLayout = VK_NULL_HANDLE;
-    VkDescriptorSet              m_descSet;
+    std::vector<VkDescriptorSet> m_descSets; // one per frame in flight, with its uniform buffer
     VkDescriptorSetLayoutBinding m_descLayoutBinding;
     void createOffscreenDescriptorSet();
     void updateOffscreenDescriptorSet();
@@ -83,8 +140,13 @@ private:
     VkDescriptorSet              m_postDescSet;
     VkDescriptorSetLayoutBinding m_postDescLayoutBinding;
 
-    VkPipeline       m_postPipeline;
-    VkPipelineLayout m_postPipelineLayout;
+    enum Tonemap { TONEMAP_GAMMA, TONEMAP_REINHARD, TONEMAP_ACES, TONEMAP_COUNT };
+    uint32_t m_postTonemap = TONEMAP_GAMMA;
+
+    std::vector<Shader*>           m_postShaders;
+    std::shared_future<VkPipeline> m_postPipeline;
+    VkPipeline                     m_postPipelineReady = VK_NULL_HANDLE;
+    VkPipelineLayout               m_postPipelineLayout;
 
     void createPostDescriptor();
     void createPostPipeline();
@@ -100,40 +162,190 @@ private:
     VkFramebuffer m_offscreenFramebuffer;
     void createOffscreenFramedata();
 
-    VkPipeline m_offscreenPipeline;
-    VkPipelineLayout m_offscreenPipelineLayout;
+    std::vector<Shader*>           m_offscreenShaders;
+    std::shared_future<VkPipeline> m_offscreenPipeline;
+    VkPipelineLayout               m_offscreenPipelineLayout;
     void createOffscreenPipeline();
+    std::shared_future<VkPipeline> createGraphicsPipeline( const std::string& name, const std::vector<Shader*>& shaders, VkPipelineLayout pipelineLayout );
+
+    // Sorts the lights of m_lightBuilder into view-space clusters before the offscreen pass
+    LightClusters*                 m_lightClusters = nullptr;
+    std::vector<Shader*>           m_clusterShaders;
+    std::shared_future<VkPipeline> m_clusterPipeline;
+    VkPipelineLayout               m_clusterPipelineLayout;
+    void createLightClusters();
+    void cmdBuildLightClusters( VkCommandBuffer commandBuffer );
 
     // vkray.cpp
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR m_rtProperties;
-    VkAccelerationStructureKHR m_blAccelStructure;
-    VkAccelerationStructureKHR m_tlAccelStructure;
+    BlasBuilder*                m_blasBuilder    = nullptr;
+    AccelCache*                 m_accelCache     = nullptr;
+    std::vector<AccelStructure> m_blas;
+    bool                        m_blasCompaction = true;
+    TlasBuilder*                m_tlasBuilder    = nullptr;
+    std::vector<Mesh*>          m_rtMeshes;
+
+    InstanceBuilder*               m_instanceBuilder = nullptr;
+    std::vector<Shader*>           m_instanceShaders;
+    std::shared_future<VkPipeline> m_instancePipeline;
+    VkPipelineLayout               m_instancePipelineLayout;
+
+    // Set 1 binding 1 of the hit shaders and the integrator, one SceneDesc per entry of m_rtMeshes
+    SceneDescBuilder* m_sceneDescBuilder = nullptr;
+    // Set TEXTURE_SET of every pipeline that samples material textures
+    TextureRegistry*  m_textureRegistry  = nullptr;
+    // Decodes on m_jobSystem, fills slots of m_textureRegistry
+    TextureLoader*    m_textureLoader    = nullptr;
+    // Set 1 bindings 2 and 3 of the hit shaders and the integrator, the lights of the offscreen pass
+    LightBuilder*     m_lightBuilder     = nullptr;
+    uint32_t          m_lightSetIndex    = 0;
 
     VkDescriptorPool      m_rtDescPool      = VK_NULL_HANDLE;
     VkDescriptorSetLayout m_rtDescSetLayout = VK_NULL_HANDLE;
     VkDescriptorSet       m_rtDescSet       = VK_NULL_HANDLE;
 
+    // Set 1, matches CameraProperties in raytrace.rgen
+    struct RtCamera {
+        glm::mat4 view;
+        glm::mat4 proj;
+        glm::mat4 viewInverse;
+        glm::mat4 projInverse;
+        glm::mat4 prevViewProj;
+    } m_rtCamera{};
+    std::vector<Buffer*>         m_rtCameraBuffers; // one per frame in flight
+    VkDescriptorPool             m_rtSceneDescPool      = VK_NULL_HANDLE;
+    VkDescriptorSetLayout        m_rtSceneDescSetLayout = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> m_rtSceneDescSets; // one per frame in flight, with its camera buffer
+
     std::vector<VkRayTracingShaderGroupCreateInfoKHR> m_rtShaderGroups;
 
-    VkPipeline       m_rtPipeline;
-    VkPipelineLayout m_rtPipelineLayout;
+    std::vector<Shader*>           m_rtShaders;
+    std::shared_future<VkPipeline> m_rtPipeline;
+    VkPipelineLayout               m_rtPipelineLayout;
 
-    Buffer* m_rtSBTBuffer;
+    // Inline data of a hit record, matches HitRecord in raytrace.rchit
+    struct RtHitRecord {
+        glm::vec4 tint; // rgb scales the diffuse term, a the specular term
+    };
+    SbtBuilder*              m_sbtBuilder  = nullptr;
+    VkPipeline               m_sbtPipeline = VK_NULL_HANDLE; // the pipeline the table holds the handles of
+    std::vector<RtHitRecord> m_rtHitRecords;
+    uint32_t                 m_rtTintIndex = 0;
 
     struct RtPushConstant
     {
-        glm::vec4 clearColor;
-        glm::vec3 lightPosition;
+        glm::vec4 clearColor{ 1.0f };   // returned by the miss shader, with bounces it lights the scene like a sky
+        glm::vec3 lightPosition{ 10.0f, 15.0f, 8.0f };
         float     lightIntensity{ 100.0f };
-        int       lightType{ 0 };
+        uint32_t  frame{ 0 };
+        uint32_t  sampleCount{ 0 };     // samples averaged in m_rtAccumImage so far
+        uint32_t  samplesPerPixel{ 1 };
+        uint32_t  maxDepth{ 1 };
+        uint32_t  resolution{ RT_RESOLUTION_FULL }; // below full every thread traces one pixel of a block
+        uint32_t  textures{ 1 };        // 0 for a capture, the CPU tracer does not sample textures
     } m_rtPushConstants;
 
+    // Progressive path tracing, the running average restarts whenever the view or the scene changes
+    Image*   m_rtAccumImage      = nullptr;
+    bool     m_rtEnabled         = false;
+    bool     m_rtPathTrace       = true;
+    uint32_t m_rtSamplesPerFrame = 4;
+    uint32_t m_rtMaxSamples      = 4096;
+    uint32_t m_rtMaxDepth        = 8;
+
+    // Left click picks the object under the cursor, the hit arrives a frame later
+    Picker*                        m_picker  = nullptr;
+    CpuBvh*                        m_pickBvh = nullptr; // traced until pick.comp is compiled
+    std::vector<glm::mat4>         m_pickBvhTransforms; // instance matrices m_pickBvh was built with
+    PickResult                     m_pickResult;
+    std::vector<Shader*>           m_pickShaders;
+    std::shared_future<VkPipeline> m_pickPipeline;
+    VkPipelineLayout               m_pickPipelineLayout = VK_NULL_HANDLE;
+
+    // Hybrid rasterization, the offscreen fragment shader casts ray queries against the TLAS
+    bool     m_hybridShadows    = false;
+    uint32_t m_hybridAoRays     = 0;
+    float    m_hybridAoRadius   = 1.0f;
+    float    m_hybridAoStrength = 0.6f;
+
+    // Filters the ray traced output before the post pass
+    Denoiser*                      m_denoiser        = nullptr;
+    bool                           m_denoise         = true;
+    bool                           m_denoiseTemporal = true;
+    std::vector<Shader*>           m_denoiseTemporalShaders;
+    std::vector<Shader*>           m_denoiseAtrousShaders;
+    std::shared_future<VkPipeline> m_denoiseTemporalPipeline;
+    std::shared_future<VkPipeline> m_denoiseAtrousPipeline;
+    VkPipelineLayout               m_denoiseTemporalPipelineLayout;
+    VkPipelineLayout               m_denoiseAtrousPipelineLayout;
+
+    // Reduced resolution launches of raytrace.rgen, [0] for primary rays and [1] for the path tracer
+    Upsampler*                     m_upsampler       = nullptr;
+    uint32_t                       m_rtResolution[2] = { RT_RESOLUTION_FULL, RT_RESOLUTION_FULL };
+    std::vector<Shader*>           m_upsampleShaders;
+    std::shared_future<VkPipeline> m_upsamplePipeline;
+    VkPipelineLayout               m_upsamplePipelineLayout;
+    std::vector<Shader*>           m_upsampleGuideShaders;
+    std::shared_future<VkPipeline> m_upsampleGuidePipeline;
+    VkPipelineLayout               m_upsampleGuidePipelineLayout;
+
+    // Wavefront path tracer, an alternative to the ray tracing pipeline on the same scene and images
+    Integrator*                                 m_integrator  = nullptr;
+    bool                                        m_rtWavefront = false;
+    std::vector<Shader*>                        m_integratorShaders;
+    std::vector<std::shared_future<VkPipeline>> m_integratorPipelines;
+    VkPipelineLayout                            m_integratorPipelineLayout;
+    VkDescriptorPool                            m_integratorDescPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet>                m_integratorDescSets; // set 0, then set 1 of every frame in flight
+
+    GpuTimer*         m_rtTimer = nullptr;
+    std::vector<bool> m_rtTimedWavefront;
+    bool              m_rtTimeWavefront = false;
+    double            m_rtTimeSum       = 0.0;
+    uint32_t          m_rtTimeCount     = 0;
+
+    // Specialization constants of raytrace.rchit
+    uint32_t m_rtLightType = 0;
+    bool     m_rtShadows   = true;
+
+    // CPU port of the ray tracing pipeline, traces the current view on demand
+    CpuTracer* m_cpuTracer = nullptr;
+    bool       m_cpuStream = true;
+
+    // The next launch of the ray tracing pipeline read back at full resolution as a new average,
+    // diffed against the CPU tracer once its frame's fence has signaled
+    bool             m_gpuCaptureRequested = false;
+    int32_t          m_gpuCaptureFrame     = -1;      // frame in flight the readback was recorded in
+    Buffer*          m_gpuCaptureBuffer    = nullptr; // host visible copy of m_rtAccumImage
+    CpuTraceSettings m_gpuCaptureSettings;
+
     void initRayTracing();
+    std::shared_future<VkPipeline> createComputePipeline( const std::string& name, Shader* shader, VkPipelineLayout pipelineLayout );
     void createBottomLevelAS();
     void createTopLevelAS();
+    bool updateTopLevelAS( VkCommandBuffer commandBuffer );
+    void createSceneDesc();
+    void updateSceneDesc( VkCommandBuffer commandBuffer );
+    void createDenoiser();
+    void createUpsampler();
+    void createPicker();
+    void cmdPick( VkCommandBuffer commandBuffer );
     void createRtDescriptorSet();
+    void createIntegrator();
     void createRtPipeline();
+    void createRtPipelineVariant();
     void createRtShaderBindingTable();
+    bool updateRtShaderBindingTable();
+    bool isRtReady();
+    void setRtHitRecord( uint32_t instance, const RtHitRecord& hitRecord );
+    void setDemoLights( uint32_t count );
+    void resetAccumulation();
+    void cmdTraceRays( VkCommandBuffer commandBuffer );
+    void reportRtTime( bool wavefront, double milliseconds );
+    CpuTraceSettings getCpuTraceSettings();
+    void renderCpuReference( const CpuTraceSettings& settings );
+    void cmdCaptureGpuOutput( VkCommandBuffer commandBuffer );
+    void diffGpuCapture();
     
     // device.cpp
     std::vector<const char*> deviceExtensions;
@@ -0,0 +1,225 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+
+#include "blasbuilder.h"
+#include "dispatch.h"
+
+BlasBuilder::~BlasBuilder() {}
+BlasBuilder::BlasBuilder( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelProperties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR };
+    VkPhysicalDeviceProperties2 properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+    properties2.pNext = &accelProperties;
+    vkGetPhysicalDeviceProperties2( m_physicalDevice, &properties2 );
+    m_scratchAlignment = accelProperties.minAccelerationStructureScratchOffsetAlignment;
+}
+
+void BlasBuilder::cleanup() {
+    destroyRetired();
+    if ( m_queryPool != VK_NULL_HANDLE ) vkDestroyQueryPool( m_device, m_queryPool, nullptr );
+    m_queryPool     = VK_NULL_HANDLE;
+    m_queryCapacity = 0;
+    m_queryCount    = 0;
+
+    if ( m_scratchBuffer != nullptr ) {
+        m_scratchBuffer->cleanup();
+        delete m_scratchBuffer;
+    }
+    m_scratchBuffer = nullptr;
+    m_scratchSize   = 0;
+}
+
+void BlasBuilder::setScratchBudget( VkDeviceSize budget ) {
+    m_scratchBudget = budget;
+}
+
+void BlasBuilder::add( Mesh* mesh ) {
+    m_meshes.push_back( mesh );
+}
+
+std::vector<AccelStructure> BlasBuilder::cmdBuild( VkCommandBuffer commandBuffer, VkBuildAccelerationStructureFlagsKHR flags ) {
+    std::vector<BuildInput> inputs;
+    for ( Mesh* mesh : m_meshes ) inputs.push_back( getBuildInput( mesh, flags ) );
+    m_meshes.clear();
+
+    // Split into batches whose scratch fits the budget, a mesh bigger than the budget gets a batch alone
+    std::vector<size_t> batchEnds;
+    VkDeviceSize batchScratch = 0;
+    VkDeviceSize maxScratch   = 0;
+    for ( size_t i = 0; i < inputs.size(); i++ ) {
+        VkDeviceSize scratch = AlignUp( inputs[i].sizeInfo.buildScratchSize, m_scratchAlignment );
+        if ( batchScratch > 0 && batchScratch + scratch > m_scratchBudget ) {
+            batchEnds.push_back( i );
+            batchScratch = 0;
+        }
+        batchScratch += scratch;
+        maxScratch    = std::max( maxScratch, batchScratch );
+    }
+    batchEnds.push_back( inputs.size() );
+    reserveScratch( maxScratch );
+
+    std::vector<AccelStructure> accelStructures;
+    for ( BuildInput& input : inputs ) {
+        accelStructures.push_back( CreateAccelStructure( m_device, m_physicalDevice, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                                                         input.sizeInfo.accelerationStructureSize ) );
+    }
+
+
+    size_t batchBegin = 0;
+    for ( size_t batchEnd : batchEnds ) {
+        std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+        std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> ranges;
+        VkDeviceSize scratchOffset = 0;
+        for ( size_t i = batchBegin; i < batchEnd; i++ ) {
+            VkAccelerationStructureBuildGeometryInfoKHR buildInfo = inputs[i].buildInfo;
+            buildInfo.pGeometries                = &inputs[i].geometry;
+            buildInfo.dstAccelerationStructure   = accelStructures[i].handle;
+            buildInfo.scratchData.deviceAddress  = m_scratchAddress + scratchOffset;
+            scratchOffset += AlignUp( inputs[i].sizeInfo.buildScratchSize, m_scratchAlignment );
+
+            buildInfos.push_back( buildInfo );
+            ranges.push_back( &inputs[i].range );
+        }
+        vkd.CmdBuildAccelerationStructuresKHR( commandBuffer, UINT32( buildInfos.size() ), buildInfos.data(), ranges.data() );
+
+        // The next batch reuses the scratch memory, and later commands read the results
+        VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+        barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr );
+        batchBegin = batchEnd;
+    }
+
+    if ( flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR ) {
+        cmdQueryCompactedSizes( commandBuffer, accelStructures );
+    }
+
+    LOG( "BlasBuilder::cmdBuild " << inputs.size() << " meshes in " << batchEnds.size() << " batches, "
+         << maxScratch / 1024 << " KB scratch" );
+    return accelStructures;
+}
+
+void BlasBuilder::cmdCompact( VkCommandBuffer commandBuffer, std::vector<AccelStructure>& accelStructures ) {
+    if ( m_queryCount == 0 || m_queryCount != accelStructures.size() )
+        RUNTIME_ERROR( "acceleration structures were not built for compaction!" );
+
+    std::vector<VkDeviceSize> compactedSizes( m_queryCount );
+    VkResult result = vkGetQueryPoolResults( m_device, m_queryPool, 0, m_queryCount, compactedSizes.size() * sizeof( VkDeviceSize ),
+                                             compactedSizes.data(), sizeof( VkDeviceSize ), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT );
+    CHECK_VKRESULT( result, "failed to get compacted sizes!" );
+
+
+    VkDeviceSize totalBefore = 0;
+    VkDeviceSize totalAfter  = 0;
+    for ( size_t i = 0; i < accelStructures.size(); i++ ) {
+        AccelStructure compacted = CreateAccelStructure( m_device, m_physicalDevice, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                                                         compactedSizes[i] );
+
+        VkCopyAccelerationStructureInfoKHR copyInfo{ VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR };
+        copyInfo.src  = accelStructures[i].handle;
+        copyInfo.dst  = compacted.handle;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+        vkd.CmdCopyAccelerationStructureKHR( commandBuffer, &copyInfo );
+
+        LOG( "BlasBuilder::cmdCompact mesh " << i << " " << accelStructures[i].size / 1024 << " KB -> "
+             << compacted.size / 1024 << " KB, saved " << ( accelStructures[i].size - compacted.size ) / 1024 << " KB" );
+        totalBefore += accelStructures[i].size;
+        totalAfter  += compacted.size;
+
+        m_retired.push_back( accelStructures[i] );
+        accelStructures[i] = compacted;
+    }
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    m_queryCount = 0;
+    if ( totalBefore > 0 ) {
+        LOG( "BlasBuilder::cmdCompact total " << totalBefore / 1024 << " KB -> " << totalAfter / 1024 << " KB ("
+             << 100 * ( totalBefore - totalAfter ) / totalBefore << "% saved)" );
+    }
+}
+
+void BlasBuilder::destroyRetired() {
+    for ( AccelStructure& accelStructure : m_retired ) DestroyAccelStructure( m_device, accelStructure );
+    m_retired.clear();
+}
+
+// Private ==================================================
+
+void BlasBuilder::cmdQueryCompactedSizes( VkCommandBuffer commandBuffer, const std::vector<AccelStructure>& accelStructures ) {
+    m_queryCount = UINT32( accelStructures.size() );
+    if ( m_queryCount == 0 ) return;
+
+    if ( m_queryCapacity < m_queryCount ) {
+        if ( m_queryPool != VK_NULL_HANDLE ) vkDestroyQueryPool( m_device, m_queryPool, nullptr );
+
+        VkQueryPoolCreateInfo queryPoolInfo{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+        queryPoolInfo.queryType  = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+        queryPoolInfo.queryCount = m_queryCount;
+        VkResult result = vkCreateQueryPool( m_device, &queryPoolInfo, nullptr, &m_queryPool );
+        CHECK_VKRESULT( result, "failed to create query pool!" );
+        m_queryCapacity = m_queryCount;
+    }
+
+    std::vector<VkAccelerationStructureKHR> handles;
+    for ( const AccelStructure& accelStructure : accelStructures ) handles.push_back( accelStructure.handle );
+
+    vkd.CmdResetQueryPool( commandBuffer, m_queryPool, 0, m_queryCount );
+    vkd.CmdWriteAccelerationStructuresPropertiesKHR( commandBuffer, m_queryCount, handles.data(),
+                                                     VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, m_queryPool, 0 );
+}
+
+BlasBuilder::BuildInput BlasBuilder::getBuildInput( Mesh* mesh, VkBuildAccelerationStructureFlagsKHR flags ) {
+    BuildInput input{};
+
+    VkAccelerationStructureGeometryTrianglesDataKHR& triangles = input.geometry.geometry.triangles;
+    triangles.sType                    = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+    triangles.vertexFormat             = VK_FORMAT_R32G32B32_SFLOAT;
+    triangles.vertexData.deviceAddress = mesh->m_vertexBuffer->getDeviceAddress();
+    triangles.vertexStride             = mesh->getVertexStride();
+    triangles.indexType                = VK_INDEX_TYPE_UINT32;
+    triangles.indexData.deviceAddress  = mesh->m_indexBuffer->getDeviceAddress();
+    triangles.maxVertex                = mesh->getVertexCount() - 1;
+
+    input.geometry.sType        = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    input.geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+    input.geometry.flags        = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+    input.range.primitiveCount = mesh->getIndexCount() / 3;
+
+    input.buildInfo.sType         = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    input.buildInfo.flags         = flags;
+    input.buildInfo.mode          = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    input.buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    input.buildInfo.geometryCount = 1;
+    input.buildInfo.pGeometries   = &input.geometry;
+
+    input.sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    vkd.GetAccelerationStructureBuildSizesKHR( m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &input.buildInfo,
+                                               &input.range.primitiveCount, &input.sizeInfo );
+    return input;
+}
+
+void BlasBuilder::reserveScratch( VkDeviceSize size ) {
+    if ( size <= m_scratchSize ) return;
+    if ( m_scratchBuffer != nullptr ) {
+        m_scratchBuffer->cleanup();
+        delete m_scratchBuffer;
+    }
+
+    // Padded so the start can be moved up to the required alignment
+    m_scratchBuffer = new Buffer( m_device, m_physicalDevice );
+    m_scratchBuffer->setup( size + m_scratchAlignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_scratchBuffer->create();
+    m_scratchAddress = AlignUp( m_scratchBuffer->getDeviceAddress(), m_scratchAlignment );
+    m_scratchSize    = size;
+}
@@ -0,0 +1,65 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "accelstructure.h"
+#include "mesh.h"
+
+// Scratch memory a single batch of builds may use, larger scenes are split into several batches
+#define BLAS_SCRATCH_BUDGET ( 64ull * 1024 * 1024 )
+
+class BlasBuilder {
+
+public:
+    ~BlasBuilder();
+    BlasBuilder( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // Frees the scratch pool, the acceleration structures belong to the caller
+    void cleanup();
+
+    void setScratchBudget( VkDeviceSize budget );
+    void add( Mesh* mesh );
+
+    // Records the builds of every added mesh and returns their acceleration structures in the
+    // order they were added. Batches share one scratch pool that is kept for later calls, so
+    // the previous command buffer has to be finished before recording the next one.
+    std::vector<AccelStructure> cmdBuild( VkCommandBuffer commandBuffer,
+                                          VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR );
+
+    // Needs the builds of the last cmdBuild, made with ALLOW_COMPACTION, to have finished on the GPU.
+    // Replaces each structure with a right-sized copy, the originals stay alive until destroyRetired().
+    void cmdCompact( VkCommandBuffer commandBuffer, std::vector<AccelStructure>& accelStructures );
+    void destroyRetired();
+
+private:
+
+    struct BuildInput {
+        VkAccelerationStructureGeometryKHR          geometry;
+        VkAccelerationStructureBuildRangeInfoKHR    range;
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo;
+        VkAccelerationStructureBuildSizesInfoKHR    sizeInfo;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    std::vector<Mesh*> m_meshes;
+
+    Buffer*         m_scratchBuffer    = nullptr;
+    VkDeviceSize    m_scratchSize      = 0;
+    VkDeviceAddress m_scratchAddress   = 0;
+    VkDeviceSize    m_scratchAlignment = 0;
+    VkDeviceSize    m_scratchBudget    = BLAS_SCRATCH_BUDGET;
+
+    VkQueryPool                 m_queryPool      = VK_NULL_HANDLE;
+    uint32_t                    m_queryCapacity  = 0;
+    uint32_t                    m_queryCount     = 0;
+    std::vector<AccelStructure> m_retired;
+
+    BuildInput getBuildInput( Mesh* mesh, VkBuildAccelerationStructureFlagsKHR flags );
+    void       cmdQueryCompactedSizes( VkCommandBuffer commandBuffer, const std::vector<AccelStructure>& accelStructures );
+    void       reserveScratch( VkDeviceSize size );
+
+};
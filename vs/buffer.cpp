@@ -17,13 +17,14 @@ void Buffer::cleanup() {
     vkFreeMemory      (m_device, m_bufferMemory, nullptr);
 }
 
-void Buffer::setup(VkDeviceSize size, VkBufferUsageFlags usage) {
+void Buffer::setup(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties) {
     VkBufferCreateInfo bufferInfo = m_bufferInfo;
     
     bufferInfo.size  = size;
     bufferInfo.usage = usage;
     
-    m_bufferInfo = bufferInfo;
+    m_bufferInfo       = bufferInfo;
+    m_memoryProperties = properties;
 }
 
 void Buffer::create() {
@@ -49,8 +50,7 @@ void Buffer::allocateBufferMemory() {
     int32_t memoryTypeIndex;
     memoryTypeIndex = FindMemoryTypeIndex(physicalDevice,
                                           memoryRequirements.memoryTypeBits,
-                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+                                          m_memoryProperties);
     
     VkMemoryAllocateFlagsInfo flagInfo{};
     flagInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
@@ -103,6 +103,11 @@ VkDescriptorBufferInfo Buffer::getBufferInfo() {
     bufferInfo.offset = 0;
     return bufferInfo;
 }
+VkDeviceAddress Buffer::getDeviceAddress() {
+    VkBufferDeviceAddressInfo addressInfo{ VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+    addressInfo.buffer = m_buffer;
+    return vkGetBufferDeviceAddress(m_device, &addressInfo);
+}
 
 
 
@@ -21,14 +21,18 @@ public:
     VkBuffer         m_buffer         = VK_NULL_HANDLE;
     VkDeviceMemory   m_bufferMemory   = VK_NULL_HANDLE;
     
-    VkBufferCreateInfo m_bufferInfo{};
+    VkBufferCreateInfo    m_bufferInfo{};
+    VkMemoryPropertyFlags m_memoryProperties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     
     VkBuffer       getBuffer();
     VkDeviceSize   getBufferSize();
     VkDeviceMemory getBufferMemory();
     VkDescriptorBufferInfo getBufferInfo();
+    VkDeviceAddress        getDeviceAddress();
     
-    void setup (VkDeviceSize size, VkBufferUsageFlags usage);
+    // Host visible by default, pass DEVICE_LOCAL for buffers only the GPU touches
+    void setup (VkDeviceSize size, VkBufferUsageFlags usage,
+                VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
     void create();
     
     void createBuffer();
@@ -16,6 +16,7 @@
 #define SPEED     0.10f
 #define SENSITIVITY   0.07f
 #define VIEW_DISTANCE 1000.0f
+#define NEAR_DISTANCE 0.1f
 #define VIEW_ANGLE    60.0f
 
 #define YAW   0.0f
@@ -73,11 +74,19 @@ glm::mat4 Camera::getViewMatrix() {
 }
 
 glm::mat4 Camera::getProjection(float ratio) {
-    glm::mat4 projection = glm::perspective(glm::radians(viewAngle), ratio, 0.1f, viewDistance);
+    glm::mat4 projection = glm::perspective(glm::radians(viewAngle), ratio, NEAR_DISTANCE, viewDistance);
     projection[1][1] *= -1; // for Vulkan, because GLM OpenGL has inverted Y clip 
     return projection;
 }
 
+float Camera::getNear() {
+    return NEAR_DISTANCE;
+}
+
+float Camera::getFar() {
+    return viewDistance;
+}
+
 void Camera::setInvertedAxis(bool value) {
     axis = value ? -1 : 1;
 }
@@ -27,6 +27,8 @@ public:
     glm::vec3 getPosition();
     glm::mat4 getViewMatrix();
     glm::mat4 getProjection(float ratio);
+    float getNear();
+    float getFar();
     
 private:
     glm::vec3 focusPoint;
@@ -1,4 +1,5 @@
 #include "app.h"
+#include "dispatch.h"
 
 void App::createCommandPool() {
     VkCommandPoolCreateInfo poolInfo{};
@@ -29,20 +30,20 @@ VkCommandBuffer App::beginSingleTimeCommands() {
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     VkCommandBuffer commandBuffer = createCommandBuffers()[0];
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    vkd.BeginCommandBuffer(commandBuffer, &beginInfo);
     return commandBuffer;
 }
 
 void App::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
     LOG("endSingleTimeCommands");
-    vkEndCommandBuffer(commandBuffer);
+    vkd.EndCommandBuffer(commandBuffer);
     
     VkSubmitInfo submitInfo{};
     submitInfo.sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers    = &commandBuffer;
     
-    vkQueueSubmit  (m_graphicQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    vkd.QueueSubmit  (m_graphicQueue, 1, &submitInfo, VK_NULL_HANDLE);
     vkQueueWaitIdle(m_graphicQueue);
     vkFreeCommandBuffers( m_device, m_commandPool, 1, &commandBuffer);
 }
@@ -0,0 +1,605 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "cpubvh.h"
+
+// Float vector of CPU_BVH_WIDTH lanes, only what the box test needs
+#if defined( __AVX__ )
+#include <immintrin.h>
+typedef __m256 SimdFloat;
+static inline SimdFloat SimdLoad( const float* p ) { return _mm256_loadu_ps( p ); }
+static inline SimdFloat SimdSet( float v ) { return _mm256_set1_ps( v ); }
+static inline SimdFloat SimdSub( SimdFloat a, SimdFloat b ) { return _mm256_sub_ps( a, b ); }
+static inline SimdFloat SimdMul( SimdFloat a, SimdFloat b ) { return _mm256_mul_ps( a, b ); }
+static inline SimdFloat SimdMin( SimdFloat a, SimdFloat b ) { return _mm256_min_ps( a, b ); }
+static inline SimdFloat SimdMax( SimdFloat a, SimdFloat b ) { return _mm256_max_ps( a, b ); }
+static inline void     SimdStore( float* p, SimdFloat a ) { _mm256_storeu_ps( p, a ); }
+static inline uint32_t SimdLessEqual( SimdFloat a, SimdFloat b ) { return UINT32( _mm256_movemask_ps( _mm256_cmp_ps( a, b, _CMP_LE_OQ ) ) ); }
+#elif defined( __SSE__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 )
+#include <xmmintrin.h>
+typedef __m128 SimdFloat;
+static inline SimdFloat SimdLoad( const float* p ) { return _mm_loadu_ps( p ); }
+static inline SimdFloat SimdSet( float v ) { return _mm_set1_ps( v ); }
+static inline SimdFloat SimdSub( SimdFloat a, SimdFloat b ) { return _mm_sub_ps( a, b ); }
+static inline SimdFloat SimdMul( SimdFloat a, SimdFloat b ) { return _mm_mul_ps( a, b ); }
+static inline SimdFloat SimdMin( SimdFloat a, SimdFloat b ) { return _mm_min_ps( a, b ); }
+static inline SimdFloat SimdMax( SimdFloat a, SimdFloat b ) { return _mm_max_ps( a, b ); }
+static inline void     SimdStore( float* p, SimdFloat a ) { _mm_storeu_ps( p, a ); }
+static inline uint32_t SimdLessEqual( SimdFloat a, SimdFloat b ) { return UINT32( _mm_movemask_ps( _mm_cmple_ps( a, b ) ) ); }
+#else
+struct SimdFloat { float v[CPU_BVH_WIDTH]; };
+static inline SimdFloat SimdLoad( const float* p ) { SimdFloat r; for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) r.v[i] = p[i]; return r; }
+static inline SimdFloat SimdSet( float v ) { SimdFloat r; for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) r.v[i] = v; return r; }
+static inline SimdFloat SimdSub( SimdFloat a, SimdFloat b ) { for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) a.v[i] -= b.v[i]; return a; }
+static inline SimdFloat SimdMul( SimdFloat a, SimdFloat b ) { for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) a.v[i] *= b.v[i]; return a; }
+static inline SimdFloat SimdMin( SimdFloat a, SimdFloat b ) { for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return a; }
+static inline SimdFloat SimdMax( SimdFloat a, SimdFloat b ) { for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return a; }
+static inline void     SimdStore( float* p, SimdFloat a ) { for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) p[i] = a.v[i]; }
+static inline uint32_t SimdLessEqual( SimdFloat a, SimdFloat b ) {
+    uint32_t mask = 0;
+    for ( int i = 0; i < CPU_BVH_WIDTH; i++ ) mask |= ( a.v[i] <= b.v[i] ? 1u : 0u ) << i;
+    return mask;
+}
+#endif
+
+// Bounds of ( plane - o ) * inv over the intervals of the origins and inverse directions of a packet,
+// the product is bilinear so its extremes are at the corners
+static inline SimdFloat SlabLower( SimdFloat plane, SimdFloat originMin, SimdFloat originMax, SimdFloat invMin, SimdFloat invMax ) {
+    SimdFloat a = SimdSub( plane, originMin );
+    SimdFloat b = SimdSub( plane, originMax );
+    return SimdMin( SimdMin( SimdMul( a, invMin ), SimdMul( a, invMax ) ), SimdMin( SimdMul( b, invMin ), SimdMul( b, invMax ) ) );
+}
+
+static inline SimdFloat SlabUpper( SimdFloat plane, SimdFloat originMin, SimdFloat originMax, SimdFloat invMin, SimdFloat invMax ) {
+    SimdFloat a = SimdSub( plane, originMin );
+    SimdFloat b = SimdSub( plane, originMax );
+    return SimdMax( SimdMax( SimdMul( a, invMin ), SimdMul( a, invMax ) ), SimdMax( SimdMul( b, invMin ), SimdMul( b, invMax ) ) );
+}
+
+// A zero component becomes a tiny one so no slab ever computes 0 * inf
+static inline glm::vec3 InverseDirection( const glm::vec3& direction ) {
+    glm::vec3 invDir;
+    for ( int32_t axis = 0; axis < 3; axis++ ) {
+        float d = direction[axis];
+        invDir[axis] = 1.0f / ( std::fabs( d ) > 1e-20f ? d : std::copysign( 1e-20f, d ) );
+    }
+    return invDir;
+}
+
+static inline uint32_t BinIndex( float centroid, float min, float scale ) {
+    return std::min( UINT32( ( centroid - min ) * scale ), UINT32( CPU_BVH_BINS - 1 ) );
+}
+
+CpuBvh::~CpuBvh() {}
+CpuBvh::CpuBvh() {}
+
+void CpuBvh::build( const std::vector<Mesh*>& meshes, JobSystem* jobSystem ) {
+    cleanup();
+
+    for ( uint32_t instance = 0; instance < meshes.size(); instance++ ) {
+        Mesh*     mesh  = meshes[instance];
+        glm::mat4 model = mesh->getMatrix();
+        for ( uint32_t primitive = 0; primitive < mesh->m_indices.size() / 3; primitive++ ) {
+            glm::vec3 v[3];
+            Bounds    bounds;
+            for ( uint32_t k = 0; k < 3; k++ ) {
+                v[k] = glm::vec3( model * glm::vec4( mesh->m_positions[mesh->m_indices[primitive * 3 + k]], 1.0f ) );
+                bounds.grow( v[k] );
+            }
+            m_triangles.push_back( { v[0], v[1] - v[0], v[2] - v[0], instance, primitive } );
+            m_primBounds.push_back( bounds );
+            m_centroids.push_back( ( bounds.min + bounds.max ) * 0.5f );
+        }
+    }
+    uint32_t triangleCount = UINT32( m_triangles.size() );
+    if ( triangleCount == 0 ) return;
+
+    m_primIndices.resize( triangleCount );
+    for ( uint32_t i = 0; i < triangleCount; i++ ) m_primIndices[i] = i;
+    m_binaryNodes.emplace_back();
+    initNode( m_binaryNodes[0], 0, triangleCount );
+
+    // The top levels are split here until the ranges are small enough to hand out. Each job builds
+    // its subtree into its own array over a disjoint range of m_primIndices, the arrays are appended after.
+    uint32_t grain = std::max( UINT32( CPU_BVH_JOB_GRAIN ), triangleCount / ( jobSystem->getThreadCount() * 4 ) );
+    std::vector<uint32_t> subtreeRoots;
+    splitTopLevels( 0, grain, subtreeRoots );
+
+    std::vector<std::future<std::vector<BinaryNode>>> subtrees;
+    for ( uint32_t root : subtreeRoots ) {
+        BinaryNode rootNode = m_binaryNodes[root];
+        subtrees.push_back( jobSystem->submit( [this, rootNode]() {
+            std::vector<BinaryNode> nodes = { rootNode };
+            buildSubtree( nodes, 0 );
+            return nodes;
+        } ) );
+    }
+    for ( size_t i = 0; i < subtrees.size(); i++ ) {
+        std::vector<BinaryNode> nodes = subtrees[i].get();
+        // Local node k > 0 lands at offset + k, the local root replaces its placeholder
+        uint32_t offset = UINT32( m_binaryNodes.size() ) - 1;
+        for ( BinaryNode& node : nodes ) {
+            if ( node.count > 0 ) continue;
+            node.left  += offset;
+            node.right += offset;
+        }
+        m_binaryNodes[subtreeRoots[i]] = nodes[0];
+        m_binaryNodes.insert( m_binaryNodes.end(), nodes.begin() + 1, nodes.end() );
+    }
+
+    uint32_t maxDepth = 0;
+    collapse( 0, 0, &maxDepth );
+    if ( ( maxDepth + 1 ) * ( CPU_BVH_WIDTH - 1 ) + 1 > CPU_BVH_STACK_SIZE ) RUNTIME_ERROR( "CPU BVH is too deep for its traversal stack!" );
+
+    // Leaves index the triangles directly once they are in tree order
+    std::vector<Triangle> triangles( triangleCount );
+    for ( uint32_t i = 0; i < triangleCount; i++ ) triangles[i] = m_triangles[m_primIndices[i]];
+    m_triangles.swap( triangles );
+
+    std::vector<Bounds>().swap( m_primBounds );
+    std::vector<glm::vec3>().swap( m_centroids );
+    std::vector<uint32_t>().swap( m_primIndices );
+    std::vector<BinaryNode>().swap( m_binaryNodes );
+}
+
+void CpuBvh::cleanup() {
+    m_triangles.clear();
+    m_nodes.clear();
+    m_primBounds.clear();
+    m_centroids.clear();
+    m_primIndices.clear();
+    m_binaryNodes.clear();
+}
+
+bool CpuBvh::intersect( const CpuRay& ray, CpuHit* hit ) const {
+    return traverse<false>( ray, hit );
+}
+
+bool CpuBvh::occluded( const CpuRay& ray ) const {
+    CpuHit hit;
+    return traverse<true>( ray, &hit );
+}
+
+void CpuBvh::intersect( const CpuRayPacket& packet, CpuHit* hits ) const {
+    traversePacket<false>( packet, hits, nullptr );
+}
+
+void CpuBvh::occluded( const CpuRayPacket& packet, bool* occluded ) const {
+    traversePacket<true>( packet, nullptr, occluded );
+}
+
+uint32_t CpuBvh::getTriangleCount() const { return UINT32( m_triangles.size() ); }
+uint32_t CpuBvh::getNodeCount    () const { return UINT32( m_nodes.size() ); }
+
+
+// Private ==================================================
+
+
+void CpuBvh::Bounds::grow( const glm::vec3& point ) {
+    min = glm::min( min, point );
+    max = glm::max( max, point );
+}
+
+void CpuBvh::Bounds::grow( const Bounds& bounds ) {
+    min = glm::min( min, bounds.min );
+    max = glm::max( max, bounds.max );
+}
+
+float CpuBvh::Bounds::area() const {
+    glm::vec3 extent = max - min;
+    return 2.0f * ( extent.x * extent.y + extent.y * extent.z + extent.z * extent.x );
+}
+
+void CpuBvh::initNode( BinaryNode& node, uint32_t first, uint32_t count ) const {
+    node.bounds = Bounds();
+    node.first  = first;
+    node.count  = count;
+    for ( uint32_t i = first; i < first + count; i++ ) node.bounds.grow( m_primBounds[m_primIndices[i]] );
+}
+
+bool CpuBvh::splitNode( std::vector<BinaryNode>& nodes, uint32_t nodeIndex ) {
+    uint32_t first  = nodes[nodeIndex].first;
+    uint32_t count  = nodes[nodeIndex].count;
+    Bounds   bounds = nodes[nodeIndex].bounds;
+    if ( count <= 1 ) return false;
+
+    Bounds centroidBounds;
+    for ( uint32_t i = first; i < first + count; i++ ) centroidBounds.grow( m_centroids[m_primIndices[i]] );
+
+    // Binned SAH, the planes between bins of every axis are priced and the cheapest wins
+    int32_t  bestAxis  = -1;
+    uint32_t bestPlane = 0;
+    float    bestCost  = INFINITY;
+    for ( int32_t axis = 0; axis < 3; axis++ ) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        if ( extent <= 0.0f ) continue;
+        float scale = CPU_BVH_BINS / extent;
+
+        Bounds   binBounds[CPU_BVH_BINS];
+        uint32_t binCounts[CPU_BVH_BINS] = {};
+        for ( uint32_t i = first; i < first + count; i++ ) {
+            uint32_t prim = m_primIndices[i];
+            uint32_t bin  = BinIndex( m_centroids[prim][axis], centroidBounds.min[axis], scale );
+            binCounts[bin]++;
+            binBounds[bin].grow( m_primBounds[prim] );
+        }
+
+        // Plane p lies between bin p - 1 and bin p, the left sweep prices the side below it
+        float    leftArea [CPU_BVH_BINS];
+        uint32_t leftCount[CPU_BVH_BINS];
+        Bounds   side;
+        uint32_t sideCount = 0;
+        for ( uint32_t plane = 1; plane < CPU_BVH_BINS; plane++ ) {
+            side.grow( binBounds[plane - 1] );
+            sideCount += binCounts[plane - 1];
+            leftCount[plane] = sideCount;
+            leftArea [plane] = sideCount > 0 ? side.area() : 0.0f;
+        }
+        side      = Bounds();
+        sideCount = 0;
+        for ( uint32_t plane = CPU_BVH_BINS - 1; plane > 0; plane-- ) {
+            side.grow( binBounds[plane] );
+            sideCount += binCounts[plane];
+            if ( sideCount == 0 || leftCount[plane] == 0 ) continue;
+            float cost = leftCount[plane] * leftArea[plane] + sideCount * side.area();
+            if ( cost < bestCost ) {
+                bestAxis  = axis;
+                bestPlane = plane;
+                bestCost  = cost;
+            }
+        }
+    }
+    // Every centroid in one point, no plane separates them
+    if ( bestAxis < 0 ) return false;
+    // Small nodes stay leaves unless a traversal step and two children cost less than their triangles
+    if ( count <= CPU_BVH_LEAF_SIZE && bounds.area() + bestCost >= count * bounds.area() ) return false;
+
+    float     min    = centroidBounds.min[bestAxis];
+    float     scale  = CPU_BVH_BINS / ( centroidBounds.max[bestAxis] - min );
+    uint32_t* begin  = m_primIndices.data() + first;
+    uint32_t* middle = std::partition( begin, begin + count, [&]( uint32_t prim ) {
+        return BinIndex( m_centroids[prim][bestAxis], min, scale ) < bestPlane;
+    } );
+    uint32_t leftCount = UINT32( middle - begin );
+
+    BinaryNode left, right;
+    initNode( left,  first, leftCount );
+    initNode( right, first + leftCount, count - leftCount );
+
+    nodes[nodeIndex].left  = UINT32( nodes.size() );
+    nodes[nodeIndex].right = UINT32( nodes.size() ) + 1;
+    nodes[nodeIndex].count = 0;
+    nodes.push_back( left );
+    nodes.push_back( right );
+    return true;
+}
+
+void CpuBvh::buildSubtree( std::vector<BinaryNode>& nodes, uint32_t nodeIndex ) {
+    if ( !splitNode( nodes, nodeIndex ) ) return;
+    uint32_t left  = nodes[nodeIndex].left;
+    uint32_t right = nodes[nodeIndex].right;
+    buildSubtree( nodes, left );
+    buildSubtree( nodes, right );
+}
+
+void CpuBvh::splitTopLevels( uint32_t nodeIndex, uint32_t grain, std::vector<uint32_t>& subtreeRoots ) {
+    if ( m_binaryNodes[nodeIndex].count <= grain ) {
+        subtreeRoots.push_back( nodeIndex );
+        return;
+    }
+    if ( !splitNode( m_binaryNodes, nodeIndex ) ) return;
+    uint32_t left  = m_binaryNodes[nodeIndex].left;
+    uint32_t right = m_binaryNodes[nodeIndex].right;
+    splitTopLevels( left,  grain, subtreeRoots );
+    splitTopLevels( right, grain, subtreeRoots );
+}
+
+int32_t CpuBvh::collapse( uint32_t binaryIndex, uint32_t depth, uint32_t* maxDepth ) {
+    *maxDepth = std::max( *maxDepth, depth );
+
+    // The inner child with the largest box is opened until every lane is used
+    uint32_t          children[CPU_BVH_WIDTH];
+    uint32_t          childCount = 0;
+    const BinaryNode& node       = m_binaryNodes[binaryIndex];
+    if ( node.count > 0 ) {
+        children[childCount++] = binaryIndex;
+    }
+    else {
+        children[childCount++] = node.left;
+        children[childCount++] = node.right;
+    }
+    while ( childCount < CPU_BVH_WIDTH ) {
+        int32_t largest     = -1;
+        float   largestArea = -1.0f;
+        for ( uint32_t i = 0; i < childCount; i++ ) {
+            const BinaryNode& child = m_binaryNodes[children[i]];
+            if ( child.count > 0 || child.bounds.area() <= largestArea ) continue;
+            largest     = static_cast<int32_t>( i );
+            largestArea = child.bounds.area();
+        }
+        if ( largest < 0 ) break;
+        const BinaryNode& opened = m_binaryNodes[children[largest]];
+        children[largest]        = opened.left;
+        children[childCount++]   = opened.right;
+    }
+
+    WideNode wide;
+    for ( uint32_t i = 0; i < CPU_BVH_WIDTH; i++ ) {
+        const BinaryNode* child = i < childCount ? &m_binaryNodes[children[i]] : nullptr;
+        Bounds bounds = child != nullptr ? child->bounds : Bounds();
+        wide.minX[i]  = bounds.min.x;
+        wide.minY[i]  = bounds.min.y;
+        wide.minZ[i]  = bounds.min.z;
+        wide.maxX[i]  = bounds.max.x;
+        wide.maxY[i]  = bounds.max.y;
+        wide.maxZ[i]  = bounds.max.z;
+        wide.child[i] = child != nullptr && child->count > 0 ? ~static_cast<int32_t>( child->first ) : 0;
+        wide.count[i] = child != nullptr ? child->count : 0;
+    }
+    int32_t wideIndex = static_cast<int32_t>( m_nodes.size() );
+    m_nodes.push_back( wide );
+
+    for ( uint32_t i = 0; i < childCount; i++ ) {
+        if ( m_binaryNodes[children[i]].count > 0 ) continue;
+        int32_t childIndex = collapse( children[i], depth + 1, maxDepth );
+        m_nodes[wideIndex].child[i] = childIndex;
+    }
+    return wideIndex;
+}
+
+template<bool ANY_HIT>
+bool CpuBvh::traverse( const CpuRay& ray, CpuHit* hit ) const {
+    if ( m_nodes.empty() ) return false;
+
+    // Slabs as ( plane - origin ) * invDir, the near and far planes swap where the direction is negative
+    glm::vec3 invDir  = InverseDirection( ray.direction );
+    bool      negX    = invDir.x < 0.0f;
+    bool      negY    = invDir.y < 0.0f;
+    bool      negZ    = invDir.z < 0.0f;
+    SimdFloat originX = SimdSet( ray.origin.x );
+    SimdFloat originY = SimdSet( ray.origin.y );
+    SimdFloat originZ = SimdSet( ray.origin.z );
+    SimdFloat invX    = SimdSet( invDir.x );
+    SimdFloat invY    = SimdSet( invDir.y );
+    SimdFloat invZ    = SimdSet( invDir.z );
+    SimdFloat tMin    = SimdSet( ray.tMin );
+    float     tMax    = ray.tMax;
+    bool      found   = false;
+
+    StackEntry stack[CPU_BVH_STACK_SIZE];
+    uint32_t   stackSize = 0;
+    stack[stackSize++] = { 0, ray.tMin };
+    while ( stackSize > 0 ) {
+        StackEntry entry = stack[--stackSize];
+        if ( entry.tNear > tMax ) continue;
+        const WideNode& node = m_nodes[entry.node];
+
+        SimdFloat nearX = SimdMul( SimdSub( SimdLoad( negX ? node.maxX : node.minX ), originX ), invX );
+        SimdFloat nearY = SimdMul( SimdSub( SimdLoad( negY ? node.maxY : node.minY ), originY ), invY );
+        SimdFloat nearZ = SimdMul( SimdSub( SimdLoad( negZ ? node.maxZ : node.minZ ), originZ ), invZ );
+        SimdFloat farX  = SimdMul( SimdSub( SimdLoad( negX ? node.minX : node.maxX ), originX ), invX );
+        SimdFloat farY  = SimdMul( SimdSub( SimdLoad( negY ? node.minY : node.maxY ), originY ), invY );
+        SimdFloat farZ  = SimdMul( SimdSub( SimdLoad( negZ ? node.minZ : node.maxZ ), originZ ), invZ );
+        SimdFloat tNear = SimdMax( SimdMax( nearX, nearY ), SimdMax( nearZ, tMin ) );
+        SimdFloat tFar  = SimdMin( SimdMin( farX, farY ), SimdMin( farZ, SimdSet( tMax ) ) );
+        uint32_t  mask  = SimdLessEqual( tNear, tFar );
+        if ( mask == 0 ) continue;
+
+        float distances[CPU_BVH_WIDTH];
+        SimdStore( distances, tNear );
+
+        // Leaves are tested right away, inner children are sorted so the nearest is popped first
+        StackEntry inner[CPU_BVH_WIDTH];
+        uint32_t   innerCount = 0;
+        for ( uint32_t lane = 0; lane < CPU_BVH_WIDTH; lane++ ) {
+            if ( ( mask & ( 1u << lane ) ) == 0 ) continue;
+            if ( node.count[lane] > 0 ) {
+                uint32_t first = UINT32( ~node.child[lane] );
+                for ( uint32_t i = first; i < first + node.count[lane]; i++ ) {
+                    if ( !intersectTriangle( m_triangles[i], ray, tMax, hit ) ) continue;
+                    if ( ANY_HIT ) return true;
+                    tMax  = hit->t;
+                    found = true;
+                }
+            }
+            else {
+                uint32_t j = innerCount++;
+                for ( ; j > 0 && inner[j - 1].tNear < distances[lane]; j-- ) inner[j] = inner[j - 1];
+                inner[j] = { node.child[lane], distances[lane] };
+            }
+        }
+        for ( uint32_t i = 0; i < innerCount; i++ ) stack[stackSize++] = inner[i];
+    }
+    return found;
+}
+
+template<bool ANY_HIT>
+void CpuBvh::traversePacket( const CpuRayPacket& packet, CpuHit* hits, bool* occluded ) const {
+    CpuHit scratch;
+    for ( uint32_t i = 0; i < packet.count; i++ ) {
+        if ( ANY_HIT ) occluded[i] = false;
+        else           hits[i]     = CpuHit();
+    }
+    if ( m_nodes.empty() || packet.count == 0 ) return;
+
+    // Intervals of the origins and inverse directions. The slab bounds computed from them hold for every
+    // ray of the packet as long as each axis keeps one sign.
+    glm::vec3 invDirs[CPU_PACKET_SIZE];
+    glm::vec3 originMin( INFINITY ), originMax( -INFINITY );
+    glm::vec3 invMin   ( INFINITY ), invMax   ( -INFINITY );
+    float     tMinAll  = INFINITY;
+    uint32_t  negative = 0;
+    uint32_t  positive = 0;
+    for ( uint32_t i = 0; i < packet.count; i++ ) {
+        const CpuRay& ray = packet.rays[i];
+        invDirs[i] = InverseDirection( ray.direction );
+        originMin  = glm::min( originMin, ray.origin );
+        originMax  = glm::max( originMax, ray.origin );
+        invMin     = glm::min( invMin, invDirs[i] );
+        invMax     = glm::max( invMax, invDirs[i] );
+        tMinAll    = std::min( tMinAll, ray.tMin );
+        for ( int32_t axis = 0; axis < 3; axis++ ) {
+            if ( invDirs[i][axis] < 0.0f ) negative |= 1u << axis;
+            else                           positive |= 1u << axis;
+        }
+    }
+    if ( ( negative & positive ) != 0 ) {
+        for ( uint32_t i = 0; i < packet.count; i++ ) {
+            if ( ANY_HIT ) occluded[i] = traverse<true>( packet.rays[i], &scratch );
+            else           traverse<false>( packet.rays[i], &hits[i] );
+        }
+        return;
+    }
+
+    bool      negX       = ( negative & 1u ) != 0;
+    bool      negY       = ( negative & 2u ) != 0;
+    bool      negZ       = ( negative & 4u ) != 0;
+    SimdFloat originMinX = SimdSet( originMin.x );
+    SimdFloat originMinY = SimdSet( originMin.y );
+    SimdFloat originMinZ = SimdSet( originMin.z );
+    SimdFloat originMaxX = SimdSet( originMax.x );
+    SimdFloat originMaxY = SimdSet( originMax.y );
+    SimdFloat originMaxZ = SimdSet( originMax.z );
+    SimdFloat invMinX    = SimdSet( invMin.x );
+    SimdFloat invMinY    = SimdSet( invMin.y );
+    SimdFloat invMinZ    = SimdSet( invMin.z );
+    SimdFloat invMaxX    = SimdSet( invMax.x );
+    SimdFloat invMaxY    = SimdSet( invMax.y );
+    SimdFloat invMaxZ    = SimdSet( invMax.z );
+    SimdFloat tMinPacket = SimdSet( tMinAll );
+
+    SimdFloat originX[CPU_PACKET_SIZE], originY[CPU_PACKET_SIZE], originZ[CPU_PACKET_SIZE];
+    SimdFloat invX   [CPU_PACKET_SIZE], invY   [CPU_PACKET_SIZE], invZ   [CPU_PACKET_SIZE];
+    SimdFloat tMin   [CPU_PACKET_SIZE];
+    float     tMax   [CPU_PACKET_SIZE];
+    for ( uint32_t i = 0; i < packet.count; i++ ) {
+        originX[i] = SimdSet( packet.rays[i].origin.x );
+        originY[i] = SimdSet( packet.rays[i].origin.y );
+        originZ[i] = SimdSet( packet.rays[i].origin.z );
+        invX   [i] = SimdSet( invDirs[i].x );
+        invY   [i] = SimdSet( invDirs[i].y );
+        invZ   [i] = SimdSet( invDirs[i].z );
+        tMin   [i] = SimdSet( packet.rays[i].tMin );
+        tMax   [i] = packet.rays[i].tMax;
+    }
+
+    // Rays still looking for a hit, the farthest of their tMax bounds the packet
+    uint32_t active     = ( 1u << packet.count ) - 1;
+    float    packetTMax = -INFINITY;
+    for ( uint32_t i = 0; i < packet.count; i++ ) packetTMax = std::max( packetTMax, tMax[i] );
+
+    PacketStackEntry stack[CPU_BVH_STACK_SIZE];
+    uint32_t         stackSize = 0;
+    stack[stackSize++] = { 0, tMinAll, active };
+    while ( stackSize > 0 ) {
+        PacketStackEntry entry = stack[--stackSize];
+        uint32_t         rays  = entry.rays & active;
+        if ( rays == 0 || entry.tNear > packetTMax ) continue;
+        const WideNode& node = m_nodes[entry.node];
+
+        SimdFloat nearPlaneX = SimdLoad( negX ? node.maxX : node.minX );
+        SimdFloat nearPlaneY = SimdLoad( negY ? node.maxY : node.minY );
+        SimdFloat nearPlaneZ = SimdLoad( negZ ? node.maxZ : node.minZ );
+        SimdFloat farPlaneX  = SimdLoad( negX ? node.minX : node.maxX );
+        SimdFloat farPlaneY  = SimdLoad( negY ? node.minY : node.maxY );
+        SimdFloat farPlaneZ  = SimdLoad( negZ ? node.minZ : node.maxZ );
+
+        // Culled for the whole packet when even the earliest entry of any ray comes after the latest exit of any ray
+        SimdFloat packetNear = SimdMax( SimdMax( SlabLower( nearPlaneX, originMinX, originMaxX, invMinX, invMaxX ),
+                                                 SlabLower( nearPlaneY, originMinY, originMaxY, invMinY, invMaxY ) ),
+                                        SimdMax( SlabLower( nearPlaneZ, originMinZ, originMaxZ, invMinZ, invMaxZ ), tMinPacket ) );
+        SimdFloat packetFar  = SimdMin( SimdMin( SlabUpper( farPlaneX, originMinX, originMaxX, invMinX, invMaxX ),
+                                                 SlabUpper( farPlaneY, originMinY, originMaxY, invMinY, invMaxY ) ),
+                                        SimdMin( SlabUpper( farPlaneZ, originMinZ, originMaxZ, invMinZ, invMaxZ ), SimdSet( packetTMax ) ) );
+        uint32_t packetMask = SimdLessEqual( packetNear, packetFar );
+        if ( packetMask == 0 ) continue;
+
+        // The boxes left are tested ray by ray, a child only sees the rays that enter it
+        uint32_t childRays[CPU_BVH_WIDTH] = {};
+        float    childNear[CPU_BVH_WIDTH];
+        for ( uint32_t lane = 0; lane < CPU_BVH_WIDTH; lane++ ) childNear[lane] = INFINITY;
+        for ( uint32_t i = 0; i < packet.count; i++ ) {
+            if ( ( rays & ( 1u << i ) ) == 0 ) continue;
+            SimdFloat tNear = SimdMax( SimdMax( SimdMul( SimdSub( nearPlaneX, originX[i] ), invX[i] ),
+                                                SimdMul( SimdSub( nearPlaneY, originY[i] ), invY[i] ) ),
+                                       SimdMax( SimdMul( SimdSub( nearPlaneZ, originZ[i] ), invZ[i] ), tMin[i] ) );
+            SimdFloat tFar  = SimdMin( SimdMin( SimdMul( SimdSub( farPlaneX, originX[i] ), invX[i] ),
+                                                SimdMul( SimdSub( farPlaneY, originY[i] ), invY[i] ) ),
+                                       SimdMin( SimdMul( SimdSub( farPlaneZ, originZ[i] ), invZ[i] ), SimdSet( tMax[i] ) ) );
+            uint32_t mask = SimdLessEqual( tNear, tFar ) & packetMask;
+            if ( mask == 0 ) continue;
+
+            float distances[CPU_BVH_WIDTH];
+            SimdStore( distances, tNear );
+            for ( uint32_t lane = 0; lane < CPU_BVH_WIDTH; lane++ ) {
+                if ( ( mask & ( 1u << lane ) ) == 0 ) continue;
+                childRays[lane] |= 1u << i;
+                childNear[lane]  = std::min( childNear[lane], distances[lane] );
+            }
+        }
+
+        PacketStackEntry inner[CPU_BVH_WIDTH];
+        uint32_t         innerCount = 0;
+        bool             leafHit    = false;
+        for ( uint32_t lane = 0; lane < CPU_BVH_WIDTH; lane++ ) {
+            if ( childRays[lane] == 0 ) continue;
+            if ( node.count[lane] > 0 ) {
+                uint32_t first = UINT32( ~node.child[lane] );
+                for ( uint32_t i = 0; i < packet.count; i++ ) {
+                    if ( ( childRays[lane] & active & ( 1u << i ) ) == 0 ) continue;
+                    for ( uint32_t t = first; t < first + node.count[lane]; t++ ) {
+                        if ( !intersectTriangle( m_triangles[t], packet.rays[i], tMax[i], ANY_HIT ? &scratch : &hits[i] ) ) continue;
+                        leafHit = true;
+                        if ( ANY_HIT ) {
+                            occluded[i] = true;
+                            active     &= ~( 1u << i );
+                            break;
+                        }
+                        tMax[i] = hits[i].t;
+                    }
+                }
+            }
+            else {
+                uint32_t j = innerCount++;
+                for ( ; j > 0 && inner[j - 1].tNear < childNear[lane]; j-- ) inner[j] = inner[j - 1];
+                inner[j] = { node.child[lane], childNear[lane], childRays[lane] };
+            }
+        }
+        if ( leafHit ) {
+            if ( active == 0 ) return;
+            packetTMax = -INFINITY;
+            for ( uint32_t i = 0; i < packet.count; i++ ) {
+                if ( ( active & ( 1u << i ) ) != 0 ) packetTMax = std::max( packetTMax, tMax[i] );
+            }
+        }
+        for ( uint32_t i = 0; i < innerCount; i++ ) stack[stackSize++] = inner[i];
+    }
+}
+
+bool CpuBvh::intersectTriangle( const Triangle& triangle, const CpuRay& ray, float tMax, CpuHit* hit ) const {
+    glm::vec3 p   = glm::cross( ray.direction, triangle.e2 );
+    float     det = glm::dot( triangle.e1, p );
+    if ( std::fabs( det ) < 1e-12f ) return false;
+    float invDet = 1.0f / det;
+
+    glm::vec3 s = ray.origin - triangle.v0;
+    float     u = glm::dot( s, p ) * invDet;
+    if ( u < 0.0f || u > 1.0f ) return false;
+
+    glm::vec3 q = glm::cross( s, triangle.e1 );
+    float     v = glm::dot( ray.direction, q ) * invDet;
+    if ( v < 0.0f || u + v > 1.0f ) return false;
+
+    float t = glm::dot( triangle.e2, q ) * invDet;
+    if ( t < ray.tMin || t > tMax ) return false;
+
+    hit->t         = t;
+    hit->u         = u;
+    hit->v         = v;
+    hit->instance  = triangle.instance;
+    hit->primitive = triangle.primitive;
+    return true;
+}
@@ -0,0 +1,152 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "mesh.h"
+#include "jobs.h"
+
+// Children of a node, one box per float lane. AVX tests 8 boxes at once, SSE and the scalar fallback 4
+#if defined( __AVX__ )
+#define CPU_BVH_WIDTH 8
+#else
+#define CPU_BVH_WIDTH 4
+#endif
+
+#define CPU_BVH_BINS       16
+#define CPU_BVH_LEAF_SIZE  4
+#define CPU_BVH_STACK_SIZE 256
+
+// Ranges below this many triangles are built by one job
+#define CPU_BVH_JOB_GRAIN  4096
+
+// Rays traversed together, a 4x2 block of primary rays or neighbours in a sorted stream
+#define CPU_PACKET_SIZE 8
+
+struct CpuRay {
+    glm::vec3 origin;
+    float     tMin = 0.0f;
+    glm::vec3 direction;
+    float     tMax = INFINITY;
+};
+
+// u and v weight the second and third vertex, like the hit attributes of a triangle
+struct CpuHit {
+    float    t         = INFINITY;
+    float    u         = 0.0f;
+    float    v         = 0.0f;
+    uint32_t instance  = UINT32_MAX;
+    uint32_t primitive = 0;
+};
+
+// Only the first count rays are traced
+struct CpuRayPacket {
+    CpuRay   rays[CPU_PACKET_SIZE];
+    uint32_t count = 0;
+};
+
+// World space BVH over the triangles of several meshes, the CPU counterpart of the TLAS and its BLASes.
+// A binned SAH builds a binary tree that is then collapsed into nodes of CPU_BVH_WIDTH children,
+// whose boxes one ray tests together.
+class CpuBvh {
+
+public:
+    ~CpuBvh();
+    CpuBvh();
+
+    // Instance i is meshes[i] with its current model matrix, subtrees are built as jobs
+    void build( const std::vector<Mesh*>& meshes, JobSystem* jobSystem );
+    void cleanup();
+
+    // Closest hit in [tMin, tMax], both faces count like an opaque triangle without culling
+    bool intersect( const CpuRay& ray, CpuHit* hit ) const;
+    // Stops at the first hit in [tMin, tMax]
+    bool occluded( const CpuRay& ray ) const;
+
+    // A packet shares one traversal. The interval bounds of its rays cull a node's boxes for all of them
+    // at once, the boxes left are tested ray by ray so a subtree only sees the rays that enter it. Needs
+    // every ray in the same direction octant, other packets fall back to one ray at a time.
+    // hits and occluded hold packet.count results.
+    void intersect( const CpuRayPacket& packet, CpuHit* hits ) const;
+    void occluded ( const CpuRayPacket& packet, bool* occluded ) const;
+
+    uint32_t getTriangleCount() const;
+    uint32_t getNodeCount() const;
+
+private:
+
+    // Edges are kept for Moller-Trumbore instead of the last two vertices
+    struct Triangle {
+        glm::vec3 v0;
+        glm::vec3 e1;
+        glm::vec3 e2;
+        uint32_t  instance;
+        uint32_t  primitive;
+    };
+
+    struct Bounds {
+        glm::vec3 min = glm::vec3(  INFINITY );
+        glm::vec3 max = glm::vec3( -INFINITY );
+        void  grow( const glm::vec3& point );
+        void  grow( const Bounds& bounds );
+        float area() const;
+    };
+
+    // An inner node has no triangles, a leaf owns [first, first + count) of m_primIndices
+    struct BinaryNode {
+        Bounds   bounds;
+        uint32_t left  = 0;
+        uint32_t right = 0;
+        uint32_t first = 0;
+        uint32_t count = 0;
+    };
+
+    // Child boxes as arrays, one lane each. Empty slots keep an inverted box that no ray enters.
+    struct alignas( 32 ) WideNode {
+        float    minX[CPU_BVH_WIDTH];
+        float    minY[CPU_BVH_WIDTH];
+        float    minZ[CPU_BVH_WIDTH];
+        float    maxX[CPU_BVH_WIDTH];
+        float    maxY[CPU_BVH_WIDTH];
+        float    maxZ[CPU_BVH_WIDTH];
+        int32_t  child[CPU_BVH_WIDTH]; // inner node index, or ~first triangle of a leaf
+        uint32_t count[CPU_BVH_WIDTH]; // triangles of a leaf, 0 for an inner node
+    };
+
+    struct StackEntry {
+        int32_t node;
+        float   tNear;
+    };
+
+    // rays holds a bit per ray of the packet that entered the node's box
+    struct PacketStackEntry {
+        int32_t  node;
+        float    tNear;
+        uint32_t rays;
+    };
+
+    std::vector<Triangle> m_triangles;
+    std::vector<WideNode> m_nodes;
+
+    // Build inputs, released once the tree is collapsed
+    std::vector<Bounds>     m_primBounds;
+    std::vector<glm::vec3>  m_centroids;
+    std::vector<uint32_t>   m_primIndices;
+    std::vector<BinaryNode> m_binaryNodes;
+
+    void initNode( BinaryNode& node, uint32_t first, uint32_t count ) const;
+    // Splits a node in place and returns false when it stays a leaf. The children are appended to nodes.
+    bool splitNode( std::vector<BinaryNode>& nodes, uint32_t nodeIndex );
+    void buildSubtree( std::vector<BinaryNode>& nodes, uint32_t nodeIndex );
+    void splitTopLevels( uint32_t nodeIndex, uint32_t grain, std::vector<uint32_t>& subtreeRoots );
+
+    int32_t  collapse( uint32_t binaryIndex, uint32_t depth, uint32_t* maxDepth );
+
+    template<bool ANY_HIT>
+    bool traverse( const CpuRay& ray, CpuHit* hit ) const;
+    template<bool ANY_HIT>
+    void traversePacket( const CpuRayPacket& packet, CpuHit* hits, bool* occluded ) const;
+    bool intersectTriangle( const Triangle& triangle, const CpuRay& ray, float tMax, CpuHit* hit ) const;
+
+};
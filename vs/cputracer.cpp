@@ -0,0 +1,557 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "cputracer.h"
+#include "imagediff.h"
+
+// sampling.glsl ==================================================
+
+static uint32_t Tea( uint32_t val0, uint32_t val1 ) {
+    uint32_t v0 = val0;
+    uint32_t v1 = val1;
+    uint32_t s0 = 0;
+    for ( uint32_t n = 0; n < 16; n++ ) {
+        s0 += 0x9e3779b9;
+        v0 += ( ( v1 << 4 ) + 0xa341316c ) ^ ( v1 + s0 ) ^ ( ( v1 >> 5 ) + 0xc8013ea4 );
+        v1 += ( ( v0 << 4 ) + 0xad90777d ) ^ ( v0 + s0 ) ^ ( ( v0 >> 5 ) + 0x7e95761e );
+    }
+    return v0;
+}
+
+static uint32_t Lcg( uint32_t& prev ) {
+    prev = 1664525u * prev + 1013904223u;
+    return prev & 0x00FFFFFF;
+}
+
+static float Rnd( uint32_t& prev ) {
+    return float( Lcg( prev ) ) / float( 0x01000000 );
+}
+
+static glm::vec3 SampleCosineHemisphere( uint32_t& seed, const glm::vec3& normal ) {
+    const float kPi = 3.14159265358979323846f;
+    float r1 = Rnd( seed );
+    float r2 = Rnd( seed );
+    float sq = std::sqrt( r1 );
+    glm::vec3 local( std::cos( 2.0f * kPi * r2 ) * sq, std::sin( 2.0f * kPi * r2 ) * sq, std::sqrt( 1.0f - r1 ) );
+
+    glm::vec3 tangent   = std::fabs( normal.x ) > std::fabs( normal.z ) ? glm::normalize( glm::vec3( -normal.y, normal.x, 0.0f ) )
+                                                                        : glm::normalize( glm::vec3( 0.0f, -normal.z, normal.y ) );
+    glm::vec3 bitangent = glm::cross( normal, tangent );
+    return glm::normalize( local.x * tangent + local.y * bitangent + local.z * normal );
+}
+
+// wavefront.glsl ==================================================
+
+static glm::vec3 ComputeDiffuse( const CpuMaterial& mat, const glm::vec3& lightDir, const glm::vec3& normal ) {
+    float     dotNL = std::max( glm::dot( normal, lightDir ), 0.0f );
+    glm::vec3 c     = mat.diffuse * dotNL;
+    if ( mat.illum >= 1 ) c += mat.ambient;
+    return c;
+}
+
+static glm::vec3 ComputeSpecular( const CpuMaterial& mat, const glm::vec3& viewDir, const glm::vec3& lightDir, const glm::vec3& normal ) {
+    if ( mat.illum < 2 ) return glm::vec3( 0.0f );
+
+    const float kPi                 = 3.14159265f;
+    const float kShininess          = std::max( mat.shininess, 4.0f );
+    const float kEnergyConservation = ( 2.0f + kShininess ) / ( 2.0f * kPi );
+    glm::vec3   V                   = glm::normalize( -viewDir );
+    glm::vec3   R                   = glm::reflect( -lightDir, normal );
+    float       specular            = kEnergyConservation * std::pow( std::max( glm::dot( V, R ), 0.0f ), kShininess );
+    return mat.specular * specular;
+}
+
+// lights.glsl and lighttree.glsl ==================================================
+
+static float LightNodeImportance( const LightNode& node, const glm::vec3& P, const glm::vec3& N ) {
+    glm::vec3 front = glm::mix( node.boundsMin, node.boundsMax, glm::step( glm::vec3( 0.0f ), N ) );
+    if ( glm::dot( front - P, N ) <= 0.0f ) return 0.0f;
+
+    glm::vec3 toCenter = 0.5f * ( node.boundsMin + node.boundsMax ) - P;
+    glm::vec3 extent   = node.boundsMax - node.boundsMin;
+    float     dist2    = std::max( glm::dot( toCenter, toCenter ), 0.25f * glm::dot( extent, extent ) );
+    return node.power / std::max( dist2, 1e-4f );
+}
+
+static int32_t SampleLightTree( const std::vector<LightNode>& nodes, const glm::vec3& P, const glm::vec3& N, float u, float& pdf ) {
+    pdf = 1.0f;
+    if ( nodes.empty() || nodes[0].power <= 0.0f ) return -1;
+
+    int32_t node = 0;
+    for ( uint32_t depth = 0; depth < 32; depth++ ) {
+        int32_t child = nodes[node].child;
+        if ( child < 0 ) return ~child;
+
+        float left  = LightNodeImportance( nodes[child], P, N );
+        float right = LightNodeImportance( nodes[child + 1], P, N );
+        if ( left + right <= 0.0f ) return -1;
+
+        float pLeft = left / ( left + right );
+        if ( u < pLeft ) {
+            node = child;
+            pdf *= pLeft;
+            u    = std::min( u / pLeft, 0.99999f );
+        }
+        else {
+            node = child + 1;
+            pdf *= 1.0f - pLeft;
+            u    = std::min( ( u - pLeft ) / ( 1.0f - pLeft ), 0.99999f );
+        }
+    }
+    return -1;
+}
+
+CpuTracer::~CpuTracer() {}
+CpuTracer::CpuTracer( JobSystem* jobSystem ) :
+    m_jobSystem( jobSystem ) {}
+
+void CpuTracer::setup( const std::vector<Mesh*>& meshes, const std::vector<CpuMaterial>& materials, const std::vector<glm::vec4>& tints,
+                       const std::vector<Light>& lights, const std::vector<LightNode>& lightNodes ) {
+    m_meshes     = meshes;
+    m_materials  = materials;
+    m_tints      = tints;
+    m_lights     = lights;
+    m_lightNodes = lightNodes;
+    m_transforms.clear();
+    m_transformsIT.clear();
+    for ( Mesh* mesh : meshes ) {
+        glm::mat4 transform = mesh->getMatrix();
+        m_transforms  .push_back( transform );
+        m_transformsIT.push_back( glm::transpose( glm::inverse( transform ) ) );
+    }
+
+    if ( m_bvh == nullptr ) m_bvh = new CpuBvh();
+    auto start = std::chrono::high_resolution_clock::now();
+    m_bvh->build( meshes, m_jobSystem );
+    m_buildSeconds = std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - start ).count();
+    LOG( "CpuTracer::setup " << m_bvh->getTriangleCount() << " triangles, " << m_bvh->getNodeCount() << " nodes of "
+         << CPU_BVH_WIDTH << " in " << m_buildSeconds * 1000.0 << " ms" );
+}
+
+void CpuTracer::cleanup() {
+    if ( m_bvh != nullptr ) m_bvh->cleanup();
+    m_image.clear();
+}
+
+void CpuTracer::render( Size<uint32_t> size, const CpuTraceSettings& settings ) {
+    m_size = size;
+    m_image.assign( size.width * size.height, glm::vec4( 0.0f ) );
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::future<CpuRayStats>> jobs;
+    for ( uint32_t row = 0; row < size.height; row += CPU_TRACER_JOB_ROWS ) {
+        uint32_t rowCount = std::min( UINT32( CPU_TRACER_JOB_ROWS ), size.height - row );
+        jobs.push_back( m_jobSystem->submit( [this, row, rowCount, &settings]() {
+            return settings.stream ? renderRowsStream( row, rowCount, settings ) : renderRows( row, rowCount, settings );
+        } ) );
+    }
+    m_rayStats = CpuRayStats();
+    for ( std::future<CpuRayStats>& job : jobs ) {
+        CpuRayStats stats = job.get();
+        for ( uint32_t type = 0; type < CPU_RAY_TYPE_COUNT; type++ ) {
+            m_rayStats.count  [type] += stats.count  [type];
+            m_rayStats.seconds[type] += stats.seconds[type];
+        }
+    }
+    m_renderSeconds = std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - start ).count();
+
+    LOG( "CpuTracer::render " << ( settings.stream ? "stream " : "single " ) << getRayCount() << " rays in "
+         << m_renderSeconds * 1000.0 << " ms, " << getRayCount() / m_renderSeconds / 1e6 << " Mrays/s" );
+    static const char* typeNames[] = { "primary", "bounce", "shadow" };
+    for ( uint32_t type = 0; type < CPU_RAY_TYPE_COUNT; type++ ) {
+        if ( m_rayStats.count[type] == 0 ) continue;
+        if ( m_rayStats.seconds[type] > 0.0 ) {
+            LOG( "CpuTracer::render " << typeNames[type] << " " << m_rayStats.count[type] << " rays, "
+                 << m_rayStats.count[type] / m_rayStats.seconds[type] / 1e6 << " Mrays/s per thread" );
+        }
+        else LOG( "CpuTracer::render " << typeNames[type] << " " << m_rayStats.count[type] << " rays" );
+    }
+}
+
+void CpuTracer::savePfm( const std::string& filename ) const {
+    FloatImage image;
+    image.size   = m_size;
+    image.pixels = m_image;
+    SavePfm( filename, image );
+}
+
+const std::vector<glm::vec4>& CpuTracer::getImage   () const { return m_image; }
+const CpuBvh*                 CpuTracer::getBvh     () const { return m_bvh; }
+const CpuRayStats&            CpuTracer::getRayStats() const { return m_rayStats; }
+
+uint64_t CpuTracer::getRayCount() const {
+    uint64_t count = 0;
+    for ( uint32_t type = 0; type < CPU_RAY_TYPE_COUNT; type++ ) count += m_rayStats.count[type];
+    return count;
+}
+
+double CpuTracer::getRenderSeconds() const { return m_renderSeconds; }
+double CpuTracer::getBuildSeconds () const { return m_buildSeconds; }
+
+
+// Private ==================================================
+
+
+// Spreads the low 10 bits of v to every third bit
+static uint32_t ExpandBits( uint32_t v ) {
+    v = ( v * 0x00010001u ) & 0xFF0000FFu;
+    v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+    v = ( v * 0x00000011u ) & 0xC30C30C3u;
+    v = ( v * 0x00000005u ) & 0x49249249u;
+    return v;
+}
+
+// Rays by direction octant, a packet needs one octant for its interval bounds, then by the Morton code of
+// their origin within the stream's bounds so neighbours in a packet also start close together
+static void SortByOctant( const std::vector<CpuRay>& rays, std::vector<uint32_t>& order ) {
+    glm::vec3 originMin( INFINITY ), originMax( -INFINITY );
+    for ( const CpuRay& ray : rays ) {
+        originMin = glm::min( originMin, ray.origin );
+        originMax = glm::max( originMax, ray.origin );
+    }
+    glm::vec3 scale = glm::vec3( 1023.0f ) / glm::max( originMax - originMin, glm::vec3( 1e-6f ) );
+
+    std::vector<uint64_t> keys( rays.size() );
+    for ( size_t i = 0; i < rays.size(); i++ ) {
+        const glm::vec3& d      = rays[i].direction;
+        glm::vec3        cell   = ( rays[i].origin - originMin ) * scale;
+        uint32_t         octant = ( d.x < 0.0f ? 1u : 0u ) | ( d.y < 0.0f ? 2u : 0u ) | ( d.z < 0.0f ? 4u : 0u );
+        uint32_t         morton = ExpandBits( UINT32( cell.x ) ) | ( ExpandBits( UINT32( cell.y ) ) << 1 ) | ( ExpandBits( UINT32( cell.z ) ) << 2 );
+        keys[i] = ( uint64_t( octant << 30 | morton ) << 32 ) | i;
+    }
+    std::sort( keys.begin(), keys.end() );
+    order.resize( rays.size() );
+    for ( size_t i = 0; i < rays.size(); i++ ) order[i] = UINT32( keys[i] & 0xFFFFFFFFu );
+}
+
+// raytrace.rgen, one launch ID per pixel and one path per sample
+CpuRayStats CpuTracer::renderRows( uint32_t firstRow, uint32_t rowCount, const CpuTraceSettings& settings ) {
+    CpuRayStats stats;
+    uint32_t    samplesPerPixel = std::max( settings.samplesPerPixel, 1u );
+
+    for ( uint32_t y = firstRow; y < firstRow + rowCount; y++ ) {
+        for ( uint32_t x = 0; x < m_size.width; x++ ) {
+            uint32_t  seed = Tea( y * m_size.width + x, settings.frame );
+            glm::vec3 sum( 0.0f );
+            for ( uint32_t s = 0; s < samplesPerPixel; s++ ) {
+                Payload prd;
+                generateRay( x, y, settings, seed, prd );
+
+                glm::vec3 radiance( 0.0f );
+                glm::vec3 throughput( 1.0f );
+                for ( uint32_t depth = 0; depth < settings.maxDepth; depth++ ) {
+                    CpuRay ray = beginTrace( prd );
+                    traceRay( ray, depth == 0 ? CPU_RAY_PRIMARY : CPU_RAY_BOUNCE, settings, prd, &stats );
+                    if ( !continuePath( depth, prd, radiance, throughput ) ) break;
+                }
+                seed = prd.seed;
+                sum += radiance;
+            }
+            m_image[y * m_size.width + x] = glm::vec4( sum / float( samplesPerPixel ), 1.0f );
+        }
+    }
+    return stats;
+}
+
+// The same paths as renderRows, but every path of the rows takes its next bounce before any takes the one
+// after. Each path keeps its own seed, so the random sequences and the image do not change.
+CpuRayStats CpuTracer::renderRowsStream( uint32_t firstRow, uint32_t rowCount, const CpuTraceSettings& settings ) {
+    CpuRayStats stats;
+    uint32_t    samplesPerPixel = std::max( settings.samplesPerPixel, 1u );
+    uint32_t    lastRow         = firstRow + rowCount;
+
+    // Pixels block by block, the primary rays of a block are neighbours in the stream
+    std::vector<uint32_t> pixels;
+    for ( uint32_t blockY = firstRow; blockY < lastRow; blockY += CPU_TRACER_BLOCK_HEIGHT ) {
+        for ( uint32_t blockX = 0; blockX < m_size.width; blockX += CPU_TRACER_BLOCK_WIDTH ) {
+            for ( uint32_t y = blockY; y < std::min( blockY + CPU_TRACER_BLOCK_HEIGHT, lastRow ); y++ ) {
+                for ( uint32_t x = blockX; x < std::min( blockX + CPU_TRACER_BLOCK_WIDTH, m_size.width ); x++ ) {
+                    pixels.push_back( y * m_size.width + x );
+                }
+            }
+        }
+    }
+
+    uint32_t               pathCount = UINT32( pixels.size() );
+    std::vector<uint32_t>  seeds( pathCount );
+    std::vector<glm::vec3> sums( pathCount, glm::vec3( 0.0f ) );
+    for ( uint32_t i = 0; i < pathCount; i++ ) seeds[i] = Tea( pixels[i], settings.frame );
+
+    std::vector<Path>     paths( pathCount );
+    std::vector<uint32_t> active, next, order, shadowPaths;
+    std::vector<CpuRay>   rays, shadowRays;
+    std::vector<CpuHit>   hits;
+    std::vector<Shading>  shadings;
+    std::vector<bool>     occluded, shadowed;
+    for ( uint32_t s = 0; s < samplesPerPixel; s++ ) {
+        active.clear();
+        for ( uint32_t i = 0; i < pathCount; i++ ) {
+            generateRay( pixels[i] % m_size.width, pixels[i] / m_size.width, settings, seeds[i], paths[i].prd );
+            paths[i].radiance   = glm::vec3( 0.0f );
+            paths[i].throughput = glm::vec3( 1.0f );
+            active.push_back( i );
+        }
+
+        for ( uint32_t depth = 0; depth < settings.maxDepth && !active.empty(); depth++ ) {
+            rays.clear();
+            for ( uint32_t path : active ) rays.push_back( beginTrace( paths[path].prd ) );
+
+            // Primary rays keep the block order, bounces leave in every direction and are grouped by octant
+            if ( depth == 0 ) {
+                order.resize( rays.size() );
+                for ( uint32_t i = 0; i < order.size(); i++ ) order[i] = i;
+            }
+            else SortByOctant( rays, order );
+            traceStream( rays, order, hits, depth == 0 ? CPU_RAY_PRIMARY : CPU_RAY_BOUNCE, &stats );
+
+            shadings.resize( active.size() );
+            shadowPaths.clear();
+            shadowRays.clear();
+            for ( uint32_t k = 0; k < active.size(); k++ ) {
+                Payload& prd = paths[active[k]].prd;
+                if ( hits[k].instance == UINT32_MAX ) {
+                    miss( settings, prd );
+                    continue;
+                }
+                shadeHit( rays[k], hits[k], settings, prd, &shadings[k] );
+                // Entry 2k is the shadow ray to the key light, 2k + 1 the one to the light of the tree
+                if ( shadings[k].traceShadow ) {
+                    shadowPaths.push_back( 2 * k );
+                    shadowRays.push_back( shadings[k].shadowRay );
+                }
+                if ( shadings[k].traceLightShadow ) {
+                    shadowPaths.push_back( 2 * k + 1 );
+                    shadowRays.push_back( shadings[k].lightShadowRay );
+                }
+            }
+
+            SortByOctant( shadowRays, order );
+            occludedStream( shadowRays, order, occluded, &stats );
+            shadowed.assign( 2 * active.size(), false );
+            for ( uint32_t shadow = 0; shadow < shadowPaths.size(); shadow++ ) shadowed[shadowPaths[shadow]] = occluded[shadow];
+            for ( uint32_t k = 0; k < active.size(); k++ ) {
+                if ( hits[k].instance == UINT32_MAX ) continue;
+                finishHit( shadings[k], shadowed[2 * k], shadowed[2 * k + 1], paths[active[k]].prd );
+            }
+
+            next.clear();
+            for ( uint32_t path : active ) {
+                if ( continuePath( depth, paths[path].prd, paths[path].radiance, paths[path].throughput ) ) next.push_back( path );
+            }
+            active.swap( next );
+        }
+
+        for ( uint32_t i = 0; i < pathCount; i++ ) {
+            seeds[i] = paths[i].prd.seed;
+            sums[i] += paths[i].radiance;
+        }
+    }
+
+    for ( uint32_t i = 0; i < pathCount; i++ ) m_image[pixels[i]] = glm::vec4( sums[i] / float( samplesPerPixel ), 1.0f );
+    return stats;
+}
+
+// Primary rays alone go through the pixel center, paths are jittered for anti-aliasing
+void CpuTracer::generateRay( uint32_t x, uint32_t y, const CpuTraceSettings& settings, uint32_t& seed, Payload& prd ) const {
+    // Drawn one at a time, in the order glslang evaluates vec2( rnd( seed ), rnd( seed ) )
+    glm::vec2 jitter( 0.5f );
+    if ( settings.maxDepth > 1 ) {
+        jitter.x = Rnd( seed );
+        jitter.y = Rnd( seed );
+    }
+    glm::vec2 pixelCenter = glm::vec2( x, y ) + jitter;
+    glm::vec2 inUV        = pixelCenter / glm::vec2( m_size.width, m_size.height );
+    glm::vec2 d           = inUV * 2.0f - 1.0f;
+
+    glm::vec4 origin    = settings.viewInverse * glm::vec4( 0.0f, 0.0f, 0.0f, 1.0f );
+    glm::vec4 target    = settings.projInverse * glm::vec4( d.x, d.y, 1.0f, 1.0f );
+    glm::vec4 direction = settings.viewInverse * glm::vec4( glm::normalize( glm::vec3( target ) ), 0.0f );
+
+    prd.rayOrigin = glm::vec3( origin );
+    prd.rayDir    = glm::vec3( direction );
+    prd.seed      = seed;
+}
+
+// Russian roulette, paths carrying little energy end early and the survivors are scaled to stay unbiased
+bool CpuTracer::continuePath( uint32_t depth, Payload& prd, glm::vec3& radiance, glm::vec3& throughput ) const {
+    radiance += throughput * prd.hitValue;
+    if ( prd.done ) return false;
+    throughput *= prd.weight;
+
+    if ( depth >= 2 ) {
+        float survive = std::min( std::max( throughput.r, std::max( throughput.g, throughput.b ) ), 0.95f );
+        if ( Rnd( prd.seed ) >= survive ) return false;
+        throughput /= survive;
+    }
+    return true;
+}
+
+CpuRay CpuTracer::beginTrace( Payload& prd ) const {
+    prd.done   = true;
+    prd.weight = glm::vec3( 0.0f );
+    prd.hitT   = -1.0f;
+
+    CpuRay ray;
+    ray.origin    = prd.rayOrigin;
+    ray.tMin      = 0.001f;
+    ray.direction = prd.rayDir;
+    ray.tMax      = 10000.0f;
+    return ray;
+}
+
+// traceRayEXT, with the shadow rays of the hit traced right away
+void CpuTracer::traceRay( const CpuRay& ray, CpuRayType type, const CpuTraceSettings& settings, Payload& prd, CpuRayStats* stats ) const {
+    stats->count[type]++;
+    CpuHit hit;
+    if ( !m_bvh->intersect( ray, &hit ) ) {
+        miss( settings, prd );
+        return;
+    }
+
+    Shading shading;
+    shadeHit( ray, hit, settings, prd, &shading );
+    bool occluded = false;
+    if ( shading.traceShadow ) {
+        stats->count[CPU_RAY_SHADOW]++;
+        occluded = m_bvh->occluded( shading.shadowRay );
+    }
+    bool lightOccluded = false;
+    if ( shading.traceLightShadow ) {
+        stats->count[CPU_RAY_SHADOW]++;
+        lightOccluded = m_bvh->occluded( shading.lightShadowRay );
+    }
+    finishHit( shading, occluded, lightOccluded, prd );
+}
+
+// raytrace.rmiss
+void CpuTracer::miss( const CpuTraceSettings& settings, Payload& prd ) const {
+    prd.hitValue = glm::vec3( settings.clearColor ) * 0.8f;
+    prd.done     = true;
+}
+
+// raytrace.rchit up to its shadow rays, each only asks for any hit like gl_RayFlagsTerminateOnFirstHitEXT
+void CpuTracer::shadeHit( const CpuRay& ray, const CpuHit& hit, const CpuTraceSettings& settings, Payload& prd, Shading* shading ) const {
+    const Mesh*        mesh = m_meshes[hit.instance];
+    const CpuMaterial& mat  = m_materials[hit.instance];
+    const glm::vec4&   tint = m_tints[hit.instance];
+
+    int32_t   i0           = mesh->m_indices[hit.primitive * 3 + 0];
+    int32_t   i1           = mesh->m_indices[hit.primitive * 3 + 1];
+    int32_t   i2           = mesh->m_indices[hit.primitive * 3 + 2];
+    glm::vec3 barycentrics = glm::vec3( 1.0f - hit.u - hit.v, hit.u, hit.v );
+
+    glm::vec3 normal = mesh->m_normals[i0] * barycentrics.x + mesh->m_normals[i1] * barycentrics.y + mesh->m_normals[i2] * barycentrics.z;
+    normal = glm::normalize( glm::vec3( m_transformsIT[hit.instance] * glm::vec4( normal, 0.0f ) ) );
+
+    glm::vec3 worldPos = mesh->m_positions[i0] * barycentrics.x + mesh->m_positions[i1] * barycentrics.y + mesh->m_positions[i2] * barycentrics.z;
+    worldPos = glm::vec3( m_transforms[hit.instance] * glm::vec4( worldPos, 1.0f ) );
+
+    glm::vec3 L;
+    float     lightIntensity = settings.lightIntensity;
+    float     lightDistance  = 100000.0f;
+    if ( settings.lightType == 0 ) {
+        glm::vec3 lDir = settings.lightPosition - worldPos;
+        lightDistance  = glm::length( lDir );
+        lightIntensity = settings.lightIntensity / ( lightDistance * lightDistance );
+        L              = glm::normalize( lDir );
+    }
+    else {
+        L = glm::normalize( settings.lightPosition );
+    }
+
+    // The specular term is dropped later if the shadow ray finds an occluder
+    glm::vec3 specular = glm::vec3( 0.0f );
+    if ( glm::dot( normal, L ) > 0.0f ) specular = ComputeSpecular( mat, ray.direction, L, normal );
+
+    shading->diffuse        = ComputeDiffuse( mat, L, normal ) * glm::vec3( tint );
+    shading->specular       = specular * tint.a;
+    shading->emission       = mat.emission;
+    shading->lightIntensity = lightIntensity;
+    shading->traceShadow    = settings.shadows && glm::dot( normal, L ) > 0.0f;
+    if ( shading->traceShadow ) {
+        shading->shadowRay.origin    = ray.origin + ray.direction * hit.t;
+        shading->shadowRay.tMin      = 0.001f;
+        shading->shadowRay.direction = L;
+        shading->shadowRay.tMax      = lightDistance;
+    }
+
+    // The tree takes its random number even without any light, so the bounce below draws the same ones
+    float   lightPdf;
+    int32_t lightIdx = SampleLightTree( m_lightNodes, worldPos, normal, Rnd( prd.seed ), lightPdf );
+    shading->sampledLight     = glm::vec3( 0.0f );
+    shading->traceLightShadow = false;
+    if ( lightIdx >= 0 ) {
+        const Light& light    = m_lights[lightIdx];
+        glm::vec3    toLight  = light.position - worldPos;
+        float        dist2    = glm::dot( toLight, toLight );
+        glm::vec3    sampledL = toLight / std::sqrt( dist2 );
+        float        dotNL    = glm::dot( normal, sampledL );
+        if ( dotNL > 0.0f ) {
+            glm::vec3 lightDiffuse  = mat.diffuse * dotNL * glm::vec3( tint );
+            glm::vec3 lightSpecular = ComputeSpecular( mat, ray.direction, sampledL, normal ) * tint.a;
+            shading->sampledLight     = light.intensity / ( dist2 * lightPdf ) * ( lightDiffuse + lightSpecular );
+            shading->traceLightShadow = settings.shadows;
+            if ( shading->traceLightShadow ) {
+                shading->lightShadowRay.origin    = ray.origin + ray.direction * hit.t;
+                shading->lightShadowRay.tMin      = 0.001f;
+                shading->lightShadowRay.direction = sampledL;
+                shading->lightShadowRay.tMax      = std::sqrt( dist2 );
+            }
+        }
+    }
+
+    glm::vec3 faceNormal = glm::dot( normal, ray.direction ) > 0.0f ? -normal : normal;
+    prd.rayOrigin        = worldPos + faceNormal * 0.001f;
+    prd.rayDir           = SampleCosineHemisphere( prd.seed, faceNormal );
+    prd.weight           = mat.diffuse * glm::vec3( tint );
+    prd.normal           = faceNormal;
+    prd.hitT             = hit.t;
+    prd.done             = false;
+}
+
+void CpuTracer::finishHit( const Shading& shading, bool occluded, bool lightOccluded, Payload& prd ) const {
+    float     attenuation = occluded ? 0.3f : 1.0f;
+    glm::vec3 specular    = occluded ? glm::vec3( 0.0f ) : shading.specular;
+    prd.hitValue = glm::vec3( shading.lightIntensity * attenuation * ( shading.diffuse + specular ) ) + shading.emission;
+    if ( !lightOccluded ) prd.hitValue += shading.sampledLight;
+}
+
+void CpuTracer::traceStream( const std::vector<CpuRay>& rays, const std::vector<uint32_t>& order, std::vector<CpuHit>& hits,
+                             CpuRayType type, CpuRayStats* stats ) const {
+    auto start = std::chrono::high_resolution_clock::now();
+    hits.resize( rays.size() );
+
+    CpuRayPacket packet;
+    CpuHit       packetHits[CPU_PACKET_SIZE];
+    for ( size_t first = 0; first < order.size(); first += CPU_PACKET_SIZE ) {
+        packet.count = UINT32( std::min( order.size() - first, size_t( CPU_PACKET_SIZE ) ) );
+        for ( uint32_t i = 0; i < packet.count; i++ ) packet.rays[i] = rays[order[first + i]];
+        m_bvh->intersect( packet, packetHits );
+        for ( uint32_t i = 0; i < packet.count; i++ ) hits[order[first + i]] = packetHits[i];
+    }
+
+    stats->count  [type] += rays.size();
+    stats->seconds[type] += std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - start ).count();
+}
+
+void CpuTracer::occludedStream( const std::vector<CpuRay>& rays, const std::vector<uint32_t>& order, std::vector<bool>& occluded,
+                                CpuRayStats* stats ) const {
+    auto start = std::chrono::high_resolution_clock::now();
+    occluded.resize( rays.size() );
+
+    CpuRayPacket packet;
+    bool         packetOccluded[CPU_PACKET_SIZE];
+    for ( size_t first = 0; first < order.size(); first += CPU_PACKET_SIZE ) {
+        packet.count = UINT32( std::min( order.size() - first, size_t( CPU_PACKET_SIZE ) ) );
+        for ( uint32_t i = 0; i < packet.count; i++ ) packet.rays[i] = rays[order[first + i]];
+        m_bvh->occluded( packet, packetOccluded );
+        for ( uint32_t i = 0; i < packet.count; i++ ) occluded[order[first + i]] = packetOccluded[i];
+    }
+
+    stats->count  [CPU_RAY_SHADOW] += rays.size();
+    stats->seconds[CPU_RAY_SHADOW] += std::chrono::duration<double>( std::chrono::high_resolution_clock::now() - start ).count();
+}
@@ -0,0 +1,155 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "cpubvh.h"
+#include "lightbuilder.h"
+
+// Rows of the image one job renders
+#define CPU_TRACER_JOB_ROWS 8
+
+// Pixels whose primary rays make one packet, CPU_PACKET_SIZE in all
+#define CPU_TRACER_BLOCK_WIDTH  4
+#define CPU_TRACER_BLOCK_HEIGHT 2
+
+enum CpuRayType {
+    CPU_RAY_PRIMARY,
+    CPU_RAY_BOUNCE,
+    CPU_RAY_SHADOW,
+    CPU_RAY_TYPE_COUNT
+};
+
+// Rays traced per type and the time spent traversing them, summed over the jobs. Only the stream
+// mode times the types apart, one path at a time interleaves them too finely.
+struct CpuRayStats {
+    uint64_t count  [CPU_RAY_TYPE_COUNT] = {};
+    double   seconds[CPU_RAY_TYPE_COUNT] = {};
+};
+
+// The WaveFrontMaterial terms raytrace.rchit shades with, textures are not sampled
+struct CpuMaterial {
+    glm::vec3 ambient   = glm::vec3( 0.0f );
+    glm::vec3 diffuse   = glm::vec3( 0.7f );
+    glm::vec3 specular  = glm::vec3( 0.3f );
+    glm::vec3 emission  = glm::vec3( 0.0f );
+    float     shininess = 32.0f;
+    int32_t   illum     = 2;
+};
+
+// Everything a launch of raytrace.rgen reads, the camera, the push constants and the specialization
+// constants of raytrace.rchit. The launch starts a new average, sampleCount is 0.
+struct CpuTraceSettings {
+    glm::mat4 viewInverse     = glm::mat4( 1.0f );
+    glm::mat4 projInverse     = glm::mat4( 1.0f );
+    glm::vec4 clearColor      = glm::vec4( 1.0f );
+    glm::vec3 lightPosition   = glm::vec3( 0.0f );
+    float     lightIntensity  = 100.0f;
+    uint32_t  lightType       = 0;
+    bool      shadows         = true;
+    uint32_t  frame           = 0;
+    uint32_t  samplesPerPixel = 1;
+    uint32_t  maxDepth        = 1;
+    // Paths of a job advance one bounce at a time, primary rays go in packets and the bounce and shadow
+    // rays are sorted by direction octant into packets. Otherwise each path is traced to its end like the shaders.
+    bool      stream          = true;
+};
+
+// Port of raytrace.rgen and raytrace.rchit over a CpuBvh, down to the random sequence of each pixel, so
+// an image rendered with the settings of a launch is what the launch should produce up to float rounding.
+// Runs without a device, as a reference to diff the GPU output against and a rays/s baseline.
+class CpuTracer {
+
+public:
+    ~CpuTracer();
+    CpuTracer( JobSystem* jobSystem );
+
+    // Instance i is meshes[i] shaded with materials[i], tints[i] is the tint of its hit record. The lights and
+    // the tree over them are the arrays a LightBuilder uploads, without any the tree picks nothing.
+    void setup( const std::vector<Mesh*>& meshes, const std::vector<CpuMaterial>& materials, const std::vector<glm::vec4>& tints,
+                const std::vector<Light>& lights, const std::vector<LightNode>& lightNodes );
+    void cleanup();
+
+    // Blocks until every row is done, the rows are spread over the job system
+    void render( Size<uint32_t> size, const CpuTraceSettings& settings );
+    // Portable float map, keeps the unclamped radiance
+    void savePfm( const std::string& filename ) const;
+
+    const std::vector<glm::vec4>& getImage() const;
+    const CpuBvh*                 getBvh() const;
+    const CpuRayStats&            getRayStats() const;
+    uint64_t getRayCount() const; // primary, bounce and shadow rays of the last render
+    double   getRenderSeconds() const;
+    double   getBuildSeconds() const;
+
+private:
+
+    // Matches hitPayload in raycommon.glsl
+    struct Payload {
+        glm::vec3 hitValue;
+        glm::vec3 weight;
+        glm::vec3 rayOrigin;
+        glm::vec3 rayDir;
+        glm::vec3 normal;
+        float     hitT;
+        uint32_t  seed;
+        bool      done;
+    };
+
+    // What raytrace.rchit computes before its shadow rays, the rest waits for the rays' results
+    struct Shading {
+        glm::vec3 diffuse;
+        glm::vec3 specular;
+        glm::vec3 emission;
+        float     lightIntensity;
+        bool      traceShadow;
+        CpuRay    shadowRay;
+        // The light picked from the tree, its contribution is dropped if its own shadow ray is occluded
+        glm::vec3 sampledLight;
+        bool      traceLightShadow;
+        CpuRay    lightShadowRay;
+    };
+
+    // State of one path between the bounces of a stream
+    struct Path {
+        Payload   prd;
+        glm::vec3 radiance;
+        glm::vec3 throughput;
+    };
+
+    JobSystem* m_jobSystem = nullptr;
+    CpuBvh*    m_bvh       = nullptr;
+
+    std::vector<Mesh*>       m_meshes;
+    std::vector<glm::mat4>   m_transforms;
+    std::vector<glm::mat4>   m_transformsIT;
+    std::vector<CpuMaterial> m_materials;
+    std::vector<glm::vec4>   m_tints;
+    std::vector<Light>       m_lights;
+    std::vector<LightNode>   m_lightNodes;
+
+    Size<uint32_t>         m_size{ 0, 0 };
+    std::vector<glm::vec4> m_image;
+    CpuRayStats            m_rayStats;
+    double                 m_renderSeconds = 0.0;
+    double                 m_buildSeconds  = 0.0;
+
+    CpuRayStats renderRows      ( uint32_t firstRow, uint32_t rowCount, const CpuTraceSettings& settings );
+    CpuRayStats renderRowsStream( uint32_t firstRow, uint32_t rowCount, const CpuTraceSettings& settings );
+
+    void   generateRay( uint32_t x, uint32_t y, const CpuTraceSettings& settings, uint32_t& seed, Payload& prd ) const;
+    bool   continuePath( uint32_t depth, Payload& prd, glm::vec3& radiance, glm::vec3& throughput ) const;
+    CpuRay beginTrace( Payload& prd ) const;
+    void   traceRay( const CpuRay& ray, CpuRayType type, const CpuTraceSettings& settings, Payload& prd, CpuRayStats* stats ) const;
+    void   miss( const CpuTraceSettings& settings, Payload& prd ) const;
+    void   shadeHit( const CpuRay& ray, const CpuHit& hit, const CpuTraceSettings& settings, Payload& prd, Shading* shading ) const;
+    void   finishHit( const Shading& shading, bool occluded, bool lightOccluded, Payload& prd ) const;
+
+    // Traces rays[order[0]], rays[order[1]], ... in packets of consecutive entries
+    void traceStream   ( const std::vector<CpuRay>& rays, const std::vector<uint32_t>& order, std::vector<CpuHit>& hits,
+                         CpuRayType type, CpuRayStats* stats ) const;
+    void occludedStream( const std::vector<CpuRay>& rays, const std::vector<uint32_t>& order, std::vector<bool>& occluded,
+                         CpuRayStats* stats ) const;
+
+};
@@ -0,0 +1,157 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <array>
+
+#include "denoiser.h"
+#include "dispatch.h"
+
+Denoiser::~Denoiser() {}
+Denoiser::Denoiser( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void Denoiser::setup( Size<int32_t> size, Image* target, VkDescriptorSetLayout temporalSetLayout, VkDescriptorSetLayout atrousSetLayout ) {
+    m_size   = size;
+    m_target = target;
+
+    m_normalDepth     = createImage();
+    m_albedo          = createImage();
+    m_motion          = createImage();
+    m_prevNormalDepth = createImage();
+    m_history         = createImage();
+    m_work[0]         = createImage();
+    m_work[1]         = createImage();
+
+    VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 6 + 4 * 4 };
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.maxSets       = 5;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes    = &poolSize;
+    VkResult result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    std::array<VkDescriptorSetLayout, 5> setLayouts = { temporalSetLayout, atrousSetLayout, atrousSetLayout, atrousSetLayout, atrousSetLayout };
+    std::array<VkDescriptorSet, 5>       descSets;
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.descriptorPool     = m_descPool;
+    allocateInfo.descriptorSetCount = UINT32( setLayouts.size() );
+    allocateInfo.pSetLayouts        = setLayouts.data();
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, descSets.data() );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    m_temporalSet = descSets[0];
+    writeSet( m_temporalSet, { m_target, m_normalDepth, m_motion, m_prevNormalDepth, m_history, m_work[0] } );
+    for ( uint32_t i = 0; i < 2; i++ ) {
+        m_atrousSets[i][0] = descSets[1 + i * 2];
+        m_atrousSets[i][1] = descSets[2 + i * 2];
+        writeSet( m_atrousSets[i][0], { m_work[i], m_normalDepth, m_albedo, m_work[1 - i] } );
+        writeSet( m_atrousSets[i][1], { m_work[i], m_normalDepth, m_albedo, m_target } );
+    }
+}
+
+void Denoiser::cleanup() {
+    for ( Image** image : { &m_normalDepth, &m_albedo, &m_motion, &m_prevNormalDepth, &m_history, &m_work[0], &m_work[1] } ) {
+        if ( *image == nullptr ) continue;
+        ( *image )->cleanup();
+        delete *image;
+        *image = nullptr;
+    }
+    vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    m_descPool = VK_NULL_HANDLE;
+}
+
+void Denoiser::cmdInitialize( VkCommandBuffer commandBuffer ) {
+    for ( Image* image : { m_normalDepth, m_albedo, m_motion, m_prevNormalDepth, m_history, m_work[0], m_work[1] } ) {
+        image->cmdTransitionLayout( commandBuffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL );
+    }
+    m_resetHistory = true;
+}
+
+bool Denoiser::cmdDenoise( VkCommandBuffer commandBuffer, VkPipeline temporalPipeline, VkPipelineLayout temporalLayout,
+                           VkPipeline atrousPipeline, VkPipelineLayout atrousLayout ) {
+    if ( temporalPipeline == VK_NULL_HANDLE || atrousPipeline == VK_NULL_HANDLE ) return false;
+
+    uint32_t groupsX = ( m_size.width  + DENOISE_WORKGROUP_SIZE - 1 ) / DENOISE_WORKGROUP_SIZE;
+    uint32_t groupsY = ( m_size.height + DENOISE_WORKGROUP_SIZE - 1 ) / DENOISE_WORKGROUP_SIZE;
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    // Without history the temporal pass only copies the color into the first work image
+    struct { float alpha; uint32_t useHistory; } temporal = { 0.2f, m_temporal && !m_resetHistory };
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, temporalPipeline );
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, temporalLayout, 0, 1, &m_temporalSet, 0, nullptr );
+    vkd.CmdPushConstants( commandBuffer, temporalLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( temporal ), &temporal );
+    vkd.CmdDispatch( commandBuffer, groupsX, groupsY, 1 );
+    m_resetHistory = false;
+
+    // The history of the next frame is the temporal result before any spatial filtering
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+    cmdCopy( commandBuffer, m_work[0], m_history );
+    cmdCopy( commandBuffer, m_normalDepth, m_prevNormalDepth );
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    // Ping-pong between the work images, the last iteration writes the target
+    DenoiseSettings settings = m_settings;
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, atrousPipeline );
+    for ( uint32_t i = 0; i < DENOISE_ITERATIONS; i++ ) {
+        VkDescriptorSet descSet = m_atrousSets[i % 2][i + 1 == DENOISE_ITERATIONS ? 1 : 0];
+        settings.stepSize = 1 << i;
+        vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, atrousLayout, 0, 1, &descSet, 0, nullptr );
+        vkd.CmdPushConstants( commandBuffer, atrousLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( DenoiseSettings ), &settings );
+        vkd.CmdDispatch( commandBuffer, groupsX, groupsY, 1 );
+
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr );
+    }
+    return true;
+}
+
+void Denoiser::resetHistory() { m_resetHistory = true; }
+void Denoiser::setTemporal( bool enabled ) { m_temporal = enabled; }
+DenoiseSettings& Denoiser::getSettings() { return m_settings; }
+
+Image* Denoiser::getNormalDepth() { return m_normalDepth; }
+Image* Denoiser::getAlbedo     () { return m_albedo;      }
+Image* Denoiser::getMotion     () { return m_motion;      }
+
+// Private ==================================================
+
+Image* Denoiser::createImage() {
+    Image* image = new Image( m_device, m_physicalDevice );
+    image->createForOffscreen( m_size );
+    return image;
+}
+
+void Denoiser::writeSet( VkDescriptorSet descSet, const std::vector<Image*>& images ) {
+    std::vector<VkDescriptorImageInfo> imageInfos;
+    std::vector<VkWriteDescriptorSet>  writeSets( images.size() );
+    for ( Image* image : images ) imageInfos.push_back( { VK_NULL_HANDLE, image->getImageView(), VK_IMAGE_LAYOUT_GENERAL } );
+    for ( uint32_t binding = 0; binding < images.size(); binding++ ) {
+        writeSets[binding].sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeSets[binding].dstSet          = descSet;
+        writeSets[binding].dstBinding      = binding;
+        writeSets[binding].descriptorCount = 1;
+        writeSets[binding].descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        writeSets[binding].pImageInfo      = &imageInfos[binding];
+    }
+    vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+}
+
+void Denoiser::cmdCopy( VkCommandBuffer commandBuffer, Image* src, Image* dst ) {
+    VkImageCopy region{};
+    region.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.extent         = { UINT32( m_size.width ), UINT32( m_size.height ), 1 };
+    vkd.CmdCopyImage( commandBuffer, src->getImage(), VK_IMAGE_LAYOUT_GENERAL, dst->getImage(), VK_IMAGE_LAYOUT_GENERAL, 1, &region );
+}
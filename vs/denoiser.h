@@ -0,0 +1,79 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "image.h"
+
+#define DENOISE_WORKGROUP_SIZE 8
+#define DENOISE_ITERATIONS     5
+
+// Push constants of denoise_atrous.comp
+struct DenoiseSettings {
+    int32_t stepSize       = 1;
+    float   sigmaNormal    = 128.0f;
+    float   sigmaDepth     = 0.1f;
+    float   sigmaAlbedo    = 0.1f;
+    float   sigmaLuminance = 4.0f;
+};
+
+// Filters the ray traced color in place: temporal reprojection against the previous frame, then
+// DENOISE_ITERATIONS passes of the edge-avoiding à-trous filter guided by the G-buffer raytrace.rgen
+// writes. Every image stays in GENERAL layout.
+class Denoiser {
+
+public:
+    ~Denoiser();
+    Denoiser( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // target holds the noisy color and receives the filtered one. temporalSetLayout and
+    // atrousSetLayout are the set 0 layouts of denoise_temporal.comp and denoise_atrous.comp.
+    void setup( Size<int32_t> size, Image* target, VkDescriptorSetLayout temporalSetLayout, VkDescriptorSetLayout atrousSetLayout );
+    void cleanup();
+
+    // Moves the images from UNDEFINED to GENERAL
+    void cmdInitialize( VkCommandBuffer commandBuffer );
+
+    // Returns false and records nothing until both pipelines are ready
+    bool cmdDenoise( VkCommandBuffer commandBuffer, VkPipeline temporalPipeline, VkPipelineLayout temporalLayout,
+                     VkPipeline atrousPipeline, VkPipelineLayout atrousLayout );
+
+    // The next frame ignores the previous one
+    void resetHistory();
+    void setTemporal( bool enabled );
+    DenoiseSettings& getSettings();
+
+    // G-buffer written by the ray generation shader
+    Image* getNormalDepth();
+    Image* getAlbedo();
+    Image* getMotion();
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    Size<int32_t>   m_size{};
+    Image*          m_target = nullptr;
+    DenoiseSettings m_settings;
+    bool            m_temporal     = true;
+    bool            m_resetHistory = true;
+
+    Image* m_normalDepth     = nullptr;
+    Image* m_albedo          = nullptr;
+    Image* m_motion          = nullptr;
+    Image* m_prevNormalDepth = nullptr;
+    Image* m_history         = nullptr;
+    Image* m_work[2]         = {};
+
+    VkDescriptorPool m_descPool    = VK_NULL_HANDLE;
+    VkDescriptorSet  m_temporalSet = VK_NULL_HANDLE;
+    // Indexed by the input, [i][0] writes the other work image and [i][1] the target
+    VkDescriptorSet  m_atrousSets[2][2] = {};
+
+    Image* createImage();
+    void writeSet( VkDescriptorSet descSet, const std::vector<Image*>& images );
+    void cmdCopy( VkCommandBuffer commandBuffer, Image* src, Image* dst );
+
+};
@@ -1,4 +1,5 @@
 #include "app.h"
+#include "dispatch.h"
 
 static VKAPI_ATTR VkBool32 VKAPI_CALL DebugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
                                                     VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -157,7 +158,8 @@ void App::pickPhysicalDevice() {
         VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
         VK_KHR_RAY_QUERY_EXTENSION_NAME,
         VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
-        VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME
+        VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
+        VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
     };
 
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
@@ -176,6 +178,10 @@ void App::pickPhysicalDevice() {
         VkPhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR };
         VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR };
         VkPhysicalDeviceHostQueryResetFeatures queryResetFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES };
+        VkPhysicalDeviceScalarBlockLayoutFeatures scalarLayoutFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SCALAR_BLOCK_LAYOUT_FEATURES };
+        VkPhysicalDeviceDescriptorIndexingFeatures indexingFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES };
+        scalarLayoutFeature.pNext = &indexingFeature;
+        queryResetFeature.pNext = &scalarLayoutFeature;
         rayQueryFeature.pNext = &queryResetFeature;
         rayTracingFeature.pNext = &rayQueryFeature;
         accelerationFeature.pNext = &rayTracingFeature;
@@ -197,6 +203,14 @@ void App::pickPhysicalDevice() {
 
         if ( swapchainAdequate && hasFamilyIndex && extensionSupported &&
             supportedFeatures.features.samplerAnisotropy &&
+            supportedFeatures.features.shaderInt64 &&
+            supportedFeatures.features.fragmentStoresAndAtomics &&
+            scalarLayoutFeature.scalarBlockLayout &&
+            indexingFeature.runtimeDescriptorArray &&
+            indexingFeature.shaderSampledImageArrayNonUniformIndexing &&
+            indexingFeature.descriptorBindingPartiallyBound &&
+            indexingFeature.descriptorBindingVariableDescriptorCount &&
+            indexingFeature.descriptorBindingSampledImageUpdateAfterBind &&
             bufferDeviceAdressFeature.bufferDeviceAddress &&
             accelerationFeature.accelerationStructure &&
             rayTracingFeature.rayTracingPipeline &&
@@ -229,7 +243,21 @@ void App::createLogicalDevice() {
         queueInfos.push_back(queueInfo);
     }
 
+    // SceneDesc and the vertices are read with scalar layout and 64 bit device addresses
+    VkPhysicalDeviceScalarBlockLayoutFeatures scalarLayoutFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SCALAR_BLOCK_LAYOUT_FEATURES };
+    scalarLayoutFeature.scalarBlockLayout = VK_TRUE;
+
+    // Bindless texture table, see TextureRegistry
+    VkPhysicalDeviceDescriptorIndexingFeatures indexingFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES };
+    indexingFeature.runtimeDescriptorArray                       = VK_TRUE;
+    indexingFeature.shaderSampledImageArrayNonUniformIndexing    = VK_TRUE;
+    indexingFeature.descriptorBindingPartiallyBound              = VK_TRUE;
+    indexingFeature.descriptorBindingVariableDescriptorCount     = VK_TRUE;
+    indexingFeature.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    scalarLayoutFeature.pNext = &indexingFeature;
+
     VkPhysicalDeviceHostQueryResetFeatures queryResetFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES };
+    queryResetFeature.pNext = &scalarLayoutFeature;
     queryResetFeature.hostQueryReset = VK_TRUE;
 
     VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeature{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR };
@@ -251,7 +279,13 @@ void App::createLogicalDevice() {
 
     VkPhysicalDeviceFeatures2 deviceFeatures2{};
     deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
-    deviceFeatures2.features.samplerAnisotropy = VK_TRUE;
+    deviceFeatures2.features.samplerAnisotropy        = VK_TRUE;
+    deviceFeatures2.features.shaderInt64              = VK_TRUE;
+    deviceFeatures2.features.fragmentStoresAndAtomics = VK_TRUE; // texture feedback of the raster pass
+    // Optional, TextureLoader stores RGBA8 instead when the BC formats cannot be sampled
+    VkPhysicalDeviceFeatures physicalFeatures;
+    vkGetPhysicalDeviceFeatures( m_physicalDevice, &physicalFeatures );
+    deviceFeatures2.features.textureCompressionBC = physicalFeatures.textureCompressionBC;
     deviceFeatures2.pNext = &bufferDeviceAdressFeature;
 
     VkDeviceCreateInfo deviceInfo{};
@@ -266,6 +300,7 @@ void App::createLogicalDevice() {
 
     VkResult result = vkCreateDevice( m_physicalDevice, &deviceInfo, nullptr, &m_device );
     CHECK_VKRESULT( result, "failed to create logical device" );
+    vkd.load( m_device );
 
     vkGetDeviceQueue( m_device, m_graphicQueueIndex, 0, &m_graphicQueue );
     vkGetDeviceQueue( m_device, m_presentQueueIndex, 0, &m_presentQueue );
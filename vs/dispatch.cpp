@@ -0,0 +1,14 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "dispatch.h"
+
+DeviceDispatch vkd;
+
+void DeviceDispatch::load( VkDevice device ) {
+#define DEVICE_DISPATCH_LOAD( name )                                                          \
+    name = ( PFN_vk##name )vkGetDeviceProcAddr( device, "vk" #name );                         \
+    if ( name == nullptr ) RUNTIME_ERROR( "failed to load device function vk" #name "!" );
+    DEVICE_DISPATCH_FUNCTIONS( DEVICE_DISPATCH_LOAD )
+#undef DEVICE_DISPATCH_LOAD
+}
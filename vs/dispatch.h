@@ -0,0 +1,62 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+
+// Device functions resolved once with vkGetDeviceProcAddr, calls skip the loader trampoline.
+// Extension functions and everything recorded every frame go through here.
+#define DEVICE_DISPATCH_FUNCTIONS( X )                   \
+    X( CreateAccelerationStructureKHR )                  \
+    X( DestroyAccelerationStructureKHR )                 \
+    X( GetAccelerationStructureDeviceAddressKHR )        \
+    X( GetAccelerationStructureBuildSizesKHR )           \
+    X( GetDeviceAccelerationStructureCompatibilityKHR )  \
+    X( CmdBuildAccelerationStructuresKHR )               \
+    X( CmdCopyAccelerationStructureKHR )                 \
+    X( CmdCopyAccelerationStructureToMemoryKHR )         \
+    X( CmdCopyMemoryToAccelerationStructureKHR )         \
+    X( CmdWriteAccelerationStructuresPropertiesKHR )     \
+    X( CreateRayTracingPipelinesKHR )                    \
+    X( GetRayTracingShaderGroupHandlesKHR )              \
+    X( CmdTraceRaysKHR )                                 \
+    X( AcquireNextImageKHR )                             \
+    X( QueuePresentKHR )                                 \
+    X( QueueSubmit )                                     \
+    X( WaitForFences )                                   \
+    X( ResetFences )                                     \
+    X( BeginCommandBuffer )                              \
+    X( EndCommandBuffer )                                \
+    X( CmdBeginRenderPass )                              \
+    X( CmdEndRenderPass )                                \
+    X( CmdBindPipeline )                                 \
+    X( CmdBindDescriptorSets )                           \
+    X( CmdBindVertexBuffers )                            \
+    X( CmdBindIndexBuffer )                              \
+    X( CmdPushConstants )                                \
+    X( CmdDraw )                                         \
+    X( CmdDrawIndexed )                                  \
+    X( CmdDispatch )                                     \
+    X( CmdDispatchIndirect )                             \
+    X( CmdPipelineBarrier )                              \
+    X( CmdUpdateBuffer )                                 \
+    X( CmdCopyBuffer )                                   \
+    X( CmdFillBuffer )                                   \
+    X( CmdCopyImage )                                    \
+    X( CmdCopyBufferToImage )                            \
+    X( CmdCopyImageToBuffer )                            \
+    X( CmdBlitImage )                                    \
+    X( CmdResetQueryPool )                               \
+    X( CmdWriteTimestamp )
+
+struct DeviceDispatch {
+#define DEVICE_DISPATCH_MEMBER( name ) PFN_vk##name name = nullptr;
+    DEVICE_DISPATCH_FUNCTIONS( DEVICE_DISPATCH_MEMBER )
+#undef DEVICE_DISPATCH_MEMBER
+
+    // Called once right after the device is created, throws when a function is missing
+    void load( VkDevice device );
+};
+
+extern DeviceDispatch vkd;
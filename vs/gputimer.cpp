@@ -0,0 +1,51 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "gputimer.h"
+#include "dispatch.h"
+
+GpuTimer::~GpuTimer() {}
+GpuTimer::GpuTimer( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void GpuTimer::setup( uint32_t frameCount ) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties( m_physicalDevice, &properties );
+    m_timestampPeriod = properties.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo queryPoolInfo{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+    queryPoolInfo.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = frameCount * 2;
+    VkResult result = vkCreateQueryPool( m_device, &queryPoolInfo, nullptr, &m_queryPool );
+    CHECK_VKRESULT( result, "failed to create query pool!" );
+    m_recorded.assign( frameCount, false );
+}
+
+void GpuTimer::cleanup() {
+    if ( m_queryPool != VK_NULL_HANDLE ) vkDestroyQueryPool( m_device, m_queryPool, nullptr );
+    m_queryPool = VK_NULL_HANDLE;
+    m_recorded.clear();
+}
+
+void GpuTimer::cmdBegin( VkCommandBuffer commandBuffer, uint32_t frameIndex ) {
+    vkd.CmdResetQueryPool( commandBuffer, m_queryPool, frameIndex * 2, 2 );
+    vkd.CmdWriteTimestamp( commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, frameIndex * 2 );
+}
+
+void GpuTimer::cmdEnd( VkCommandBuffer commandBuffer, uint32_t frameIndex ) {
+    vkd.CmdWriteTimestamp( commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, frameIndex * 2 + 1 );
+    m_recorded[frameIndex] = true;
+}
+
+bool GpuTimer::collect( uint32_t frameIndex, double* milliseconds ) {
+    if ( !m_recorded[frameIndex] ) return false;
+    m_recorded[frameIndex] = false;
+
+    uint64_t timestamps[2];
+    VkResult result = vkGetQueryPoolResults( m_device, m_queryPool, frameIndex * 2, 2, sizeof( timestamps ), timestamps,
+                                             sizeof( uint64_t ), VK_QUERY_RESULT_64_BIT );
+    if ( result != VK_SUCCESS ) return false;
+    *milliseconds = double( timestamps[1] - timestamps[0] ) * m_timestampPeriod * 1e-6;
+    return true;
+}
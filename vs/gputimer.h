@@ -0,0 +1,34 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+
+// Times one section of every frame with a pair of timestamps. A frame's result is read once its
+// fence has signaled, so collecting never waits on the GPU.
+class GpuTimer {
+
+public:
+    ~GpuTimer();
+    GpuTimer( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    void setup( uint32_t frameCount );
+    void cleanup();
+
+    void cmdBegin( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+    void cmdEnd  ( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+
+    // Call after the fence of frameIndex has signaled. Returns false when the frame recorded no section.
+    bool collect( uint32_t frameIndex, double* milliseconds );
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    VkQueryPool       m_queryPool       = VK_NULL_HANDLE;
+    double            m_timestampPeriod = 1.0;
+    std::vector<bool> m_recorded;
+
+};
@@ -71,4 +71,13 @@ std::vector<char> ReadBinaryFile(const std::string filename) {
     file.read(buffer.data(), fileSize);
     file.close();
     return buffer;
-}
\ No newline at end of file
+}
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
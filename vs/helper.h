@@ -13,3 +13,6 @@ VkFormat   ChooseDepthFormat(VkPhysicalDevice physicalDevice);
 VkExtent2D ChooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities, Size<int> size);
 
 std::vector<char> ReadBinaryFile (const std::string filename);
+
+// 64-bit FNV-1a, pass the previous result as hash to chain several ranges
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
@@ -1,10 +1,13 @@
 //  Copyright © 2021 Subph. All rights reserved.
 //
 
+#include <algorithm>
+
 #include "image.h"
 
 #include "helper.h"
 #include "buffer.h"
+#include "dispatch.h"
 
 Image::~Image() {}
 Image::Image( VkDevice device, VkPhysicalDevice physicalDevice ) :
@@ -68,7 +71,7 @@ void Image::createForOffscreen(Size<int32_t> size) {
     imageInfo.mipLevels     = 1;
     imageInfo.format        = VK_FORMAT_R32G32B32A32_SFLOAT;
     imageInfo.usage         = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
-        | VK_IMAGE_USAGE_STORAGE_BIT;
+        | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     
     VkResult result = vkCreateImage(m_device, &imageInfo, nullptr, &m_image);
     CHECK_VKRESULT(result, "failed to create image!");
@@ -87,6 +90,33 @@ void Image::createForOffscreen(Size<int32_t> size) {
     createSampler();
 }
 
+void Image::createForTexture(Size<int32_t> size, VkFormat format, uint32_t mipLevels) {
+    m_format    = format;
+    m_size      = size;
+    m_mipLevels = mipLevels;
+
+    VkImageCreateInfo imageInfo = GetDefaultImageCreateInfo();
+    imageInfo.extent.width  = size.width;
+    imageInfo.extent.height = size.height;
+    imageInfo.mipLevels     = mipLevels;
+    imageInfo.format        = format;
+    imageInfo.usage         = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+    VkResult result = vkCreateImage(m_device, &imageInfo, nullptr, &m_image);
+    CHECK_VKRESULT(result, "failed to create image!");
+
+    allocateImageMemory();
+
+    VkImageViewCreateInfo imageViewInfo = GetDefaultImageViewCreateInfo();
+    imageViewInfo.image  = m_image;
+    imageViewInfo.format = format;
+    imageViewInfo.subresourceRange.levelCount = mipLevels;
+    imageViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+
+    result = vkCreateImageView(m_device, &imageViewInfo, nullptr, &m_imageView);
+    CHECK_VKRESULT(result, "failed to create image views!");
+}
+
 void Image::allocateImageMemory() {
     VkMemoryRequirements memoryRequirements;
     vkGetImageMemoryRequirements( m_device, m_image, &memoryRequirements);
@@ -136,6 +166,9 @@ void Image::createSampler() {
 VkImage         Image::getImage      () { return m_image;       }
 VkImageView     Image::getImageView  () { return m_imageView;   }
 VkDeviceMemory  Image::getImageMemory() { return m_imageMemory; }
+VkFormat        Image::getFormat     () { return m_format;      }
+Size<int32_t>   Image::getSize       () { return m_size;        }
+uint32_t        Image::getMipLevels  () { return m_mipLevels;   }
 
 VkDescriptorImageInfo Image::getDescriptor()
 {
@@ -146,6 +179,84 @@ VkDescriptorImageInfo Image::getDescriptor()
     return imageInfo;
 }
 
+void Image::cmdTransitionLayout(VkCommandBuffer commandBuffer, VkImageLayout oldLayout, VkImageLayout newLayout) {
+    VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+    barrier.srcAccessMask       = VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.dstAccessMask       = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.oldLayout           = oldLayout;
+    barrier.newLayout           = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image               = m_image;
+    barrier.subresourceRange    = {VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS};
+    vkd.CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void Image::cmdGenerateMipmaps(VkCommandBuffer commandBuffer, uint32_t firstLevel) {
+    VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image               = m_image;
+
+    // Level 0 is the one level nothing blits into, it has to be written already
+    firstLevel = std::max(firstLevel, 1u);
+
+    // Each level turns into a blit source once it is written, and is done when the next one has been blitted
+    int32_t width  = std::max(m_size.width  >> (firstLevel - 1), 1);
+    int32_t height = std::max(m_size.height >> (firstLevel - 1), 1);
+    for (uint32_t level = firstLevel; level < m_mipLevels; level++) {
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 1, 0, 1};
+        barrier.oldLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout        = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask    = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask    = VK_ACCESS_TRANSFER_READ_BIT;
+        vkd.CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                               0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        int32_t nextWidth  = std::max(width  / 2, 1);
+        int32_t nextHeight = std::max(height / 2, 1);
+        VkImageBlit blit{};
+        blit.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1};
+        blit.srcOffsets[1]  = {width, height, 1};
+        blit.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1};
+        blit.dstOffsets[1]  = {nextWidth, nextHeight, 1};
+        vkd.CmdBlitImage(commandBuffer, m_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         m_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+        width  = nextWidth;
+        height = nextHeight;
+    }
+
+    // The blit sources, the last level and the levels written below the first source all end up readable.
+    // With firstLevel == m_mipLevels nothing is blitted and only the layout changes.
+    uint32_t sourceBegin = firstLevel - 1;
+    uint32_t sourceEnd   = std::max(m_mipLevels - 1, sourceBegin);
+    VkImageMemoryBarrier barriers[3] = {barrier, barrier, barrier};
+    uint32_t             barrierCount = 0;
+    if (sourceEnd > sourceBegin) {
+        barriers[barrierCount].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, sourceBegin, sourceEnd - sourceBegin, 0, 1};
+        barriers[barrierCount].oldLayout        = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barriers[barrierCount].srcAccessMask    = VK_ACCESS_TRANSFER_READ_BIT;
+        barrierCount++;
+    }
+    barriers[barrierCount].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, sourceEnd, 1, 0, 1};
+    barriers[barrierCount].oldLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barriers[barrierCount].srcAccessMask    = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrierCount++;
+    if (sourceBegin > 0) {
+        barriers[barrierCount].subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, sourceBegin, 0, 1};
+        barriers[barrierCount].oldLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barriers[barrierCount].srcAccessMask    = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrierCount++;
+    }
+    for (uint32_t i = 0; i < barrierCount; i++) {
+        barriers[i].newLayout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barriers[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    vkd.CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                           0, 0, nullptr, 0, nullptr, barrierCount, barriers);
+}
+
 
 // Private ==================================================
 
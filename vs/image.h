@@ -19,13 +19,25 @@ public:
     void createForDepth     (Size<int32_t> size);
     void createForSwapchain (VkImage image, VkFormat imageFormat);
     void createForOffscreen (Size<int32_t> size);
+    // Sampled image with a view over every mip level, filled with transfers
+    void createForTexture   (Size<int32_t> size, VkFormat format, uint32_t mipLevels);
     void allocateImageMemory();
     void createSampler      ();
+
+    // Whole image, color aspect, waits on every earlier command
+    void cmdTransitionLayout(VkCommandBuffer commandBuffer, VkImageLayout oldLayout, VkImageLayout newLayout);
+    // Blits level i - 1 into level i for every level from firstLevel on. The whole image is in
+    // TRANSFER_DST_OPTIMAL with the levels below firstLevel written, it ends in SHADER_READ_ONLY_OPTIMAL.
+    // firstLevel is at least 1, a smaller one is clamped.
+    void cmdGenerateMipmaps (VkCommandBuffer commandBuffer, uint32_t firstLevel);
     
     VkImage          getImage      ();
     VkImageView      getImageView  ();
     VkDeviceMemory   getImageMemory();
     VkDescriptorImageInfo getDescriptor();
+    VkFormat         getFormat     ();
+    Size<int32_t>    getSize       ();
+    uint32_t         getMipLevels  ();
     
 private:
         
@@ -37,6 +49,10 @@ private:
     VkDeviceMemory   m_imageMemory    = VK_NULL_HANDLE;
     VkSampler        m_sampler        = VK_NULL_HANDLE;
 
+    VkFormat         m_format         = VK_FORMAT_UNDEFINED;
+    Size<int32_t>    m_size           = { 0, 0 };
+    uint32_t         m_mipLevels      = 1;
+
     static VkFormat ChooseDepthFormat( VkPhysicalDevice physicalDevice );
     static VkImageCreateInfo     GetDefaultImageCreateInfo();
     static VkImageViewCreateInfo GetDefaultImageViewCreateInfo();
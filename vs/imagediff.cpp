@@ -0,0 +1,95 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include "imagediff.h"
+
+void SavePfm( const std::string& filename, const FloatImage& image ) {
+    std::ofstream file( filename, std::ios::binary | std::ios::trunc );
+    if ( !file.is_open() ) RUNTIME_ERROR( "failed to open " + filename + "!" );
+
+    // The negative scale marks little endian floats
+    file << "PF\n" << image.size.width << " " << image.size.height << "\n-1.0\n";
+    for ( uint32_t y = image.size.height; y-- > 0; ) {
+        for ( uint32_t x = 0; x < image.size.width; x++ ) {
+            const glm::vec4& pixel = image.pixels[y * image.size.width + x];
+            float rgb[3] = { pixel.r, pixel.g, pixel.b };
+            file.write( reinterpret_cast<const char*>( rgb ), sizeof( rgb ) );
+        }
+    }
+}
+
+FloatImage LoadPfm( const std::string& filename ) {
+    std::ifstream file( filename, std::ios::binary );
+    if ( !file.is_open() ) RUNTIME_ERROR( "failed to open " + filename + "!" );
+
+    std::string magic;
+    FloatImage  image;
+    float       scale = 0.0f;
+    file >> magic >> image.size.width >> image.size.height >> scale;
+    if ( !file || magic != "PF" ) RUNTIME_ERROR( filename + " is not an RGB float map!" );
+    file.get(); // the single whitespace before the data
+
+    size_t pixelCount = size_t( image.size.width ) * image.size.height;
+    std::vector<float> data( pixelCount * 3 );
+    file.read( reinterpret_cast<char*>( data.data() ), data.size() * sizeof( float ) );
+    if ( !file ) RUNTIME_ERROR( filename + " is truncated!" );
+
+    // A positive scale marks big endian floats
+    if ( scale > 0.0f ) {
+        for ( float& value : data ) {
+            uint32_t bits;
+            memcpy( &bits, &value, sizeof( bits ) );
+            bits = ( bits >> 24 ) | ( ( bits >> 8 ) & 0xFF00 ) | ( ( bits << 8 ) & 0xFF0000 ) | ( bits << 24 );
+            memcpy( &value, &bits, sizeof( bits ) );
+        }
+    }
+
+    image.pixels.resize( pixelCount );
+    for ( uint32_t y = 0; y < image.size.height; y++ ) {
+        const float* row = &data[size_t( image.size.height - 1 - y ) * image.size.width * 3];
+        for ( uint32_t x = 0; x < image.size.width; x++ ) {
+            image.pixels[size_t( y ) * image.size.width + x] = glm::vec4( row[x * 3], row[x * 3 + 1], row[x * 3 + 2], 1.0f );
+        }
+    }
+    return image;
+}
+
+ImageDiff DiffImages( const FloatImage& reference, const FloatImage& image, float tolerance, float outlierRatio ) {
+    ImageDiff diff;
+    if ( reference.size.width != image.size.width || reference.size.height != image.size.height ) return diff;
+    if ( reference.pixels.size() != image.pixels.size() ) return diff;
+
+    double errorSum = 0.0;
+    for ( size_t i = 0; i < reference.pixels.size(); i++ ) {
+        float pixelError = 0.0f;
+        for ( uint32_t channel = 0; channel < 3; channel++ ) {
+            float a = reference.pixels[i][channel];
+            float b = image.pixels[i][channel];
+            // NaN and infinity only match themselves
+            float error = std::isfinite( a ) && std::isfinite( b ) ? std::abs( a - b ) / ( 1.0f + std::max( std::abs( a ), std::abs( b ) ) )
+                        : ( a == b ? 0.0f : INFINITY );
+            pixelError = std::max( pixelError, error );
+        }
+        if ( pixelError > tolerance ) diff.outliers++;
+        else errorSum += pixelError;
+        diff.maxError = std::max( diff.maxError, pixelError );
+    }
+    diff.pixelCount = UINT32( reference.pixels.size() );
+    diff.meanError  = diff.pixelCount > diff.outliers ? float( errorSum / ( diff.pixelCount - diff.outliers ) ) : 0.0f;
+    diff.passed     = diff.outliers <= outlierRatio * diff.pixelCount;
+    return diff;
+}
+
+void LogImageDiff( const std::string& name, const ImageDiff& diff ) {
+    if ( diff.pixelCount == 0 ) {
+        LOG( name << " failed, the sizes differ" );
+        return;
+    }
+    LOG( name << ( diff.passed ? " passed" : " failed" ) << ", " << diff.outliers << " of " << diff.pixelCount
+              << " pixels beyond the tolerance, mean error " << diff.meanError << " of the rest, max error " << diff.maxError );
+}
@@ -0,0 +1,35 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+
+// Error a channel may have, relative to 1 + the larger of the two values so dark pixels compare absolutely
+#define IMAGE_DIFF_TOLERANCE     0.02f
+// Share of the pixels allowed beyond the tolerance. A path whose rounding differs picks another
+// direction at some bounce, its pixel differs by far more than the rest of the image.
+#define IMAGE_DIFF_OUTLIER_RATIO 0.001f
+
+// RGB radiance with the first row at the top, what CpuTracer renders and the GPU accumulates
+struct FloatImage {
+    Size<uint32_t>         size{ 0, 0 };
+    std::vector<glm::vec4> pixels;
+};
+
+struct ImageDiff {
+    float    maxError   = 0.0f;
+    float    meanError  = 0.0f;
+    uint32_t outliers   = 0; // pixels with a channel beyond the tolerance
+    uint32_t pixelCount = 0;
+    bool     passed     = false;
+};
+
+// Portable float maps keep the unclamped radiance. Little endian, rows from the bottom up.
+void       SavePfm( const std::string& filename, const FloatImage& image );
+FloatImage LoadPfm( const std::string& filename );
+
+// Images of different sizes never pass
+ImageDiff DiffImages( const FloatImage& reference, const FloatImage& image,
+                      float tolerance = IMAGE_DIFF_TOLERANCE, float outlierRatio = IMAGE_DIFF_OUTLIER_RATIO );
+void      LogImageDiff( const std::string& name, const ImageDiff& diff );
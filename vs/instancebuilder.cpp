@@ -0,0 +1,202 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "instancebuilder.h"
+#include "dispatch.h"
+
+static_assert( sizeof( InstanceDesc ) == 32, "InstanceDesc must match instances.comp" );
+
+InstanceBuilder::~InstanceBuilder() {}
+InstanceBuilder::InstanceBuilder( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void InstanceBuilder::setup( uint32_t instanceCount, uint32_t frameCount, VkDescriptorSetLayout setLayout ) {
+    m_instanceCount = instanceCount;
+    uint32_t count  = std::max( instanceCount, 1u );
+
+    createMirror( m_transforms, count * sizeof( glm::mat4 ) );
+    createMirror( m_descs, count * sizeof( InstanceDesc ) );
+    createMirror( m_visibility, ( ( count + 31 ) / 32 ) * sizeof( uint32_t ) );
+    // Everything starts visible
+    memset( m_visibility.data.data(), 0xFF, m_visibility.data.size() );
+
+    m_staging = new StagingRing( m_device, m_physicalDevice );
+    m_staging->setup( frameCount );
+    for ( uint32_t i = 0; i < frameCount; i++ ) {
+        Buffer* instanceBuffer = new Buffer( m_device, m_physicalDevice );
+        instanceBuffer->setup( count * sizeof( VkAccelerationStructureInstanceKHR ),
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                               VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+        instanceBuffer->create();
+        m_instanceBuffers.push_back( instanceBuffer );
+    }
+
+    VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * frameCount };
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.maxSets       = frameCount;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes    = &poolSize;
+    VkResult result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    std::vector<VkDescriptorSetLayout> setLayouts( frameCount, setLayout );
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.descriptorPool     = m_descPool;
+    allocateInfo.descriptorSetCount = frameCount;
+    allocateInfo.pSetLayouts        = setLayouts.data();
+    m_descSets.resize( frameCount );
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, m_descSets.data() );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    // Only binding 3, the output, differs between frames
+    for ( uint32_t i = 0; i < frameCount; i++ ) {
+        std::array<VkDescriptorBufferInfo, 4> bufferInfos = {
+            m_transforms.buffer->getBufferInfo(),
+            m_descs.buffer->getBufferInfo(),
+            m_visibility.buffer->getBufferInfo(),
+            m_instanceBuffers[i]->getBufferInfo(),
+        };
+        std::array<VkWriteDescriptorSet, 4> writeSets{};
+        for ( uint32_t binding = 0; binding < 4; binding++ ) {
+            writeSets[binding].sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writeSets[binding].dstSet          = m_descSets[i];
+            writeSets[binding].dstBinding      = binding;
+            writeSets[binding].descriptorCount = 1;
+            writeSets[binding].descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writeSets[binding].pBufferInfo     = &bufferInfos[binding];
+        }
+        vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+    }
+}
+
+void InstanceBuilder::cleanup() {
+    if ( m_staging != nullptr ) {
+        m_staging->cleanup();
+        delete m_staging;
+        m_staging = nullptr;
+    }
+    for ( Buffer* instanceBuffer : m_instanceBuffers ) {
+        instanceBuffer->cleanup();
+        delete instanceBuffer;
+    }
+    m_instanceBuffers.clear();
+    for ( Mirror* mirror : { &m_transforms, &m_descs, &m_visibility } ) {
+        if ( mirror->buffer != nullptr ) {
+            mirror->buffer->cleanup();
+            delete mirror->buffer;
+        }
+        *mirror = Mirror();
+    }
+    vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    m_descPool = VK_NULL_HANDLE;
+    m_descSets.clear();
+}
+
+void InstanceBuilder::setDesc( uint32_t index, const InstanceDesc& desc ) {
+    write( m_descs, index * sizeof( InstanceDesc ), &desc, sizeof( InstanceDesc ) );
+}
+
+void InstanceBuilder::setTransform( uint32_t index, const glm::mat4& transform ) {
+    write( m_transforms, index * sizeof( glm::mat4 ), &transform, sizeof( glm::mat4 ) );
+}
+
+void InstanceBuilder::setVisible( uint32_t index, bool visible ) {
+    uint32_t word = reinterpret_cast<uint32_t*>( m_visibility.data.data() )[index / 32];
+    uint32_t bit  = 1u << ( index % 32 );
+    word = visible ? ( word | bit ) : ( word & ~bit );
+    write( m_visibility, ( index / 32 ) * sizeof( uint32_t ), &word, sizeof( uint32_t ) );
+}
+
+bool InstanceBuilder::cmdGenerate( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout ) {
+    // The fence of this frame has signaled, its staging memory is free again
+    m_staging->beginFrame( frameIndex );
+    if ( !m_dirty || pipeline == VK_NULL_HANDLE || m_instanceCount == 0 ) return false;
+    frameIndex %= m_instanceBuffers.size();
+
+    // The previous frame may still be reading the buffers the uploads write to
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 0, nullptr, 0, nullptr, 0, nullptr );
+    for ( Mirror* mirror : { &m_transforms, &m_descs, &m_visibility } ) cmdUpload( commandBuffer, *mirror );
+
+    // Uploads before the reads, and the previous TLAS build before this frame's instance array is overwritten
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &m_descSets[frameIndex], 0, nullptr );
+    vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( uint32_t ), &m_instanceCount );
+    vkd.CmdDispatch( commandBuffer, ( m_instanceCount + INSTANCE_WORKGROUP_SIZE - 1 ) / INSTANCE_WORKGROUP_SIZE, 1, 1 );
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    m_dirty = false;
+    return true;
+}
+
+VkDeviceAddress InstanceBuilder::getInstanceAddress( uint32_t frameIndex ) {
+    return m_instanceBuffers[frameIndex % m_instanceBuffers.size()]->getDeviceAddress();
+}
+
+uint32_t InstanceBuilder::getInstanceCount() { return m_instanceCount; }
+
+// Private ==================================================
+
+void InstanceBuilder::createMirror( Mirror& mirror, size_t size ) {
+    mirror.data.assign( size, 0 );
+    mirror.dirtyBegin = 0;
+    mirror.dirtyEnd   = size;
+
+    mirror.buffer = new Buffer( m_device, m_physicalDevice );
+    mirror.buffer->setup( size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    mirror.buffer->create();
+}
+
+void InstanceBuilder::write( Mirror& mirror, size_t offset, const void* data, size_t size ) {
+    if ( offset + size > mirror.data.size() ) RUNTIME_ERROR( "instance index out of range!" );
+    // Unchanged writes keep the frame clean, a static scene generates nothing
+    if ( memcmp( mirror.data.data() + offset, data, size ) == 0 ) return;
+
+    memcpy( mirror.data.data() + offset, data, size );
+    if ( mirror.dirtyBegin == mirror.dirtyEnd ) {
+        mirror.dirtyBegin = offset;
+        mirror.dirtyEnd   = offset + size;
+    }
+    else {
+        mirror.dirtyBegin = std::min( mirror.dirtyBegin, offset );
+        mirror.dirtyEnd   = std::max( mirror.dirtyEnd, offset + size );
+    }
+    m_dirty = true;
+}
+
+void InstanceBuilder::cmdUpload( VkCommandBuffer commandBuffer, Mirror& mirror ) {
+    // vkCmdUpdateBuffer wants 4 byte aligned offsets and sizes
+    VkDeviceSize begin = mirror.dirtyBegin & ~VkDeviceSize( 3 );
+    VkDeviceSize end   = std::min<VkDeviceSize>( ( mirror.dirtyEnd + 3 ) & ~VkDeviceSize( 3 ), mirror.data.size() );
+    mirror.dirtyBegin  = mirror.dirtyEnd = 0;
+    if ( begin >= end ) return;
+
+    VkDeviceSize size = end - begin;
+    if ( size <= INSTANCE_INLINE_UPLOAD ) {
+        for ( VkDeviceSize offset = begin; offset < end; offset += 65536 ) {
+            VkDeviceSize chunk = std::min<VkDeviceSize>( 65536, end - offset );
+            vkd.CmdUpdateBuffer( commandBuffer, mirror.buffer->getBuffer(), offset, chunk, mirror.data.data() + offset );
+        }
+        return;
+    }
+
+    StagingRegion staging = m_staging->write( mirror.data.data() + begin, size );
+    VkBufferCopy  region{ staging.offset, begin, size };
+    vkd.CmdCopyBuffer( commandBuffer, staging.buffer, mirror.buffer->getBuffer(), 1, &region );
+}
@@ -0,0 +1,77 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+#include "stagingring.h"
+
+#define INSTANCE_WORKGROUP_SIZE 64
+// Dirty ranges up to this size are recorded inline with vkCmdUpdateBuffer, larger ones go through staging
+#define INSTANCE_INLINE_UPLOAD  ( 256 * 1024 )
+
+// Static part of an instance, matches InstanceDesc in instances.comp
+struct InstanceDesc {
+    VkDeviceAddress blasAddress = 0;
+    uint32_t        customIndex = 0;
+    uint32_t        mask        = 0xFF;
+    uint32_t        sbtOffset   = 0;
+    uint32_t        flags       = 0;
+    uint32_t        pad[2]      = {};
+};
+
+// Generates the TLAS instance array on the GPU from device local transform, descriptor and
+// visibility buffers. Only the ranges changed on the host are uploaded.
+class InstanceBuilder {
+
+public:
+    ~InstanceBuilder();
+    InstanceBuilder( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // setLayout is the set 0 layout of instances.comp
+    void setup( uint32_t instanceCount, uint32_t frameCount, VkDescriptorSetLayout setLayout );
+    void cleanup();
+
+    void setDesc( uint32_t index, const InstanceDesc& desc );
+    void setTransform( uint32_t index, const glm::mat4& transform );
+    void setVisible( uint32_t index, bool visible );
+
+    // Uploads the dirty ranges and writes the instance array of this frame. Returns false and
+    // records nothing when nothing changed since the last call or the pipeline is not ready.
+    bool cmdGenerate( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout );
+
+    VkDeviceAddress getInstanceAddress( uint32_t frameIndex );
+    uint32_t        getInstanceCount();
+
+private:
+
+    // Host copy of a device local buffer and the byte range that has to be uploaded
+    struct Mirror {
+        std::vector<uint8_t> data;
+        Buffer*              buffer     = nullptr;
+        size_t               dirtyBegin = 0;
+        size_t               dirtyEnd   = 0;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    uint32_t m_instanceCount = 0;
+    bool     m_dirty         = true;
+
+    Mirror m_transforms;
+    Mirror m_descs;
+    Mirror m_visibility;
+
+    std::vector<Buffer*> m_instanceBuffers;
+    StagingRing*         m_staging = nullptr;
+
+    VkDescriptorPool             m_descPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> m_descSets;
+
+    void createMirror( Mirror& mirror, size_t size );
+    void write( Mirror& mirror, size_t offset, const void* data, size_t size );
+    void cmdUpload( VkCommandBuffer commandBuffer, Mirror& mirror );
+
+};
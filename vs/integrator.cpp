@@ -0,0 +1,127 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "integrator.h"
+#include "dispatch.h"
+
+// Steps of integrator_control.comp
+#define CONTROL_RESET 0
+#define CONTROL_SORT  1
+#define CONTROL_NEXT  2
+
+// std430 sizes of the structs in integrator.glsl
+#define INTEGRATOR_RAY_SIZE        48
+#define INTEGRATOR_HIT_SIZE        32
+#define INTEGRATOR_SHADOW_RAY_SIZE 48
+
+static_assert( sizeof( IntegratorConstants ) == 64, "IntegratorConstants must match integrator.glsl" );
+
+Integrator::~Integrator() {}
+Integrator::Integrator( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void Integrator::setup( Size<int32_t> size, VkDescriptorSet descSet ) {
+    m_size = size;
+
+    // Every bounce has at most one ray and hit per pixel, and two shadow rays for the key light and one sampled light
+    VkDeviceSize pixelCount = VkDeviceSize( size.width ) * size.height;
+    m_queues     = createBuffer( INTEGRATOR_QUEUES_SIZE, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT );
+    m_rays       = createBuffer( 2 * pixelCount * INTEGRATOR_RAY_SIZE );
+    m_hits       = createBuffer( pixelCount * INTEGRATOR_HIT_SIZE );
+    m_sortedHits = createBuffer( pixelCount * sizeof( uint32_t ) );
+    m_shadowRays = createBuffer( INTEGRATOR_SHADOW_RAYS * pixelCount * INTEGRATOR_SHADOW_RAY_SIZE );
+    m_radiance   = createBuffer( pixelCount * sizeof( glm::vec4 ) );
+
+    std::vector<Buffer*> buffers = { m_queues, m_rays, m_hits, m_sortedHits, m_shadowRays, m_radiance };
+    std::vector<VkDescriptorBufferInfo> bufferInfos;
+    std::vector<VkWriteDescriptorSet>   writeSets( buffers.size() );
+    for ( Buffer* buffer : buffers ) bufferInfos.push_back( buffer->getBufferInfo() );
+    for ( uint32_t i = 0; i < buffers.size(); i++ ) {
+        writeSets[i].sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeSets[i].dstSet          = descSet;
+        writeSets[i].dstBinding      = 3 + i;
+        writeSets[i].descriptorCount = 1;
+        writeSets[i].descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeSets[i].pBufferInfo     = &bufferInfos[i];
+    }
+    vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+}
+
+void Integrator::cleanup() {
+    for ( Buffer** buffer : { &m_queues, &m_rays, &m_hits, &m_sortedHits, &m_shadowRays, &m_radiance } ) {
+        if ( *buffer == nullptr ) continue;
+        ( *buffer )->cleanup();
+        delete *buffer;
+        *buffer = nullptr;
+    }
+}
+
+bool Integrator::cmdTrace( VkCommandBuffer commandBuffer, const std::vector<VkPipeline>& pipelines, VkPipelineLayout pipelineLayout,
+                           const std::vector<VkDescriptorSet>& descSets, IntegratorConstants constants ) {
+    if ( pipelines.size() != INTEGRATOR_KERNEL_COUNT ) return false;
+    for ( VkPipeline pipeline : pipelines ) if ( pipeline == VK_NULL_HANDLE ) return false;
+
+    uint32_t tilesX = ( m_size.width  + INTEGRATOR_TILE_SIZE - 1 ) / INTEGRATOR_TILE_SIZE;
+    uint32_t tilesY = ( m_size.height + INTEGRATOR_TILE_SIZE - 1 ) / INTEGRATOR_TILE_SIZE;
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout,
+                               0, UINT32( descSets.size() ), descSets.data(), 0, nullptr );
+
+    for ( uint32_t sample = 0; sample < constants.samplesPerPixel; sample++ ) {
+        constants.sampleIndex = sample;
+        constants.depth       = 0;
+        constants.mode        = CONTROL_RESET;
+        cmdDispatch( commandBuffer, pipelines[INTEGRATOR_CONTROL], pipelineLayout, constants, 1 );
+        cmdDispatch( commandBuffer, pipelines[INTEGRATOR_GENERATE], pipelineLayout, constants, tilesX, tilesY );
+
+        // Paths that ended leave the queues, later bounces dispatch fewer threads
+        for ( uint32_t depth = 0; depth < constants.maxDepth; depth++ ) {
+            constants.depth = depth;
+            cmdDispatchIndirect( commandBuffer, pipelines[INTEGRATOR_INTERSECT], pipelineLayout, constants, INTEGRATOR_INTERSECT_ARGS );
+            constants.mode = CONTROL_SORT;
+            cmdDispatch( commandBuffer, pipelines[INTEGRATOR_CONTROL], pipelineLayout, constants, 1 );
+            cmdDispatchIndirect( commandBuffer, pipelines[INTEGRATOR_SCATTER], pipelineLayout, constants, INTEGRATOR_SHADE_ARGS );
+            cmdDispatchIndirect( commandBuffer, pipelines[INTEGRATOR_SHADE], pipelineLayout, constants, INTEGRATOR_SHADE_ARGS );
+            constants.mode = CONTROL_NEXT;
+            cmdDispatch( commandBuffer, pipelines[INTEGRATOR_CONTROL], pipelineLayout, constants, 1 );
+            cmdDispatchIndirect( commandBuffer, pipelines[INTEGRATOR_SHADOW], pipelineLayout, constants, INTEGRATOR_SHADOW_ARGS );
+        }
+    }
+    cmdDispatch( commandBuffer, pipelines[INTEGRATOR_RESOLVE], pipelineLayout, constants, tilesX, tilesY );
+    return true;
+}
+
+// Private ==================================================
+
+Buffer* Integrator::createBuffer( VkDeviceSize size, VkBufferUsageFlags usage ) {
+    Buffer* buffer = new Buffer( m_device, m_physicalDevice );
+    buffer->setup( size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    buffer->create();
+    return buffer;
+}
+
+void Integrator::cmdDispatch( VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                              const IntegratorConstants& constants, uint32_t groupCountX, uint32_t groupCountY ) {
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( IntegratorConstants ), &constants );
+    vkd.CmdDispatch( commandBuffer, groupCountX, groupCountY, 1 );
+    cmdBarrier( commandBuffer );
+}
+
+void Integrator::cmdDispatchIndirect( VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                                      const IntegratorConstants& constants, VkDeviceSize argsOffset ) {
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( IntegratorConstants ), &constants );
+    vkd.CmdDispatchIndirect( commandBuffer, m_queues->getBuffer(), argsOffset );
+    cmdBarrier( commandBuffer );
+}
+
+void Integrator::cmdBarrier( VkCommandBuffer commandBuffer ) {
+    // Each kernel reads the queues, and possibly the dispatch arguments, the previous one wrote
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+}
@@ -0,0 +1,87 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+
+#define INTEGRATOR_WORKGROUP_SIZE 64
+#define INTEGRATOR_TILE_SIZE      8
+#define INTEGRATOR_MATERIAL_BINS  64
+#define INTEGRATOR_SHADOW_RAYS    2
+
+// Byte offsets of the VkDispatchIndirectCommands in the queue buffer, see Queues in integrator.glsl
+#define INTEGRATOR_INTERSECT_ARGS 16
+#define INTEGRATOR_SHADE_ARGS     32
+#define INTEGRATOR_SHADOW_ARGS    48
+#define INTEGRATOR_QUEUES_SIZE    ( 64 + 2 * INTEGRATOR_MATERIAL_BINS * 4 )
+
+// Kernels in the order their pipelines are passed to cmdTrace
+enum IntegratorKernel {
+    INTEGRATOR_CONTROL,
+    INTEGRATOR_GENERATE,
+    INTEGRATOR_INTERSECT,
+    INTEGRATOR_SCATTER,
+    INTEGRATOR_SHADE,
+    INTEGRATOR_SHADOW,
+    INTEGRATOR_RESOLVE,
+    INTEGRATOR_KERNEL_COUNT
+};
+
+// Push constants of the integrator_*.comp kernels, the first part matches the ray tracing pipeline
+struct IntegratorConstants {
+    glm::vec4 clearColor;
+    glm::vec3 lightPosition;
+    float     lightIntensity  = 100.0f;
+    uint32_t  frame           = 0;
+    uint32_t  sampleCount     = 0;
+    uint32_t  samplesPerPixel = 1;
+    uint32_t  maxDepth        = 1;
+    uint32_t  sampleIndex     = 0;
+    uint32_t  depth           = 0;
+    uint32_t  mode            = 0;
+    uint32_t  pad             = 0;
+};
+
+// Wavefront path tracer: instead of one ray tracing pipeline doing everything per pixel, every
+// stage of a bounce is its own compute kernel working on a GPU queue. Rays are intersected with
+// ray queries, hits are sorted by material before shading and shadow rays are traced in a batch.
+// Queue sizes never come back to the host, each kernel is dispatched indirectly.
+class Integrator {
+
+public:
+    ~Integrator();
+    Integrator( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // Creates the queues and writes them to bindings 3 to 8 of descSet, the set 0 of the kernels
+    void setup( Size<int32_t> size, VkDescriptorSet descSet );
+    void cleanup();
+
+    // Traces samplesPerPixel samples of up to maxDepth bounces and resolves them into the output
+    // image. Returns false and records nothing until every pipeline is ready.
+    bool cmdTrace( VkCommandBuffer commandBuffer, const std::vector<VkPipeline>& pipelines, VkPipelineLayout pipelineLayout,
+                   const std::vector<VkDescriptorSet>& descSets, IntegratorConstants constants );
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    Size<int32_t> m_size{};
+
+    Buffer* m_queues     = nullptr;
+    Buffer* m_rays       = nullptr;
+    Buffer* m_hits       = nullptr;
+    Buffer* m_sortedHits = nullptr;
+    Buffer* m_shadowRays = nullptr;
+    Buffer* m_radiance   = nullptr;
+
+    Buffer* createBuffer( VkDeviceSize size, VkBufferUsageFlags usage = 0 );
+    void cmdDispatch( VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                      const IntegratorConstants& constants, uint32_t groupCountX, uint32_t groupCountY = 1 );
+    void cmdDispatchIndirect( VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                              const IntegratorConstants& constants, VkDeviceSize argsOffset );
+    void cmdBarrier( VkCommandBuffer commandBuffer );
+
+};
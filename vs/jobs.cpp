@@ -0,0 +1,55 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "jobs.h"
+
+JobSystem::~JobSystem() {}
+JobSystem::JobSystem( uint32_t threadCount ) {
+    if ( threadCount == 0 ) {
+        uint32_t hardwareThreads = std::thread::hardware_concurrency();
+        threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    }
+    for ( uint32_t i = 0; i < threadCount; i++ ) {
+        m_workers.emplace_back( &JobSystem::work, this );
+    }
+}
+
+void JobSystem::cleanup() {
+    LOG( "JobSystem::cleanup" );
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_stop = true;
+    }
+    m_condition.notify_all();
+    for ( std::thread& worker : m_workers ) {
+        if ( worker.joinable() ) worker.join();
+    }
+    m_workers.clear();
+}
+
+void JobSystem::waitIdle() {
+    std::unique_lock<std::mutex> lock( m_mutex );
+    m_idleCondition.wait( lock, [this]() { return m_jobs.empty() && m_activeJobs == 0; } );
+}
+
+uint32_t JobSystem::getThreadCount() { return UINT32( m_workers.size() ); }
+
+void JobSystem::work() {
+    while ( true ) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            m_condition.wait( lock, [this]() { return m_stop || !m_jobs.empty(); } );
+            if ( m_jobs.empty() ) return;
+            job = std::move( m_jobs.front() );
+            m_jobs.pop();
+            m_activeJobs++;
+        }
+        job();
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_activeJobs--;
+        }
+        m_idleCondition.notify_all();
+    }
+}
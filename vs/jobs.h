@@ -0,0 +1,52 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <condition_variable>
+#include <queue>
+
+#include "common.h"
+
+class JobSystem {
+
+public:
+    ~JobSystem();
+    JobSystem( uint32_t threadCount = 0 );
+
+    void cleanup();
+    void waitIdle();
+
+    uint32_t getThreadCount();
+
+    template<typename F>
+    auto submit( F&& job ) -> std::future<decltype( job() )> {
+        typedef decltype( job() ) R;
+        auto task = std::make_shared<std::packaged_task<R()>>( std::forward<F>( job ) );
+        std::future<R> future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_jobs.push( [task]() { ( *task )(); } );
+        }
+        m_condition.notify_one();
+        return future;
+    }
+
+private:
+
+    std::vector<std::thread>          m_workers;
+    std::queue<std::function<void()>> m_jobs;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_condition;
+    std::condition_variable m_idleCondition;
+    uint32_t m_activeJobs = 0;
+    bool     m_stop       = false;
+
+    void work();
+
+};
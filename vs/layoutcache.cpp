@@ -0,0 +1,168 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "layoutcache.h"
+#include "helper.h"
+
+#include <algorithm>
+
+LayoutCache::~LayoutCache() {}
+LayoutCache::LayoutCache( VkDevice device ) : m_device( device ) {}
+
+void LayoutCache::cleanup() {
+    LOG( "LayoutCache::cleanup" );
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for ( auto& entry : m_pipelineLayouts ) vkDestroyPipelineLayout( m_device, entry.second, nullptr );
+    for ( auto& entry : m_setLayouts )      vkDestroyDescriptorSetLayout( m_device, entry.second, nullptr );
+    m_pipelineLayouts.clear();
+    m_setLayouts.clear();
+    m_pushConstantStages.clear();
+    m_sharedSetLayouts.clear();
+}
+
+VkDescriptorSetLayout LayoutCache::getDescriptorSetLayout( const std::vector<VkDescriptorSetLayoutBinding>& bindings,
+                                                          const std::vector<VkDescriptorBindingFlags>& bindingFlags,
+                                                          VkDescriptorSetLayoutCreateFlags flags ) {
+    if ( !bindingFlags.empty() && bindingFlags.size() != bindings.size() )
+        RUNTIME_ERROR( "binding flags do not match the bindings!" );
+
+    std::vector<uint32_t> key = { flags };
+    for ( size_t i = 0; i < bindings.size(); i++ ) {
+        const VkDescriptorSetLayoutBinding& binding = bindings[i];
+        key.insert( key.end(), { binding.binding, UINT32( binding.descriptorType ), binding.descriptorCount, binding.stageFlags,
+                                 bindingFlags.empty() ? 0u : bindingFlags[i] } );
+    }
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto found = m_setLayouts.find( key );
+    if ( found != m_setLayouts.end() ) return found->second;
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO };
+    bindingFlagsInfo.bindingCount  = UINT32( bindingFlags.size() );
+    bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext        = bindingFlags.empty() ? nullptr : &bindingFlagsInfo;
+    layoutInfo.flags        = flags;
+    layoutInfo.bindingCount = UINT32( bindings.size() );
+    layoutInfo.pBindings    = bindings.data();
+
+    VkDescriptorSetLayout setLayout;
+    VkResult result = vkCreateDescriptorSetLayout( m_device, &layoutInfo, nullptr, &setLayout );
+    CHECK_VKRESULT( result, "failed to create descriptor set layout!" );
+    m_setLayouts[key] = setLayout;
+    return setLayout;
+}
+
+VkDescriptorSetLayout LayoutCache::getDescriptorSetLayout( const std::vector<Shader*>& shaders, uint32_t set ) {
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        auto shared = m_sharedSetLayouts.find( set );
+        if ( shared != m_sharedSetLayouts.end() ) return shared->second;
+    }
+    return getDescriptorSetLayout( GetSetBindings( shaders, set ) );
+}
+
+VkPipelineLayout LayoutCache::getPipelineLayout( const std::vector<Shader*>& shaders ) {
+    // Sets without bindings in between get an empty layout
+    uint32_t setCount = 0;
+    for ( Shader* shader : shaders )
+        for ( const ShaderBinding& binding : shader->getBindings() )
+            setCount = std::max( setCount, binding.set + 1 );
+
+    std::vector<VkDescriptorSetLayout> setLayouts;
+    for ( uint32_t set = 0; set < setCount; set++ )
+        setLayouts.push_back( getDescriptorSetLayout( shaders, set ) );
+
+    // All stages share one range covering every push constant block
+    VkPushConstantRange pushConstantRange{ 0, UINT32_MAX, 0 };
+    for ( Shader* shader : shaders ) {
+        for ( const VkPushConstantRange& range : shader->getPushConstantRanges() ) {
+            uint32_t end = std::max( pushConstantRange.offset == UINT32_MAX ? 0 : pushConstantRange.offset + pushConstantRange.size,
+                                     range.offset + range.size );
+            pushConstantRange.stageFlags |= range.stageFlags;
+            pushConstantRange.offset      = std::min( pushConstantRange.offset, range.offset );
+            pushConstantRange.size        = end - pushConstantRange.offset;
+        }
+    }
+    bool hasPushConstants = pushConstantRange.stageFlags != 0;
+
+    std::vector<uint32_t> key;
+    for ( VkDescriptorSetLayout setLayout : setLayouts ) {
+        uint64_t handle = (uint64_t)setLayout;
+        key.insert( key.end(), { UINT32( handle ), UINT32( handle >> 32 ) } );
+    }
+    if ( hasPushConstants )
+        key.insert( key.end(), { pushConstantRange.stageFlags, pushConstantRange.offset, pushConstantRange.size } );
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto found = m_pipelineLayouts.find( key );
+    if ( found != m_pipelineLayouts.end() ) return found->second;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount         = UINT32( setLayouts.size() );
+    pipelineLayoutInfo.pSetLayouts            = setLayouts.data();
+    pipelineLayoutInfo.pushConstantRangeCount = hasPushConstants ? 1 : 0;
+    pipelineLayoutInfo.pPushConstantRanges    = hasPushConstants ? &pushConstantRange : nullptr;
+
+    VkPipelineLayout pipelineLayout;
+    VkResult result = vkCreatePipelineLayout( m_device, &pipelineLayoutInfo, nullptr, &pipelineLayout );
+    CHECK_VKRESULT( result, "failed to create pipeline layout!" );
+    m_pipelineLayouts[key] = pipelineLayout;
+    m_pushConstantStages[pipelineLayout] = pushConstantRange.stageFlags;
+    return pipelineLayout;
+}
+
+void LayoutCache::setSharedSetLayout( uint32_t set, VkDescriptorSetLayout setLayout ) {
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_sharedSetLayouts[set] = setLayout;
+}
+
+VkShaderStageFlags LayoutCache::getPushConstantStages( VkPipelineLayout pipelineLayout ) {
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto found = m_pushConstantStages.find( pipelineLayout );
+    return found == m_pushConstantStages.end() ? 0 : found->second;
+}
+
+std::vector<VkDescriptorSetLayoutBinding> LayoutCache::GetSetBindings( const std::vector<Shader*>& shaders, uint32_t set ) {
+    std::map<uint32_t, VkDescriptorSetLayoutBinding> merged;
+    for ( Shader* shader : shaders ) {
+        for ( const ShaderBinding& binding : shader->getBindings() ) {
+            if ( binding.set != set ) continue;
+            VkDescriptorSetLayoutBinding layoutBinding = binding.layoutBinding;
+            if ( layoutBinding.descriptorCount == 0 ) layoutBinding.descriptorCount = UNBOUNDED_DESCRIPTOR_COUNT;
+
+            auto found = merged.find( layoutBinding.binding );
+            if ( found == merged.end() ) {
+                merged[layoutBinding.binding] = layoutBinding;
+                continue;
+            }
+            if ( found->second.descriptorType != layoutBinding.descriptorType )
+                RUNTIME_ERROR( "descriptor type mismatch between shader stages!" );
+            found->second.stageFlags     |= layoutBinding.stageFlags;
+            found->second.descriptorCount = std::max( found->second.descriptorCount, layoutBinding.descriptorCount );
+        }
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    for ( auto& entry : merged ) bindings.push_back( entry.second );
+    return bindings;
+}
+
+std::vector<VkDescriptorPoolSize> LayoutCache::GetPoolSizes( const std::vector<VkDescriptorSetLayoutBinding>& bindings, uint32_t setCount ) {
+    std::map<VkDescriptorType, uint32_t> counts;
+    for ( const VkDescriptorSetLayoutBinding& binding : bindings )
+        counts[binding.descriptorType] += binding.descriptorCount * setCount;
+
+    std::vector<VkDescriptorPoolSize> poolSizes;
+    for ( auto& entry : counts ) poolSizes.push_back( { entry.first, entry.second } );
+    return poolSizes;
+}
+
+// Private ==================================================
+
+size_t LayoutCache::KeyHash::operator()( const std::vector<uint32_t>& key ) const {
+    return size_t( HashBytes( key.data(), key.size() * sizeof( uint32_t ) ) );
+}
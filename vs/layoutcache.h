@@ -0,0 +1,55 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+
+#include "common.h"
+#include "shader.h"
+
+// Runtime arrays in the shaders have no size, the layout gets this many descriptors
+#define UNBOUNDED_DESCRIPTOR_COUNT 64
+
+class LayoutCache {
+
+public:
+    ~LayoutCache();
+    LayoutCache( VkDevice device );
+
+    void cleanup();
+
+    // Layouts are deduplicated by content and owned by the cache, they are destroyed in cleanup().
+    // bindingFlags is empty or has one entry per binding, flags and binding flags are part of the content.
+    VkDescriptorSetLayout getDescriptorSetLayout( const std::vector<VkDescriptorSetLayoutBinding>& bindings,
+                                                  const std::vector<VkDescriptorBindingFlags>& bindingFlags = {},
+                                                  VkDescriptorSetLayoutCreateFlags flags = 0 );
+    VkDescriptorSetLayout getDescriptorSetLayout( const std::vector<Shader*>& shaders, uint32_t set );
+    VkPipelineLayout      getPipelineLayout( const std::vector<Shader*>& shaders );
+
+    // A set whose layout is owned elsewhere and bound by every pipeline that declares it, like the
+    // bindless texture table. Pipeline layouts created afterwards use it instead of reflecting the set.
+    void setSharedSetLayout( uint32_t set, VkDescriptorSetLayout setLayout );
+
+    // Stage flags vkCmdPushConstants has to be called with for this layout
+    VkShaderStageFlags getPushConstantStages( VkPipelineLayout pipelineLayout );
+
+    static std::vector<VkDescriptorSetLayoutBinding> GetSetBindings( const std::vector<Shader*>& shaders, uint32_t set );
+    static std::vector<VkDescriptorPoolSize> GetPoolSizes( const std::vector<VkDescriptorSetLayoutBinding>& bindings, uint32_t setCount = 1 );
+
+private:
+
+    struct KeyHash {
+        size_t operator()( const std::vector<uint32_t>& key ) const;
+    };
+
+    VkDevice m_device = VK_NULL_HANDLE;
+
+    std::mutex m_mutex;
+    std::unordered_map<std::vector<uint32_t>, VkDescriptorSetLayout, KeyHash> m_setLayouts;
+    std::unordered_map<std::vector<uint32_t>, VkPipelineLayout, KeyHash>      m_pipelineLayouts;
+    std::map<VkPipelineLayout, VkShaderStageFlags> m_pushConstantStages;
+    std::map<uint32_t, VkDescriptorSetLayout>      m_sharedSetLayouts;
+
+};
@@ -0,0 +1,147 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "lightbuilder.h"
+#include "dispatch.h"
+
+static_assert( sizeof( Light ) == 32, "Light must match lights.glsl" );
+static_assert( sizeof( LightNode ) == 32, "LightNode must match lights.glsl" );
+
+// Stages that read the lights, the hit shaders, the integrator, the cluster pass and the raster pass
+static const VkPipelineStageFlags LIGHT_READ_STAGES =
+    VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+static float Luminance( const glm::vec3& color ) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+LightBuilder::~LightBuilder() {}
+LightBuilder::LightBuilder( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void LightBuilder::setup( uint32_t frameCount ) {
+    m_lightBuffer = new Buffer( m_device, m_physicalDevice );
+    m_lightBuffer->setup( LIGHT_CAPACITY * sizeof( Light ), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_lightBuffer->create();
+
+    // A binary tree with a leaf per light has 2n - 1 nodes
+    m_nodeBuffer = new Buffer( m_device, m_physicalDevice );
+    m_nodeBuffer->setup( ( 2 * LIGHT_CAPACITY - 1 ) * sizeof( LightNode ), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_nodeBuffer->create();
+
+    m_staging = new StagingRing( m_device, m_physicalDevice );
+    m_staging->setup( frameCount );
+    setLights( {} );
+}
+
+void LightBuilder::cleanup() {
+    if ( m_staging != nullptr ) {
+        m_staging->cleanup();
+        delete m_staging;
+        m_staging = nullptr;
+    }
+    for ( Buffer** buffer : { &m_lightBuffer, &m_nodeBuffer } ) {
+        if ( *buffer == nullptr ) continue;
+        ( *buffer )->cleanup();
+        delete *buffer;
+        *buffer = nullptr;
+    }
+    m_lights.clear();
+    m_nodes.clear();
+}
+
+void LightBuilder::setLights( const std::vector<Light>& lights ) {
+    if ( lights.size() > LIGHT_CAPACITY ) RUNTIME_ERROR( "too many lights!" );
+    m_lights = lights;
+    for ( Light& light : m_lights ) {
+        float peak  = std::max( { light.intensity.x, light.intensity.y, light.intensity.z } );
+        light.range = std::sqrt( std::max( peak, 0.0f ) / LIGHT_CUTOFF );
+    }
+
+    // The shaders check the power of the root, an empty scene keeps one node without any
+    m_nodes.assign( 1, { glm::vec3( 0.0f ), 0.0f, glm::vec3( 0.0f ), ~0 } );
+    if ( !m_lights.empty() ) {
+        std::vector<uint32_t> order( m_lights.size() );
+        for ( uint32_t i = 0; i < order.size(); i++ ) order[i] = i;
+        m_nodes.reserve( 2 * m_lights.size() - 1 );
+        buildNode( 0, order, 0, UINT32( order.size() ) );
+    }
+    m_dirty = true;
+}
+
+bool LightBuilder::cmdUpload( VkCommandBuffer commandBuffer, uint32_t frameIndex ) {
+    // The fence of this frame has signaled, its staging memory is free again
+    m_staging->beginFrame( frameIndex );
+    if ( !m_dirty ) return false;
+    m_dirty = false;
+
+    VkDeviceSize lightSize = m_lights.size() * sizeof( Light );
+    VkDeviceSize nodeSize  = m_nodes.size() * sizeof( LightNode );
+    StagingRegion staging = m_staging->allocate( nodeSize + lightSize );
+    memcpy( staging.data, m_nodes.data(), nodeSize );
+    if ( lightSize > 0 ) memcpy( static_cast<char*>( staging.data ) + nodeSize, m_lights.data(), lightSize );
+
+    // The previous frame may still be reading the lights the upload overwrites
+    vkd.CmdPipelineBarrier( commandBuffer, LIGHT_READ_STAGES, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 0, nullptr, 0, nullptr, 0, nullptr );
+    VkBufferCopy nodeRegion{ staging.offset, 0, nodeSize };
+    vkd.CmdCopyBuffer( commandBuffer, staging.buffer, m_nodeBuffer->getBuffer(), 1, &nodeRegion );
+    if ( lightSize > 0 ) {
+        VkBufferCopy lightRegion{ staging.offset + nodeSize, 0, lightSize };
+        vkd.CmdCopyBuffer( commandBuffer, staging.buffer, m_lightBuffer->getBuffer(), 1, &lightRegion );
+    }
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, LIGHT_READ_STAGES,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+    return true;
+}
+
+VkDescriptorBufferInfo LightBuilder::getLightBufferInfo() { return m_lightBuffer->getBufferInfo(); }
+VkDescriptorBufferInfo LightBuilder::getNodeBufferInfo() { return m_nodeBuffer->getBufferInfo(); }
+uint32_t               LightBuilder::getLightCount() { return UINT32( m_lights.size() ); }
+
+const std::vector<Light>&     LightBuilder::getLights() { return m_lights; }
+const std::vector<LightNode>& LightBuilder::getNodes () { return m_nodes; }
+
+// Private ==================================================
+
+void LightBuilder::buildNode( uint32_t node, std::vector<uint32_t>& order, uint32_t begin, uint32_t end ) {
+    glm::vec3 boundsMin( INFINITY ), boundsMax( -INFINITY );
+    float     power = 0.0f;
+    for ( uint32_t i = begin; i < end; i++ ) {
+        const Light& light = m_lights[order[i]];
+        boundsMin = glm::min( boundsMin, light.position );
+        boundsMax = glm::max( boundsMax, light.position );
+        power    += Luminance( light.intensity );
+    }
+    m_nodes[node].boundsMin = boundsMin;
+    m_nodes[node].boundsMax = boundsMax;
+    m_nodes[node].power     = power;
+    if ( end - begin == 1 ) {
+        m_nodes[node].child = ~static_cast<int32_t>( order[begin] );
+        return;
+    }
+
+    // Median of the longest axis, the halves stay balanced and the tree log2 n deep
+    glm::vec3 extent = boundsMax - boundsMin;
+    int32_t   axis   = extent.x > extent.y ? ( extent.x > extent.z ? 0 : 2 ) : ( extent.y > extent.z ? 1 : 2 );
+    uint32_t  middle = ( begin + end ) / 2;
+    std::nth_element( order.begin() + begin, order.begin() + middle, order.begin() + end, [this, axis]( uint32_t a, uint32_t b ) {
+        return m_lights[a].position[axis] < m_lights[b].position[axis];
+    } );
+
+    uint32_t child = UINT32( m_nodes.size() );
+    m_nodes[node].child = static_cast<int32_t>( child );
+    m_nodes.resize( m_nodes.size() + 2 );
+    buildNode( child, order, begin, middle );
+    buildNode( child + 1, order, middle, end );
+}
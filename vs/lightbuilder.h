@@ -0,0 +1,70 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+#include "stagingring.h"
+
+// Lights the buffers are sized for
+#define LIGHT_CAPACITY 4096
+// Irradiance below which a light is left out of a cluster, sets Light::range
+#define LIGHT_CUTOFF   0.05f
+
+// Point light, matches Light in lights.glsl
+struct Light {
+    glm::vec3 position  = glm::vec3( 0.0f );
+    float     range     = 0.0f; // filled in from intensity and LIGHT_CUTOFF
+    glm::vec3 intensity = glm::vec3( 1.0f ); // falls off with 1 / d^2 like the key light
+    float     pad       = 0.0f;
+};
+
+// Node of the light tree, matches LightNode in lights.glsl
+struct LightNode {
+    glm::vec3 boundsMin;
+    float     power;    // luminance of the lights below, 0 in the root of an empty tree
+    glm::vec3 boundsMax;
+    int32_t   child;    // first of two adjacent children, ~light index in a leaf
+};
+
+// Point lights of the scene and a binary tree over them. The path tracers walk the tree to pick one light
+// per hit in proportion to its estimated contribution, log2 of the light count steps instead of one shadow
+// ray per light. The tree splits the light positions at the median of their longest axis.
+class LightBuilder {
+
+public:
+    ~LightBuilder();
+    LightBuilder( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    void setup( uint32_t frameCount );
+    void cleanup();
+
+    // Replaces every light, the tree is rebuilt here and uploaded by the next cmdUpload
+    void setLights( const std::vector<Light>& lights );
+    // Returns false and records nothing when the lights did not change
+    bool cmdUpload( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+
+    VkDescriptorBufferInfo getLightBufferInfo();
+    VkDescriptorBufferInfo getNodeBufferInfo();
+    uint32_t               getLightCount();
+    // Host copies of what cmdUpload writes, the CPU reference tracer samples the same tree
+    const std::vector<Light>&     getLights();
+    const std::vector<LightNode>& getNodes();
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    std::vector<Light>     m_lights;
+    std::vector<LightNode> m_nodes;
+    bool                   m_dirty = false;
+
+    Buffer*      m_lightBuffer = nullptr;
+    Buffer*      m_nodeBuffer  = nullptr;
+    StagingRing* m_staging     = nullptr;
+
+    void buildNode( uint32_t node, std::vector<uint32_t>& order, uint32_t begin, uint32_t end );
+
+};
@@ -0,0 +1,90 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <array>
+
+#include "lightclusters.h"
+#include "dispatch.h"
+
+LightClusters::~LightClusters() {}
+LightClusters::LightClusters( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void LightClusters::setup( VkDescriptorSetLayout setLayout, LightBuilder* lightBuilder ) {
+    m_clusters = new Buffer( m_device, m_physicalDevice );
+    m_clusters->setup( CLUSTER_COUNT * ( CLUSTER_MAX_LIGHTS + 1 ) * sizeof( uint32_t ),
+                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_clusters->create();
+
+    VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 };
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.maxSets       = 1;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes    = &poolSize;
+    VkResult result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.descriptorPool     = m_descPool;
+    allocateInfo.descriptorSetCount = 1;
+    allocateInfo.pSetLayouts        = &setLayout;
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, &m_descSet );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    std::array<VkDescriptorBufferInfo, 2> bufferInfos = { lightBuilder->getLightBufferInfo(), m_clusters->getBufferInfo() };
+    std::array<VkWriteDescriptorSet, 2>   writeSets{};
+    for ( uint32_t binding = 0; binding < writeSets.size(); binding++ ) {
+        writeSets[binding].sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeSets[binding].dstSet          = m_descSet;
+        writeSets[binding].dstBinding      = binding;
+        writeSets[binding].descriptorCount = 1;
+        writeSets[binding].descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeSets[binding].pBufferInfo     = &bufferInfos[binding];
+    }
+    vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+}
+
+void LightClusters::cleanup() {
+    if ( m_clusters != nullptr ) {
+        m_clusters->cleanup();
+        delete m_clusters;
+        m_clusters = nullptr;
+    }
+    vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    m_descPool = VK_NULL_HANDLE;
+}
+
+void LightClusters::cmdInitialize( VkCommandBuffer commandBuffer ) {
+    // The raster pass may run before the first build, empty lists leave it unlit
+    vkd.CmdFillBuffer( commandBuffer, m_clusters->getBuffer(), 0, VK_WHOLE_SIZE, 0 );
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+}
+
+bool LightClusters::cmdBuild( VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout, const ClusterSettings& settings ) {
+    if ( pipeline == VK_NULL_HANDLE ) return false;
+
+    // The fragment shader of the previous frame may still be reading the lists
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            0, 0, nullptr, 0, nullptr, 0, nullptr );
+
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &m_descSet, 0, nullptr );
+    vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( ClusterSettings ), &settings );
+    vkd.CmdDispatch( commandBuffer, ( CLUSTER_COUNT + CLUSTER_WORKGROUP_SIZE - 1 ) / CLUSTER_WORKGROUP_SIZE, 1, 1 );
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+    return true;
+}
+
+VkDescriptorBufferInfo LightClusters::getClusterBufferInfo() { return m_clusters->getBufferInfo(); }
@@ -0,0 +1,58 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+#include "lightbuilder.h"
+
+// Froxels of the cluster grid, mirrored in lights.glsl
+#define CLUSTER_GRID_X         16
+#define CLUSTER_GRID_Y         9
+#define CLUSTER_GRID_Z         24
+#define CLUSTER_COUNT          ( CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z )
+#define CLUSTER_MAX_LIGHTS     127
+#define CLUSTER_WORKGROUP_SIZE 64
+
+// Push constants of cluster_lights.comp
+struct ClusterSettings {
+    glm::mat4 view;
+    glm::vec2 tanHalfFov;  // of the x and y axes, 1 / proj[0][0] and 1 / proj[1][1]
+    float     zNear;
+    float     zFar;
+    uint32_t  lightCount;
+};
+
+// Per-cluster light lists of the raster pass. The view frustum is cut into CLUSTER_GRID_X by
+// CLUSTER_GRID_Y screen tiles and CLUSTER_GRID_Z exponential depth slices, cluster_lights.comp
+// writes the lights whose range reaches each one, and the fragment shader only loops over the list
+// of the cluster it falls in. A cluster holds the light count followed by up to CLUSTER_MAX_LIGHTS indices.
+class LightClusters {
+
+public:
+    ~LightClusters();
+    LightClusters( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // setLayout is the set 0 layout of cluster_lights.comp, it reads the lights of lightBuilder
+    void setup( VkDescriptorSetLayout setLayout, LightBuilder* lightBuilder );
+    void cleanup();
+
+    // Clears every list, before the first frame
+    void cmdInitialize( VkCommandBuffer commandBuffer );
+
+    // Returns false and records nothing until the pipeline is ready, call outside of a render pass
+    bool cmdBuild( VkCommandBuffer commandBuffer, VkPipeline pipeline, VkPipelineLayout pipelineLayout, const ClusterSettings& settings );
+
+    VkDescriptorBufferInfo getClusterBufferInfo();
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    Buffer*          m_clusters = nullptr;
+    VkDescriptorPool m_descPool = VK_NULL_HANDLE;
+    VkDescriptorSet  m_descSet  = VK_NULL_HANDLE;
+
+};
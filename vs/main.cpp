@@ -1,16 +1,27 @@
 #include "app.h"
 #include <iostream>
 
-int main() {
+int main(int argc, char** argv) {
     App app;
 
+    // --cpu renders the reference image on the CPU tracer, no GPU needed
+    bool cpuReference = argc > 1 && std::string(argv[1]) == "--cpu";
+    // --diff reference.pfm image.pfm [tolerance] fails unless the images match, e.g. the files C writes
+    bool imageDiff    = argc > 3 && std::string(argv[1]) == "--diff";
+
     try {
-        app.run();
+        if (imageDiff) {
+            float     tolerance = argc > 4 ? std::stof(argv[4]) : IMAGE_DIFF_TOLERANCE;
+            ImageDiff diff      = DiffImages(LoadPfm(argv[2]), LoadPfm(argv[3]), tolerance);
+            LogImageDiff(argv[3], diff);
+            return diff.passed ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (cpuReference) app.runCpuReference();
+        else              app.run();
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
-        return EXIT_SUCCESS;
+        return imageDiff ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
     return EXIT_SUCCESS;
 }
-
@@ -11,6 +11,7 @@
 #include <unordered_map>
 
 #include "mesh.h"
+#include "helper.h"
 
 Mesh::~Mesh() {}
 Mesh::Mesh( VkDevice device, VkPhysicalDevice physicalDevice ) :
@@ -82,7 +83,8 @@ void Mesh::createCube() {
 }
 
 void Mesh::cmdCreateVertexBuffer() {
-    VkDeviceSize bufferSize = sizeofPositions() + sizeofNormals() + sizeofColors();
+    // Interleaved like Vertex in wavefront.glsl, the hit shaders read it through its device address
+    VkDeviceSize bufferSize = sizeofPositions() + sizeofNormals() + sizeofColors() + sizeofTexCoords();
     
     Buffer* vertexBuffer = new Buffer( m_device, m_physicalDevice );
     vertexBuffer->setup(bufferSize, 
@@ -99,6 +101,8 @@ void Mesh::cmdCreateVertexBuffer() {
         shift += sizeofNormal;
         vertexBuffer->fillBuffer(&m_colors   [i], sizeofColor   , shift);
         shift += sizeofColor;
+        vertexBuffer->fillBuffer(&m_texCoords[i], sizeofTexCoord, shift);
+        shift += sizeofTexCoord;
     }
     
     m_vertexBuffer = vertexBuffer;
@@ -119,13 +123,13 @@ void Mesh::cmdCreateIndexBuffer() {
 }
 
 VkPipelineVertexInputStateCreateInfo* Mesh::createVertexInputInfo() {
-    int32_t stride = sizeofPosition + sizeofNormal + sizeofColor;
+    int32_t stride = getVertexStride();
     
     bindingDescription.binding = 0;
     bindingDescription.stride = stride;
     bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
     
-    attributeDescriptions.resize(3);
+    attributeDescriptions.resize(4);
     
     attributeDescriptions[0].binding = 0;
     attributeDescriptions[0].location = 0;
@@ -142,6 +146,11 @@ VkPipelineVertexInputStateCreateInfo* Mesh::createVertexInputInfo() {
     attributeDescriptions[2].format = VK_FORMAT_R32G32B32_SFLOAT;
     attributeDescriptions[2].offset = sizeofPosition + sizeofNormal;
     
+    attributeDescriptions[3].binding = 0;
+    attributeDescriptions[3].location = 3;
+    attributeDescriptions[3].format = VK_FORMAT_R32G32_SFLOAT;
+    attributeDescriptions[3].offset = sizeofPosition + sizeofNormal + sizeofColor;
+    
     stateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     stateCreateInfo.vertexBindingDescriptionCount = 1;
     stateCreateInfo.vertexAttributeDescriptionCount = UINT32(attributeDescriptions.size());
@@ -161,3 +170,15 @@ int32_t Mesh::sizeofNormals  () { return sizeofNormal   * (int32_t) m_normals.si
 int32_t Mesh::sizeofColors   () { return sizeofColor    * (int32_t) m_colors.size(); }
 int32_t Mesh::sizeofTexCoords() { return sizeofTexCoord * (int32_t) m_texCoords.size(); }
 int32_t Mesh::sizeofIndices  () { return sizeofIndex    * (int32_t) m_indices.size(); }
+
+uint32_t Mesh::getVertexStride() { return UINT32(sizeofPosition + sizeofNormal + sizeofColor + sizeofTexCoord); }
+uint32_t Mesh::getVertexCount () { return UINT32(m_positions.size()); }
+uint32_t Mesh::getIndexCount  () { return UINT32(m_indices.size()); }
+
+uint64_t Mesh::getHash() {
+    uint32_t stride = getVertexStride();
+    uint64_t hash   = HashBytes(&stride, sizeof(stride));
+    hash = HashBytes(m_positions.data(), m_positions.size() * sizeof(glm::vec3), hash);
+    hash = HashBytes(m_indices.data(), m_indices.size() * sizeof(int32_t), hash);
+    return hash;
+}
@@ -27,6 +27,12 @@ public:
     int32_t sizeofColors();
     int32_t sizeofTexCoords();
     int32_t sizeofIndices();
+
+    uint32_t getVertexStride();
+    uint32_t getVertexCount();
+    uint32_t getIndexCount();
+    // Content hash of the geometry a BLAS is built from
+    uint64_t getHash();
     
     VkPipelineVertexInputStateCreateInfo* createVertexInputInfo();
 
@@ -72,158 +72,192 @@ void App::createOffscreenFramedata() {
 }
 
 void App::createOffscreenDescriptorSet() {
-    VkDescriptorSetLayoutBinding layoutBinding0{};
-    layoutBinding0.binding         = 0;
-    layoutBinding0.descriptorCount = 1;
-    layoutBinding0.descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    layoutBinding0.stageFlags      = VK_SHADER_STAGE_VERTEX_BIT;
-    layoutBinding0.pImmutableSamplers = nullptr;
-
-    //VkDescriptorSetLayoutBinding layoutBinding1{};
-    //layoutBinding1.binding         = 1;
-    //layoutBinding1.descriptorCount = 1;
-    //layoutBinding1.descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    //layoutBinding1.stageFlags      = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
-    //layoutBinding1.pImmutableSamplers = nullptr;
-
-    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = { layoutBinding0 };
-
-    VkDescriptorSetLayoutCreateInfo layoutInfo{};
-    layoutInfo.sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = UINT32(layoutBindings.size());
-    layoutInfo.pBindings    = layoutBindings.data();
-
-    VkResult result = vkCreateDescriptorSetLayout( m_device, &layoutInfo, nullptr, &m_descSetLayout );
-    CHECK_VKRESULT( result, "failed to create descriptor set layout!" );
-
-    VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 };
+    m_offscreenShaders = {
+        loadShader( "vert.spv", VK_SHADER_STAGE_VERTEX_BIT ),
+        loadShader( "frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ),
+    };
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = LayoutCache::GetSetBindings( m_offscreenShaders, 0 );
+    m_descSetLayout = m_layoutCache->getDescriptorSetLayout( layoutBindings );
+
+    // One set per frame in flight, each with the uniform buffer of its frame
+    std::vector<VkDescriptorPoolSize> poolSizes = LayoutCache::GetPoolSizes( layoutBindings, m_totalFrame );
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolInfo.maxSets = 1;
-    poolInfo.poolSizeCount = 1;
-    poolInfo.pPoolSizes = &poolSize;
+    poolInfo.maxSets = m_totalFrame;
+    poolInfo.poolSizeCount = UINT32(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
 
-    result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    VkResult result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
     CHECK_VKRESULT( result, "failed to create descriptor pool!" );
 
+    std::vector<VkDescriptorSetLayout> setLayouts( m_totalFrame, m_descSetLayout );
     VkDescriptorSetAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocInfo.descriptorPool = m_descPool;
-    allocInfo.descriptorSetCount = 1;
-    allocInfo.pSetLayouts = &m_descSetLayout;
+    allocInfo.descriptorSetCount = m_totalFrame;
+    allocInfo.pSetLayouts = setLayouts.data();
 
-    result = vkAllocateDescriptorSets( m_device, &allocInfo, &m_descSet );
+    m_descSets.resize( m_totalFrame );
+    result = vkAllocateDescriptorSets( m_device, &allocInfo, m_descSets.data() );
     CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
 }
 
 void App::updateOffscreenDescriptorSet() {
-    VkDescriptorBufferInfo bufferInfo = m_uniformBuffer->getBufferInfo();
-    VkWriteDescriptorSet writeDescSet{};
-    writeDescSet.sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeDescSet.dstBinding      = 0;
-    writeDescSet.descriptorCount = 1;
-    writeDescSet.descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    writeDescSet.dstArrayElement = 0;
-    writeDescSet.dstSet          = m_descSet;
-    writeDescSet.pBufferInfo     = &bufferInfo;
-
-    vkUpdateDescriptorSets( m_device, 1, &writeDescSet, 0, nullptr );
+    for ( uint32_t i = 0; i < m_totalFrame; i++ ) {
+        VkDescriptorBufferInfo bufferInfo = m_uniformBuffers[i]->getBufferInfo();
+        VkWriteDescriptorSet writeDescSet{};
+        writeDescSet.sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescSet.dstBinding      = 0;
+        writeDescSet.descriptorCount = 1;
+        writeDescSet.descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        writeDescSet.dstArrayElement = 0;
+        writeDescSet.dstSet          = m_descSets[i];
+        writeDescSet.pBufferInfo     = &bufferInfo;
+
+        // The lights and the cluster lists the fragment shader loops over
+        VkDescriptorBufferInfo lightInfo    = m_lightBuilder->getLightBufferInfo();
+        VkDescriptorBufferInfo clusterInfo  = m_lightClusters->getClusterBufferInfo();
+        VkWriteDescriptorSet   lightWrite   = writeDescSet;
+        lightWrite.dstBinding     = 1;
+        lightWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        lightWrite.pBufferInfo    = &lightInfo;
+        VkWriteDescriptorSet   clusterWrite = lightWrite;
+        clusterWrite.dstBinding  = 2;
+        clusterWrite.pBufferInfo = &clusterInfo;
+
+        // The TLAS the hybrid mode casts its shadow and occlusion rays against, updated in place every frame
+        VkAccelerationStructureKHR tlas = m_tlasBuilder->getHandle();
+        VkWriteDescriptorSetAccelerationStructureKHR descASInfo{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR };
+        descASInfo.accelerationStructureCount = 1;
+        descASInfo.pAccelerationStructures    = &tlas;
+        VkWriteDescriptorSet tlasWrite = writeDescSet;
+        tlasWrite.dstBinding     = 3;
+        tlasWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+        tlasWrite.pBufferInfo    = nullptr;
+        tlasWrite.pNext          = &descASInfo;
+
+        VkWriteDescriptorSet writes[] = { writeDescSet, lightWrite, clusterWrite, tlasWrite };
+        vkUpdateDescriptorSets( m_device, 4, writes, 0, nullptr );
+    }
+}
+
+void App::createLightClusters() {
+    m_clusterShaders        = { loadShader( "cluster_lights.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) };
+    m_clusterPipelineLayout = m_layoutCache->getPipelineLayout( m_clusterShaders );
+    m_clusterPipeline       = createComputePipeline( "cluster_lights", m_clusterShaders[0], m_clusterPipelineLayout );
+
+    m_lightClusters = new LightClusters( m_device, m_physicalDevice );
+    m_lightClusters->setup( m_layoutCache->getDescriptorSetLayout( m_clusterShaders, 0 ), m_lightBuilder );
+
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    m_lightClusters->cmdInitialize( cmdBuffer );
+    endSingleTimeCommands( cmdBuffer );
+}
+
+void App::cmdBuildLightClusters( VkCommandBuffer commandBuffer ) {
+    // Same view as the offscreen pass, rebuilt every frame as the camera and the lights may move
+    glm::mat4 proj = m_camera->getProjection( ( float )WIDTH / HEIGHT );
+    ClusterSettings settings;
+    settings.view       = m_camera->getViewMatrix();
+    settings.tanHalfFov = glm::vec2( 1.0f / proj[0][0], 1.0f / std::abs( proj[1][1] ) );
+    settings.zNear      = m_camera->getNear();
+    settings.zFar       = m_camera->getFar();
+    settings.lightCount = m_lightBuilder->getLightCount();
+    m_lightClusters->cmdBuild( commandBuffer, PipelineCompiler::GetIfReady( m_clusterPipeline ), m_clusterPipelineLayout, settings );
 }
 
 void App::createOffscreenPipeline() {
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width  = WIDTH;
-    viewport.height = HEIGHT;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = m_extent;
-
-    VkPipelineViewportStateCreateInfo viewportInfo{};
-    viewportInfo.sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportInfo.viewportCount = 1;
-    viewportInfo.scissorCount  = 1;
-    viewportInfo.pViewports    = &viewport;
-    viewportInfo.pScissors     = &scissor;
-
-    VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo{};
-    inputAssemblyInfo.sType    = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssemblyInfo.primitiveRestartEnable = VK_FALSE;
-    
-    VkPipelineRasterizationStateCreateInfo rasterizationInfo{};
-    rasterizationInfo.sType       = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizationInfo.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizationInfo.cullMode    = VK_CULL_MODE_NONE;
-    rasterizationInfo.frontFace   = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterizationInfo.rasterizerDiscardEnable = VK_FALSE;
-    rasterizationInfo.depthClampEnable        = VK_FALSE;
-    rasterizationInfo.depthBiasEnable         = VK_FALSE;
-    rasterizationInfo.lineWidth               = 1.0f;
-    
-    VkPipelineMultisampleStateCreateInfo multisampleInfo{};
-    multisampleInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampleInfo.rasterizationSamples  = VK_SAMPLE_COUNT_1_BIT;
-    multisampleInfo.sampleShadingEnable   = VK_FALSE;
-    
-    VkPipelineDepthStencilStateCreateInfo depthStencilInfo{};
-    depthStencilInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencilInfo.depthTestEnable        = VK_TRUE;
-    depthStencilInfo.depthWriteEnable       = VK_TRUE;
-    depthStencilInfo.depthBoundsTestEnable  = VK_FALSE;
-    depthStencilInfo.depthCompareOp         = VK_COMPARE_OP_LESS;
-    depthStencilInfo.minDepthBounds         = 0.0f;
-    depthStencilInfo.maxDepthBounds         = 1.0f;
-    depthStencilInfo.stencilTestEnable      = VK_FALSE;
-
-    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-
-    VkPipelineColorBlendStateCreateInfo colorBlendInfo{};
-    colorBlendInfo.sType             = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlendInfo.logicOpEnable     = VK_FALSE;
-    colorBlendInfo.logicOp           = VK_LOGIC_OP_COPY;
-    colorBlendInfo.attachmentCount   = 1;
-    colorBlendInfo.pAttachments      = &colorBlendAttachment;
-
-    Shader* vertexShader = new Shader( m_device, "../shaders/spv/vert.spv", VK_SHADER_STAGE_VERTEX_BIT );
-    Shader* pixelShader = new Shader( m_device, "../shaders/spv/frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT );
-    std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
-    shaderStages.push_back(vertexShader->getShaderStageInfo());
-    shaderStages.push_back(pixelShader->getShaderStageInfo());
-    
+    m_offscreenPipelineLayout = m_layoutCache->getPipelineLayout( m_offscreenShaders );
+    m_offscreenPipeline       = createGraphicsPipeline( "offscreen", m_offscreenShaders, m_offscreenPipelineLayout );
+}
+
+// Meshes drawn into a target of m_offscreenRenderPass, or a render pass compatible with it
+std::shared_future<VkPipeline> App::createGraphicsPipeline( const std::string& name, const std::vector<Shader*>& shaders, VkPipelineLayout pipelineLayout ) {
     VkPipelineVertexInputStateCreateInfo* vertexInputInfo = m_pCube->createVertexInputInfo();
-    
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts    = &m_descSetLayout;
-    
-    VkResult result = vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &m_offscreenPipelineLayout);
-    CHECK_VKRESULT(result, "failed to create pipeline layout!");
-
-    VkGraphicsPipelineCreateInfo pipelineInfo{};
-    pipelineInfo.sType      = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.layout     = m_offscreenPipelineLayout;
-    pipelineInfo.renderPass = m_offscreenRenderPass;
-    pipelineInfo.subpass    = 0;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages             = shaderStages.data();
-    pipelineInfo.pVertexInputState   = vertexInputInfo;
-    pipelineInfo.pViewportState      = &viewportInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
-    pipelineInfo.pRasterizationState = &rasterizationInfo;
-    pipelineInfo.pMultisampleState   = &multisampleInfo;
-    pipelineInfo.pColorBlendState    = &colorBlendInfo;
-    pipelineInfo.pDepthStencilState  = &depthStencilInfo;
-    pipelineInfo.basePipelineHandle  = VK_NULL_HANDLE;
-    
-    result = vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_offscreenPipeline);
-    CHECK_VKRESULT(result, "failed to create graphics pipeline!");
-    
+
+    return m_pipelineCompiler->submit( name, PipelineCompiler::GetKey( name, shaders ), [this, shaders, pipelineLayout, vertexInputInfo]( VkPipelineCache pipelineCache ) {
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width  = WIDTH;
+        viewport.height = HEIGHT;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+
+        VkRect2D scissor{};
+        scissor.offset = {0, 0};
+        scissor.extent = m_extent;
+
+        VkPipelineViewportStateCreateInfo viewportInfo{};
+        viewportInfo.sType         = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportInfo.viewportCount = 1;
+        viewportInfo.scissorCount  = 1;
+        viewportInfo.pViewports    = &viewport;
+        viewportInfo.pScissors     = &scissor;
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo{};
+        inputAssemblyInfo.sType    = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssemblyInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+        inputAssemblyInfo.primitiveRestartEnable = VK_FALSE;
+
+        VkPipelineRasterizationStateCreateInfo rasterizationInfo{};
+        rasterizationInfo.sType       = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizationInfo.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizationInfo.cullMode    = VK_CULL_MODE_NONE;
+        rasterizationInfo.frontFace   = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+        rasterizationInfo.rasterizerDiscardEnable = VK_FALSE;
+        rasterizationInfo.depthClampEnable        = VK_FALSE;
+        rasterizationInfo.depthBiasEnable         = VK_FALSE;
+        rasterizationInfo.lineWidth               = 1.0f;
+
+        VkPipelineMultisampleStateCreateInfo multisampleInfo{};
+        multisampleInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampleInfo.rasterizationSamples  = VK_SAMPLE_COUNT_1_BIT;
+        multisampleInfo.sampleShadingEnable   = VK_FALSE;
+
+        VkPipelineDepthStencilStateCreateInfo depthStencilInfo{};
+        depthStencilInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencilInfo.depthTestEnable        = VK_TRUE;
+        depthStencilInfo.depthWriteEnable       = VK_TRUE;
+        depthStencilInfo.depthBoundsTestEnable  = VK_FALSE;
+        depthStencilInfo.depthCompareOp         = VK_COMPARE_OP_LESS;
+        depthStencilInfo.minDepthBounds         = 0.0f;
+        depthStencilInfo.maxDepthBounds         = 1.0f;
+        depthStencilInfo.stencilTestEnable      = VK_FALSE;
+
+        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+        colorBlendAttachment.blendEnable = VK_FALSE;
+
+        VkPipelineColorBlendStateCreateInfo colorBlendInfo{};
+        colorBlendInfo.sType             = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlendInfo.logicOpEnable     = VK_FALSE;
+        colorBlendInfo.logicOp           = VK_LOGIC_OP_COPY;
+        colorBlendInfo.attachmentCount   = 1;
+        colorBlendInfo.pAttachments      = &colorBlendAttachment;
+
+        std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+        for ( Shader* shader : shaders ) shaderStages.push_back( shader->getShaderStageInfo() );
+
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType      = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout     = pipelineLayout;
+        pipelineInfo.renderPass = m_offscreenRenderPass;
+        pipelineInfo.subpass    = 0;
+        pipelineInfo.stageCount = UINT32(shaderStages.size());
+        pipelineInfo.pStages             = shaderStages.data();
+        pipelineInfo.pVertexInputState   = vertexInputInfo;
+        pipelineInfo.pViewportState      = &viewportInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
+        pipelineInfo.pRasterizationState = &rasterizationInfo;
+        pipelineInfo.pMultisampleState   = &multisampleInfo;
+        pipelineInfo.pColorBlendState    = &colorBlendInfo;
+        pipelineInfo.pDepthStencilState  = &depthStencilInfo;
+        pipelineInfo.basePipelineHandle  = VK_NULL_HANDLE;
+
+        VkPipeline pipeline;
+        VkResult result = vkCreateGraphicsPipelines(m_device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+        CHECK_VKRESULT(result, "failed to create graphics pipeline!");
+        return pipeline;
+    } );
 }
@@ -0,0 +1,148 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "picker.h"
+#include "dispatch.h"
+
+Picker::~Picker() {}
+Picker::Picker( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void Picker::setup( uint32_t frameCount, VkDescriptorSetLayout setLayout, VkAccelerationStructureKHR tlas ) {
+    m_results = new Buffer( m_device, m_physicalDevice );
+    m_results->setup( frameCount * sizeof( PickResult ), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT );
+    m_results->create();
+    m_recorded.assign( frameCount, false );
+    if ( setLayout == VK_NULL_HANDLE ) return;
+
+    std::array<VkDescriptorPoolSize, 2> poolSizes = { {
+        { VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+    } };
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.maxSets       = 1;
+    poolInfo.poolSizeCount = UINT32( poolSizes.size() );
+    poolInfo.pPoolSizes    = poolSizes.data();
+    VkResult result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.descriptorPool     = m_descPool;
+    allocateInfo.descriptorSetCount = 1;
+    allocateInfo.pSetLayouts        = &setLayout;
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, &m_descSet );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    // The TLAS is updated in place, the set is written once
+    VkWriteDescriptorSetAccelerationStructureKHR descASInfo{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR };
+    descASInfo.accelerationStructureCount = 1;
+    descASInfo.pAccelerationStructures    = &tlas;
+    VkDescriptorBufferInfo resultInfo = m_results->getBufferInfo();
+
+    std::array<VkWriteDescriptorSet, 2> writeSets{};
+    for ( uint32_t binding = 0; binding < writeSets.size(); binding++ ) {
+        writeSets[binding].sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeSets[binding].dstSet          = m_descSet;
+        writeSets[binding].dstBinding      = binding;
+        writeSets[binding].descriptorCount = 1;
+    }
+    writeSets[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    writeSets[0].pNext          = &descASInfo;
+    writeSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeSets[1].pBufferInfo    = &resultInfo;
+    vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+}
+
+void Picker::cleanup() {
+    if ( m_results != nullptr ) {
+        m_results->cleanup();
+        delete m_results;
+        m_results = nullptr;
+    }
+    vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    m_descPool = VK_NULL_HANDLE;
+    m_recorded.clear();
+}
+
+uint32_t Picker::pick( const CpuRay& ray ) {
+    m_pending = true;
+    m_ray     = ray;
+    m_request = m_nextRequest++;
+    return m_request;
+}
+
+bool Picker::hasRequest() const { return m_pending; }
+
+bool Picker::cmdPick( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                      const CpuBvh* fallback ) {
+    if ( !m_pending || ( pipeline == VK_NULL_HANDLE && fallback == nullptr ) ) return false;
+    m_pending = false;
+    m_recorded[frameIndex] = true;
+
+    // The slot is only read by collect once this frame's fence signals, like the GPU result
+    if ( pipeline == VK_NULL_HANDLE ) {
+        CpuHit     hit;
+        PickResult pickResult;
+        pickResult.request = m_request;
+        if ( fallback->intersect( m_ray, &hit ) ) {
+            pickResult.position  = m_ray.origin + m_ray.direction * hit.t;
+            pickResult.t         = hit.t;
+            pickResult.instance  = hit.instance;
+            pickResult.primitive = hit.primitive;
+        }
+        m_results->fillBuffer( &pickResult, sizeof( PickResult ), static_cast<int32_t>( frameIndex * sizeof( PickResult ) ) );
+        return true;
+    }
+
+    PickConstants constants;
+    constants.origin    = m_ray.origin;
+    constants.tMin      = m_ray.tMin;
+    constants.direction = m_ray.direction;
+    constants.tMax      = std::min( m_ray.tMax, constants.tMax );
+    constants.slot      = frameIndex;
+    constants.request   = m_request;
+
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &m_descSet, 0, nullptr );
+    vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( PickConstants ), &constants );
+    vkd.CmdDispatch( commandBuffer, 1, 1, 1 );
+
+    // Made visible to the host read of collect
+    VkBufferMemoryBarrier barrier{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+    barrier.srcAccessMask       = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask       = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer              = m_results->getBuffer();
+    barrier.offset              = frameIndex * sizeof( PickResult );
+    barrier.size                = sizeof( PickResult );
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                            0, 0, nullptr, 1, &barrier, 0, nullptr );
+    return true;
+}
+
+bool Picker::collect( uint32_t frameIndex, PickResult* result ) {
+    if ( !m_recorded[frameIndex] ) return false;
+    m_recorded[frameIndex] = false;
+
+    char* data = static_cast<char*>( m_results->mapMemory( m_results->getBufferSize() ) );
+    std::memcpy( result, data + frameIndex * sizeof( PickResult ), sizeof( PickResult ) );
+    m_results->unmapMemory();
+    return true;
+}
+
+CpuRay Picker::GetRay( glm::vec2 cursor, glm::vec2 size, const glm::mat4& viewInverse, const glm::mat4& projInverse ) {
+    glm::vec2 d      = ( glm::floor( cursor ) + 0.5f ) / size * 2.0f - 1.0f;
+    glm::vec4 target = projInverse * glm::vec4( d.x, d.y, 1.0f, 1.0f );
+
+    CpuRay ray;
+    ray.origin    = glm::vec3( viewInverse * glm::vec4( 0.0f, 0.0f, 0.0f, 1.0f ) );
+    ray.direction = glm::normalize( glm::vec3( viewInverse * glm::vec4( glm::normalize( glm::vec3( target ) ), 0.0f ) ) );
+    ray.tMin      = 0.001f;
+    return ray;
+}
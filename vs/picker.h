@@ -0,0 +1,76 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+#include "cpubvh.h"
+
+// Matches PickResult in pick.comp. A miss has instance UINT32_MAX.
+struct PickResult {
+    glm::vec3 position;
+    float     t         = INFINITY;
+    uint32_t  instance  = UINT32_MAX; // custom index of the TLAS instance, the index of its mesh
+    uint32_t  primitive = 0;
+    uint32_t  request   = 0;          // what pick returned for it
+    uint32_t  pad       = 0;
+};
+
+// Push constants of pick.comp
+struct PickConstants {
+    glm::vec3 origin;
+    float     tMin = 0.0f;
+    glm::vec3 direction;
+    float     tMax = 10000.0f;
+    uint32_t  slot    = 0;
+    uint32_t  request = 0;
+};
+
+// Object picking through the TLAS. pick queues one ray, cmdPick records a single thread ray query
+// dispatch that writes the hit into the slot of the frame, and collect reads it back once the fence
+// of that frame has signaled, so a result arrives a frame later without waiting on the GPU. Until
+// pick.comp is compiled, or without it, the ray goes through a CpuBvh instead and waits in the slot all the same.
+class Picker {
+
+public:
+    ~Picker();
+    Picker( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // setLayout is the set 0 layout of pick.comp, VK_NULL_HANDLE without the shader leaves only the CPU path
+    void setup( uint32_t frameCount, VkDescriptorSetLayout setLayout, VkAccelerationStructureKHR tlas );
+    void cleanup();
+
+    // Queues the ray, a later call before the next cmdPick replaces it. Returns the request id of the result.
+    uint32_t pick( const CpuRay& ray );
+    bool     hasRequest() const;
+
+    // Records nothing and returns false without a queued ray. Without the pipeline the queued ray is
+    // traced through fallback right away, without either it stays queued.
+    bool cmdPick( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                  const CpuBvh* fallback );
+
+    // Call after the fence of frameIndex has signaled. Returns false when the frame picked nothing.
+    bool collect( uint32_t frameIndex, PickResult* result );
+
+    // The primary ray raytrace.rgen traces through the center of the cursor's pixel, cursor and size
+    // in pixels of the render target
+    static CpuRay GetRay( glm::vec2 cursor, glm::vec2 size, const glm::mat4& viewInverse, const glm::mat4& projInverse );
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    Buffer*           m_results = nullptr; // one PickResult per frame, host visible
+    std::vector<bool> m_recorded;
+
+    bool     m_pending     = false;
+    CpuRay   m_ray;
+    uint32_t m_request     = 0;
+    uint32_t m_nextRequest = 1;
+
+    VkDescriptorPool m_descPool = VK_NULL_HANDLE;
+    VkDescriptorSet  m_descSet  = VK_NULL_HANDLE;
+
+};
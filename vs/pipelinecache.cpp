@@ -0,0 +1,130 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include "pipelinecache.h"
+
+#define PIPELINE_CACHE_MAGIC 0x43505356 // "VSPC"
+
+PipelineCache::~PipelineCache() {}
+PipelineCache::PipelineCache( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void PipelineCache::cleanup() {
+    LOG( "PipelineCache::cleanup" );
+    vkDestroyPipelineCache( m_device, m_pipelineCache, nullptr );
+}
+
+void PipelineCache::load( const std::string directory ) {
+    FileHeader deviceHeader = getDeviceHeader();
+
+    std::stringstream filename;
+    filename << directory << "/pipeline_" << std::hex << std::setfill( '0' );
+    for ( uint32_t i = 0; i < VK_UUID_SIZE; i++ ) filename << std::setw( 2 ) << UINT32( deviceHeader.uuid[i] );
+    filename << "_" << std::setw( 8 ) << deviceHeader.driverVersion << ".bin";
+    m_filepath = filename.str();
+
+    std::vector<char> data;
+    std::ifstream file( m_filepath, std::ios::ate | std::ios::binary );
+    if ( file.is_open() ) {
+        size_t fileSize = ( size_t )file.tellg();
+        FileHeader header{};
+        if ( fileSize > sizeof( FileHeader ) ) {
+            file.seekg( 0 );
+            file.read( reinterpret_cast< char* >( &header ), sizeof( FileHeader ) );
+        }
+        bool valid = header.magic         == deviceHeader.magic    &&
+                     header.vendorID      == deviceHeader.vendorID &&
+                     header.deviceID      == deviceHeader.deviceID &&
+                     header.driverVersion == deviceHeader.driverVersion &&
+                     memcmp( header.uuid, deviceHeader.uuid, VK_UUID_SIZE ) == 0 &&
+                     header.dataSize      == fileSize - sizeof( FileHeader );
+        if ( valid ) {
+            data.resize( header.dataSize );
+            file.read( data.data(), header.dataSize );
+        }
+        LOG( "PipelineCache::load " << m_filepath << ( valid ? " hit " : " stale " ) << data.size() << " bytes" );
+        file.close();
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo{ VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+    cacheInfo.initialDataSize = data.size();
+    cacheInfo.pInitialData    = data.empty() ? nullptr : data.data();
+
+    VkResult result = vkCreatePipelineCache( m_device, &cacheInfo, nullptr, &m_pipelineCache );
+    if ( result != VK_SUCCESS && !data.empty() ) {
+        // Driver refused the blob, start from an empty cache instead
+        cacheInfo.initialDataSize = 0;
+        cacheInfo.pInitialData    = nullptr;
+        result = vkCreatePipelineCache( m_device, &cacheInfo, nullptr, &m_pipelineCache );
+    }
+    CHECK_VKRESULT( result, "failed to create pipeline cache!" );
+}
+
+void PipelineCache::save() {
+    LOG( "PipelineCache::save total pipeline creation " << m_totalCreationTime << " ms" );
+    if ( m_pipelineCache == VK_NULL_HANDLE || m_filepath.empty() ) return;
+
+    size_t dataSize = 0;
+    VkResult result = vkGetPipelineCacheData( m_device, m_pipelineCache, &dataSize, nullptr );
+    if ( result != VK_SUCCESS || dataSize == 0 ) return;
+
+    std::vector<char> data( dataSize );
+    result = vkGetPipelineCacheData( m_device, m_pipelineCache, &dataSize, data.data() );
+    if ( result != VK_SUCCESS ) return;
+
+    FileHeader header = getDeviceHeader();
+    header.dataSize   = dataSize;
+
+    // Write next to the target and rename over it, a crash never leaves a truncated cache behind
+    std::filesystem::path filepath( m_filepath );
+    std::filesystem::path temppath( m_filepath + ".tmp" );
+    std::error_code error;
+    std::filesystem::create_directories( filepath.parent_path(), error );
+
+    std::ofstream file( temppath, std::ios::binary | std::ios::trunc );
+    if ( !file.is_open() ) return;
+    file.write( reinterpret_cast< const char* >( &header ), sizeof( FileHeader ) );
+    file.write( data.data(), dataSize );
+    file.close();
+    if ( file.fail() ) {
+        std::filesystem::remove( temppath, error );
+        return;
+    }
+
+    std::filesystem::rename( temppath, filepath, error );
+    if ( error ) std::filesystem::remove( temppath, error );
+}
+
+void PipelineCache::recordCreationTime( const std::string name, std::chrono::high_resolution_clock::time_point start ) {
+    auto   end      = std::chrono::high_resolution_clock::now();
+    double duration = std::chrono::duration<double, std::milli>( end - start ).count();
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_totalCreationTime += duration;
+    LOG( "PipelineCache::" << name << " pipeline created in " << duration << " ms" );
+}
+
+VkPipelineCache PipelineCache::getPipelineCache() { return m_pipelineCache; }
+
+
+// Private ==================================================
+
+
+PipelineCache::FileHeader PipelineCache::getDeviceHeader() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties( m_physicalDevice, &properties );
+
+    FileHeader header{};
+    header.magic         = PIPELINE_CACHE_MAGIC;
+    header.vendorID      = properties.vendorID;
+    header.deviceID      = properties.deviceID;
+    header.driverVersion = properties.driverVersion;
+    memcpy( header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE );
+    return header;
+}
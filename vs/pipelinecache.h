@@ -0,0 +1,47 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+
+#include "common.h"
+
+class PipelineCache {
+
+public:
+    ~PipelineCache();
+    PipelineCache( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    void cleanup();
+    void load( const std::string directory );
+    void save();
+
+    void recordCreationTime( const std::string name, std::chrono::high_resolution_clock::time_point start );
+
+    VkPipelineCache getPipelineCache();
+
+private:
+
+    // Written in front of the driver blob, the file is only reused on the exact same device and driver
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t  uuid[VK_UUID_SIZE];
+        uint64_t dataSize;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+    VkPipelineCache  m_pipelineCache  = VK_NULL_HANDLE;
+
+    std::string m_filepath;
+    std::mutex  m_mutex;
+    double      m_totalCreationTime = 0.0;
+
+    FileHeader getDeviceHeader();
+
+};
@@ -0,0 +1,72 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include "pipelinecompiler.h"
+#include "helper.h"
+
+PipelineCompiler::~PipelineCompiler() {}
+PipelineCompiler::PipelineCompiler( VkDevice device, PipelineCache* pipelineCache, JobSystem* jobSystem ) :
+    m_device( device ),
+    m_pipelineCache( pipelineCache ),
+    m_jobSystem( jobSystem ) {}
+
+void PipelineCompiler::cleanup() {
+    LOG( "PipelineCompiler::cleanup" );
+    waitIdle();
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for ( std::shared_future<VkPipeline>& pipeline : m_pipelines ) {
+        try {
+            vkDestroyPipeline( m_device, pipeline.get(), nullptr );
+        } catch ( const std::exception& e ) {
+            LOG( "PipelineCompiler::cleanup skipped failed pipeline " << e.what() );
+        }
+    }
+    m_pipelines.clear();
+    m_pipelineKeys.clear();
+}
+
+void PipelineCompiler::waitIdle() {
+    std::vector<std::shared_future<VkPipeline>> pipelines;
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        pipelines = m_pipelines;
+    }
+    for ( std::shared_future<VkPipeline>& pipeline : pipelines ) pipeline.wait();
+}
+
+std::shared_future<VkPipeline> PipelineCompiler::submit( const std::string name, uint64_t key, Job job ) {
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        auto found = m_pipelineKeys.find( key );
+        if ( found != m_pipelineKeys.end() ) return found->second;
+    }
+
+    PipelineCache* pipelineCache = m_pipelineCache;
+    std::shared_future<VkPipeline> pipeline = m_jobSystem->submit( [name, job, pipelineCache]() {
+        auto start = std::chrono::high_resolution_clock::now();
+        VkPipeline result = job( pipelineCache->getPipelineCache() );
+        pipelineCache->recordCreationTime( name, start );
+        return result;
+    } ).share();
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_pipelines.push_back( pipeline );
+    m_pipelineKeys[key] = pipeline;
+    return pipeline;
+}
+
+uint64_t PipelineCompiler::GetKey( const std::string name, const std::vector<Shader*>& shaders, uint64_t variant ) {
+    uint64_t key = HashBytes( name.data(), name.size() );
+    key = HashBytes( &variant, sizeof( variant ), key );
+    for ( Shader* shader : shaders ) {
+        uint64_t hash = shader->getHash();
+        key = HashBytes( &hash, sizeof( hash ), key );
+    }
+    return key;
+}
+
+VkPipeline PipelineCompiler::GetIfReady( const std::shared_future<VkPipeline>& pipeline, VkPipeline fallback ) {
+    if ( !pipeline.valid() ) return fallback;
+    if ( pipeline.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready ) return fallback;
+    return pipeline.get();
+}
@@ -0,0 +1,42 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "jobs.h"
+#include "pipelinecache.h"
+#include "shader.h"
+
+class PipelineCompiler {
+
+public:
+    typedef std::function<VkPipeline( VkPipelineCache )> Job;
+
+    ~PipelineCompiler();
+    PipelineCompiler( VkDevice device, PipelineCache* pipelineCache, JobSystem* jobSystem );
+
+    void cleanup();
+    void waitIdle();
+
+    // The compiler owns every pipeline it returns, they are destroyed in cleanup().
+    // Submitting a key again returns the pipeline already compiled or in flight.
+    std::shared_future<VkPipeline> submit( const std::string name, uint64_t key, Job job );
+
+    // Content hash of the shaders plus the variant, identical SPIR-V gives the same key across runs
+    static uint64_t GetKey( const std::string name, const std::vector<Shader*>& shaders, uint64_t variant = 0 );
+
+    // Non-blocking, returns the fallback until the pipeline has finished compiling
+    static VkPipeline GetIfReady( const std::shared_future<VkPipeline>& pipeline, VkPipeline fallback = VK_NULL_HANDLE );
+
+private:
+
+    VkDevice       m_device        = VK_NULL_HANDLE;
+    PipelineCache* m_pipelineCache = nullptr;
+    JobSystem*     m_jobSystem     = nullptr;
+
+    std::mutex m_mutex;
+    std::vector<std::shared_future<VkPipeline>> m_pipelines;
+    std::map<uint64_t, std::shared_future<VkPipeline>> m_pipelineKeys;
+
+};
@@ -0,0 +1,174 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "sbtbuilder.h"
+#include "accelstructure.h"
+#include "dispatch.h"
+
+SbtBuilder::~SbtBuilder() {}
+SbtBuilder::SbtBuilder( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rtProperties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR };
+    VkPhysicalDeviceProperties2 properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+    properties2.pNext = &rtProperties;
+    vkGetPhysicalDeviceProperties2( m_physicalDevice, &properties2 );
+    m_handleSize      = rtProperties.shaderGroupHandleSize;
+    m_handleAlignment = rtProperties.shaderGroupHandleAlignment;
+    m_baseAlignment   = rtProperties.shaderGroupBaseAlignment;
+}
+
+void SbtBuilder::setup( uint32_t frameCount ) {
+    m_retired.resize( frameCount );
+}
+
+void SbtBuilder::cleanup() {
+    if ( m_buffer != nullptr ) {
+        m_buffer->cleanup();
+        delete m_buffer;
+    }
+    m_buffer = nullptr;
+    for ( uint32_t i = 0; i < m_retired.size(); i++ ) releaseFrame( i );
+    m_retired.clear();
+}
+
+uint32_t SbtBuilder::addRecord( SbtRegion region, uint32_t group, const void* data, uint32_t dataSize ) {
+    Record record;
+    record.group = group;
+    record.data.resize( dataSize );
+    if ( data != nullptr ) memcpy( record.data.data(), data, dataSize );
+    record.dirty = true;
+    m_records[region].push_back( record );
+    return UINT32( m_records[region].size() - 1 );
+}
+
+void SbtBuilder::setRecordData( SbtRegion region, uint32_t record, const void* data, uint32_t dataSize ) {
+    Record& target = m_records[region][record];
+    if ( dataSize > target.data.size() ) RUNTIME_ERROR( "shader record data does not fit its stride!" );
+    if ( memcmp( target.data.data(), data, dataSize ) == 0 ) return;
+
+    memcpy( target.data.data(), data, dataSize );
+    target.dirty = true;
+    m_dirty      = true;
+    if ( m_buffer != nullptr ) writeRecord( region, record );
+}
+
+void SbtBuilder::beginFrame( uint32_t frameIndex ) {
+    m_frameIndex = frameIndex % m_retired.size();
+    releaseFrame( m_frameIndex );
+}
+
+void SbtBuilder::create( VkPipeline pipeline ) {
+    // Frames in flight keep tracing with the old table
+    if ( m_buffer != nullptr ) m_retired[m_frameIndex].push_back( m_buffer );
+    m_buffer = nullptr;
+
+    uint32_t groupCount = 0;
+    for ( const std::vector<Record>& records : m_records )
+        for ( const Record& record : records ) groupCount = std::max( groupCount, record.group + 1 );
+
+    m_handles.resize( groupCount * m_handleSize );
+    VkResult result = vkd.GetRayTracingShaderGroupHandlesKHR( m_device, pipeline, 0, groupCount, m_handles.size(), m_handles.data() );
+    CHECK_VKRESULT( result, "failed to get shader group handles!" );
+
+    // Regions start at the base alignment, records inside a region only need the handle alignment
+    VkDeviceSize tableSize = 0;
+    for ( uint32_t region = 0; region < SBT_REGION_COUNT; region++ ) {
+        size_t dataSize = 0;
+        for ( const Record& record : m_records[region] ) dataSize = std::max( dataSize, record.data.size() );
+
+        // vkCmdUpdateBuffer writes whole records and wants a multiple of 4
+        VkDeviceSize stride = AlignUp( m_handleSize + dataSize, std::max( m_handleAlignment, 4u ) );
+        m_offsets[region]   = AlignUp( tableSize, m_baseAlignment );
+        m_regions[region]   = { 0, stride, stride * m_records[region].size() };
+        tableSize           = m_offsets[region] + m_regions[region].size;
+    }
+    // The raygen region holds exactly one record
+    if ( m_records[SBT_RAYGEN].size() != 1 ) RUNTIME_ERROR( "shader binding table needs exactly one raygen record!" );
+
+    m_buffer = new Buffer( m_device, m_physicalDevice );
+    m_buffer->setup( tableSize + m_baseAlignment, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                                                  VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                                                  VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_buffer->create();
+
+    VkDeviceAddress address = m_buffer->getDeviceAddress();
+    VkDeviceAddress base    = AlignUp( address, m_baseAlignment );
+    m_table.assign( base - address + tableSize, 0 );
+    for ( uint32_t region = 0; region < SBT_REGION_COUNT; region++ ) {
+        m_offsets[region] += base - address;
+        if ( m_records[region].empty() ) {
+            m_regions[region] = {};
+            continue;
+        }
+        m_regions[region].deviceAddress = address + m_offsets[region];
+        for ( uint32_t record = 0; record < m_records[region].size(); record++ ) {
+            writeRecord( SbtRegion( region ), record );
+            m_records[region][record].dirty = true;
+        }
+    }
+    m_dirty = true;
+    LOG( "SbtBuilder::create " << tableSize << " bytes, " << groupCount << " groups" );
+}
+
+void SbtBuilder::cmdUpdate( VkCommandBuffer commandBuffer ) {
+    if ( !m_dirty || m_buffer == nullptr ) return;
+
+    // Earlier frames may still read the table
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 0, nullptr, 0, nullptr, 0, nullptr );
+
+    // Neighbouring dirty records are merged into one update
+    VkDeviceSize begin = 0;
+    VkDeviceSize end   = 0;
+    auto flush = [&]() {
+        for ( VkDeviceSize offset = begin; offset < end; offset += 65536 ) {
+            VkDeviceSize chunk = std::min<VkDeviceSize>( 65536, end - offset );
+            vkd.CmdUpdateBuffer( commandBuffer, m_buffer->getBuffer(), offset, chunk, m_table.data() + offset );
+        }
+        begin = end = 0;
+    };
+    for ( uint32_t region = 0; region < SBT_REGION_COUNT; region++ ) {
+        for ( uint32_t index = 0; index < m_records[region].size(); index++ ) {
+            Record& record = m_records[region][index];
+            if ( !record.dirty ) continue;
+            record.dirty = false;
+
+            VkDeviceSize offset = m_offsets[region] + index * m_regions[region].stride;
+            if ( offset != end ) flush();
+            if ( begin == end ) begin = offset;
+            end = offset + m_regions[region].stride;
+        }
+    }
+    flush();
+    m_dirty = false;
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+}
+
+const VkStridedDeviceAddressRegionKHR* SbtBuilder::getRegion( SbtRegion region ) { return &m_regions[region]; }
+
+// Private ==================================================
+
+void SbtBuilder::writeRecord( SbtRegion region, uint32_t record ) {
+    const Record& source = m_records[region][record];
+    uint8_t*      target = m_table.data() + m_offsets[region] + record * m_regions[region].stride;
+    memcpy( target, m_handles.data() + source.group * m_handleSize, m_handleSize );
+    if ( !source.data.empty() ) memcpy( target + m_handleSize, source.data.data(), source.data.size() );
+}
+
+void SbtBuilder::releaseFrame( uint32_t frameIndex ) {
+    for ( Buffer* buffer : m_retired[frameIndex] ) {
+        buffer->cleanup();
+        delete buffer;
+    }
+    m_retired[frameIndex].clear();
+}
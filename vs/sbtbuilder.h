@@ -0,0 +1,69 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+
+enum SbtRegion { SBT_RAYGEN, SBT_MISS, SBT_HIT, SBT_CALLABLE, SBT_REGION_COUNT };
+
+// Lays out the shader binding table as one region per group kind. Every record is a group handle
+// followed by optional inline data, the stride of a region fits its largest record.
+class SbtBuilder {
+
+public:
+    ~SbtBuilder();
+    SbtBuilder( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // frameCount frames in flight may still trace with a table create replaced
+    void setup( uint32_t frameCount );
+    void cleanup();
+
+    // Returns the index of the record in its region, for hit records that is the
+    // instanceShaderBindingTableRecordOffset (plus the geometry index for per-geometry records)
+    uint32_t addRecord( SbtRegion region, uint32_t group, const void* data = nullptr, uint32_t dataSize = 0 );
+    // dataSize can not grow past the size the record was added with
+    void setRecordData( SbtRegion region, uint32_t record, const void* data, uint32_t dataSize );
+
+    // The fence of frameIndex has signaled, the tables replaced while recording it are destroyed
+    void beginFrame( uint32_t frameIndex );
+    // Reads the group handles and creates the table, every record is uploaded by the next cmdUpdate.
+    // A pipeline variant calls it again, the old table is kept until its frame comes round.
+    void create( VkPipeline pipeline );
+    // Uploads the records changed since the last call, nothing is recorded when none changed
+    void cmdUpdate( VkCommandBuffer commandBuffer );
+
+    const VkStridedDeviceAddressRegionKHR* getRegion( SbtRegion region );
+
+private:
+
+    struct Record {
+        uint32_t             group;
+        std::vector<uint8_t> data;
+        bool                 dirty;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    uint32_t m_handleSize      = 0;
+    uint32_t m_handleAlignment = 0;
+    uint32_t m_baseAlignment   = 0;
+
+    std::array<std::vector<Record>, SBT_REGION_COUNT>            m_records;
+    std::array<VkDeviceSize, SBT_REGION_COUNT>                   m_offsets{};
+    std::array<VkStridedDeviceAddressRegionKHR, SBT_REGION_COUNT> m_regions{};
+
+    std::vector<uint8_t> m_handles;
+    std::vector<uint8_t> m_table;
+    Buffer*              m_buffer = nullptr;
+    bool                 m_dirty  = false;
+
+    std::vector<std::vector<Buffer*>> m_retired; // replaced while recording each frame
+    uint32_t                          m_frameIndex = 0;
+
+    void writeRecord( SbtRegion region, uint32_t record );
+    void releaseFrame( uint32_t frameIndex );
+
+};
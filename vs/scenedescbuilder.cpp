@@ -0,0 +1,160 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "scenedescbuilder.h"
+#include "dispatch.h"
+
+static_assert( sizeof( WaveFrontMaterial ) == 80, "WaveFrontMaterial must match wavefront.glsl" );
+static_assert( sizeof( SceneDesc ) == 168, "SceneDesc must match wavefront.glsl" );
+
+// Stages that read the SceneDesc buffer, the hit shaders, the integrator and the raster passes
+static const VkPipelineStageFlags SCENE_DESC_READ_STAGES =
+    VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+    VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+SceneDescBuilder::~SceneDescBuilder() {}
+SceneDescBuilder::SceneDescBuilder( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void SceneDescBuilder::setup( uint32_t instanceCount, uint32_t frameCount ) {
+    m_descs.assign( instanceCount, SceneDesc() );
+    m_objects.assign( instanceCount, Object() );
+    for ( uint32_t i = 0; i < instanceCount; i++ ) {
+        m_descs[i].transfo   = glm::mat4( 1.0f );
+        m_descs[i].transfoIT = glm::mat4( 1.0f );
+        m_descs[i].objId     = static_cast<int32_t>( i );
+    }
+    m_dirtyBegin = 0;
+    m_dirtyEnd   = instanceCount;
+
+    m_descBuffer = new Buffer( m_device, m_physicalDevice );
+    m_descBuffer->setup( std::max( instanceCount, 1u ) * sizeof( SceneDesc ),
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_descBuffer->create();
+
+    m_staging = new StagingRing( m_device, m_physicalDevice );
+    m_staging->setup( frameCount );
+}
+
+void SceneDescBuilder::cleanup() {
+    if ( m_staging != nullptr ) {
+        m_staging->cleanup();
+        delete m_staging;
+        m_staging = nullptr;
+    }
+    for ( Object& object : m_objects ) releaseObject( object );
+    m_objects.clear();
+    m_descs.clear();
+    if ( m_descBuffer != nullptr ) {
+        m_descBuffer->cleanup();
+        delete m_descBuffer;
+        m_descBuffer = nullptr;
+    }
+}
+
+void SceneDescBuilder::setObject( uint32_t index, Mesh* mesh, const std::vector<WaveFrontMaterial>& materials,
+                                  const std::vector<int32_t>& matIndices, int32_t txtOffset ) {
+    if ( index >= m_descs.size() ) RUNTIME_ERROR( "instance index out of range!" );
+    if ( materials.empty() ) RUNTIME_ERROR( "an object needs at least one material!" );
+    uint32_t triangleCount = mesh->getIndexCount() / 3;
+    if ( !matIndices.empty() && matIndices.size() != triangleCount ) RUNTIME_ERROR( "one material index per triangle!" );
+
+    Object& object = m_objects[index];
+    releaseObject( object );
+
+    object.materials = new Buffer( m_device, m_physicalDevice );
+    object.materials->setup( materials.size() * sizeof( WaveFrontMaterial ),
+                             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT );
+    object.materials->create();
+    object.materials->fillBufferFull( materials.data() );
+
+    std::vector<int32_t> indices = matIndices;
+    indices.resize( std::max( triangleCount, 1u ), 0 );
+    object.matIndices = new Buffer( m_device, m_physicalDevice );
+    object.matIndices->setup( indices.size() * sizeof( int32_t ),
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT );
+    object.matIndices->create();
+    object.matIndices->fillBufferFull( indices.data() );
+
+    SceneDesc& desc           = m_descs[index];
+    desc.txtOffset            = txtOffset;
+    desc.vertexAddress        = mesh->m_vertexBuffer->getDeviceAddress();
+    desc.indexAddress         = mesh->m_indexBuffer->getDeviceAddress();
+    desc.materialAddress      = object.materials->getDeviceAddress();
+    desc.materialIndexAddress = object.matIndices->getDeviceAddress();
+    markDirty( index );
+}
+
+void SceneDescBuilder::setTransform( uint32_t index, const glm::mat4& transform ) {
+    if ( index >= m_descs.size() ) RUNTIME_ERROR( "instance index out of range!" );
+    // Unchanged matrices keep the frame clean, a static scene uploads nothing
+    SceneDesc& desc = m_descs[index];
+    if ( memcmp( &desc.transfo, &transform, sizeof( glm::mat4 ) ) == 0 ) return;
+
+    desc.transfo   = transform;
+    desc.transfoIT = glm::transpose( glm::inverse( transform ) );
+    markDirty( index );
+}
+
+bool SceneDescBuilder::cmdUpload( VkCommandBuffer commandBuffer, uint32_t frameIndex ) {
+    // The fence of this frame has signaled, its staging memory is free again
+    m_staging->beginFrame( frameIndex );
+    if ( m_dirtyBegin >= m_dirtyEnd ) return false;
+
+    // The previous frame may still be reading the descriptors the upload overwrites
+    vkd.CmdPipelineBarrier( commandBuffer, SCENE_DESC_READ_STAGES, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 0, nullptr, 0, nullptr, 0, nullptr );
+
+    VkDeviceSize offset = m_dirtyBegin * sizeof( SceneDesc );
+    VkDeviceSize size   = ( m_dirtyEnd - m_dirtyBegin ) * sizeof( SceneDesc );
+    const uint8_t* data = reinterpret_cast<const uint8_t*>( m_descs.data() ) + offset;
+    if ( size <= SCENE_DESC_INLINE_UPLOAD ) {
+        // vkCmdUpdateBuffer takes 65536 bytes at most, SceneDesc keeps every chunk 4 byte aligned
+        for ( VkDeviceSize chunk = 0; chunk < size; chunk += 65536 ) {
+            VkDeviceSize chunkSize = std::min<VkDeviceSize>( 65536, size - chunk );
+            vkd.CmdUpdateBuffer( commandBuffer, m_descBuffer->getBuffer(), offset + chunk, chunkSize, data + chunk );
+        }
+    }
+    else {
+        StagingRegion staging = m_staging->write( data, size );
+        VkBufferCopy  region{ staging.offset, offset, size };
+        vkd.CmdCopyBuffer( commandBuffer, staging.buffer, m_descBuffer->getBuffer(), 1, &region );
+    }
+    m_dirtyBegin = m_dirtyEnd = 0;
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, SCENE_DESC_READ_STAGES,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+    return true;
+}
+
+VkDescriptorBufferInfo SceneDescBuilder::getBufferInfo() { return m_descBuffer->getBufferInfo(); }
+uint32_t               SceneDescBuilder::getInstanceCount() { return UINT32( m_descs.size() ); }
+
+// Private ==================================================
+
+void SceneDescBuilder::markDirty( uint32_t index ) {
+    if ( m_dirtyBegin >= m_dirtyEnd ) {
+        m_dirtyBegin = index;
+        m_dirtyEnd   = index + 1;
+        return;
+    }
+    m_dirtyBegin = std::min( m_dirtyBegin, index );
+    m_dirtyEnd   = std::max( m_dirtyEnd, index + 1 );
+}
+
+void SceneDescBuilder::releaseObject( Object& object ) {
+    for ( Buffer* buffer : { object.materials, object.matIndices } ) {
+        if ( buffer == nullptr ) continue;
+        buffer->cleanup();
+        delete buffer;
+    }
+    object = Object();
+}
@@ -0,0 +1,89 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+#include "stagingring.h"
+#include "mesh.h"
+
+// Dirty ranges up to this size are recorded inline with vkCmdUpdateBuffer, larger ones go through staging
+#define SCENE_DESC_INLINE_UPLOAD ( 64 * 1024 )
+
+// Matches WaveFrontMaterial in wavefront.glsl. A negative textureId samples no texture.
+struct WaveFrontMaterial {
+    glm::vec3 ambient       = glm::vec3( 0.0f );
+    glm::vec3 diffuse       = glm::vec3( 0.7f );
+    glm::vec3 specular      = glm::vec3( 0.3f );
+    glm::vec3 transmittance = glm::vec3( 0.0f );
+    glm::vec3 emission      = glm::vec3( 0.0f );
+    float     shininess     = 32.0f;
+    float     ior           = 1.0f;
+    float     dissolve      = 1.0f;
+    int32_t   illum         = 2;
+    int32_t   textureId     = -1;
+};
+
+// Matches SceneDesc in wavefront.glsl, the shaders index it with the custom index of the instance
+struct SceneDesc {
+    glm::mat4       transfo;
+    glm::mat4       transfoIT;
+    int32_t         objId;
+    int32_t         txtOffset;
+    VkDeviceAddress vertexAddress;
+    VkDeviceAddress indexAddress;
+    VkDeviceAddress materialAddress;
+    VkDeviceAddress materialIndexAddress;
+};
+
+// Packs one SceneDesc per instance from the device addresses of its mesh and material buffers into a
+// device local storage buffer, bound once at set 1 binding 1. Only the descriptors changed on the host
+// are uploaded, a moving instance rewrites its two matrices.
+class SceneDescBuilder {
+
+public:
+    ~SceneDescBuilder();
+    SceneDescBuilder( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    void setup( uint32_t instanceCount, uint32_t frameCount );
+    void cleanup();
+
+    // The vertex and index buffers of the mesh have to exist. matIndices holds the material of each
+    // triangle, empty when every triangle uses the first one. Replacing an object needs the device
+    // idle, its previous material buffers are released at once.
+    void setObject( uint32_t index, Mesh* mesh, const std::vector<WaveFrontMaterial>& materials,
+                    const std::vector<int32_t>& matIndices = {}, int32_t txtOffset = 0 );
+    void setTransform( uint32_t index, const glm::mat4& transform );
+
+    // Records the upload of the changed descriptors. Returns false and records nothing when none changed.
+    bool cmdUpload( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+
+    VkDescriptorBufferInfo getBufferInfo();
+    uint32_t               getInstanceCount();
+
+private:
+
+    // Material buffers of one instance, their addresses go into its SceneDesc
+    struct Object {
+        Buffer* materials  = nullptr;
+        Buffer* matIndices = nullptr;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    std::vector<SceneDesc> m_descs;
+    std::vector<Object>    m_objects;
+    Buffer*                m_descBuffer = nullptr;
+
+    // Descriptors [m_dirtyBegin, m_dirtyEnd) differ from the device copy
+    uint32_t m_dirtyBegin = 0;
+    uint32_t m_dirtyEnd   = 0;
+
+    StagingRing* m_staging = nullptr;
+
+    void markDirty( uint32_t index );
+    void releaseObject( Object& object );
+
+};
@@ -1,6 +1,103 @@
 #include "shader.h"
 #include "helper.h"
 
+#include <algorithm>
+
+// Subset of the SPIR-V specification needed to reflect descriptor bindings,
+// push constant blocks and specialization constants
+enum SpirvOp {
+    SPIRV_OP_TYPE_BOOL          = 20,
+    SPIRV_OP_TYPE_INT           = 21,
+    SPIRV_OP_TYPE_FLOAT         = 22,
+    SPIRV_OP_TYPE_VECTOR        = 23,
+    SPIRV_OP_TYPE_MATRIX        = 24,
+    SPIRV_OP_TYPE_IMAGE         = 25,
+    SPIRV_OP_TYPE_SAMPLER       = 26,
+    SPIRV_OP_TYPE_SAMPLED_IMAGE = 27,
+    SPIRV_OP_TYPE_ARRAY         = 28,
+    SPIRV_OP_TYPE_RUNTIME_ARRAY = 29,
+    SPIRV_OP_TYPE_STRUCT        = 30,
+    SPIRV_OP_TYPE_POINTER       = 32,
+    SPIRV_OP_CONSTANT           = 43,
+    SPIRV_OP_SPEC_CONSTANT_TRUE  = 48,
+    SPIRV_OP_SPEC_CONSTANT_FALSE = 49,
+    SPIRV_OP_SPEC_CONSTANT       = 50,
+    SPIRV_OP_VARIABLE           = 59,
+    SPIRV_OP_DECORATE           = 71,
+    SPIRV_OP_MEMBER_DECORATE    = 72,
+    SPIRV_OP_TYPE_ACCELERATION_STRUCTURE = 5341,
+};
+
+enum SpirvDecoration {
+    SPIRV_DECORATION_SPEC_ID        = 1,
+    SPIRV_DECORATION_BLOCK          = 2,
+    SPIRV_DECORATION_BUFFER_BLOCK   = 3,
+    SPIRV_DECORATION_ARRAY_STRIDE   = 6,
+    SPIRV_DECORATION_MATRIX_STRIDE  = 7,
+    SPIRV_DECORATION_BINDING        = 33,
+    SPIRV_DECORATION_DESCRIPTOR_SET = 34,
+    SPIRV_DECORATION_OFFSET         = 35,
+};
+
+enum SpirvStorageClass {
+    SPIRV_STORAGE_UNIFORM_CONSTANT = 0,
+    SPIRV_STORAGE_UNIFORM          = 2,
+    SPIRV_STORAGE_PUSH_CONSTANT    = 9,
+    SPIRV_STORAGE_STORAGE_BUFFER   = 12,
+};
+
+#define SPIRV_MAGIC       0x07230203
+#define SPIRV_DIM_BUFFER  5
+#define SPIRV_DIM_SUBPASS 6
+
+struct SpirvId {
+    uint32_t opcode       = 0;
+    uint32_t typeId       = 0;
+    uint32_t storageClass = 0;
+    uint32_t value        = 0;
+    uint32_t sampled      = 0;
+    uint32_t set          = UINT32_MAX;
+    uint32_t binding      = UINT32_MAX;
+    uint32_t specId       = UINT32_MAX;
+    uint32_t arrayStride  = 0;
+    bool     bufferBlock  = false;
+    std::vector<uint32_t> members;
+    std::vector<uint32_t> memberOffsets;
+    std::vector<uint32_t> memberMatrixStrides;
+};
+
+static uint32_t GetSpirvTypeSize(const std::vector<SpirvId>& ids, uint32_t typeId) {
+    const SpirvId& type = ids[typeId];
+    switch (type.opcode) {
+    case SPIRV_OP_TYPE_BOOL:
+        return 4;
+    case SPIRV_OP_TYPE_INT:
+    case SPIRV_OP_TYPE_FLOAT:
+        return type.value / 8;
+    case SPIRV_OP_TYPE_VECTOR:
+    case SPIRV_OP_TYPE_MATRIX:
+        return type.value * GetSpirvTypeSize(ids, type.typeId);
+    case SPIRV_OP_TYPE_ARRAY: {
+        uint32_t stride = type.arrayStride ? type.arrayStride : GetSpirvTypeSize(ids, type.typeId);
+        return ids[type.value].value * stride;
+    }
+    case SPIRV_OP_TYPE_STRUCT: {
+        uint32_t size = 0;
+        for (size_t i = 0; i < type.members.size(); i++) {
+            const SpirvId& member = ids[type.members[i]];
+            uint32_t offset = i < type.memberOffsets.size() ? type.memberOffsets[i] : 0;
+            uint32_t stride = i < type.memberMatrixStrides.size() ? type.memberMatrixStrides[i] : 0;
+            uint32_t memberSize = member.opcode == SPIRV_OP_TYPE_MATRIX && stride > 0 ?
+                member.value * stride : GetSpirvTypeSize(ids, type.members[i]);
+            size = std::max(size, offset + memberSize);
+        }
+        return size;
+    }
+    default:
+        return 0;
+    }
+}
+
 Shader::~Shader() {}
 Shader::Shader() {}
 
@@ -8,25 +105,209 @@ Shader::Shader(VkDevice device, const std::string filepath, VkShaderStageFlagBit
     m_device = device;
     m_filepath = filepath;
     auto code = ReadBinaryFile(filepath);
-    
+    m_hash = HashBytes(code.data(), code.size());
+    create(reinterpret_cast<const uint32_t*>(code.data()), code.size(), stage, entryPoint);
+}
+
+// The module is created straight from the mapped bundle, the blob is not copied
+Shader::Shader(VkDevice device, const ShaderBlob& blob, VkShaderStageFlagBits stage, const char* entryPoint) {
+    m_device = device;
+    m_filepath = "bundle";
+    m_hash = blob.hash;
+    create(blob.code, blob.size, stage, entryPoint);
+}
+
+void Shader::cleanup() {
+    vkDestroyShaderModule(m_device, m_shaderModule, nullptr);
+}
+
+// Constant ids the module does not declare are ignored, one info can serve every stage
+VkPipelineShaderStageCreateInfo Shader::getShaderStageInfo(const VkSpecializationInfo* specializationInfo) {
+    VkPipelineShaderStageCreateInfo shaderStageInfo = m_shaderStageInfo;
+    shaderStageInfo.pSpecializationInfo = specializationInfo;
+    return shaderStageInfo;
+}
+
+VkShaderStageFlagBits Shader::getStage() { return m_shaderStageInfo.stage; }
+uint64_t              Shader::getHash()  { return m_hash; }
+const std::vector<ShaderBinding>&       Shader::getBindings()           { return m_bindings; }
+const std::vector<VkPushConstantRange>& Shader::getPushConstantRanges() { return m_pushConstantRanges; }
+const std::vector<uint32_t>&            Shader::getSpecConstantIds()    { return m_specConstantIds; }
+
+// Private ==================================================
+
+void Shader::create(const uint32_t* code, size_t size, VkShaderStageFlagBits stage, const char* entryPoint) {
     VkShaderModuleCreateInfo shaderInfo{};
     shaderInfo.sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    shaderInfo.codeSize = code.size();
-    shaderInfo.pCode    = reinterpret_cast<const uint32_t*>(code.data());
-    
+    shaderInfo.codeSize = size;
+    shaderInfo.pCode    = code;
+
     VkResult result = vkCreateShaderModule( m_device, &shaderInfo, nullptr, &m_shaderModule );
     CHECK_VKRESULT(result, "failed to create shader modul!");
-    
+
     m_shaderStageInfo.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     m_shaderStageInfo.stage  = stage;
     m_shaderStageInfo.pName  = entryPoint;
     m_shaderStageInfo.module = m_shaderModule;
-}
 
-void Shader::cleanup() {
-    vkDestroyShaderModule(m_device, m_shaderModule, nullptr);
+    reflect(code, size / sizeof(uint32_t));
 }
 
-VkPipelineShaderStageCreateInfo Shader::getShaderStageInfo() {
-    return m_shaderStageInfo;
+void Shader::reflect(const uint32_t* code, size_t wordCount) {
+    if (wordCount < 5 || code[0] != SPIRV_MAGIC) RUNTIME_ERROR("invalid SPIR-V " + m_filepath);
+
+    std::vector<SpirvId> ids(code[3]);
+    for (size_t i = 5; i < wordCount;) {
+        const uint32_t* op = code + i;
+        uint32_t opcode = op[0] & 0xFFFF;
+        uint32_t count  = op[0] >> 16;
+        if (count == 0 || i + count > wordCount) RUNTIME_ERROR("invalid SPIR-V " + m_filepath);
+
+        switch (opcode) {
+        case SPIRV_OP_DECORATE: {
+            SpirvId& id = ids[op[1]];
+            if (op[2] == SPIRV_DECORATION_SPEC_ID)        id.specId      = op[3];
+            if (op[2] == SPIRV_DECORATION_DESCRIPTOR_SET) id.set         = op[3];
+            if (op[2] == SPIRV_DECORATION_BINDING)        id.binding     = op[3];
+            if (op[2] == SPIRV_DECORATION_ARRAY_STRIDE)   id.arrayStride = op[3];
+            if (op[2] == SPIRV_DECORATION_BUFFER_BLOCK)   id.bufferBlock = true;
+            break;
+        }
+        case SPIRV_OP_MEMBER_DECORATE: {
+            SpirvId& id = ids[op[1]];
+            uint32_t member = op[2];
+            if (op[3] == SPIRV_DECORATION_OFFSET) {
+                if (id.memberOffsets.size() <= member) id.memberOffsets.resize(member + 1);
+                id.memberOffsets[member] = op[4];
+            }
+            if (op[3] == SPIRV_DECORATION_MATRIX_STRIDE) {
+                if (id.memberMatrixStrides.size() <= member) id.memberMatrixStrides.resize(member + 1);
+                id.memberMatrixStrides[member] = op[4];
+            }
+            break;
+        }
+        case SPIRV_OP_TYPE_BOOL:
+        case SPIRV_OP_TYPE_SAMPLER:
+        case SPIRV_OP_TYPE_ACCELERATION_STRUCTURE:
+            ids[op[1]].opcode = opcode;
+            break;
+        case SPIRV_OP_TYPE_INT:
+        case SPIRV_OP_TYPE_FLOAT:
+            ids[op[1]].opcode = opcode;
+            ids[op[1]].value  = op[2];
+            break;
+        case SPIRV_OP_TYPE_VECTOR:
+        case SPIRV_OP_TYPE_MATRIX:
+        case SPIRV_OP_TYPE_ARRAY:
+            ids[op[1]].opcode = opcode;
+            ids[op[1]].typeId = op[2];
+            ids[op[1]].value  = op[3];
+            break;
+        case SPIRV_OP_TYPE_SAMPLED_IMAGE:
+        case SPIRV_OP_TYPE_RUNTIME_ARRAY:
+            ids[op[1]].opcode = opcode;
+            ids[op[1]].typeId = op[2];
+            break;
+        case SPIRV_OP_TYPE_IMAGE:
+            ids[op[1]].opcode  = opcode;
+            ids[op[1]].value   = op[3];
+            ids[op[1]].sampled = op[7];
+            break;
+        case SPIRV_OP_TYPE_STRUCT:
+            ids[op[1]].opcode = opcode;
+            ids[op[1]].members.assign(op + 2, op + count);
+            break;
+        case SPIRV_OP_TYPE_POINTER:
+            ids[op[1]].opcode       = opcode;
+            ids[op[1]].storageClass = op[2];
+            ids[op[1]].typeId       = op[3];
+            break;
+        case SPIRV_OP_CONSTANT:
+        case SPIRV_OP_SPEC_CONSTANT:
+            ids[op[2]].opcode = opcode;
+            ids[op[2]].typeId = op[1];
+            ids[op[2]].value  = op[3];
+            break;
+        case SPIRV_OP_SPEC_CONSTANT_TRUE:
+        case SPIRV_OP_SPEC_CONSTANT_FALSE:
+            ids[op[2]].opcode = opcode;
+            ids[op[2]].typeId = op[1];
+            break;
+        case SPIRV_OP_VARIABLE:
+            ids[op[2]].opcode       = opcode;
+            ids[op[2]].typeId       = op[1];
+            ids[op[2]].storageClass = op[3];
+            break;
+        }
+        i += count;
+    }
+
+    for (const SpirvId& id : ids) {
+        bool isSpecConstant = id.opcode == SPIRV_OP_SPEC_CONSTANT ||
+                              id.opcode == SPIRV_OP_SPEC_CONSTANT_TRUE ||
+                              id.opcode == SPIRV_OP_SPEC_CONSTANT_FALSE;
+        if (isSpecConstant && id.specId != UINT32_MAX) m_specConstantIds.push_back(id.specId);
+
+        if (id.opcode != SPIRV_OP_VARIABLE) continue;
+        uint32_t typeId = ids[id.typeId].typeId;
+
+        if (id.storageClass == SPIRV_STORAGE_PUSH_CONSTANT) {
+            const SpirvId& block = ids[typeId];
+            uint32_t offset = block.memberOffsets.empty() ? 0 :
+                *std::min_element(block.memberOffsets.begin(), block.memberOffsets.end());
+            uint32_t size = GetSpirvTypeSize(ids, typeId);
+            m_pushConstantRanges.push_back({ VkShaderStageFlags(m_shaderStageInfo.stage), offset, size - offset });
+            continue;
+        }
+
+        bool isResource = id.storageClass == SPIRV_STORAGE_UNIFORM_CONSTANT ||
+                          id.storageClass == SPIRV_STORAGE_UNIFORM ||
+                          id.storageClass == SPIRV_STORAGE_STORAGE_BUFFER;
+        if (!isResource || id.binding == UINT32_MAX) continue;
+
+        // A runtime array is reported with a descriptor count of 0
+        uint32_t descriptorCount = 1;
+        while (ids[typeId].opcode == SPIRV_OP_TYPE_ARRAY || ids[typeId].opcode == SPIRV_OP_TYPE_RUNTIME_ARRAY) {
+            const SpirvId& array = ids[typeId];
+            descriptorCount *= array.opcode == SPIRV_OP_TYPE_ARRAY ? ids[array.value].value : 0;
+            typeId = array.typeId;
+        }
+
+        const SpirvId& type = ids[typeId];
+        VkDescriptorType descriptorType;
+        switch (type.opcode) {
+        case SPIRV_OP_TYPE_STRUCT:
+            descriptorType = id.storageClass == SPIRV_STORAGE_STORAGE_BUFFER || type.bufferBlock ?
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            break;
+        case SPIRV_OP_TYPE_SAMPLED_IMAGE:
+            descriptorType = ids[type.typeId].value == SPIRV_DIM_BUFFER ?
+                VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            break;
+        case SPIRV_OP_TYPE_IMAGE:
+            if (type.value == SPIRV_DIM_SUBPASS)
+                descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+            else if (type.value == SPIRV_DIM_BUFFER)
+                descriptorType = type.sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            else
+                descriptorType = type.sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+            break;
+        case SPIRV_OP_TYPE_SAMPLER:
+            descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+            break;
+        case SPIRV_OP_TYPE_ACCELERATION_STRUCTURE:
+            descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            break;
+        default:
+            continue;
+        }
+
+        ShaderBinding binding{};
+        binding.set = id.set == UINT32_MAX ? 0 : id.set;
+        binding.layoutBinding.binding         = id.binding;
+        binding.layoutBinding.descriptorType  = descriptorType;
+        binding.layoutBinding.descriptorCount = descriptorCount;
+        binding.layoutBinding.stageFlags      = m_shaderStageInfo.stage;
+        m_bindings.push_back(binding);
+    }
 }
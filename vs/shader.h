@@ -1,6 +1,12 @@
 #pragma once
 
 #include "common.h"
+#include "shaderbundle.h"
+
+struct ShaderBinding {
+    uint32_t                     set;
+    VkDescriptorSetLayoutBinding layoutBinding;
+};
 
 class Shader {
     
@@ -8,9 +14,16 @@ public:
     ~Shader();
     Shader();
     Shader(VkDevice device, const std::string filepath, VkShaderStageFlagBits stage, const char* entryPoint = "main");
+    Shader(VkDevice device, const ShaderBlob& blob, VkShaderStageFlagBits stage, const char* entryPoint = "main");
     
     void cleanup();
-    VkPipelineShaderStageCreateInfo getShaderStageInfo();
+    VkPipelineShaderStageCreateInfo getShaderStageInfo(const VkSpecializationInfo* specializationInfo = nullptr);
+    
+    VkShaderStageFlagBits getStage();
+    uint64_t              getHash();
+    const std::vector<ShaderBinding>&       getBindings();
+    const std::vector<VkPushConstantRange>& getPushConstantRanges();
+    const std::vector<uint32_t>&            getSpecConstantIds();
     
 private:
     
@@ -21,5 +34,13 @@ private:
     VkPipelineShaderStageCreateInfo m_shaderStageInfo{};
     
     std::string m_filepath;
+    uint64_t    m_hash = 0;
+    
+    std::vector<ShaderBinding>       m_bindings;
+    std::vector<VkPushConstantRange> m_pushConstantRanges;
+    std::vector<uint32_t>            m_specConstantIds;
+    
+    void create(const uint32_t* code, size_t size, VkShaderStageFlagBits stage, const char* entryPoint);
+    void reflect(const uint32_t* code, size_t wordCount);
     
 };
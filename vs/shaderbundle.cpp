@@ -0,0 +1,133 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <cstring>
+
+#include "shaderbundle.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SHADER_BUNDLE_MAGIC   0x4B415053
+#define SHADER_BUNDLE_VERSION 1
+
+ShaderBundle::~ShaderBundle() {}
+ShaderBundle::ShaderBundle() {}
+
+bool ShaderBundle::open( const std::string filepath ) {
+    m_data = static_cast<const uint8_t*>( mapFile( filepath, &m_size ) );
+    if ( m_data == nullptr ) {
+        LOG( "ShaderBundle::open no bundle at " << filepath );
+        return false;
+    }
+
+    const Header* header = reinterpret_cast<const Header*>( m_data );
+    bool valid = m_size >= sizeof( Header ) &&
+                 header->magic   == SHADER_BUNDLE_MAGIC &&
+                 header->version == SHADER_BUNDLE_VERSION &&
+                 sizeof( Header ) + header->count * sizeof( Entry ) <= m_size;
+
+    const Entry* entries = reinterpret_cast<const Entry*>( m_data + sizeof( Header ) );
+    for ( uint32_t i = 0; valid && i < header->count; i++ ) {
+        const Entry& entry = entries[i];
+        valid = entry.offset % sizeof( uint32_t ) == 0 && entry.offset + entry.size <= m_size;
+        if ( !valid ) break;
+
+        ShaderBlob blob{};
+        blob.code = reinterpret_cast<const uint32_t*>( m_data + entry.offset );
+        blob.size = size_t( entry.size );
+        blob.hash = entry.hash;
+        m_blobs[std::string( entry.name, strnlen( entry.name, sizeof( entry.name ) ) )] = blob;
+    }
+
+    if ( !valid ) {
+        LOG( "ShaderBundle::open ignoring corrupt bundle " << filepath );
+        cleanup();
+        return false;
+    }
+    LOG( "ShaderBundle::open " << m_blobs.size() << " shaders from " << filepath );
+    return true;
+}
+
+void ShaderBundle::cleanup() {
+    m_blobs.clear();
+    unmapFile();
+}
+
+bool ShaderBundle::isOpen() {
+    return m_data != nullptr;
+}
+
+bool ShaderBundle::find( const std::string name, ShaderBlob* blob ) {
+    auto found = m_blobs.find( name );
+    if ( found == m_blobs.end() ) return false;
+    *blob = found->second;
+    return true;
+}
+
+// Private ==================================================
+
+#ifdef _WIN32
+void* ShaderBundle::mapFile( const std::string filepath, size_t* size ) {
+    HANDLE file = CreateFileA( filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+    if ( file == INVALID_HANDLE_VALUE ) return nullptr;
+
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = nullptr;
+    void*  data    = nullptr;
+    if ( GetFileSizeEx( file, &fileSize ) && fileSize.QuadPart > 0 ) {
+        mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        if ( mapping != nullptr ) data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+    }
+    if ( data == nullptr ) {
+        if ( mapping != nullptr ) CloseHandle( mapping );
+        CloseHandle( file );
+        return nullptr;
+    }
+
+    m_file    = file;
+    m_mapping = mapping;
+    *size     = size_t( fileSize.QuadPart );
+    return data;
+}
+
+void ShaderBundle::unmapFile() {
+    if ( m_data != nullptr ) UnmapViewOfFile( m_data );
+    if ( m_mapping != nullptr ) CloseHandle( m_mapping );
+    if ( m_file != nullptr ) CloseHandle( m_file );
+    m_data    = nullptr;
+    m_size    = 0;
+    m_mapping = nullptr;
+    m_file    = nullptr;
+}
+#else
+void* ShaderBundle::mapFile( const std::string filepath, size_t* size ) {
+    int file = ::open( filepath.c_str(), O_RDONLY );
+    if ( file < 0 ) return nullptr;
+
+    struct stat fileStat;
+    void* data = MAP_FAILED;
+    if ( fstat( file, &fileStat ) == 0 && fileStat.st_size > 0 )
+        data = mmap( nullptr, size_t( fileStat.st_size ), PROT_READ, MAP_PRIVATE, file, 0 );
+    // The mapping stays valid after the descriptor is closed
+    close( file );
+    if ( data == MAP_FAILED ) return nullptr;
+
+    *size = size_t( fileStat.st_size );
+    return data;
+}
+
+void ShaderBundle::unmapFile() {
+    if ( m_data != nullptr ) munmap( const_cast<uint8_t*>( m_data ), m_size );
+    m_data = nullptr;
+    m_size = 0;
+}
+#endif
@@ -0,0 +1,56 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+
+// Points into the mapped archive, valid until the bundle is cleaned up
+struct ShaderBlob {
+    const uint32_t* code;
+    size_t          size;
+    uint64_t        hash;
+};
+
+// Read-only view of the archive written by shaders/pack_shaders.py
+class ShaderBundle {
+
+public:
+    ~ShaderBundle();
+    ShaderBundle();
+
+    bool open( const std::string filepath );
+    void cleanup();
+
+    bool isOpen();
+    bool find( const std::string name, ShaderBlob* blob );
+
+private:
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t count;
+        uint32_t reserved;
+    };
+
+    struct Entry {
+        char     name[40];
+        uint64_t offset;
+        uint64_t size;
+        uint64_t hash;
+    };
+
+    const uint8_t* m_data = nullptr;
+    size_t         m_size = 0;
+#ifdef _WIN32
+    void* m_file    = nullptr;
+    void* m_mapping = nullptr;
+#endif
+
+    std::map<std::string, ShaderBlob> m_blobs;
+
+    void* mapFile( const std::string filepath, size_t* size );
+    void  unmapFile();
+
+};
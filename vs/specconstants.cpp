@@ -0,0 +1,50 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <cstring>
+
+#include "specconstants.h"
+#include "helper.h"
+
+SpecConstants::~SpecConstants() {}
+SpecConstants::SpecConstants() {}
+
+void SpecConstants::set( uint32_t id, uint32_t value ) {
+    for ( const VkSpecializationMapEntry& entry : m_entries ) {
+        if ( entry.constantID != id ) continue;
+        m_data[entry.offset / sizeof( uint32_t )] = value;
+        return;
+    }
+    m_entries.push_back( { id, UINT32( m_data.size() * sizeof( uint32_t ) ), sizeof( uint32_t ) } );
+    m_data.push_back( value );
+}
+
+void SpecConstants::set( uint32_t id, int32_t value ) {
+    set( id, static_cast<uint32_t>( value ) );
+}
+
+void SpecConstants::set( uint32_t id, float value ) {
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof( bits ) );
+    set( id, bits );
+}
+
+void SpecConstants::set( uint32_t id, bool value ) {
+    set( id, static_cast<uint32_t>( value ? VK_TRUE : VK_FALSE ) );
+}
+
+const VkSpecializationInfo* SpecConstants::getInfo() {
+    if ( m_entries.empty() ) return nullptr;
+    m_info.mapEntryCount = UINT32( m_entries.size() );
+    m_info.pMapEntries   = m_entries.data();
+    m_info.dataSize      = m_data.size() * sizeof( uint32_t );
+    m_info.pData         = m_data.data();
+    return &m_info;
+}
+
+uint64_t SpecConstants::getHash() {
+    uint64_t hash = HashBytes( m_data.data(), m_data.size() * sizeof( uint32_t ) );
+    for ( const VkSpecializationMapEntry& entry : m_entries )
+        hash = HashBytes( &entry.constantID, sizeof( entry.constantID ), hash );
+    return hash;
+}
@@ -0,0 +1,31 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+
+// Values for the constant_id declarations of a pipeline variant. Every
+// constant is stored as 32 bits, which covers int, uint, float and bool.
+class SpecConstants {
+
+public:
+    ~SpecConstants();
+    SpecConstants();
+
+    void set( uint32_t id, uint32_t value );
+    void set( uint32_t id, int32_t value );
+    void set( uint32_t id, float value );
+    void set( uint32_t id, bool value );
+
+    // Points into this object, only valid while it is alive and unchanged
+    const VkSpecializationInfo* getInfo();
+    uint64_t getHash();
+
+private:
+
+    std::vector<VkSpecializationMapEntry> m_entries;
+    std::vector<uint32_t>                 m_data;
+    VkSpecializationInfo                  m_info{};
+
+};
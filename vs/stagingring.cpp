@@ -0,0 +1,69 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "stagingring.h"
+#include "accelstructure.h"
+
+StagingRing::~StagingRing() {}
+StagingRing::StagingRing( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void StagingRing::setup( uint32_t frameCount ) {
+    m_chunks.resize( frameCount );
+    m_frame  = 0;
+    m_chunk  = 0;
+    m_offset = 0;
+}
+
+void StagingRing::cleanup() {
+    for ( std::vector<Chunk>& chunks : m_chunks ) {
+        for ( Chunk& chunk : chunks ) {
+            chunk.buffer->unmapMemory();
+            chunk.buffer->cleanup();
+            delete chunk.buffer;
+        }
+    }
+    m_chunks.clear();
+}
+
+void StagingRing::beginFrame( uint32_t frameIndex ) {
+    m_frame  = frameIndex % m_chunks.size();
+    m_chunk  = 0;
+    m_offset = 0;
+}
+
+StagingRegion StagingRing::allocate( VkDeviceSize size ) {
+    std::vector<Chunk>& chunks = m_chunks[m_frame];
+    VkDeviceSize offset = AlignUp( m_offset, STAGING_ALIGNMENT );
+    while ( m_chunk < chunks.size() && offset + size > chunks[m_chunk].buffer->getBufferSize() ) {
+        m_chunk++;
+        offset = 0;
+    }
+
+    if ( m_chunk == chunks.size() ) {
+        Chunk chunk;
+        chunk.buffer = new Buffer( m_device, m_physicalDevice );
+        chunk.buffer->setup( std::max<VkDeviceSize>( size, STAGING_CHUNK_SIZE ), VK_BUFFER_USAGE_TRANSFER_SRC_BIT );
+        chunk.buffer->create();
+        chunk.data = chunk.buffer->mapMemory( chunk.buffer->getBufferSize() );
+        chunks.push_back( chunk );
+        LOG( "StagingRing::allocate frame " << m_frame << " chunk " << m_chunk << " size " << chunk.buffer->getBufferSize() );
+    }
+    m_offset = offset + size;
+
+    StagingRegion region;
+    region.buffer = chunks[m_chunk].buffer->getBuffer();
+    region.offset = offset;
+    region.data   = static_cast<char*>( chunks[m_chunk].data ) + offset;
+    return region;
+}
+
+StagingRegion StagingRing::write( const void* data, VkDeviceSize size ) {
+    StagingRegion region = allocate( size );
+    memcpy( region.data, data, size );
+    return region;
+}
@@ -0,0 +1,56 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+
+// Size of a staging chunk, an upload larger than this gets a chunk of its own size
+#define STAGING_CHUNK_SIZE ( 4 * 1024 * 1024 )
+// Offset alignment of every allocation, enough for buffer to image copies of any texel block
+#define STAGING_ALIGNMENT  16
+
+// Where allocate placed an upload, copy from buffer at offset
+struct StagingRegion {
+    VkBuffer     buffer = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    void*        data   = nullptr;
+};
+
+// Host visible upload memory that stays mapped for the lifetime of the ring. Each frame in flight
+// owns a list of chunks that allocate fills linearly, beginFrame rewinds them once the fence of that
+// frame has signaled. Chunks are only added when a frame uploads more than it ever did before.
+class StagingRing {
+
+public:
+    ~StagingRing();
+    StagingRing( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    void setup( uint32_t frameCount );
+    void cleanup();
+
+    // Call after the fence of frameIndex has signaled, later allocations go to its memory
+    void beginFrame( uint32_t frameIndex );
+
+    // Reserves size bytes in the memory of the current frame, write them through data
+    StagingRegion allocate( VkDeviceSize size );
+    // Same, filled with a copy of data
+    StagingRegion write( const void* data, VkDeviceSize size );
+
+private:
+
+    struct Chunk {
+        Buffer* buffer = nullptr;
+        void*   data   = nullptr;
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    std::vector<std::vector<Chunk>> m_chunks; // per frame
+    uint32_t                        m_frame  = 0;
+    uint32_t                        m_chunk  = 0;
+    VkDeviceSize                    m_offset = 0;
+
+};
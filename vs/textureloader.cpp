@@ -0,0 +1,685 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include "textureloader.h"
+#include "dispatch.h"
+
+// 8 bit RGBA texels, rows from the top
+struct Rgba8Image {
+    int32_t              width  = 0;
+    int32_t              height = 0;
+    std::vector<uint8_t> texels;
+};
+
+static std::vector<uint8_t> ReadFile( const std::string& filename ) {
+    std::ifstream file( filename, std::ios::binary | std::ios::ate );
+    if ( !file.is_open() ) RUNTIME_ERROR( "failed to open " + filename );
+    std::vector<uint8_t> bytes( size_t( file.tellg() ) );
+    file.seekg( 0 );
+    file.read( reinterpret_cast<char*>( bytes.data() ), bytes.size() );
+    return bytes;
+}
+
+static bool HasExtension( const std::string& filename, const std::string& extension ) {
+    if ( filename.size() < extension.size() ) return false;
+    std::string end = filename.substr( filename.size() - extension.size() );
+    std::transform( end.begin(), end.end(), end.begin(), []( char c ) { return char( tolower( c ) ); } );
+    return end == extension;
+}
+
+static uint32_t MipCount( Size<int32_t> size ) {
+    uint32_t levels = 1;
+    for ( int32_t extent = std::max( size.width, size.height ); extent > 1; extent /= 2 ) levels++;
+    return levels;
+}
+
+static uint32_t BlockBytes( VkFormat format ) {
+    switch ( format ) {
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        return 8;
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC5_SNORM_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+// Bytes of one level, BC formats round the extent up to whole blocks
+static VkDeviceSize LevelBytes( VkFormat format, int32_t width, int32_t height ) {
+    uint32_t blockBytes = BlockBytes( format );
+    if ( blockBytes == 0 ) return VkDeviceSize( width ) * height * 4;
+    VkDeviceSize blocksX = ( width + TEXTURE_BLOCK_SIZE - 1 ) / TEXTURE_BLOCK_SIZE;
+    VkDeviceSize blocksY = ( height + TEXTURE_BLOCK_SIZE - 1 ) / TEXTURE_BLOCK_SIZE;
+    return blocksX * blocksY * blockBytes;
+}
+
+// Uncompressed true color, types 2 and 10 (RLE), 24 or 32 bits
+static Rgba8Image DecodeTga( const std::vector<uint8_t>& bytes ) {
+    if ( bytes.size() < 18 ) RUNTIME_ERROR( "truncated TGA header!" );
+    uint8_t  idLength   = bytes[0];
+    uint8_t  imageType  = bytes[2];
+    uint8_t  bits       = bytes[16];
+    bool     topDown    = ( bytes[17] & 0x20 ) != 0;
+    uint32_t pixelBytes = bits / 8;
+    if ( bytes[1] != 0 || ( imageType != 2 && imageType != 10 ) || ( bits != 24 && bits != 32 ) )
+        RUNTIME_ERROR( "only true color TGA images are supported!" );
+
+    Rgba8Image image;
+    image.width  = bytes[12] | ( bytes[13] << 8 );
+    image.height = bytes[14] | ( bytes[15] << 8 );
+    image.texels.resize( size_t( image.width ) * image.height * 4 );
+
+    size_t   position   = 18 + idLength;
+    size_t   pixelCount = size_t( image.width ) * image.height;
+    size_t   pixel      = 0;
+    uint32_t runLeft    = 0;
+    bool     runRepeats = false;
+    uint8_t  value[4]   = { 0, 0, 0, 255 };
+    while ( pixel < pixelCount ) {
+        // RLE packets either repeat one value or carry raw values, the header byte holds the length
+        if ( imageType == 10 && runLeft == 0 ) {
+            if ( position >= bytes.size() ) RUNTIME_ERROR( "truncated TGA data!" );
+            runRepeats = ( bytes[position] & 0x80 ) != 0;
+            runLeft    = ( bytes[position] & 0x7F ) + 1;
+            position++;
+            if ( runRepeats ) {
+                if ( position + pixelBytes > bytes.size() ) RUNTIME_ERROR( "truncated TGA data!" );
+                memcpy( value, &bytes[position], pixelBytes );
+                position += pixelBytes;
+            }
+        }
+        if ( imageType == 2 || !runRepeats ) {
+            if ( position + pixelBytes > bytes.size() ) RUNTIME_ERROR( "truncated TGA data!" );
+            memcpy( value, &bytes[position], pixelBytes );
+            position += pixelBytes;
+        }
+        if ( runLeft > 0 ) runLeft--;
+
+        size_t   x   = pixel % image.width;
+        size_t   y   = topDown ? pixel / image.width : image.height - 1 - pixel / image.width;
+        uint8_t* out = &image.texels[( y * image.width + x ) * 4];
+        out[0] = value[2];
+        out[1] = value[1];
+        out[2] = value[0];
+        out[3] = pixelBytes == 4 ? value[3] : 255;
+        pixel++;
+    }
+    return image;
+}
+
+// Binary PPM, 8 bits per channel
+static Rgba8Image DecodePpm( const std::vector<uint8_t>& bytes ) {
+    size_t position = 0;
+    auto nextToken = [&]() {
+        std::string token;
+        while ( position < bytes.size() ) {
+            char c = char( bytes[position] );
+            if ( c == '#' ) {
+                while ( position < bytes.size() && bytes[position] != '\n' ) position++;
+            }
+            else if ( isspace( c ) ) {
+                if ( !token.empty() ) break;
+                position++;
+            }
+            else {
+                token += c;
+                position++;
+            }
+        }
+        return token;
+    };
+    if ( nextToken() != "P6" ) RUNTIME_ERROR( "only binary PPM images are supported!" );
+
+    Rgba8Image image;
+    image.width       = std::stoi( nextToken() );
+    image.height      = std::stoi( nextToken() );
+    int32_t maxValue  = std::stoi( nextToken() );
+    position++; // the single whitespace before the texels
+    size_t pixelCount = size_t( image.width ) * image.height;
+    if ( maxValue != 255 ) RUNTIME_ERROR( "only 8 bit PPM images are supported!" );
+    if ( position + pixelCount * 3 > bytes.size() ) RUNTIME_ERROR( "truncated PPM data!" );
+
+    image.texels.resize( pixelCount * 4 );
+    for ( size_t i = 0; i < pixelCount; i++ ) {
+        memcpy( &image.texels[i * 4], &bytes[position + i * 3], 3 );
+        image.texels[i * 4 + 3] = 255;
+    }
+    return image;
+}
+
+static float SrgbToLinear( uint8_t value ) {
+    float c = value / 255.0f;
+    return c <= 0.04045f ? c / 12.92f : std::pow( ( c + 0.055f ) / 1.055f, 2.4f );
+}
+
+static uint8_t LinearToSrgb( float c ) {
+    c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow( c, 1.0f / 2.4f ) - 0.055f;
+    return uint8_t( std::min( std::max( c, 0.0f ), 1.0f ) * 255.0f + 0.5f );
+}
+
+// 2x2 box filter, the last row or column of an odd extent is counted twice. Color is averaged in linear space.
+static Rgba8Image Downsample( const Rgba8Image& image, bool srgb ) {
+    Rgba8Image next;
+    next.width  = std::max( image.width / 2, 1 );
+    next.height = std::max( image.height / 2, 1 );
+    next.texels.resize( size_t( next.width ) * next.height * 4 );
+    for ( int32_t y = 0; y < next.height; y++ ) {
+        for ( int32_t x = 0; x < next.width; x++ ) {
+            int32_t x0 = std::min( x * 2, image.width - 1 ), x1 = std::min( x * 2 + 1, image.width - 1 );
+            int32_t y0 = std::min( y * 2, image.height - 1 ), y1 = std::min( y * 2 + 1, image.height - 1 );
+            const uint8_t* texels[4] = {
+                &image.texels[( size_t( y0 ) * image.width + x0 ) * 4], &image.texels[( size_t( y0 ) * image.width + x1 ) * 4],
+                &image.texels[( size_t( y1 ) * image.width + x0 ) * 4], &image.texels[( size_t( y1 ) * image.width + x1 ) * 4],
+            };
+            uint8_t* out = &next.texels[( size_t( y ) * next.width + x ) * 4];
+            for ( int32_t channel = 0; channel < 4; channel++ ) {
+                float sum = 0.0f;
+                for ( const uint8_t* texel : texels ) sum += srgb && channel < 3 ? SrgbToLinear( texel[channel] ) : texel[channel];
+                out[channel] = srgb && channel < 3 ? LinearToSrgb( sum / 4.0f ) : uint8_t( sum / 4.0f + 0.5f );
+            }
+        }
+    }
+    return next;
+}
+
+static uint16_t PackRgb565( const float color[3] ) {
+    uint32_t r = uint32_t( std::min( std::max( color[0], 0.0f ), 255.0f ) * 31.0f / 255.0f + 0.5f );
+    uint32_t g = uint32_t( std::min( std::max( color[1], 0.0f ), 255.0f ) * 63.0f / 255.0f + 0.5f );
+    uint32_t b = uint32_t( std::min( std::max( color[2], 0.0f ), 255.0f ) * 31.0f / 255.0f + 0.5f );
+    return uint16_t( ( r << 11 ) | ( g << 5 ) | b );
+}
+
+static void UnpackRgb565( uint16_t packed, int32_t color[3] ) {
+    int32_t r = ( packed >> 11 ) & 31, g = ( packed >> 5 ) & 63, b = packed & 31;
+    color[0] = ( r << 3 ) | ( r >> 2 );
+    color[1] = ( g << 2 ) | ( g >> 4 );
+    color[2] = ( b << 3 ) | ( b >> 2 );
+}
+
+// Endpoints at the extremes of the texels along their principal axis, four color mode
+static void EncodeBc1Block( const uint8_t texels[16][4], uint8_t* block ) {
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for ( int32_t i = 0; i < 16; i++ )
+        for ( int32_t c = 0; c < 3; c++ ) mean[c] += texels[i][c] / 16.0f;
+
+    float covariance[6] = {};
+    for ( int32_t i = 0; i < 16; i++ ) {
+        float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2] };
+        covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1]; covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1]; covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+    }
+    // A few power iterations are enough to separate the endpoints
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for ( int32_t iteration = 0; iteration < 4; iteration++ ) {
+        float next[3] = {
+            covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2],
+        };
+        float length = std::max( { std::fabs( next[0] ), std::fabs( next[1] ), std::fabs( next[2] ) } );
+        if ( length < 1e-6f ) break;
+        for ( int32_t c = 0; c < 3; c++ ) axis[c] = next[c] / length;
+    }
+
+    int32_t minIndex = 0, maxIndex = 0;
+    float   minDot   = INFINITY, maxDot = -INFINITY;
+    for ( int32_t i = 0; i < 16; i++ ) {
+        float dot = texels[i][0] * axis[0] + texels[i][1] * axis[1] + texels[i][2] * axis[2];
+        if ( dot < minDot ) { minDot = dot; minIndex = i; }
+        if ( dot > maxDot ) { maxDot = dot; maxIndex = i; }
+    }
+    float maxColor[3] = { float( texels[maxIndex][0] ), float( texels[maxIndex][1] ), float( texels[maxIndex][2] ) };
+    float minColor[3] = { float( texels[minIndex][0] ), float( texels[minIndex][1] ), float( texels[minIndex][2] ) };
+    uint16_t color0 = PackRgb565( maxColor );
+    uint16_t color1 = PackRgb565( minColor );
+    if ( color0 < color1 ) std::swap( color0, color1 );
+
+    // color0 > color1 selects the four color palette, equal endpoints use index 0 throughout
+    uint32_t indices = 0;
+    if ( color0 != color1 ) {
+        int32_t palette[4][3];
+        UnpackRgb565( color0, palette[0] );
+        UnpackRgb565( color1, palette[1] );
+        for ( int32_t c = 0; c < 3; c++ ) {
+            palette[2][c] = ( 2 * palette[0][c] + palette[1][c] ) / 3;
+            palette[3][c] = ( palette[0][c] + 2 * palette[1][c] ) / 3;
+        }
+        for ( int32_t i = 0; i < 16; i++ ) {
+            int32_t best = 0, bestDistance = INT32_MAX;
+            for ( int32_t p = 0; p < 4; p++ ) {
+                int32_t dr = texels[i][0] - palette[p][0], dg = texels[i][1] - palette[p][1], db = texels[i][2] - palette[p][2];
+                int32_t distance = dr * dr + dg * dg + db * db;
+                if ( distance < bestDistance ) { bestDistance = distance; best = p; }
+            }
+            indices |= uint32_t( best ) << ( i * 2 );
+        }
+    }
+    memcpy( block, &color0, 2 );
+    memcpy( block + 2, &color1, 2 );
+    memcpy( block + 4, &indices, 4 );
+}
+
+// One channel between its minimum and maximum, eight value mode
+static void EncodeBc4Block( const uint8_t values[16], uint8_t* block ) {
+    uint8_t value0 = *std::max_element( values, values + 16 );
+    uint8_t value1 = *std::min_element( values, values + 16 );
+
+    uint64_t indices = 0;
+    if ( value0 != value1 ) {
+        int32_t palette[8] = { value0, value1 };
+        for ( int32_t p = 1; p < 7; p++ ) palette[p + 1] = ( ( 7 - p ) * value0 + p * value1 ) / 7;
+        for ( int32_t i = 0; i < 16; i++ ) {
+            int32_t best = 0, bestDistance = INT32_MAX;
+            for ( int32_t p = 0; p < 8; p++ ) {
+                int32_t distance = std::abs( values[i] - palette[p] );
+                if ( distance < bestDistance ) { bestDistance = distance; best = p; }
+            }
+            indices |= uint64_t( best ) << ( i * 3 );
+        }
+    }
+    block[0] = value0;
+    block[1] = value1;
+    for ( int32_t i = 0; i < 6; i++ ) block[2 + i] = uint8_t( indices >> ( i * 8 ) );
+}
+
+// Appends one level in format, BC1 from rgb or BC5 from rg, texels past the edge repeat the last row or column
+static void AppendLevel( const Rgba8Image& image, VkFormat format, std::vector<uint8_t>& data ) {
+    if ( BlockBytes( format ) == 0 ) {
+        data.insert( data.end(), image.texels.begin(), image.texels.end() );
+        return;
+    }
+    size_t offset = data.size();
+    data.resize( offset + size_t( LevelBytes( format, image.width, image.height ) ) );
+    uint8_t* block = &data[offset];
+    for ( int32_t blockY = 0; blockY < image.height; blockY += TEXTURE_BLOCK_SIZE ) {
+        for ( int32_t blockX = 0; blockX < image.width; blockX += TEXTURE_BLOCK_SIZE ) {
+            uint8_t texels[16][4];
+            for ( int32_t i = 0; i < 16; i++ ) {
+                int32_t x = std::min( blockX + i % 4, image.width - 1 );
+                int32_t y = std::min( blockY + i / 4, image.height - 1 );
+                memcpy( texels[i], &image.texels[( size_t( y ) * image.width + x ) * 4], 4 );
+            }
+            if ( format == VK_FORMAT_BC5_UNORM_BLOCK ) {
+                uint8_t red[16], green[16];
+                for ( int32_t i = 0; i < 16; i++ ) {
+                    red[i]   = texels[i][0];
+                    green[i] = texels[i][1];
+                }
+                EncodeBc4Block( red, block );
+                EncodeBc4Block( green, block + 8 );
+            }
+            else EncodeBc1Block( texels, block );
+            block += BlockBytes( format );
+        }
+    }
+}
+
+// Formats of the KTX2 files the loader uploads as they are
+static bool IsKtx2Format( VkFormat format ) {
+    return BlockBytes( format ) > 0 || format == VK_FORMAT_R8G8B8A8_UNORM || format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+// 2D, one layer, one face, no supercompression. A level count of 0 asks for the mips to be generated.
+static TextureData DecodeKtx2( const std::vector<uint8_t>& bytes ) {
+    static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    if ( bytes.size() < 80 || memcmp( bytes.data(), identifier, 12 ) != 0 ) RUNTIME_ERROR( "not a KTX2 file!" );
+    auto read32 = [&]( size_t offset ) { uint32_t value; memcpy( &value, &bytes[offset], 4 ); return value; };
+    auto read64 = [&]( size_t offset ) { uint64_t value; memcpy( &value, &bytes[offset], 8 ); return value; };
+
+    TextureData data;
+    data.format          = VkFormat( read32( 12 ) );
+    data.size            = { int32_t( read32( 20 ) ), int32_t( read32( 24 ) ) };
+    uint32_t depth       = read32( 28 );
+    uint32_t layerCount  = read32( 32 );
+    uint32_t faceCount   = read32( 36 );
+    uint32_t levelCount  = read32( 40 );
+    uint32_t compression = read32( 44 );
+    if ( !IsKtx2Format( data.format ) ) RUNTIME_ERROR( "unsupported KTX2 format " + std::to_string( data.format ) );
+    if ( depth > 0 || layerCount > 1 || faceCount != 1 || compression != 0 ) RUNTIME_ERROR( "only plain 2D KTX2 textures are supported!" );
+
+    uint32_t storedLevels = std::max( levelCount, 1u );
+    if ( bytes.size() < 80 + storedLevels * 24 ) RUNTIME_ERROR( "truncated KTX2 level index!" );
+    data.mipLevels = levelCount == 0 ? MipCount( data.size ) : levelCount;
+    for ( uint32_t level = 0; level < storedLevels; level++ ) {
+        uint64_t     offset   = read64( 80 + level * 24 );
+        uint64_t     length   = read64( 80 + level * 24 + 8 );
+        VkDeviceSize expected = LevelBytes( data.format, std::max( data.size.width >> level, 1 ), std::max( data.size.height >> level, 1 ) );
+        if ( length != expected || offset + length > bytes.size() ) RUNTIME_ERROR( "bad KTX2 level " + std::to_string( level ) );
+        data.levelOffsets.push_back( data.data.size() );
+        data.data.insert( data.data.end(), bytes.begin() + size_t( offset ), bytes.begin() + size_t( offset + length ) );
+    }
+    return data;
+}
+
+// Builds the levels past the stored ones from the last of them, RGBA8 only
+static void AppendMips( TextureData& data ) {
+    uint32_t   last = UINT32( data.levelOffsets.size() ) - 1;
+    Rgba8Image image;
+    image.width  = std::max( data.size.width >> last, 1 );
+    image.height = std::max( data.size.height >> last, 1 );
+    image.texels.assign( data.data.begin() + size_t( data.levelOffsets[last] ), data.data.end() );
+    for ( uint32_t level = last + 1; level < data.mipLevels; level++ ) {
+        image = Downsample( image, data.format == VK_FORMAT_R8G8B8A8_SRGB );
+        data.levelOffsets.push_back( data.data.size() );
+        AppendLevel( image, data.format, data.data );
+    }
+}
+
+// Runs on a worker. Encoded formats get every level here, BC blocks cannot be blit targets. allLevels
+// builds the RGBA8 levels on the CPU as well, for textures that are streamed a level at a time.
+static TextureData DecodeTexture( const std::string& filename, TextureUsage usage, bool bc1, bool bc5, bool bc7, bool allLevels ) {
+    std::vector<uint8_t> bytes = ReadFile( filename );
+    if ( HasExtension( filename, ".ktx2" ) ) {
+        TextureData data = DecodeKtx2( bytes );
+        bool bcFormat    = BlockBytes( data.format ) > 0;
+        bool isBc1       = data.format >= VK_FORMAT_BC1_RGB_UNORM_BLOCK && data.format <= VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+        bool isBc5       = data.format == VK_FORMAT_BC5_UNORM_BLOCK || data.format == VK_FORMAT_BC5_SNORM_BLOCK;
+        if ( bcFormat && !( isBc1 ? bc1 : isBc5 ? bc5 : bc7 ) ) RUNTIME_ERROR( "the device cannot sample the format of " + filename );
+        // Missing BC levels cannot be made, the chain ends at the last stored one
+        if ( bcFormat ) data.mipLevels = UINT32( data.levelOffsets.size() );
+        else if ( allLevels ) AppendMips( data );
+        return data;
+    }
+
+    Rgba8Image image;
+    if ( HasExtension( filename, ".tga" ) )      image = DecodeTga( bytes );
+    else if ( HasExtension( filename, ".ppm" ) ) image = DecodePpm( bytes );
+    else RUNTIME_ERROR( "unknown texture type " + filename );
+
+    // BC1 keeps no alpha, BC7 is only loaded precompressed, so transparent color stays RGBA8
+    bool opaque = true;
+    for ( size_t i = 3; i < image.texels.size(); i += 4 ) opaque &= image.texels[i] == 255;
+    bool color  = usage == TEXTURE_USAGE_COLOR;
+
+    TextureData data;
+    data.size      = { image.width, image.height };
+    data.mipLevels = MipCount( data.size );
+    if ( color ) data.format = bc1 && opaque ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_R8G8B8A8_SRGB;
+    else         data.format = bc5 ? VK_FORMAT_BC5_UNORM_BLOCK : VK_FORMAT_R8G8B8A8_UNORM;
+
+    data.levelOffsets.push_back( 0 );
+    AppendLevel( image, data.format, data.data );
+    if ( BlockBytes( data.format ) == 0 && !allLevels ) return data;
+    for ( uint32_t level = 1; level < data.mipLevels; level++ ) {
+        image = Downsample( image, color );
+        data.levelOffsets.push_back( data.data.size() );
+        AppendLevel( image, data.format, data.data );
+    }
+    return data;
+}
+
+static VkDeviceSize ImageBytes( VkDevice device, Image* image ) {
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements( device, image->getImage(), &memoryRequirements );
+    return memoryRequirements.size;
+}
+
+TextureLoader::~TextureLoader() {}
+TextureLoader::TextureLoader( VkDevice device, VkPhysicalDevice physicalDevice, JobSystem* jobSystem, TextureRegistry* registry ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ),
+    m_jobSystem( jobSystem ),
+    m_registry( registry ) {}
+
+void TextureLoader::setup( uint32_t frameCount ) {
+    VkFormatFeatureFlags sampled = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT |
+                                   VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+    m_bc1Supported = isSampled( VK_FORMAT_BC1_RGB_SRGB_BLOCK, sampled );
+    m_bc5Supported = isSampled( VK_FORMAT_BC5_UNORM_BLOCK, sampled );
+    m_bc7Supported = isSampled( VK_FORMAT_BC7_SRGB_BLOCK, sampled );
+    m_staging = new StagingRing( m_device, m_physicalDevice );
+    m_staging->setup( frameCount );
+    m_retired.resize( frameCount );
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties( m_physicalDevice, &memoryProperties );
+    VkDeviceSize deviceLocal = 0;
+    for ( uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++ ) {
+        if ( memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT )
+            deviceLocal = std::max( deviceLocal, memoryProperties.memoryHeaps[i].size );
+    }
+    m_budget = deviceLocal / TEXTURE_STREAM_BUDGET_DIVISOR;
+    LOG( "TextureLoader::setup BC1 " << m_bc1Supported << " BC5 " << m_bc5Supported << " BC7 " << m_bc7Supported <<
+         " budget " << ( m_budget >> 20 ) << " MB" );
+}
+
+void TextureLoader::cmdInitialize( VkCommandBuffer commandBuffer ) {
+    TextureData white;
+    white.format = VK_FORMAT_R8G8B8A8_UNORM;
+    white.size   = { 1, 1 };
+    white.levelOffsets.push_back( 0 );
+    white.data.assign( 4, 255 );
+    m_placeholder = cmdCreateImage( commandBuffer, white );
+}
+
+void TextureLoader::cleanup() {
+    for ( Texture& texture : m_textures ) {
+        if ( texture.decoded.valid() ) texture.decoded.wait();
+        if ( texture.image == nullptr ) continue;
+        texture.image->cleanup();
+        delete texture.image;
+    }
+    m_textures.clear();
+    if ( m_placeholder != nullptr ) {
+        m_placeholder->cleanup();
+        delete m_placeholder;
+        m_placeholder = nullptr;
+    }
+    for ( uint32_t i = 0; i < m_retired.size(); i++ ) releaseFrame( i );
+    m_retired.clear();
+    if ( m_staging != nullptr ) {
+        m_staging->cleanup();
+        delete m_staging;
+        m_staging = nullptr;
+    }
+    m_pendingCount  = 0;
+    m_residentBytes = 0;
+}
+
+uint32_t TextureLoader::load( const std::string& filename, TextureUsage usage ) { return add( filename, usage, false ); }
+uint32_t TextureLoader::stream( const std::string& filename, TextureUsage usage ) { return add( filename, usage, true ); }
+
+uint32_t TextureLoader::cmdUpload( VkCommandBuffer commandBuffer, uint32_t frameIndex ) {
+    frameIndex %= m_retired.size();
+    // The fence of this frame has signaled, its staging memory and the images it replaced are free again
+    m_staging->beginFrame( frameIndex );
+    releaseFrame( frameIndex );
+    m_frame++;
+
+    uint32_t changed = 0;
+    for ( Texture& texture : m_textures ) {
+        if ( m_pendingCount == 0 ) break;
+        if ( !texture.decoded.valid() ) continue;
+        if ( texture.decoded.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready ) continue;
+        m_pendingCount--;
+
+        // A file that fails to decode keeps the placeholder
+        TextureData data;
+        try {
+            data = texture.decoded.get();
+        }
+        catch ( const std::exception& e ) {
+            LOG( "TextureLoader::cmdUpload " << texture.filename << " " << e.what() );
+            continue;
+        }
+        if ( texture.streamed ) {
+            // The finest level at most TEXTURE_STREAM_INITIAL_EXTENT across, or the coarsest there is
+            texture.levels        = std::move( data );
+            texture.coarsestLevel = 0;
+            while ( texture.coarsestLevel + 1 < texture.levels.mipLevels &&
+                    std::max( texture.levels.size.width, texture.levels.size.height ) >> texture.coarsestLevel > TEXTURE_STREAM_INITIAL_EXTENT )
+                texture.coarsestLevel++;
+            texture.requestedLevel = texture.coarsestLevel;
+            texture.lastRequested  = m_frame;
+            cmdSetResidency( commandBuffer, frameIndex, texture, texture.coarsestLevel );
+        }
+        else {
+            texture.image  = cmdCreateImage( commandBuffer, data );
+            texture.bytes  = ImageBytes( m_device, texture.image );
+            m_residentBytes += texture.bytes;
+            m_registry->update( texture.slot, texture.image->getImageView() );
+        }
+        changed++;
+    }
+    return changed + cmdStream( commandBuffer, frameIndex );
+}
+
+void         TextureLoader::setBudget( VkDeviceSize budget ) { m_budget = budget; }
+VkDeviceSize TextureLoader::getBudget() { return m_budget; }
+uint32_t     TextureLoader::getPendingCount() { return m_pendingCount; }
+VkDeviceSize TextureLoader::getResidentBytes() { return m_residentBytes; }
+
+// Private ==================================================
+
+uint32_t TextureLoader::add( const std::string& filename, TextureUsage usage, bool streamed ) {
+    Texture texture;
+    texture.filename = filename;
+    texture.streamed = streamed;
+    texture.slot     = m_registry->add( m_placeholder->getImageView() );
+
+    bool bc1 = m_bc1Supported, bc5 = m_bc5Supported, bc7 = m_bc7Supported;
+    texture.decoded = m_jobSystem->submit( [filename, usage, bc1, bc5, bc7, streamed]() {
+        return DecodeTexture( filename, usage, bc1, bc5, bc7, streamed );
+    } );
+    m_textures.push_back( std::move( texture ) );
+    m_pendingCount++;
+    return m_textures.back().slot;
+}
+
+uint32_t TextureLoader::cmdStream( VkCommandBuffer commandBuffer, uint32_t frameIndex ) {
+    // Feedback of the last frame recorded with this index, detail - 1 is log2 of the texels wanted across
+    // and level L of a texture has MipCount - 1 - L of them
+    const std::vector<uint32_t>& feedback = m_registry->getFeedback();
+    std::vector<Texture*> upgrades;
+    for ( Texture& texture : m_textures ) {
+        if ( !texture.streamed || texture.image == nullptr ) continue;
+        uint32_t detail = texture.slot < feedback.size() ? feedback[texture.slot] : 0;
+        if ( detail > 0 ) {
+            int32_t level          = static_cast<int32_t>( MipCount( texture.levels.size ) ) - static_cast<int32_t>( detail );
+            texture.requestedLevel = UINT32( std::min( std::max( level, 0 ), static_cast<int32_t>( texture.coarsestLevel ) ) );
+            texture.lastRequested  = m_frame;
+        }
+        if ( texture.requestedLevel < texture.residentLevel ) upgrades.push_back( &texture );
+    }
+
+    // The most recently requested first, among them the ones furthest from what they asked for
+    std::sort( upgrades.begin(), upgrades.end(), []( const Texture* a, const Texture* b ) {
+        if ( a->lastRequested != b->lastRequested ) return a->lastRequested > b->lastRequested;
+        return a->residentLevel - a->requestedLevel > b->residentLevel - b->requestedLevel;
+    } );
+
+    // A level per texture and frame, each change uploads the resident levels again from the host copy
+    uint32_t              changed    = 0;
+    VkDeviceSize          uploadLeft = TEXTURE_STREAM_UPLOAD_LIMIT;
+    std::vector<Texture*> evicted;
+    for ( Texture* texture : upgrades ) {
+        // Evicted for a more recent one, it would only take the memory back
+        if ( std::find( evicted.begin(), evicted.end(), texture ) != evicted.end() ) continue;
+        const TextureData& levels = texture->levels;
+        uint32_t     level  = texture->residentLevel - 1;
+        VkDeviceSize upload = levels.data.size() - levels.levelOffsets[level];
+        if ( upload > uploadLeft && changed > 0 ) break;
+
+        // Evicts until the new image fits, the estimate leaves out the alignment of the allocation
+        Texture* victim = nullptr;
+        while ( m_residentBytes - texture->bytes + upload > m_budget && ( victim = findEviction( *texture ) ) != nullptr ) {
+            uploadLeft -= std::min( uploadLeft, victim->levels.data.size() - victim->levels.levelOffsets[victim->residentLevel + 1] );
+            cmdSetResidency( commandBuffer, frameIndex, *victim, victim->residentLevel + 1 );
+            evicted.push_back( victim );
+            changed++;
+        }
+        if ( m_residentBytes - texture->bytes + upload > m_budget ) break;
+
+        cmdSetResidency( commandBuffer, frameIndex, *texture, level );
+        uploadLeft -= std::min( uploadLeft, upload );
+        changed++;
+    }
+    return changed;
+}
+
+void TextureLoader::cmdSetResidency( VkCommandBuffer commandBuffer, uint32_t frameIndex, Texture& texture, uint32_t level ) {
+    Image* image = cmdCreateImage( commandBuffer, texture.levels, level );
+    // Frames in flight keep sampling the old image until the registry copies they use are rewritten
+    if ( texture.image != nullptr ) {
+        m_retired[frameIndex].push_back( texture.image );
+        m_residentBytes -= texture.bytes;
+    }
+    texture.image         = image;
+    texture.bytes         = ImageBytes( m_device, image );
+    texture.residentLevel = level;
+    m_residentBytes      += texture.bytes;
+    m_registry->update( texture.slot, image->getImageView() );
+}
+
+TextureLoader::Texture* TextureLoader::findEviction( const Texture& keep ) {
+    // Levels finer than requested go first, then the finest level of the least recently requested texture.
+    // Textures requested as recently as keep are left alone, two of them would evict each other every frame.
+    Texture* victim = nullptr;
+    auto     rank   = []( const Texture* texture ) {
+        return std::make_pair( texture->residentLevel >= texture->requestedLevel, texture->lastRequested );
+    };
+    for ( Texture& texture : m_textures ) {
+        if ( &texture == &keep || !texture.streamed || texture.image == nullptr ) continue;
+        if ( texture.residentLevel >= texture.coarsestLevel ) continue;
+        bool surplus = texture.residentLevel < texture.requestedLevel;
+        if ( !surplus && texture.lastRequested >= keep.lastRequested ) continue;
+        if ( victim == nullptr || rank( &texture ) < rank( victim ) ) victim = &texture;
+    }
+    return victim;
+}
+
+Image* TextureLoader::cmdCreateImage( VkCommandBuffer commandBuffer, const TextureData& data, uint32_t firstLevel ) {
+    // The levels a file leaves out are blitted when the format allows it, otherwise the chain stops there
+    uint32_t storedLevels = UINT32( data.levelOffsets.size() );
+    uint32_t mipLevels    = data.mipLevels;
+    VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if ( mipLevels > storedLevels && !isSampled( data.format, blit ) ) mipLevels = storedLevels;
+
+    Image* image = new Image( m_device, m_physicalDevice );
+    image->createForTexture( { std::max( data.size.width >> firstLevel, 1 ), std::max( data.size.height >> firstLevel, 1 ) },
+                             data.format, mipLevels - firstLevel );
+
+    VkDeviceSize  base    = data.levelOffsets[firstLevel];
+    StagingRegion staging = m_staging->write( data.data.data() + base, data.data.size() - base );
+
+    std::vector<VkBufferImageCopy> regions;
+    for ( uint32_t level = firstLevel; level < storedLevels; level++ ) {
+        VkBufferImageCopy region{};
+        region.bufferOffset     = staging.offset + data.levelOffsets[level] - base;
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - firstLevel, 0, 1 };
+        region.imageExtent      = { UINT32( std::max( data.size.width >> level, 1 ) ),
+                                    UINT32( std::max( data.size.height >> level, 1 ) ), 1 };
+        regions.push_back( region );
+    }
+    image->cmdTransitionLayout( commandBuffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL );
+    vkd.CmdCopyBufferToImage( commandBuffer, staging.buffer, image->getImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              UINT32( regions.size() ), regions.data() );
+    image->cmdGenerateMipmaps( commandBuffer, storedLevels - firstLevel );
+    return image;
+}
+
+bool TextureLoader::isSampled( VkFormat format, VkFormatFeatureFlags features ) {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties( m_physicalDevice, format, &properties );
+    return ( properties.optimalTilingFeatures & features ) == features;
+}
+
+void TextureLoader::releaseFrame( uint32_t frameIndex ) {
+    for ( Image* image : m_retired[frameIndex] ) {
+        image->cleanup();
+        delete image;
+    }
+    m_retired[frameIndex].clear();
+}
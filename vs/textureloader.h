@@ -0,0 +1,117 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "buffer.h"
+#include "image.h"
+#include "stagingring.h"
+#include "jobs.h"
+#include "textureregistry.h"
+
+// Texels per side of a BC block
+#define TEXTURE_BLOCK_SIZE 4
+// Default budget, this share of the largest device local heap
+#define TEXTURE_STREAM_BUDGET_DIVISOR 4
+// Streamed textures start with the mips at most this many texels across resident, they are never evicted
+#define TEXTURE_STREAM_INITIAL_EXTENT 64
+// Bytes of residency changes uploaded per frame, past it the rest waits for the next frames
+#define TEXTURE_STREAM_UPLOAD_LIMIT ( 16u << 20 )
+
+// Color textures are sRGB and encoded to BC1, normal maps keep x and y in BC5
+enum TextureUsage {
+    TEXTURE_USAGE_COLOR,
+    TEXTURE_USAGE_NORMAL
+};
+
+// What a worker decoded from a file, the levels it provides packed one after another from level 0
+struct TextureData {
+    VkFormat                  format = VK_FORMAT_UNDEFINED;
+    Size<int32_t>             size{ 0, 0 };
+    uint32_t                  mipLevels = 1; // levels of the image, those past levelOffsets are blitted
+    std::vector<VkDeviceSize> levelOffsets;
+    std::vector<uint8_t>      data;
+};
+
+// Loads sampled textures into the TextureRegistry. Files are decoded on the job system, KTX2 files are
+// uploaded in the BC1, BC5, BC7 or RGBA8 format they were stored in, TGA and PPM images are encoded to
+// BC1 or BC5 with their mips built on the worker. Formats the device cannot sample compressed stay RGBA8
+// and get their mips from a vkCmdBlitImage chain, like KTX2 files that come without mips.
+// Streamed textures keep every level on the host and only the coarse ones in an Image at first. The
+// feedback of the TextureRegistry tells which level each one is sampled at, finer levels are uploaded a
+// level per frame while the budget allows it, and under pressure the finest level of the least recently
+// requested texture is evicted. A residency change builds a new Image of the resident levels.
+class TextureLoader {
+
+public:
+    ~TextureLoader();
+    TextureLoader( VkDevice device, VkPhysicalDevice physicalDevice, JobSystem* jobSystem, TextureRegistry* registry );
+
+    void setup( uint32_t frameCount );
+    // Records the upload of the placeholder, before the first load
+    void cmdInitialize( VkCommandBuffer commandBuffer );
+    void cleanup();
+
+    // Returns the registry slot at once, it shows a white placeholder until the upload has been recorded
+    uint32_t load( const std::string& filename, TextureUsage usage = TEXTURE_USAGE_COLOR );
+    // Same as load, with the levels made resident as the shaders request them
+    uint32_t stream( const std::string& filename, TextureUsage usage = TEXTURE_USAGE_COLOR );
+    // Records the uploads of the textures decoded since the last call and the residency changes the
+    // feedback asks for, returns how many textures changed. Call once the fence of frameIndex has
+    // signaled and the registry has begun the frame, staging memory and replaced images are released here.
+    uint32_t cmdUpload( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+
+    // Device memory of every texture together, streaming stops short of it
+    void         setBudget( VkDeviceSize budget );
+    VkDeviceSize getBudget();
+    uint32_t     getPendingCount();
+    VkDeviceSize getResidentBytes();
+
+private:
+
+    struct Texture {
+        std::string              filename;
+        uint32_t                 slot  = 0;
+        Image*                   image = nullptr;
+        VkDeviceSize             bytes = 0;
+        std::future<TextureData> decoded;
+
+        // Streamed textures, image holds the levels from residentLevel on
+        bool        streamed       = false;
+        TextureData levels;
+        uint32_t    residentLevel  = 0;
+        uint32_t    requestedLevel = 0;
+        uint32_t    coarsestLevel  = 0; // resident from the start, the floor of eviction
+        uint64_t    lastRequested  = 0; // frame of the last feedback, the LRU order
+    };
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+    JobSystem*       m_jobSystem      = nullptr;
+    TextureRegistry* m_registry       = nullptr;
+
+    // What uploads are encoded to, decided once from the format support of the device
+    bool m_bc1Supported = false;
+    bool m_bc5Supported = false;
+    bool m_bc7Supported = false;
+
+    Image*                            m_placeholder = nullptr;
+    std::vector<Texture>              m_textures;
+    StagingRing*                      m_staging     = nullptr;
+    std::vector<std::vector<Image*>>  m_retired; // replaced while recording each frame
+    uint32_t                          m_pendingCount  = 0;
+    VkDeviceSize                      m_residentBytes = 0;
+    VkDeviceSize                      m_budget        = 0;
+    uint64_t                          m_frame         = 0;
+
+    uint32_t add( const std::string& filename, TextureUsage usage, bool streamed );
+    uint32_t cmdStream( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+    void     cmdSetResidency( VkCommandBuffer commandBuffer, uint32_t frameIndex, Texture& texture, uint32_t level );
+    Texture* findEviction( const Texture& keep );
+    // Holds the levels of data from firstLevel on
+    Image*   cmdCreateImage( VkCommandBuffer commandBuffer, const TextureData& data, uint32_t firstLevel = 0 );
+    bool     isSampled( VkFormat format, VkFormatFeatureFlags features );
+    void     releaseFrame( uint32_t frameIndex );
+
+};
@@ -0,0 +1,229 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "textureregistry.h"
+#include "dispatch.h"
+
+TextureRegistry::~TextureRegistry() {}
+TextureRegistry::TextureRegistry( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void TextureRegistry::setup( uint32_t frameCount, LayoutCache* layoutCache ) {
+    VkPhysicalDeviceDescriptorIndexingProperties indexingProperties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES };
+    VkPhysicalDeviceProperties2 properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+    properties2.pNext = &indexingProperties;
+    vkGetPhysicalDeviceProperties2( m_physicalDevice, &properties2 );
+    m_capacity = std::min( { UINT32( TEXTURE_REGISTRY_CAPACITY ),
+                             indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages,
+                             indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages } );
+
+    // The array is the variable count binding, which has to be the last one
+    VkDescriptorSetLayoutBinding bindings[2]{};
+    bindings[0].binding         = 0;
+    bindings[0].descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags      = VK_SHADER_STAGE_ALL;
+    bindings[1].binding         = 1;
+    bindings[1].descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[1].descriptorCount = m_capacity;
+    bindings[1].stageFlags      = VK_SHADER_STAGE_ALL;
+
+    // The feedback buffer is written once, here. Empty slots are never sampled, a slot may be written after
+    // the set was bound in the frame being recorded.
+    VkDescriptorBindingFlags bindingFlags[2] = { 0,
+                                                 VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+                                                 VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+                                                 VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT };
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO };
+    bindingFlagsInfo.bindingCount  = 2;
+    bindingFlagsInfo.pBindingFlags = bindingFlags;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+    layoutInfo.pNext        = &bindingFlagsInfo;
+    layoutInfo.flags        = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layoutInfo.bindingCount = 2;
+    layoutInfo.pBindings    = bindings;
+    VkResult result = vkCreateDescriptorSetLayout( m_device, &layoutInfo, nullptr, &m_setLayout );
+    CHECK_VKRESULT( result, "failed to create descriptor set layout!" );
+    layoutCache->setSharedSetLayout( TEXTURE_SET, m_setLayout );
+
+    VkDescriptorPoolSize poolSizes[] = { { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_capacity * frameCount },
+                                         { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frameCount } };
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.flags         = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    poolInfo.maxSets       = frameCount;
+    poolInfo.poolSizeCount = 2;
+    poolInfo.pPoolSizes    = poolSizes;
+    result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    std::vector<uint32_t>              counts( frameCount, m_capacity );
+    std::vector<VkDescriptorSetLayout> setLayouts( frameCount, m_setLayout );
+    VkDescriptorSetVariableDescriptorCountAllocateInfo countInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO };
+    countInfo.descriptorSetCount = frameCount;
+    countInfo.pDescriptorCounts  = counts.data();
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.pNext              = &countInfo;
+    allocateInfo.descriptorPool     = m_descPool;
+    allocateInfo.descriptorSetCount = frameCount;
+    allocateInfo.pSetLayouts        = setLayouts.data();
+    m_descSets.resize( frameCount );
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, m_descSets.data() );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    // Host visible, read back once the frame's fence has signaled
+    std::vector<uint32_t> zeros( m_capacity, 0 );
+    for ( uint32_t i = 0; i < frameCount; i++ ) {
+        Buffer* feedback = new Buffer( m_device, m_physicalDevice );
+        feedback->setup( m_capacity * sizeof( uint32_t ), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT );
+        feedback->create();
+        feedback->fillBufferFull( zeros.data() );
+        m_feedbackBuffers.push_back( feedback );
+
+        VkDescriptorBufferInfo bufferInfo = feedback->getBufferInfo();
+        VkWriteDescriptorSet   writeSet{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+        writeSet.dstSet          = m_descSets[i];
+        writeSet.dstBinding      = 0;
+        writeSet.descriptorCount = 1;
+        writeSet.descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeSet.pBufferInfo     = &bufferInfo;
+        vkUpdateDescriptorSets( m_device, 1, &writeSet, 0, nullptr );
+    }
+
+    VkSamplerCreateInfo samplerInfo{ VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+    samplerInfo.magFilter        = VK_FILTER_LINEAR;
+    samplerInfo.minFilter        = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode       = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.addressModeU     = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeV     = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeW     = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.anisotropyEnable = VK_TRUE;
+    samplerInfo.maxAnisotropy    = properties2.properties.limits.maxSamplerAnisotropy;
+    samplerInfo.maxLod           = VK_LOD_CLAMP_NONE;
+    result = vkCreateSampler( m_device, &samplerInfo, nullptr, &m_sampler );
+    CHECK_VKRESULT( result, "failed to create sampler!" );
+
+    m_retiredSlots.assign( frameCount, {} );
+    m_dirtySlots.assign( frameCount, {} );
+    LOG( "TextureRegistry::setup " << m_capacity << " slots" );
+}
+
+void TextureRegistry::cleanup() {
+    for ( Buffer* feedback : m_feedbackBuffers ) {
+        feedback->cleanup();
+        delete feedback;
+    }
+    m_feedbackBuffers.clear();
+    m_feedback.clear();
+    vkDestroySampler( m_device, m_sampler, nullptr );
+    vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    vkDestroyDescriptorSetLayout( m_device, m_setLayout, nullptr );
+    m_sampler   = VK_NULL_HANDLE;
+    m_descPool  = VK_NULL_HANDLE;
+    m_setLayout = VK_NULL_HANDLE;
+    m_descSets.clear();
+    m_slots.clear();
+    m_freeSlots.clear();
+    m_retiredSlots.clear();
+    m_dirtySlots.clear();
+    m_slotCount    = 0;
+    m_textureCount = 0;
+}
+
+uint32_t TextureRegistry::add( VkImageView imageView, VkSampler sampler ) {
+    uint32_t slot;
+    if ( !m_freeSlots.empty() ) {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+    }
+    else {
+        if ( m_slotCount == m_capacity ) RUNTIME_ERROR( "texture registry is full!" );
+        slot = m_slotCount++;
+        m_slots.push_back( {} );
+    }
+    set( slot, imageView, sampler );
+    m_textureCount++;
+    return slot;
+}
+
+void TextureRegistry::update( uint32_t slot, VkImageView imageView, VkSampler sampler ) {
+    if ( slot >= m_slotCount ) RUNTIME_ERROR( "texture slot out of range!" );
+    set( slot, imageView, sampler );
+}
+
+void TextureRegistry::remove( uint32_t slot ) {
+    if ( slot >= m_slotCount ) RUNTIME_ERROR( "texture slot out of range!" );
+    // The descriptor is left as is, partially bound slots that no material points at are never read
+    m_retiredSlots[m_frameIndex].push_back( slot );
+    m_textureCount--;
+}
+
+void TextureRegistry::beginFrame( uint32_t frameIndex ) {
+    // The last frame recorded with this index has completed, its copy is free to rewrite and nothing
+    // samples the slots removed while recording it anymore
+    m_frameIndex = frameIndex % m_descSets.size();
+    std::vector<uint32_t>& retired = m_retiredSlots[m_frameIndex];
+    m_freeSlots.insert( m_freeSlots.end(), retired.begin(), retired.end() );
+    retired.clear();
+
+    write( m_frameIndex, m_dirtySlots[m_frameIndex] );
+    m_dirtySlots[m_frameIndex].clear();
+
+    // Cleared for the frame about to be recorded, only the slots handed out so far can have been written
+    m_feedback.resize( m_slotCount );
+    if ( m_slotCount == 0 ) return;
+    VkDeviceSize size   = m_slotCount * sizeof( uint32_t );
+    uint32_t*    mapped = static_cast<uint32_t*>( m_feedbackBuffers[m_frameIndex]->mapMemory( size ) );
+    memcpy( m_feedback.data(), mapped, size );
+    memset( mapped, 0, size );
+    m_feedbackBuffers[m_frameIndex]->unmapMemory();
+}
+
+void TextureRegistry::cmdEndFrame( VkCommandBuffer commandBuffer ) {
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+}
+
+VkDescriptorSetLayout TextureRegistry::getSetLayout() { return m_setLayout; }
+VkDescriptorSet       TextureRegistry::getDescriptorSet() { return m_descSets[m_frameIndex]; }
+VkSampler             TextureRegistry::getDefaultSampler() { return m_sampler; }
+uint32_t              TextureRegistry::getCapacity() { return m_capacity; }
+uint32_t              TextureRegistry::getTextureCount() { return m_textureCount; }
+
+const std::vector<uint32_t>& TextureRegistry::getFeedback() { return m_feedback; }
+
+// Private ==================================================
+
+void TextureRegistry::set( uint32_t slot, VkImageView imageView, VkSampler sampler ) {
+    m_slots[slot] = { sampler != VK_NULL_HANDLE ? sampler : m_sampler, imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+
+    // The frame being recorded sees the slot at once, update after bind allows it even with its copy
+    // already bound. The other copies may be in use and get it in beginFrame.
+    for ( uint32_t i = 0; i < m_descSets.size(); i++ ) {
+        if ( i != m_frameIndex ) m_dirtySlots[i].push_back( slot );
+    }
+    write( m_frameIndex, { slot } );
+}
+
+void TextureRegistry::write( uint32_t frameIndex, const std::vector<uint32_t>& slots ) {
+    std::vector<VkWriteDescriptorSet> writeSets;
+    for ( uint32_t slot : slots ) {
+        VkWriteDescriptorSet writeSet{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+        writeSet.dstSet          = m_descSets[frameIndex];
+        writeSet.dstBinding      = 1;
+        writeSet.dstArrayElement = slot;
+        writeSet.descriptorCount = 1;
+        writeSet.descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        writeSet.pImageInfo      = &m_slots[slot];
+        writeSets.push_back( writeSet );
+    }
+    if ( writeSets.empty() ) return;
+    vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+}
@@ -0,0 +1,81 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "layoutcache.h"
+#include "buffer.h"
+
+// Set index of textureSamplers[] in every shader that samples materials
+#define TEXTURE_SET 2
+// Slots of the table, lowered to what the device allows for update after bind
+#define TEXTURE_REGISTRY_CAPACITY 4096
+
+// Every texture of the scene in one descriptor array at binding 1, indexed by slot with nonuniformEXT. The
+// binding is partially bound, updated after bind and has a variable count, so textures come and go without
+// new sets, and the raster, ray tracing and compute pipelines all bind the same one. Each frame in flight
+// has its own copy, a slot is rewritten in a copy only once the frame using it has completed.
+// Binding 0 is the feedback of that frame, the finest detail the shaders sampled each slot with, see
+// requestTextureDetail in textures.glsl.
+class TextureRegistry {
+
+public:
+    ~TextureRegistry();
+    TextureRegistry( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // Registers the set layout with the cache as TEXTURE_SET, before the pipeline layouts that use it are created
+    void setup( uint32_t frameCount, LayoutCache* layoutCache );
+    void cleanup();
+
+    // Returns the slot the shaders sample the view with, stable until it is removed. The image has to be in
+    // SHADER_READ_ONLY_OPTIMAL whenever a frame may sample it, VK_NULL_HANDLE uses the default sampler.
+    uint32_t add( VkImageView imageView, VkSampler sampler = VK_NULL_HANDLE );
+    // Points the slot at another view, for a texture whose image is replaced. Frames still in flight keep
+    // sampling the previous view, it has to stay alive until they complete.
+    void     update( uint32_t slot, VkImageView imageView, VkSampler sampler = VK_NULL_HANDLE );
+    // The slot is handed out again once the frames in flight that may still sample it have completed
+    void     remove( uint32_t slot );
+
+    // Call once the fence of frameIndex has signaled, before recording it. Writes the slots changed
+    // since the copy of this frame was last used and reads its feedback.
+    void beginFrame( uint32_t frameIndex );
+    // Makes the feedback written by the frame visible to the host, last in its command buffer
+    void cmdEndFrame( VkCommandBuffer commandBuffer );
+
+    VkDescriptorSetLayout getSetLayout();
+    // Copy of the frame being recorded
+    VkDescriptorSet       getDescriptorSet();
+    VkSampler             getDefaultSampler();
+    uint32_t              getCapacity();
+    uint32_t              getTextureCount();
+    // Per slot, what the frame read in beginFrame requested: 0 when it did not sample the slot,
+    // otherwise 1 + log2 of the texels it wanted across the texture
+    const std::vector<uint32_t>& getFeedback();
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    VkDescriptorSetLayout        m_setLayout = VK_NULL_HANDLE;
+    VkDescriptorPool             m_descPool  = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> m_descSets;
+    std::vector<Buffer*>         m_feedbackBuffers;
+    VkSampler                    m_sampler   = VK_NULL_HANDLE;
+
+    uint32_t m_capacity     = 0;
+    uint32_t m_slotCount    = 0; // slots ever handed out, the free list reuses those below
+    uint32_t m_textureCount = 0;
+    uint32_t m_frameIndex   = 0;
+
+    std::vector<VkDescriptorImageInfo> m_slots;
+    std::vector<uint32_t>              m_freeSlots;
+    std::vector<std::vector<uint32_t>> m_retiredSlots; // removed while recording each frame
+    std::vector<std::vector<uint32_t>> m_dirtySlots;   // changed since each frame's copy was written
+    std::vector<uint32_t>              m_feedback;
+
+    void set( uint32_t slot, VkImageView imageView, VkSampler sampler );
+    void write( uint32_t frameIndex, const std::vector<uint32_t>& slots );
+
+};
@@ -0,0 +1,112 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <algorithm>
+
+#include "tlasbuilder.h"
+#include "dispatch.h"
+
+#define TLAS_BUILD_FLAGS ( VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR )
+
+TlasBuilder::~TlasBuilder() {}
+TlasBuilder::TlasBuilder( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelProperties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR };
+    VkPhysicalDeviceProperties2 properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+    properties2.pNext = &accelProperties;
+    vkGetPhysicalDeviceProperties2( m_physicalDevice, &properties2 );
+    m_scratchAlignment = accelProperties.minAccelerationStructureScratchOffsetAlignment;
+}
+
+void TlasBuilder::setup( uint32_t maxInstanceCount ) {
+    m_maxInstanceCount = std::max( maxInstanceCount, 1u );
+
+    VkAccelerationStructureGeometryKHR geometry{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+    geometry.geometryType       = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR };
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo = getBuildInfo( &geometry );
+
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
+    vkd.GetAccelerationStructureBuildSizesKHR( m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
+                                               &m_maxInstanceCount, &sizeInfo );
+
+    m_tlas = CreateAccelStructure( m_device, m_physicalDevice, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, sizeInfo.accelerationStructureSize );
+
+    // One scratch buffer serves both modes, builds are serialized by barriers
+    VkDeviceSize scratchSize = std::max( sizeInfo.buildScratchSize, sizeInfo.updateScratchSize );
+    m_scratchBuffer = new Buffer( m_device, m_physicalDevice );
+    m_scratchBuffer->setup( scratchSize + m_scratchAlignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
+    m_scratchBuffer->create();
+    m_scratchAddress = AlignUp( m_scratchBuffer->getDeviceAddress(), m_scratchAlignment );
+}
+
+void TlasBuilder::cleanup() {
+    DestroyAccelStructure( m_device, m_tlas );
+    if ( m_scratchBuffer != nullptr ) {
+        m_scratchBuffer->cleanup();
+        delete m_scratchBuffer;
+    }
+    m_scratchBuffer = nullptr;
+    m_built         = false;
+}
+
+void TlasBuilder::cmdUpdate( VkCommandBuffer commandBuffer, VkDeviceAddress instanceAddress, uint32_t instanceCount ) {
+    if ( instanceCount > m_maxInstanceCount ) RUNTIME_ERROR( "too many TLAS instances!" );
+    cmdBuild( commandBuffer, instanceAddress, instanceCount );
+}
+
+VkAccelerationStructureKHR TlasBuilder::getHandle() { return m_tlas.handle; }
+
+bool TlasBuilder::isBuilt() { return m_built; }
+
+// Private ==================================================
+
+VkAccelerationStructureBuildGeometryInfoKHR TlasBuilder::getBuildInfo( const VkAccelerationStructureGeometryKHR* geometry ) {
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR };
+    buildInfo.flags         = TLAS_BUILD_FLAGS;
+    buildInfo.mode          = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    buildInfo.geometryCount = 1;
+    buildInfo.pGeometries   = geometry;
+    return buildInfo;
+}
+
+void TlasBuilder::cmdBuild( VkCommandBuffer commandBuffer, VkDeviceAddress instanceAddress, uint32_t instanceCount ) {
+    // A refit needs the same instance count as the build it starts from
+    bool update = m_built && instanceCount == m_builtCount && m_updatesSinceBuild < TLAS_REBUILD_INTERVAL;
+
+    // Earlier frames may still trace against the TLAS or use the scratch memory
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    VkAccelerationStructureGeometryKHR geometry{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR };
+    geometry.geometryType       = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR };
+    geometry.geometry.instances.arrayOfPointers    = VK_FALSE;
+    geometry.geometry.instances.data.deviceAddress = instanceAddress;
+
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo = getBuildInfo( &geometry );
+    buildInfo.mode                      = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.srcAccelerationStructure  = update ? m_tlas.handle : VK_NULL_HANDLE;
+    buildInfo.dstAccelerationStructure  = m_tlas.handle;
+    buildInfo.scratchData.deviceAddress = m_scratchAddress;
+
+    VkAccelerationStructureBuildRangeInfoKHR range{ instanceCount, 0, 0, 0 };
+    const VkAccelerationStructureBuildRangeInfoKHR* ranges = &range;
+
+    vkd.CmdBuildAccelerationStructuresKHR( commandBuffer, 1, &buildInfo, &ranges );
+
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    m_updatesSinceBuild = update ? m_updatesSinceBuild + 1 : 0;
+    m_builtCount        = instanceCount;
+    m_built             = true;
+}
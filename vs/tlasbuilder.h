@@ -0,0 +1,49 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "accelstructure.h"
+
+// Refits lose trace performance as instances drift, a full build restores it
+#define TLAS_REBUILD_INTERVAL 120
+
+class TlasBuilder {
+
+public:
+    ~TlasBuilder();
+    TlasBuilder( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // The TLAS is sized once for maxInstanceCount
+    void setup( uint32_t maxInstanceCount );
+    void cleanup();
+
+    // Records an in-place refit from an instance array that lives on the GPU. Runs a full build on
+    // the first call, when the instance count changes and every TLAS_REBUILD_INTERVAL refits.
+    void cmdUpdate( VkCommandBuffer commandBuffer, VkDeviceAddress instanceAddress, uint32_t instanceCount );
+
+    VkAccelerationStructureKHR getHandle();
+    // False until the first cmdUpdate, nothing may trace against the TLAS before
+    bool isBuilt();
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    AccelStructure m_tlas;
+    uint32_t       m_maxInstanceCount = 0;
+
+    Buffer*         m_scratchBuffer    = nullptr;
+    VkDeviceAddress m_scratchAddress   = 0;
+    VkDeviceSize    m_scratchAlignment = 0;
+
+    bool     m_built             = false;
+    uint32_t m_builtCount        = 0;
+    uint32_t m_updatesSinceBuild = 0;
+
+    VkAccelerationStructureBuildGeometryInfoKHR getBuildInfo( const VkAccelerationStructureGeometryKHR* geometry );
+    void cmdBuild( VkCommandBuffer commandBuffer, VkDeviceAddress instanceAddress, uint32_t instanceCount );
+
+};
@@ -0,0 +1,190 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#include <array>
+
+#include "upsampler.h"
+#include "dispatch.h"
+
+Upsampler::~Upsampler() {}
+Upsampler::Upsampler( VkDevice device, VkPhysicalDevice physicalDevice ) :
+    m_device( device ),
+    m_physicalDevice( physicalDevice ) {}
+
+void Upsampler::setup( Size<int32_t> size, uint32_t frameCount, VkDescriptorSetLayout setLayout,
+                       VkDescriptorSetLayout guideSetLayout, VkRenderPass guideRenderPass ) {
+    m_size            = size;
+    m_guideRenderPass = guideRenderPass;
+
+    // The checkerboard launch is the largest, half as wide as the target
+    Size<int32_t> lowSize = GetLaunchSize( size, RT_RESOLUTION_CHECKERBOARD );
+    for ( Image** image : { &m_color, &m_normalDepth, &m_albedo } ) {
+        *image = new Image( m_device, m_physicalDevice );
+        ( *image )->createForOffscreen( lowSize );
+    }
+
+    m_guide = new Image( m_device, m_physicalDevice );
+    m_guide->createForOffscreen( size );
+    m_guideDepth = new Image( m_device, m_physicalDevice );
+    m_guideDepth->createForDepth( size );
+
+    VkImageView attachments[] = { m_guide->getImageView(), m_guideDepth->getImageView() };
+    VkFramebufferCreateInfo framebufferInfo{ VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO };
+    framebufferInfo.renderPass      = guideRenderPass;
+    framebufferInfo.attachmentCount = 2;
+    framebufferInfo.pAttachments    = attachments;
+    framebufferInfo.width           = size.width;
+    framebufferInfo.height          = size.height;
+    framebufferInfo.layers          = 1;
+    VkResult result = vkCreateFramebuffer( m_device, &framebufferInfo, nullptr, &m_guideFramebuffer );
+    CHECK_VKRESULT( result, "failed to create framebuffer!" );
+
+    // A set of upsample.comp and one of the guide per frame
+    std::array<VkDescriptorPoolSize, 2> poolSizes = { {
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 9 * frameCount },
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * frameCount },
+    } };
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.maxSets       = 2 * frameCount;
+    poolInfo.poolSizeCount = UINT32( poolSizes.size() );
+    poolInfo.pPoolSizes    = poolSizes.data();
+    result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_descPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    std::vector<VkDescriptorSetLayout> setLayouts( frameCount, setLayout );
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.descriptorPool     = m_descPool;
+    allocateInfo.descriptorSetCount = frameCount;
+    allocateInfo.pSetLayouts        = setLayouts.data();
+    m_descSets.resize( frameCount );
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, m_descSets.data() );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    std::vector<VkDescriptorSetLayout> guideSetLayouts( frameCount, guideSetLayout );
+    allocateInfo.pSetLayouts = guideSetLayouts.data();
+    m_guideDescSets.resize( frameCount );
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, m_guideDescSets.data() );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+}
+
+void Upsampler::cleanup() {
+    for ( Image** image : { &m_color, &m_normalDepth, &m_albedo, &m_guide, &m_guideDepth } ) {
+        if ( *image == nullptr ) continue;
+        ( *image )->cleanup();
+        delete *image;
+        *image = nullptr;
+    }
+    vkDestroyFramebuffer( m_device, m_guideFramebuffer, nullptr );
+    vkDestroyDescriptorPool( m_device, m_descPool, nullptr );
+    m_guideFramebuffer = VK_NULL_HANDLE;
+    m_descPool         = VK_NULL_HANDLE;
+    m_descSets.clear();
+    m_guideDescSets.clear();
+}
+
+void Upsampler::updateDescriptorSets( const std::vector<Image*>& targets, const std::vector<VkDescriptorBufferInfo>& cameraInfos ) {
+    // Bindings 0 to 8, the guide, the low resolution images and then the targets
+    std::vector<Image*> images = { m_guide, m_color, m_normalDepth, m_albedo };
+    images.insert( images.end(), targets.begin(), targets.end() );
+    std::vector<VkDescriptorImageInfo> imageInfos;
+    for ( Image* image : images ) imageInfos.push_back( { VK_NULL_HANDLE, image->getImageView(), VK_IMAGE_LAYOUT_GENERAL } );
+
+    // The sets only differ in the camera buffer
+    for ( uint32_t frame = 0; frame < m_descSets.size(); frame++ ) {
+        std::vector<VkWriteDescriptorSet> writeSets( images.size() + 2, { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET } );
+        for ( uint32_t binding = 0; binding < images.size(); binding++ ) {
+            writeSets[binding].dstSet          = m_descSets[frame];
+            writeSets[binding].dstBinding      = binding;
+            writeSets[binding].descriptorCount = 1;
+            writeSets[binding].descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            writeSets[binding].pImageInfo      = &imageInfos[binding];
+        }
+        VkWriteDescriptorSet& cameraWrite = writeSets[images.size()];
+        cameraWrite.dstSet          = m_descSets[frame];
+        cameraWrite.dstBinding      = UINT32( images.size() );
+        cameraWrite.descriptorCount = 1;
+        cameraWrite.descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        cameraWrite.pBufferInfo     = &cameraInfos[frame];
+        VkWriteDescriptorSet& guideWrite = writeSets[images.size() + 1];
+        guideWrite            = cameraWrite;
+        guideWrite.dstSet     = m_guideDescSets[frame];
+        guideWrite.dstBinding = 0;
+        vkUpdateDescriptorSets( m_device, UINT32( writeSets.size() ), writeSets.data(), 0, nullptr );
+    }
+}
+
+void Upsampler::cmdInitialize( VkCommandBuffer commandBuffer ) {
+    for ( Image* image : { m_color, m_normalDepth, m_albedo } ) {
+        image->cmdTransitionLayout( commandBuffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL );
+    }
+}
+
+bool Upsampler::cmdRenderGuide( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                                uint32_t resolution, const std::vector<Mesh*>& meshes ) {
+    if ( resolution == RT_RESOLUTION_FULL || pipeline == VK_NULL_HANDLE ) return false;
+
+    // upsample.comp of the previous frame may still be reading the guide
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    // A w of -1 marks a miss, as in the G-buffer of raytrace.rgen
+    std::array<VkClearValue, 2> clearValues{};
+    clearValues[0].color        = { 0.0f, 0.0f, 0.0f, -1.0f };
+    clearValues[1].depthStencil = { 1.0f, 0 };
+
+    VkRenderPassBeginInfo renderPassBeginInfo{ VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO };
+    renderPassBeginInfo.renderPass      = m_guideRenderPass;
+    renderPassBeginInfo.framebuffer     = m_guideFramebuffer;
+    renderPassBeginInfo.renderArea      = { { 0, 0 }, { UINT32( m_size.width ), UINT32( m_size.height ) } };
+    renderPassBeginInfo.clearValueCount = UINT32( clearValues.size() );
+    renderPassBeginInfo.pClearValues    = clearValues.data();
+    vkd.CmdBeginRenderPass( commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE );
+
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline );
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &m_guideDescSets[frameIndex], 0, nullptr );
+    VkDeviceSize offsets[] = { 0 };
+    for ( Mesh* mesh : meshes ) {
+        glm::mat4 model = mesh->getMatrix();
+        vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof( glm::mat4 ), &model );
+        vkd.CmdBindVertexBuffers( commandBuffer, 0, 1, &mesh->m_vertexBuffer->m_buffer, offsets );
+        vkd.CmdBindIndexBuffer( commandBuffer, mesh->m_indexBuffer->m_buffer, 0, VK_INDEX_TYPE_UINT32 );
+        vkd.CmdDrawIndexed( commandBuffer, mesh->getIndexCount(), 1, 0, 0, 0 );
+    }
+
+    vkd.CmdEndRenderPass( commandBuffer );
+    return true;
+}
+
+bool Upsampler::cmdUpsample( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                             const UpsampleSettings& settings ) {
+    if ( settings.resolution == RT_RESOLUTION_FULL || pipeline == VK_NULL_HANDLE ) return false;
+
+    // The launch has written the low resolution images and the guide pass the guide
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr );
+
+    vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline );
+    vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &m_descSets[frameIndex], 0, nullptr );
+    vkd.CmdPushConstants( commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( UpsampleSettings ), &settings );
+    vkd.CmdDispatch( commandBuffer, ( m_size.width  + UPSAMPLE_WORKGROUP_SIZE - 1 ) / UPSAMPLE_WORKGROUP_SIZE,
+                                    ( m_size.height + UPSAMPLE_WORKGROUP_SIZE - 1 ) / UPSAMPLE_WORKGROUP_SIZE, 1 );
+    return true;
+}
+
+Size<int32_t> Upsampler::GetLaunchSize( Size<int32_t> size, uint32_t resolution ) {
+    // Blocks of the pixels one thread stands for, as in traceBlock of resolution.glsl
+    static const int32_t blocks[RT_RESOLUTION_COUNT][2] = { { 1, 1 }, { 2, 1 }, { 2, 2 }, { 4, 4 } };
+    const int32_t* block = blocks[resolution];
+    return { ( size.width + block[0] - 1 ) / block[0], ( size.height + block[1] - 1 ) / block[1] };
+}
+
+Image* Upsampler::getColor      () { return m_color;       }
+Image* Upsampler::getNormalDepth() { return m_normalDepth; }
+Image* Upsampler::getAlbedo     () { return m_albedo;      }
@@ -0,0 +1,95 @@
+//  Copyright © 2021 Subph. All rights reserved.
+//
+
+#pragma once
+
+#include "common.h"
+#include "image.h"
+#include "mesh.h"
+
+#define UPSAMPLE_WORKGROUP_SIZE 8
+
+// Pixels raytrace.rgen traces per frame, mirrored in resolution.glsl
+enum RtResolution {
+    RT_RESOLUTION_FULL,
+    RT_RESOLUTION_CHECKERBOARD, // half of the pixels, every other one of a row
+    RT_RESOLUTION_HALF,         // a quarter, one of each 2x2 block
+    RT_RESOLUTION_QUARTER,      // a sixteenth, one of each 4x4 block
+    RT_RESOLUTION_COUNT
+};
+
+// Push constants of upsample.comp
+struct UpsampleSettings {
+    uint32_t resolution      = RT_RESOLUTION_FULL;
+    uint32_t frame           = 0;
+    uint32_t sampleCount     = 0;
+    uint32_t samplesPerPixel = 1;
+    float    sigmaDepth      = 0.1f;
+    float    sigmaNormal     = 32.0f;
+};
+
+// Brings a reduced resolution launch of raytrace.rgen back to full resolution. The launch writes one
+// sample per thread into the low resolution images, a different pixel of its block every frame, and
+// upsample.comp blends them into the target guided by the depth and normal of every full resolution
+// pixel. The guide is rasterized, so no full resolution rays are traced. It also takes over the
+// running average and the denoiser G-buffer the full resolution launch writes. Every image stays in
+// GENERAL layout.
+class Upsampler {
+
+public:
+    ~Upsampler();
+    Upsampler( VkDevice device, VkPhysicalDevice physicalDevice );
+
+    // setLayout is the set 0 layout of upsample.comp and guideSetLayout the one of upsample_guide.vert, the
+    // low resolution images are sized for the largest reduced launch. guideRenderPass has an RGBA32F color
+    // and a depth attachment, like the offscreen pass. Each frame in flight gets its own sets for the camera
+    // buffer of that frame.
+    void setup( Size<int32_t> size, uint32_t frameCount, VkDescriptorSetLayout setLayout,
+                VkDescriptorSetLayout guideSetLayout, VkRenderPass guideRenderPass );
+    void cleanup();
+
+    // target, accumulation and G-buffer in the order the full resolution launch binds them and the camera
+    // buffer of every frame
+    void updateDescriptorSets( const std::vector<Image*>& targets, const std::vector<VkDescriptorBufferInfo>& cameraInfos );
+
+    // Moves the images from UNDEFINED to GENERAL
+    void cmdInitialize( VkCommandBuffer commandBuffer );
+
+    // Rasterizes the meshes into the guide with upsample_guide.vert and .frag. Records nothing and returns
+    // false at full resolution or until the pipeline is ready. Call before the launch.
+    bool cmdRenderGuide( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                         uint32_t resolution, const std::vector<Mesh*>& meshes );
+
+    // Records nothing and returns false at full resolution or until the pipeline is ready. Call after
+    // the launch and the guide, the barrier between them is recorded here.
+    bool cmdUpsample( VkCommandBuffer commandBuffer, uint32_t frameIndex, VkPipeline pipeline, VkPipelineLayout pipelineLayout,
+                      const UpsampleSettings& settings );
+
+    // Threads raytrace.rgen is launched with
+    static Size<int32_t> GetLaunchSize( Size<int32_t> size, uint32_t resolution );
+
+    Image* getColor();
+    Image* getNormalDepth();
+    Image* getAlbedo();
+
+private:
+
+    VkDevice         m_device         = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+
+    Size<int32_t>    m_size{};
+    Image*           m_color       = nullptr;
+    Image*           m_normalDepth = nullptr;
+    Image*           m_albedo      = nullptr;
+
+    // Full resolution normal and hit distance, drawn in m_guideRenderPass
+    Image*           m_guide            = nullptr;
+    Image*           m_guideDepth       = nullptr;
+    VkRenderPass     m_guideRenderPass  = VK_NULL_HANDLE;
+    VkFramebuffer    m_guideFramebuffer = VK_NULL_HANDLE;
+
+    VkDescriptorPool             m_descPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> m_descSets;
+    std::vector<VkDescriptorSet> m_guideDescSets;
+
+};
@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
 #include "app.h"
+#include "dispatch.h"
 
 
 void App::initRayTracing() {
@@ -6,263 +11,223 @@ void App::initRayTracing() {
     VkPhysicalDeviceProperties2 properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
     properties2.pNext = &m_rtProperties;
     vkGetPhysicalDeviceProperties2( m_physicalDevice, &properties2 );
+
+    // Compares the ray tracing pipeline with the wavefront integrator
+    m_rtTimer = new GpuTimer( m_device, m_physicalDevice );
+    m_rtTimer->setup( m_totalFrame );
+    m_rtTimedWavefront.assign( m_totalFrame, false );
 }
 
-void App::createBottomLevelAS() {
-    VkBuffer vertexBuffer = m_pCube->m_vertexBuffer->getBuffer();
-    VkBufferDeviceAddressInfo vertexInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
-    vertexInfo.buffer = vertexBuffer;
-    VkDeviceAddress vertexAddress = vkGetBufferDeviceAddress( m_device, &vertexInfo );
-
-    VkBuffer indexBuffer = m_pCube->m_indexBuffer->getBuffer();
-    VkBufferDeviceAddressInfo indexInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
-    indexInfo.buffer = indexBuffer;
-
-    VkDeviceAddress indexAddress = vkGetBufferDeviceAddress( m_device, &indexInfo );
-
-    VkAccelerationStructureGeometryTrianglesDataKHR triangles{};
-    triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-    triangles.vertexFormat             = VK_FORMAT_R32G32B32_SFLOAT;
-    triangles.vertexData.deviceAddress = vertexAddress;
-    triangles.vertexStride             = 1;
-    triangles.indexType                = VK_INDEX_TYPE_UINT32;
-    triangles.indexData.deviceAddress  = indexAddress;
-    triangles.maxVertex                = static_cast<uint32_t>(m_pCube->m_positions.size());
-
-    VkAccelerationStructureGeometryKHR geometry{};
-    geometry.sType              = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-    geometry.geometryType       = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-    geometry.flags              = VK_GEOMETRY_OPAQUE_BIT_KHR;
-    geometry.geometry.triangles = triangles;
-
-    VkAccelerationStructureBuildRangeInfoKHR offset{};
-    offset.firstVertex     = 0;
-    offset.primitiveCount  = static_cast< uint32_t >( m_pCube->m_indices.size() / 3 );
-    offset.primitiveOffset = 0;
-    offset.transformOffset = 0;
-
-    VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
-    buildInfo.sType         = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-    buildInfo.flags         = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    buildInfo.mode          = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    buildInfo.geometryCount = 1;
-    buildInfo.pGeometries   = &geometry;
-    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-
-    VkDeviceSize              maxScratch{ 0 };
-    std::vector<VkDeviceSize> originalSizes( 1 );
-
-    uint32_t maxPrimCount = offset.primitiveCount;
-
-    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
-
-    PFN_vkGetAccelerationStructureBuildSizesKHR GetAccelerationStructureBuildSizes = 
-        (PFN_vkGetAccelerationStructureBuildSizesKHR) vkGetInstanceProcAddr( m_instance, "vkGetAccelerationStructureBuildSizesKHR" );
-    GetAccelerationStructureBuildSizes( m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
-        &maxPrimCount, &sizeInfo );
-
-    //vkGetAccelerationStructureBuildSizesKHR( m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
-    //    &maxPrimCount, &sizeInfo );
-
-    VkAccelerationStructureCreateInfoKHR createInfo{ VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR };
-    createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    createInfo.size = sizeInfo.accelerationStructureSize;
-
-    Buffer* accelStructureBuffer = new Buffer( m_device, m_physicalDevice );
-    accelStructureBuffer->setup( createInfo.size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT );
-    accelStructureBuffer->create();
-    createInfo.buffer = accelStructureBuffer->getBuffer();
-
-    VkAccelerationStructureKHR accelStructure;
-
-    PFN_vkCreateAccelerationStructureKHR CreateAccelerationStructureKHR = 
-        (PFN_vkCreateAccelerationStructureKHR) vkGetInstanceProcAddr( m_instance, "vkCreateAccelerationStructureKHR" );
-    CreateAccelerationStructureKHR( m_device, &createInfo, nullptr, &accelStructure );
-
-    //vkCreateAccelerationStructureKHR( m_device, &createInfo, nullptr, &accelStructure );
-
-    buildInfo.dstAccelerationStructure = accelStructure;
-
-
-    Buffer* scratchBuffer = new Buffer( m_device, m_physicalDevice );
-    scratchBuffer->setup( sizeInfo.buildScratchSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT );
-    scratchBuffer->create();
-
-    VkBufferDeviceAddressInfo bufferInfo{ VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
-    bufferInfo.buffer = scratchBuffer->m_buffer;
-    VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress( m_device, &bufferInfo );
-    buildInfo.scratchData.deviceAddress = scratchAddress;
-    
-    // Allocate a query pool for storing the needed size for every BLAS compaction.
-    VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
-    qpci.queryCount = 1;
-    qpci.queryType  = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
-    VkQueryPool queryPool;
-    vkCreateQueryPool(m_device, &qpci, nullptr, &queryPool);
-    vkResetQueryPool(m_device, queryPool, 0, 1);
+std::shared_future<VkPipeline> App::createComputePipeline( const std::string& name, Shader* shader, VkPipelineLayout pipelineLayout ) {
+    uint64_t key = PipelineCompiler::GetKey( name, { shader } );
+    return m_pipelineCompiler->submit( name, key, [this, shader, pipelineLayout]( VkPipelineCache pipelineCache ) {
+        VkComputePipelineCreateInfo pipelineInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+        pipelineInfo.stage  = shader->getShaderStageInfo();
+        pipelineInfo.layout = pipelineLayout;
+
+        VkPipeline pipeline;
+        VkResult result = vkCreateComputePipelines( m_device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline );
+        CHECK_VKRESULT( result, "failed to create compute pipeline!" );
+        return pipeline;
+    } );
+}
 
-    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
-    const VkAccelerationStructureBuildRangeInfoKHR* accelRange = &offset;
+void App::createBottomLevelAS() {
+    m_blasBuilder = new BlasBuilder( m_device, m_physicalDevice );
+    m_accelCache  = new AccelCache( m_device, m_physicalDevice );
+    m_accelCache->load( ACCEL_CACHE_DIR );
+    m_rtMeshes = { m_pCube, m_pPlane };
 
-    PFN_vkCmdBuildAccelerationStructuresKHR CmdBuildAccelerationStructuresKHR =
-        ( PFN_vkCmdBuildAccelerationStructuresKHR )vkGetInstanceProcAddr( m_instance, "vkCmdBuildAccelerationStructuresKHR" );
-    CmdBuildAccelerationStructuresKHR( cmdBuffer, 1, &buildInfo, &accelRange );
+    VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    if ( m_blasCompaction ) flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
 
-    //vkCmdBuildAccelerationStructuresKHR( cmdBuffer, 1, &buildInfo, &accelRange );
+    // Cached meshes are deserialized and the rest built, every mesh in the same submit
+    std::vector<Mesh*>          builtMeshes;
+    std::vector<size_t>         builtIndices;
+    std::vector<AccelStructure> built;
+    m_blas.resize( m_rtMeshes.size() );
 
-    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
-    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
-    vkCmdPipelineBarrier( cmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    for ( size_t i = 0; i < m_rtMeshes.size(); i++ ) {
+        if ( m_accelCache->cmdLoad( cmdBuffer, m_rtMeshes[i], flags, &m_blas[i] ) ) continue;
+        m_blasBuilder->add( m_rtMeshes[i] );
+        builtMeshes.push_back( m_rtMeshes[i] );
+        builtIndices.push_back( i );
+    }
+    if ( !builtMeshes.empty() ) built = m_blasBuilder->cmdBuild( cmdBuffer, flags );
+    endSingleTimeCommands( cmdBuffer );
+    m_accelCache->releaseStaging();
+    if ( built.empty() ) return;
+
+    // Compacted sizes are known once the builds have finished, the originals are
+    // released after the copies have completed
+    if ( m_blasCompaction ) {
+        cmdBuffer = beginSingleTimeCommands();
+        m_blasBuilder->cmdCompact( cmdBuffer, built );
+        endSingleTimeCommands( cmdBuffer );
+        m_blasBuilder->destroyRetired();
+    }
 
+    // Serialized for the next start, the copy size has to be read back first
+    cmdBuffer = beginSingleTimeCommands();
+    m_accelCache->cmdQuerySizes( cmdBuffer, built );
     endSingleTimeCommands( cmdBuffer );
+    cmdBuffer = beginSingleTimeCommands();
+    m_accelCache->cmdSerialize( cmdBuffer, builtMeshes, flags, built );
+    endSingleTimeCommands( cmdBuffer );
+    m_accelCache->save();
 
-    m_blAccelStructure = accelStructure;
+    for ( size_t i = 0; i < built.size(); i++ ) m_blas[builtIndices[i]] = built[i];
 }
 
 void App::createTopLevelAS() {
-    VkAccelerationStructureInstanceKHR geometryInstance;
-    
-    VkAccelerationStructureDeviceAddressInfoKHR addressInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR};
-    addressInfo.accelerationStructure = m_blAccelStructure;
-    //VkDeviceAddress blasAddress       = vkGetAccelerationStructureDeviceAddressKHR(m_device, &addressInfo);
-
-    PFN_vkGetAccelerationStructureDeviceAddressKHR GetAccelerationStructureDeviceAddress =
-        ( PFN_vkGetAccelerationStructureDeviceAddressKHR )vkGetInstanceProcAddr( m_instance, "vkGetAccelerationStructureDeviceAddressKHR" );
-    VkDeviceAddress blasAddress = GetAccelerationStructureDeviceAddress( m_device, &addressInfo );
-
-    const VkTransformMatrixKHR transform = {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-    };
-    geometryInstance.transform                              = transform;
-    geometryInstance.instanceCustomIndex                    = 0;
-    geometryInstance.mask                                   = 0xFF;
-    geometryInstance.instanceShaderBindingTableRecordOffset = 0;
-    geometryInstance.flags                                  = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-    geometryInstance.accelerationStructureReference         = blasAddress;
+    m_instanceShaders        = { loadShader( "instances.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) };
+    m_instancePipelineLayout = m_layoutCache->getPipelineLayout( m_instanceShaders );
+    m_instancePipeline       = createComputePipeline( "instances", m_instanceShaders[0], m_instancePipelineLayout );
+
+    uint32_t instanceCount = UINT32( m_rtMeshes.size() );
+    m_instanceBuilder = new InstanceBuilder( m_device, m_physicalDevice );
+    m_instanceBuilder->setup( instanceCount, m_totalFrame, m_layoutCache->getDescriptorSetLayout( m_instanceShaders, 0 ) );
+    for ( uint32_t i = 0; i < instanceCount; i++ ) {
+        InstanceDesc desc;
+        desc.blasAddress = m_blas[i].address;
+        desc.customIndex = i;
+        desc.sbtOffset   = i;
+        desc.flags       = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+        m_instanceBuilder->setDesc( i, desc );
+    }
 
-    VkDeviceSize instanceSize = sizeof( VkAccelerationStructureInstanceKHR );
+    // The first build is recorded by the frame loop once the compute pipeline is ready
+    m_tlasBuilder = new TlasBuilder( m_device, m_physicalDevice );
+    m_tlasBuilder->setup( instanceCount );
+}
 
-    Buffer* instanceBuffer = new Buffer( m_device, m_physicalDevice );
-    instanceBuffer->setup( instanceSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR );
-    instanceBuffer->create();
-    instanceBuffer->fillBuffer( &geometryInstance, instanceSize );
+bool App::updateTopLevelAS( VkCommandBuffer commandBuffer ) {
+    // Unchanged matrices are not uploaded, a static frame records nothing
+    for ( uint32_t i = 0; i < m_rtMeshes.size(); i++ ) m_instanceBuilder->setTransform( i, m_rtMeshes[i]->getMatrix() );
 
-    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
-    
-    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
-    bufferInfo.buffer               = instanceBuffer->getBuffer();
-    VkDeviceAddress instanceAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
-
-    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    vkCmdPipelineBarrier( cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                        0, 1, &barrier, 0, nullptr, 0, nullptr);
-
-
-    VkAccelerationStructureGeometryInstancesDataKHR instancesVk{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR};
-    instancesVk.arrayOfPointers    = VK_FALSE;
-    instancesVk.data.deviceAddress = instanceAddress;
-
-    VkAccelerationStructureGeometryKHR topASGeometry{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR};
-    topASGeometry.geometryType       = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    topASGeometry.geometry.instances = instancesVk;
-
-    VkAccelerationStructureBuildGeometryInfoKHR buildInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
-    buildInfo.flags         = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    buildInfo.geometryCount = 1;
-    buildInfo.pGeometries   = &topASGeometry;
-    buildInfo.mode          = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-
-    uint32_t count = 1;
-    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
-
-    PFN_vkGetAccelerationStructureBuildSizesKHR GetAccelerationStructureBuildSizes =
-        ( PFN_vkGetAccelerationStructureBuildSizesKHR )vkGetInstanceProcAddr( m_instance, "vkGetAccelerationStructureBuildSizesKHR" );
-    GetAccelerationStructureBuildSizes( m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
-        &count, &sizeInfo );
-
-    VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
-    createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    createInfo.size = sizeInfo.accelerationStructureSize;
-    
-    Buffer* accelStructureBuffer = new Buffer( m_device, m_physicalDevice );
-    accelStructureBuffer->setup( createInfo.size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT );
-    accelStructureBuffer->create();
-    createInfo.buffer = accelStructureBuffer->getBuffer();
+    VkPipeline pipeline = PipelineCompiler::GetIfReady( m_instancePipeline );
+    if ( !m_instanceBuilder->cmdGenerate( commandBuffer, m_currentFrame, pipeline, m_instancePipelineLayout ) ) return false;
 
-    VkAccelerationStructureKHR accelStructure;
+    m_tlasBuilder->cmdUpdate( commandBuffer, m_instanceBuilder->getInstanceAddress( m_currentFrame ),
+                              m_instanceBuilder->getInstanceCount() );
+    return true;
+}
 
-    PFN_vkCreateAccelerationStructureKHR CreateAccelerationStructureKHR = 
-        (PFN_vkCreateAccelerationStructureKHR) vkGetInstanceProcAddr( m_instance, "vkCreateAccelerationStructureKHR" );
-    CreateAccelerationStructureKHR( m_device, &createInfo, nullptr, &accelStructure );
+void App::createSceneDesc() {
+    // One material per object until the scene loads its own
+    uint32_t instanceCount = UINT32( m_rtMeshes.size() );
+    m_sceneDescBuilder = new SceneDescBuilder( m_device, m_physicalDevice );
+    m_sceneDescBuilder->setup( instanceCount, m_totalFrame );
 
-    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-    buildInfo.dstAccelerationStructure = accelStructure;
+    // Registry slots are global, textureId is the slot and txtOffset stays 0
+    WaveFrontMaterial planeMaterial;
+    if ( std::ifstream( PLANE_TEXTURE_FILE ).good() ) m_planeTexture = static_cast<int32_t>( m_textureLoader->stream( PLANE_TEXTURE_FILE ) );
+    planeMaterial.textureId = m_planeTexture;
 
+    for ( uint32_t i = 0; i < instanceCount; i++ ) {
+        m_sceneDescBuilder->setObject( i, m_rtMeshes[i], { m_rtMeshes[i] == m_pPlane ? planeMaterial : WaveFrontMaterial() } );
+        m_sceneDescBuilder->setTransform( i, m_rtMeshes[i]->getMatrix() );
+    }
 
-    Buffer* scratchBuffer = new Buffer( m_device, m_physicalDevice );
-    scratchBuffer->setup( sizeInfo.buildScratchSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR );
-    scratchBuffer->create();
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    m_sceneDescBuilder->cmdUpload( cmdBuffer, m_currentFrame );
+    endSingleTimeCommands( cmdBuffer );
+}
 
-    VkBufferDeviceAddressInfo bufferInfoScratch{ VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
-    bufferInfoScratch.buffer = scratchBuffer->m_buffer;
-    VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress( m_device, &bufferInfoScratch );
-    buildInfo.scratchData.deviceAddress = scratchAddress;
+void App::updateSceneDesc( VkCommandBuffer commandBuffer ) {
+    // Same matrices as the instances, only the descriptors of moved objects are uploaded
+    for ( uint32_t i = 0; i < m_rtMeshes.size(); i++ ) m_sceneDescBuilder->setTransform( i, m_rtMeshes[i]->getMatrix() );
+    m_sceneDescBuilder->cmdUpload( commandBuffer, m_currentFrame );
+}
 
-    
-    VkAccelerationStructureBuildRangeInfoKHR        offset{static_cast<uint32_t>(1), 0, 0, 0};
-    const VkAccelerationStructureBuildRangeInfoKHR* accelRange = &offset;
+void App::createDenoiser() {
+    m_denoiseTemporalShaders        = { loadShader( "denoise_temporal.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) };
+    m_denoiseAtrousShaders          = { loadShader( "denoise_atrous.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) };
+    m_denoiseTemporalPipelineLayout = m_layoutCache->getPipelineLayout( m_denoiseTemporalShaders );
+    m_denoiseAtrousPipelineLayout   = m_layoutCache->getPipelineLayout( m_denoiseAtrousShaders );
+    m_denoiseTemporalPipeline = createComputePipeline( "denoise_temporal", m_denoiseTemporalShaders[0], m_denoiseTemporalPipelineLayout );
+    m_denoiseAtrousPipeline   = createComputePipeline( "denoise_atrous", m_denoiseAtrousShaders[0], m_denoiseAtrousPipelineLayout );
+
+    m_denoiser = new Denoiser( m_device, m_physicalDevice );
+    m_denoiser->setup( { WIDTH, HEIGHT }, m_offscreenImage,
+                       m_layoutCache->getDescriptorSetLayout( m_denoiseTemporalShaders, 0 ),
+                       m_layoutCache->getDescriptorSetLayout( m_denoiseAtrousShaders, 0 ) );
 
-    // Build the TLAS
-    PFN_vkCmdBuildAccelerationStructuresKHR CmdBuildAccelerationStructuresKHR =
-        ( PFN_vkCmdBuildAccelerationStructuresKHR )vkGetInstanceProcAddr( m_instance, "vkCmdBuildAccelerationStructuresKHR" );
-    CmdBuildAccelerationStructuresKHR( cmdBuffer, 1, &buildInfo, &accelRange );
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    m_denoiser->cmdInitialize( cmdBuffer );
+    endSingleTimeCommands( cmdBuffer );
+}
+
+void App::createUpsampler() {
+    m_upsampleShaders        = { loadShader( "upsample.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) };
+    m_upsamplePipelineLayout = m_layoutCache->getPipelineLayout( m_upsampleShaders );
+    m_upsamplePipeline       = createComputePipeline( "upsample", m_upsampleShaders[0], m_upsamplePipelineLayout );
 
+    // The guide is drawn into the same formats as the offscreen pass
+    m_upsampleGuideShaders        = { loadShader( "upsample_guide.vert.spv", VK_SHADER_STAGE_VERTEX_BIT ),
+                                      loadShader( "upsample_guide.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ) };
+    m_upsampleGuidePipelineLayout = m_layoutCache->getPipelineLayout( m_upsampleGuideShaders );
+    m_upsampleGuidePipeline       = createGraphicsPipeline( "upsample_guide", m_upsampleGuideShaders, m_upsampleGuidePipelineLayout );
+
+    m_upsampler = new Upsampler( m_device, m_physicalDevice );
+    m_upsampler->setup( { WIDTH, HEIGHT }, m_totalFrame, m_layoutCache->getDescriptorSetLayout( m_upsampleShaders, 0 ),
+                        m_layoutCache->getDescriptorSetLayout( m_upsampleGuideShaders, 0 ), m_offscreenRenderPass );
+
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    m_upsampler->cmdInitialize( cmdBuffer );
     endSingleTimeCommands( cmdBuffer );
-    m_tlAccelStructure = accelStructure;
 }
 
-void App::createRtDescriptorSet() {
-    VkDescriptorSetLayoutBinding layoutBinding0{};
-    layoutBinding0.binding         = 0;
-    layoutBinding0.descriptorCount = 1;
-    layoutBinding0.descriptorType  = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-    layoutBinding0.stageFlags      = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-    layoutBinding0.pImmutableSamplers = nullptr;
-    
-    VkDescriptorSetLayoutBinding layoutBinding1{};
-    layoutBinding1.binding         = 1;
-    layoutBinding1.descriptorCount = 1;
-    layoutBinding1.descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    layoutBinding1.stageFlags      = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-    layoutBinding1.pImmutableSamplers = nullptr;
-    
-    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = { layoutBinding0, layoutBinding1};
+void App::createPicker() {
+    // Without pick.comp every pick goes through the CPU BVH
+    VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+    if ( hasShader( "pick.comp.spv" ) ) {
+        m_pickShaders        = { loadShader( "pick.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) };
+        m_pickPipelineLayout = m_layoutCache->getPipelineLayout( m_pickShaders );
+        m_pickPipeline       = createComputePipeline( "pick", m_pickShaders[0], m_pickPipelineLayout );
+        setLayout            = m_layoutCache->getDescriptorSetLayout( m_pickShaders, 0 );
+    }
+    else LOG( "App::createPicker pick.comp.spv not found, picking on the CPU" );
 
-    VkDescriptorSetLayoutCreateInfo layoutInfo{};
-    layoutInfo.sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = 2;
-    layoutInfo.pBindings    = layoutBindings.data();
-    
-    VkResult result = vkCreateDescriptorSetLayout(m_device, &layoutInfo, nullptr, &m_rtDescSetLayout);
-    CHECK_VKRESULT(result, "failed to create descriptor set layout!");
+    m_picker = new Picker( m_device, m_physicalDevice );
+    m_picker->setup( m_totalFrame, setLayout, m_tlasBuilder->getHandle() );
+}
+
+void App::cmdPick( VkCommandBuffer commandBuffer ) {
+    // Until pick.comp is compiled and the TLAS built, or without pick.comp, the CPU BVH answers. It bakes the
+    // transforms in, so it is built by the first pick and again only after an instance moved.
+    VkPipeline pipeline = m_tlasBuilder->isBuilt() ? PipelineCompiler::GetIfReady( m_pickPipeline ) : VK_NULL_HANDLE;
+    if ( pipeline == VK_NULL_HANDLE && m_picker->hasRequest() ) {
+        std::vector<glm::mat4> transforms;
+        for ( Mesh* mesh : m_rtMeshes ) transforms.push_back( mesh->getMatrix() );
+        if ( m_pickBvh == nullptr || transforms != m_pickBvhTransforms ) {
+            if ( m_pickBvh == nullptr ) m_pickBvh = new CpuBvh();
+            m_pickBvh->build( m_rtMeshes, m_jobSystem );
+            m_pickBvhTransforms = transforms;
+        }
+    }
+    m_picker->cmdPick( commandBuffer, m_currentFrame, pipeline, m_pickPipelineLayout, m_pickBvh );
+}
+
+void App::createRtDescriptorSet() {
+    m_rtShaders = {
+        loadShader( "raytrace.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR ),
+        loadShader( "raytrace.rmiss.spv", VK_SHADER_STAGE_MISS_BIT_KHR ),
+        loadShader( "raytraceShadow.rmiss.spv", VK_SHADER_STAGE_MISS_BIT_KHR ),
+        loadShader( "raytrace.rchit.spv", VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR ),
+    };
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = LayoutCache::GetSetBindings( m_rtShaders, 0 );
+    m_rtDescSetLayout = m_layoutCache->getDescriptorSetLayout( layoutBindings );
     
-    VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 };
+    std::vector<VkDescriptorPoolSize> poolSizes = LayoutCache::GetPoolSizes( layoutBindings );
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.maxSets       = 1;
-    poolInfo.poolSizeCount = 1;
-    poolInfo.pPoolSizes    = &poolSize;
+    poolInfo.poolSizeCount = UINT32(poolSizes.size());
+    poolInfo.pPoolSizes    = poolSizes.data();
     
-    result = vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_rtDescPool);
+    VkResult result = vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_rtDescPool);
     CHECK_VKRESULT(result, "failed to create descriptor pool!");
 
     VkDescriptorSetAllocateInfo allocateInfo{VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
@@ -272,11 +237,21 @@ void App::createRtDescriptorSet() {
     vkAllocateDescriptorSets(m_device, &allocateInfo, &m_rtDescSet );
 
 
-    VkAccelerationStructureKHR tlas = m_tlAccelStructure;
+    // Written by the ray generation shader and kept in GENERAL from here on
+    m_rtAccumImage = new Image( m_device, m_physicalDevice );
+    m_rtAccumImage->createForOffscreen( { WIDTH, HEIGHT } );
+
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    m_offscreenImage->cmdTransitionLayout( cmdBuffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL );
+    m_rtAccumImage->cmdTransitionLayout( cmdBuffer, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL );
+    endSingleTimeCommands( cmdBuffer );
+
+    VkAccelerationStructureKHR tlas = m_tlasBuilder->getHandle();
     VkWriteDescriptorSetAccelerationStructureKHR descASInfo{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR};
     descASInfo.accelerationStructureCount = 1;
     descASInfo.pAccelerationStructures    = &tlas;
     VkDescriptorImageInfo imageInfo{{}, m_offscreenImage->getImageView(), VK_IMAGE_LAYOUT_GENERAL};
+    VkDescriptorImageInfo accumInfo{{}, m_rtAccumImage->getImageView(), VK_IMAGE_LAYOUT_GENERAL};
     
     VkWriteDescriptorSet writeSet0{};
     writeSet0.sType  = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -296,22 +271,173 @@ void App::createRtDescriptorSet() {
     writeSet1.dstSet          = m_rtDescSet;
     writeSet1.pImageInfo      = &imageInfo;
 
-    std::vector<VkWriteDescriptorSet> writes = { writeSet0, writeSet1 };
+    VkWriteDescriptorSet writeSet2 = writeSet1;
+    writeSet2.dstBinding = 2;
+    writeSet2.pImageInfo = &accumInfo;
+
+    // Denoiser G-buffer, then the images of a reduced resolution launch
+    Image*                gbuffer[] = { m_denoiser->getNormalDepth(), m_denoiser->getAlbedo(), m_denoiser->getMotion(),
+                                        m_upsampler->getColor(), m_upsampler->getNormalDepth(), m_upsampler->getAlbedo() };
+    VkDescriptorImageInfo gbufferInfos[6];
+    std::vector<VkWriteDescriptorSet> writes = { writeSet0, writeSet1, writeSet2 };
+    for ( uint32_t i = 0; i < 6; i++ ) {
+        gbufferInfos[i] = { VK_NULL_HANDLE, gbuffer[i]->getImageView(), VK_IMAGE_LAYOUT_GENERAL };
+        writeSet1.dstBinding = 3 + i;
+        writeSet1.pImageInfo = &gbufferInfos[i];
+        writes.push_back( writeSet1 );
+    }
     vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 
+    // Set 1, one per frame in flight each with its own camera buffer, the scene descriptions change in place
+    layoutBindings         = LayoutCache::GetSetBindings( m_rtShaders, 1 );
+    m_rtSceneDescSetLayout = m_layoutCache->getDescriptorSetLayout( layoutBindings );
+
+    poolSizes              = LayoutCache::GetPoolSizes( layoutBindings, m_totalFrame );
+    poolInfo.maxSets       = m_totalFrame;
+    poolInfo.poolSizeCount = UINT32(poolSizes.size());
+    poolInfo.pPoolSizes    = poolSizes.data();
+    result = vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_rtSceneDescPool);
+    CHECK_VKRESULT(result, "failed to create descriptor pool!");
+
+    std::vector<VkDescriptorSetLayout> sceneDescSetLayouts( m_totalFrame, m_rtSceneDescSetLayout );
+    allocateInfo.descriptorPool     = m_rtSceneDescPool;
+    allocateInfo.descriptorSetCount = m_totalFrame;
+    allocateInfo.pSetLayouts        = sceneDescSetLayouts.data();
+    m_rtSceneDescSets.resize( m_totalFrame );
+    result = vkAllocateDescriptorSets(m_device, &allocateInfo, m_rtSceneDescSets.data() );
+    CHECK_VKRESULT(result, "failed to allocate descriptor set!");
+
+    VkDescriptorBufferInfo sceneDescInfo = m_sceneDescBuilder->getBufferInfo();
+    // The lights and the light tree, rewritten in place by m_lightBuilder
+    VkDescriptorBufferInfo lightInfo     = m_lightBuilder->getLightBufferInfo();
+    VkDescriptorBufferInfo nodeInfo      = m_lightBuilder->getNodeBufferInfo();
+
+    std::vector<VkDescriptorBufferInfo> cameraInfos;
+    for ( uint32_t i = 0; i < m_totalFrame; i++ ) {
+        Buffer* cameraBuffer = new Buffer( m_device, m_physicalDevice );
+        cameraBuffer->setup( sizeof( RtCamera ), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT );
+        cameraBuffer->create();
+        m_rtCameraBuffers.push_back( cameraBuffer );
+        cameraInfos.push_back( cameraBuffer->getBufferInfo() );
+    }
+
+    for ( uint32_t i = 0; i < m_totalFrame; i++ ) {
+        VkWriteDescriptorSet cameraWrite{};
+        cameraWrite.sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        cameraWrite.dstBinding      = 0;
+        cameraWrite.descriptorCount = 1;
+        cameraWrite.descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        cameraWrite.dstArrayElement = 0;
+        cameraWrite.dstSet          = m_rtSceneDescSets[i];
+        cameraWrite.pBufferInfo     = &cameraInfos[i];
+
+        VkWriteDescriptorSet sceneDescWrite = cameraWrite;
+        sceneDescWrite.dstBinding     = 1;
+        sceneDescWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        sceneDescWrite.pBufferInfo    = &sceneDescInfo;
+
+        VkWriteDescriptorSet lightWrite = sceneDescWrite;
+        lightWrite.dstBinding  = 2;
+        lightWrite.pBufferInfo = &lightInfo;
+        VkWriteDescriptorSet nodeWrite  = sceneDescWrite;
+        nodeWrite.dstBinding  = 3;
+        nodeWrite.pBufferInfo = &nodeInfo;
+
+        VkWriteDescriptorSet sceneWrites[] = { cameraWrite, sceneDescWrite, lightWrite, nodeWrite };
+        vkUpdateDescriptorSets(m_device, 4, sceneWrites, 0, nullptr);
+    }
+
+    // The upsampler writes the same targets as a full resolution launch
+    m_upsampler->updateDescriptorSets( { m_offscreenImage, m_rtAccumImage, gbuffer[0], gbuffer[1], gbuffer[2] }, cameraInfos );
 }
 
-void App::createRtPipeline() {
-    Shader* rayGenShader  = new Shader( m_device, "../shaders/spv/raytrace.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR );
-    Shader* rayMissShader = new Shader( m_device, "../shaders/spv/raytrace.rmiss.spv", VK_SHADER_STAGE_MISS_BIT_KHR );
-    Shader* rayShadowShader = new Shader( m_device, "../shaders/spv/raytraceShadow.rmiss.spv", VK_SHADER_STAGE_MISS_BIT_KHR );
-    Shader* rayHitShader  = new Shader( m_device, "../shaders/spv/raytrace.rchit.spv", VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR );
+void App::createIntegrator() {
+    static const char* kernels[INTEGRATOR_KERNEL_COUNT] = {
+        "integrator_control", "integrator_generate", "integrator_intersect", "integrator_scatter",
+        "integrator_shade", "integrator_shadow", "integrator_resolve",
+    };
+    for ( const char* kernel : kernels ) {
+        m_integratorShaders.push_back( loadShader( std::string( kernel ) + ".comp.spv", VK_SHADER_STAGE_COMPUTE_BIT ) );
+    }
 
-    std::array<VkPipelineShaderStageCreateInfo, 4> stages{};
-    stages[0] = rayGenShader->getShaderStageInfo();
-    stages[1] = rayMissShader->getShaderStageInfo();
-    stages[2] = rayShadowShader->getShaderStageInfo();
-    stages[3] = rayHitShader->getShaderStageInfo();
+    // The kernels declare the same resources and share one layout
+    m_integratorPipelineLayout = m_layoutCache->getPipelineLayout( m_integratorShaders );
+    for ( uint32_t i = 0; i < INTEGRATOR_KERNEL_COUNT; i++ ) {
+        m_integratorPipelines.push_back( createComputePipeline( kernels[i], m_integratorShaders[i], m_integratorPipelineLayout ) );
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> bindings0 = LayoutCache::GetSetBindings( m_integratorShaders, 0 );
+    std::vector<VkDescriptorSetLayoutBinding> bindings1 = LayoutCache::GetSetBindings( m_integratorShaders, 1 );
+    std::vector<VkDescriptorPoolSize> poolSizes  = LayoutCache::GetPoolSizes( bindings0 );
+    std::vector<VkDescriptorPoolSize> poolSizes1 = LayoutCache::GetPoolSizes( bindings1, m_totalFrame );
+    poolSizes.insert( poolSizes.end(), poolSizes1.begin(), poolSizes1.end() );
+
+    // Set 0 once, then set 1 for every frame in flight, each with the camera buffer of its frame
+    VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.maxSets       = 1 + m_totalFrame;
+    poolInfo.poolSizeCount = UINT32( poolSizes.size() );
+    poolInfo.pPoolSizes    = poolSizes.data();
+    VkResult result = vkCreateDescriptorPool( m_device, &poolInfo, nullptr, &m_integratorDescPool );
+    CHECK_VKRESULT( result, "failed to create descriptor pool!" );
+
+    std::vector<VkDescriptorSetLayout> setLayouts( 1 + m_totalFrame, m_layoutCache->getDescriptorSetLayout( bindings1 ) );
+    setLayouts[0] = m_layoutCache->getDescriptorSetLayout( bindings0 );
+    VkDescriptorSetAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocateInfo.descriptorPool     = m_integratorDescPool;
+    allocateInfo.descriptorSetCount = UINT32( setLayouts.size() );
+    allocateInfo.pSetLayouts        = setLayouts.data();
+    m_integratorDescSets.resize( setLayouts.size() );
+    result = vkAllocateDescriptorSets( m_device, &allocateInfo, m_integratorDescSets.data() );
+    CHECK_VKRESULT( result, "failed to allocate descriptor set!" );
+
+    // Same TLAS, images, camera and scene descriptions as the ray tracing pipeline, the queues are written by the integrator
+    VkAccelerationStructureKHR tlas = m_tlasBuilder->getHandle();
+    VkWriteDescriptorSetAccelerationStructureKHR descASInfo{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR };
+    descASInfo.accelerationStructureCount = 1;
+    descASInfo.pAccelerationStructures    = &tlas;
+    VkDescriptorImageInfo  imageInfo{ VK_NULL_HANDLE, m_offscreenImage->getImageView(), VK_IMAGE_LAYOUT_GENERAL };
+    VkDescriptorImageInfo  accumInfo{ VK_NULL_HANDLE, m_rtAccumImage->getImageView(), VK_IMAGE_LAYOUT_GENERAL };
+    VkDescriptorBufferInfo sceneDescInfo = m_sceneDescBuilder->getBufferInfo();
+    VkDescriptorBufferInfo lightInfo     = m_lightBuilder->getLightBufferInfo();
+    VkDescriptorBufferInfo nodeInfo      = m_lightBuilder->getNodeBufferInfo();
+    std::vector<VkDescriptorBufferInfo> cameraInfos;
+    for ( Buffer* cameraBuffer : m_rtCameraBuffers ) cameraInfos.push_back( cameraBuffer->getBufferInfo() );
+
+    std::vector<VkWriteDescriptorSet> writes( 3 + 4 * m_totalFrame, { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET } );
+    for ( VkWriteDescriptorSet& write : writes ) {
+        write.dstSet          = m_integratorDescSets[0];
+        write.descriptorCount = 1;
+    }
+    writes[0].dstBinding     = 0;
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    writes[0].pNext          = &descASInfo;
+    writes[1].dstBinding     = 1;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[1].pImageInfo     = &imageInfo;
+    writes[2].dstBinding     = 2;
+    writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[2].pImageInfo     = &accumInfo;
+    for ( uint32_t i = 0; i < m_totalFrame; i++ ) {
+        VkWriteDescriptorSet* frameWrites = &writes[3 + 4 * i];
+        for ( uint32_t binding = 0; binding < 4; binding++ ) {
+            frameWrites[binding].dstSet         = m_integratorDescSets[1 + i];
+            frameWrites[binding].dstBinding     = binding;
+            frameWrites[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        }
+        frameWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        frameWrites[0].pBufferInfo    = &cameraInfos[i];
+        frameWrites[1].pBufferInfo    = &sceneDescInfo;
+        frameWrites[2].pBufferInfo    = &lightInfo;
+        frameWrites[3].pBufferInfo    = &nodeInfo;
+    }
+    vkUpdateDescriptorSets( m_device, UINT32( writes.size() ), writes.data(), 0, nullptr );
+
+    m_integrator = new Integrator( m_device, m_physicalDevice );
+    m_integrator->setup( { WIDTH, HEIGHT }, m_integratorDescSets[0] );
+}
+
+void App::createRtPipeline() {
+    m_rtShaderGroups.clear();
 
     VkRayTracingShaderGroupCreateInfoKHR group{ VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR };
     group.anyHitShader       = VK_SHADER_UNUSED_KHR;
@@ -336,59 +462,312 @@ void App::createRtPipeline() {
     group.closestHitShader = 3;
     m_rtShaderGroups.push_back( group );
 
-    VkPushConstantRange pushConstant{ VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR,
-                                     0, sizeof( RtPushConstant ) };
+    // Set 1 and the push constant range are whatever the shaders declare
+    m_rtPipelineLayout = m_layoutCache->getPipelineLayout( m_rtShaders );
+    createRtPipelineVariant();
+}
+
+// A variant already compiled is returned by its key, otherwise it compiles while the current one keeps tracing
+void App::createRtPipelineVariant() {
+    SpecConstants specConstants;
+    specConstants.set( 0, m_rtLightType );
+    specConstants.set( 1, m_rtShadows );
+
+    uint64_t key = PipelineCompiler::GetKey( "raytracing", m_rtShaders, specConstants.getHash() );
+    m_rtPipeline = m_pipelineCompiler->submit( "raytracing", key, [this, specConstants, groups = m_rtShaderGroups]( VkPipelineCache pipelineCache ) mutable {
+        std::vector<VkPipelineShaderStageCreateInfo> stages;
+        for ( Shader* shader : m_rtShaders ) stages.push_back( shader->getShaderStageInfo( specConstants.getInfo() ) );
+
+        VkRayTracingPipelineCreateInfoKHR rayPipelineInfo{ VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR };
+        rayPipelineInfo.stageCount = static_cast< uint32_t >( stages.size() ); 
+        rayPipelineInfo.pStages    = stages.data();
+        rayPipelineInfo.groupCount = static_cast< uint32_t >( groups.size() );
+        rayPipelineInfo.pGroups    = groups.data();
+        rayPipelineInfo.layout     = m_rtPipelineLayout;
+        rayPipelineInfo.maxPipelineRayRecursionDepth = 2;
+
+        VkPipeline pipeline;
+        VkResult result = vkd.CreateRayTracingPipelinesKHR( m_device, {}, pipelineCache, 1, &rayPipelineInfo, nullptr, &pipeline );
+        CHECK_VKRESULT( result, "failed to create ray tracing pipeline!" );
+        return pipeline;
+    } );
+}
+
+void App::createRtShaderBindingTable() {
+    // Group indices follow m_rtShaderGroups: raygen, miss, shadow miss, then the hit group
+    m_sbtBuilder = new SbtBuilder( m_device, m_physicalDevice );
+    m_sbtBuilder->setup( m_totalFrame );
+    m_sbtBuilder->addRecord( SBT_RAYGEN, 0 );
+    m_sbtBuilder->addRecord( SBT_MISS, 1 );
+    m_sbtBuilder->addRecord( SBT_MISS, 2 );
+
+    // One hit record per instance, its index is the instance SBT offset
+    m_rtHitRecords.resize( m_rtMeshes.size(), { glm::vec4( 1.0f ) } );
+    for ( RtHitRecord& hitRecord : m_rtHitRecords ) m_sbtBuilder->addRecord( SBT_HIT, 3, &hitRecord, sizeof( RtHitRecord ) );
+}
+
+// The table is created from the first pipeline the compiler finishes, and again once a requested
+// variant is ready. Returns false until the first one.
+bool App::updateRtShaderBindingTable() {
+    m_sbtBuilder->beginFrame( m_currentFrame );
+    VkPipeline pipeline = PipelineCompiler::GetIfReady( m_rtPipeline );
+    if ( pipeline != VK_NULL_HANDLE && pipeline != m_sbtPipeline ) {
+        m_sbtBuilder->create( pipeline );
+        m_sbtPipeline = pipeline;
+        resetAccumulation();
+    }
+    return m_sbtPipeline != VK_NULL_HANDLE;
+}
+
+// Ray tracing needs the first TLAS build and the pipelines of the selected integrator
+bool App::isRtReady() {
+    if ( !m_tlasBuilder->isBuilt() ) return false;
+    if ( !m_rtWavefront ) return m_sbtPipeline != VK_NULL_HANDLE;
+    for ( std::shared_future<VkPipeline>& integratorPipeline : m_integratorPipelines ) {
+        if ( PipelineCompiler::GetIfReady( integratorPipeline ) == VK_NULL_HANDLE ) return false;
+    }
+    return true;
+}
 
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
-    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
-    pipelineLayoutCreateInfo.pPushConstantRanges    = &pushConstant;
+void App::setRtHitRecord( uint32_t instance, const RtHitRecord& hitRecord ) {
+    m_rtHitRecords[instance] = hitRecord;
+    if ( m_sbtBuilder != nullptr ) m_sbtBuilder->setRecordData( SBT_HIT, instance, &hitRecord, sizeof( RtHitRecord ) );
+    resetAccumulation();
+}
 
-    std::vector<VkDescriptorSetLayout> rtDescSetLayouts = { m_rtDescSetLayout, m_descSetLayout };
-    pipelineLayoutCreateInfo.setLayoutCount = static_cast< uint32_t >( rtDescSetLayouts.size() );
-    pipelineLayoutCreateInfo.pSetLayouts    = rtDescSetLayouts.data();
+void App::setDemoLights( uint32_t count ) {
+    // Same total power whatever the count, so the ranges shrink as the lights get denser
+    std::vector<Light> lights( count );
+    uint32_t seed = 1;
+    auto random = [&seed]() {
+        seed = 1664525u * seed + 1013904223u;
+        return float( seed >> 8 ) / float( 1 << 24 );
+    };
+    for ( Light& light : lights ) {
+        light.position  = glm::vec3( random() * 4.0f - 2.0f, random() * 1.5f - 0.9f, random() * 4.0f - 2.0f );
+        light.intensity = glm::vec3( random(), random(), random() ) * ( 12.8f / count );
+    }
+    m_lightBuilder->setLights( lights );
+    LOG( "App::setDemoLights " << count << " lights" );
+}
 
-    vkCreatePipelineLayout( m_device, &pipelineLayoutCreateInfo, nullptr, &m_rtPipelineLayout );
+void App::resetAccumulation() {
+    m_rtPushConstants.sampleCount = 0;
+}
 
-    VkRayTracingPipelineCreateInfoKHR rayPipelineInfo{ VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR };
-    rayPipelineInfo.stageCount = static_cast< uint32_t >( stages.size() ); 
-    rayPipelineInfo.pStages    = stages.data();
-    rayPipelineInfo.groupCount = static_cast< uint32_t >( m_rtShaderGroups.size() );
-    rayPipelineInfo.pGroups    = m_rtShaderGroups.data();
-    rayPipelineInfo.layout     = m_rtPipelineLayout;
-    rayPipelineInfo.maxPipelineRayRecursionDepth = 2;
+void App::cmdTraceRays( VkCommandBuffer commandBuffer ) {
+    VkPipeline pipeline = m_sbtPipeline;
+    std::vector<VkPipeline> integratorPipelines;
+    for ( std::shared_future<VkPipeline>& integratorPipeline : m_integratorPipelines ) {
+        integratorPipelines.push_back( PipelineCompiler::GetIfReady( integratorPipeline ) );
+    }
+    bool integratorReady = std::find( integratorPipelines.begin(), integratorPipelines.end(), VK_NULL_HANDLE ) == integratorPipelines.end();
+    // A capture is the launch the CPU tracer ports, whatever integrator is selected, once the requested variant traces
+    bool capture   = m_gpuCaptureRequested && pipeline != VK_NULL_HANDLE && pipeline == PipelineCompiler::GetIfReady( m_rtPipeline ) &&
+                     m_gpuCaptureFrame < 0;
+    bool wavefront = m_rtWavefront && !capture;
+    if ( wavefront ? !integratorReady : pipeline == VK_NULL_HANDLE ) return;
+    if ( capture ) resetAccumulation();
+
+    RtCamera camera;
+    camera.view         = m_camera->getViewMatrix();
+    camera.proj         = m_camera->getProjection( ( float )WIDTH / HEIGHT );
+    camera.viewInverse  = glm::inverse( camera.view );
+    camera.projInverse  = glm::inverse( camera.proj );
+    camera.prevViewProj = m_rtCamera.proj * m_rtCamera.view;
+    if ( camera.view != m_rtCamera.view || camera.proj != m_rtCamera.proj ) resetAccumulation();
+    // The buffer of this frame is free once its fence has signaled, the others may still be read
+    m_rtCamera = camera;
+    m_rtCameraBuffers[m_currentFrame]->fillBuffer( &m_rtCamera, sizeof( RtCamera ) );
+
+    // Without path tracing every frame is a single primary sample, nothing is averaged
+    if ( !m_rtPathTrace ) {
+        m_rtPushConstants.sampleCount     = 0;
+        m_rtPushConstants.samplesPerPixel = 1;
+        m_rtPushConstants.maxDepth        = 1;
+    }
+    else {
+        // Converged, the output keeps the last average until something changes
+        if ( m_rtPushConstants.sampleCount >= m_rtMaxSamples ) return;
+        m_rtPushConstants.samplesPerPixel = std::min( m_rtSamplesPerFrame, m_rtMaxSamples - m_rtPushConstants.sampleCount );
+        m_rtPushConstants.maxDepth        = m_rtMaxDepth;
+    }
 
-    // vkCreateRayTracingPipelinesKHR( m_device, {}, {}, 1, & rayPipelineInfo, nullptr, & m_rtPipeline );
+    // Until upsample.comp and its guide are compiled every pixel is traced
+    VkPipeline upsamplePipeline = PipelineCompiler::GetIfReady( m_upsamplePipeline );
+    VkPipeline guidePipeline    = PipelineCompiler::GetIfReady( m_upsampleGuidePipeline );
+    bool       upsampleReady    = upsamplePipeline != VK_NULL_HANDLE && guidePipeline != VK_NULL_HANDLE;
+    m_rtPushConstants.resolution = !upsampleReady || capture ? RT_RESOLUTION_FULL : m_rtResolution[m_rtPathTrace ? 1 : 0];
+    m_rtPushConstants.textures   = capture ? 0 : 1;
+
+    // The post pass and the denoiser of the previous frame may still be reading the output and the G-buffer
+    VkPipelineStageFlags traceStages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            traceStages, 0, 0, nullptr, 0, nullptr, 0, nullptr );
+
+    m_rtTimer->cmdBegin( commandBuffer, m_currentFrame );
+    m_rtTimedWavefront[m_currentFrame] = wavefront;
+    if ( wavefront ) {
+        IntegratorConstants constants;
+        constants.clearColor      = m_rtPushConstants.clearColor;
+        constants.lightPosition   = m_rtPushConstants.lightPosition;
+        constants.lightIntensity  = m_rtPushConstants.lightIntensity;
+        constants.frame           = m_rtPushConstants.frame;
+        constants.sampleCount     = m_rtPushConstants.sampleCount;
+        constants.samplesPerPixel = m_rtPushConstants.samplesPerPixel;
+        constants.maxDepth        = m_rtPushConstants.maxDepth;
+        std::vector<VkDescriptorSet> descSets = { m_integratorDescSets[0], m_integratorDescSets[1 + m_currentFrame],
+                                                  m_textureRegistry->getDescriptorSet() };
+        m_integrator->cmdTrace( commandBuffer, integratorPipelines, m_integratorPipelineLayout, descSets, constants );
+    }
+    else {
+        m_upsampler->cmdRenderGuide( commandBuffer, m_currentFrame, guidePipeline, m_upsampleGuidePipelineLayout,
+                                     m_rtPushConstants.resolution, m_rtMeshes );
+
+        Size<int32_t>   launchSize = Upsampler::GetLaunchSize( { WIDTH, HEIGHT }, m_rtPushConstants.resolution );
+        VkDescriptorSet descSets[] = { m_rtDescSet, m_rtSceneDescSets[m_currentFrame], m_textureRegistry->getDescriptorSet() };
+        vkd.CmdBindPipeline( commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline );
+        vkd.CmdBindDescriptorSets( commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+                                   m_rtPipelineLayout, 0, 3, descSets, 0, nullptr );
+        vkd.CmdPushConstants( commandBuffer, m_rtPipelineLayout, m_layoutCache->getPushConstantStages( m_rtPipelineLayout ),
+                              0, sizeof( RtPushConstant ), &m_rtPushConstants );
+        vkd.CmdTraceRaysKHR( commandBuffer, m_sbtBuilder->getRegion( SBT_RAYGEN ), m_sbtBuilder->getRegion( SBT_MISS ),
+                             m_sbtBuilder->getRegion( SBT_HIT ), m_sbtBuilder->getRegion( SBT_CALLABLE ),
+                             launchSize.width, launchSize.height, 1 );
+
+        UpsampleSettings settings;
+        settings.resolution      = m_rtPushConstants.resolution;
+        settings.frame           = m_rtPushConstants.frame;
+        settings.sampleCount     = m_rtPushConstants.sampleCount;
+        settings.samplesPerPixel = m_rtPushConstants.samplesPerPixel;
+        m_upsampler->cmdUpsample( commandBuffer, m_currentFrame, upsamplePipeline, m_upsamplePipelineLayout, settings );
+    }
+    m_rtTimer->cmdEnd( commandBuffer, m_currentFrame );
+
+    VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkd.CmdPipelineBarrier( commandBuffer, traceStages,
+                            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            0, 1, &barrier, 0, nullptr, 0, nullptr );
+    if ( capture ) cmdCaptureGpuOutput( commandBuffer );
+
+    m_rtPushConstants.frame++;
+    if ( m_rtPathTrace ) m_rtPushConstants.sampleCount += m_rtPushConstants.samplesPerPixel;
+
+    // The G-buffer comes from raytrace.rgen, or upsample.comp after a reduced launch, the wavefront integrator writes none
+    if ( m_denoise && !wavefront ) {
+        m_denoiser->cmdDenoise( commandBuffer,
+                                PipelineCompiler::GetIfReady( m_denoiseTemporalPipeline ), m_denoiseTemporalPipelineLayout,
+                                PipelineCompiler::GetIfReady( m_denoiseAtrousPipeline ), m_denoiseAtrousPipelineLayout );
+    }
+}
 
-    PFN_vkCreateRayTracingPipelinesKHR CreateRayTracingPipelinesKHR =
-        ( PFN_vkCreateRayTracingPipelinesKHR )vkGetInstanceProcAddr( m_instance, "vkCreateRayTracingPipelinesKHR" );
-    CreateRayTracingPipelinesKHR( m_device, {}, {}, 1, &rayPipelineInfo, nullptr, &m_rtPipeline );
+void App::reportRtTime( bool wavefront, double milliseconds ) {
+    // Averaged per integrator, switching starts a new average
+    if ( wavefront != m_rtTimeWavefront ) {
+        m_rtTimeWavefront = wavefront;
+        m_rtTimeSum       = 0.0;
+        m_rtTimeCount     = 0;
+    }
+    m_rtTimeSum += milliseconds;
+    if ( ++m_rtTimeCount < RT_TIMER_REPORT_FRAMES ) return;
+
+    PRINTLN4( wavefront ? "wavefront" : "megakernel", "trace:", m_rtTimeSum / m_rtTimeCount, "ms" );
+    m_rtTimeSum   = 0.0;
+    m_rtTimeCount = 0;
 }
 
-void App::createRtShaderBindingTable() {
-    auto     groupCount       = static_cast< uint32_t >( m_rtShaderGroups.size() );
-    uint32_t groupHandleSize  = m_rtProperties.shaderGroupHandleSize;
-    uint32_t groupSizeAligned = m_rtProperties.shaderGroupBaseAlignment;
-    uint32_t sbtSize          = groupCount * groupSizeAligned;
-
-    PFN_vkGetRayTracingShaderGroupHandlesKHR GetRayTracingShaderGroupHandlesKHR =
-        ( PFN_vkGetRayTracingShaderGroupHandlesKHR )vkGetInstanceProcAddr( m_instance, "vkGetRayTracingShaderGroupHandlesKHR" );
-
-    std::vector<uint8_t> shaderHandleStorage( sbtSize );
-    VkResult result = GetRayTracingShaderGroupHandlesKHR( m_device, m_rtPipeline, 0, groupCount, sbtSize, shaderHandleStorage.data() );
-    assert( result == VK_SUCCESS );
-
-    m_rtSBTBuffer = new Buffer( m_device, m_physicalDevice );
-    m_rtSBTBuffer->setup( sbtSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | 
-                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | 
-                                   VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR );
-
-    void* ptr = m_rtSBTBuffer->mapMemory( sbtSize );
-    auto* pData = reinterpret_cast< uint8_t* >( ptr );
-    for ( uint32_t i = 0; i < groupCount; i++ )
-    {
-        memcpy( pData, shaderHandleStorage.data() + i * groupHandleSize, groupHandleSize ); 
-        pData += groupSizeAligned;
+CpuTraceSettings App::getCpuTraceSettings() {
+    // The same launch cmdTraceRays would record for the current view, started as a new average
+    CpuTraceSettings settings;
+    settings.viewInverse     = glm::inverse( m_camera->getViewMatrix() );
+    settings.projInverse     = glm::inverse( m_camera->getProjection( ( float )WIDTH / HEIGHT ) );
+    settings.clearColor      = m_rtPushConstants.clearColor;
+    settings.lightPosition   = m_rtPushConstants.lightPosition;
+    settings.lightIntensity  = m_rtPushConstants.lightIntensity;
+    settings.lightType       = m_rtLightType;
+    settings.shadows         = m_rtShadows;
+    settings.frame           = m_rtPushConstants.frame;
+    settings.samplesPerPixel = m_rtPathTrace ? m_rtSamplesPerFrame : 1;
+    settings.maxDepth        = m_rtPathTrace ? m_rtMaxDepth : 1;
+    settings.stream          = m_cpuStream;
+    return settings;
+}
+
+void App::renderCpuReference( const CpuTraceSettings& settings ) {
+    // Every object has the default WaveFrontMaterial of createSceneDesc, the default CpuMaterial matches it.
+    // The reference does not sample textures, a textured plane shows its untextured diffuse here as in a
+    // captured launch.
+    if ( m_cpuTracer == nullptr ) m_cpuTracer = new CpuTracer( m_jobSystem );
+    std::vector<glm::vec4> tints( m_rtMeshes.size(), glm::vec4( 1.0f ) );
+    for ( size_t i = 0; i < m_rtHitRecords.size() && i < tints.size(); i++ ) tints[i] = m_rtHitRecords[i].tint;
+    // Without a device there is no LightBuilder and the tree of the reference stays empty
+    std::vector<Light>     lights;
+    std::vector<LightNode> lightNodes;
+    if ( m_lightBuilder != nullptr ) {
+        lights     = m_lightBuilder->getLights();
+        lightNodes = m_lightBuilder->getNodes();
     }
-    m_rtSBTBuffer->unmapMemory();
+    m_cpuTracer->setup( m_rtMeshes, std::vector<CpuMaterial>( m_rtMeshes.size() ), tints, lights, lightNodes );
+
+    m_cpuTracer->render( { WIDTH, HEIGHT }, settings );
+    m_cpuTracer->savePfm( CPU_REFERENCE_FILE );
 
-}
\ No newline at end of file
+    LOG( "App::renderCpuReference " << CPU_REFERENCE_FILE );
+}
+
+void App::cmdCaptureGpuOutput( VkCommandBuffer commandBuffer ) {
+    if ( m_gpuCaptureBuffer == nullptr ) {
+        m_gpuCaptureBuffer = new Buffer( m_device, m_physicalDevice );
+        m_gpuCaptureBuffer->setup( WIDTH * HEIGHT * sizeof( glm::vec4 ), VK_BUFFER_USAGE_TRANSFER_DST_BIT );
+        m_gpuCaptureBuffer->create();
+    }
+
+    // The barrier after the launch already covers the transfer read, the average holds only this launch
+    VkBufferImageCopy region{};
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.imageExtent      = { WIDTH, HEIGHT, 1 };
+    vkd.CmdCopyImageToBuffer( commandBuffer, m_rtAccumImage->getImage(), VK_IMAGE_LAYOUT_GENERAL,
+                              m_gpuCaptureBuffer->getBuffer(), 1, &region );
+
+    VkBufferMemoryBarrier barrier{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+    barrier.srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask       = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer              = m_gpuCaptureBuffer->getBuffer();
+    barrier.size                = VK_WHOLE_SIZE;
+    vkd.CmdPipelineBarrier( commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                            0, 0, nullptr, 1, &barrier, 0, nullptr );
+
+    // What the launch was recorded with, before the frame counter moves on
+    m_gpuCaptureSettings                 = getCpuTraceSettings();
+    m_gpuCaptureSettings.viewInverse     = m_rtCamera.viewInverse;
+    m_gpuCaptureSettings.projInverse     = m_rtCamera.projInverse;
+    m_gpuCaptureSettings.frame           = m_rtPushConstants.frame;
+    m_gpuCaptureSettings.samplesPerPixel = m_rtPushConstants.samplesPerPixel;
+    m_gpuCaptureSettings.maxDepth        = m_rtPushConstants.maxDepth;
+    m_gpuCaptureRequested = false;
+    m_gpuCaptureFrame     = static_cast<int32_t>( m_currentFrame );
+}
+
+// The captured launch shades every texture as the white placeholder, since the CPU tracer samples none.
+// The plane of the default scene is textured, so only a captured launch compares equal.
+void App::diffGpuCapture() {
+    m_gpuCaptureFrame = -1;
+
+    FloatImage gpuImage;
+    gpuImage.size = { WIDTH, HEIGHT };
+    gpuImage.pixels.resize( WIDTH * HEIGHT );
+    void* data = m_gpuCaptureBuffer->mapMemory( m_gpuCaptureBuffer->getBufferSize() );
+    memcpy( gpuImage.pixels.data(), data, gpuImage.pixels.size() * sizeof( glm::vec4 ) );
+    m_gpuCaptureBuffer->unmapMemory();
+    SavePfm( GPU_OUTPUT_FILE, gpuImage );
+
+    renderCpuReference( m_gpuCaptureSettings );
+    FloatImage cpuImage;
+    cpuImage.size   = { WIDTH, HEIGHT };
+    cpuImage.pixels = m_cpuTracer->getImage();
+    LogImageDiff( "App::diffGpuCapture " GPU_OUTPUT_FILE, DiffImages( cpuImage, gpuImage ) );
+}